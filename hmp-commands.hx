@@ -1790,6 +1790,8 @@ show roms
 show the TPM device
 @item info memory-devices
 show the memory devices
+@item info qcuda
+show virtio-qcuda command counters and latencies
 @end table
 ETEXI
 
@@ -2312,3 +2312,84 @@ void hmp_rocker_of_dpa_groups(Monitor *mon, const QDict *qdict)
 
     qapi_free_RockerOfDpaGroupList(list);
 }
+
+static void hmp_print_qcuda_latency(Monitor *mon, const char *phase,
+                                    QcudaLatency *lat)
+{
+    monitor_printf(mon, "    %-10s avg %10.1f us  max %10.1f us\n", phase,
+                   lat->count ? lat->total_ns / 1000.0 / lat->count : 0.0,
+                   lat->max_ns / 1000.0);
+}
+
+static void hmp_print_qcuda_alloc(Monitor *mon, QcudaAllocStats *st)
+{
+    uint64_t calls = st->hits + st->misses;
+
+    monitor_printf(mon, "  allocator: %" PRIu64 " hits, %" PRIu64
+                   " misses (%.1f%% hit rate), %" PRIu64 " frees, %" PRIu64
+                   " trims\n", st->hits, st->misses,
+                   calls ? 100.0 * st->hits / calls : 0.0,
+                   st->frees, st->trims);
+    monitor_printf(mon, "    %" PRIu64 " segments, reserved %" PRIu64
+                   " bytes, allocated %" PRIu64 " (%.1f%% cached unused),"
+                   " requested %" PRIu64 "\n", st->segments, st->reserved,
+                   st->allocated,
+                   st->reserved ?
+                   100.0 * (st->reserved - st->allocated) / st->reserved : 0.0,
+                   st->requested);
+}
+
+static void hmp_print_qcuda_swap(Monitor *mon, QcudaSwapStats *st)
+{
+    monitor_printf(mon, "  oversubscription: resident %" PRIu64
+                   " bytes, swapped %" PRIu64 " bytes\n",
+                   st->resident, st->swapped);
+    monitor_printf(mon, "    %" PRIu64 " evictions (%" PRIu64
+                   " bytes out), %" PRIu64 " faults (%" PRIu64 " bytes in)\n",
+                   st->evictions, st->bytes_out, st->faults, st->bytes_in);
+}
+
+static void hmp_print_qcuda_qos(Monitor *mon, QcudaQos *qos)
+{
+    monitor_printf(mon, "  qos: group %s, weight %" PRIu32 ", launch-rate %"
+                   PRIu64 ", copy-bw %" PRIu64 "\n",
+                   qos->has_group ? qos->group : "(none)", qos->weight,
+                   qos->launch_rate, qos->copy_bw);
+    monitor_printf(mon, "    throttled %" PRIu64 " launches for %.1f ms, %"
+                   PRIu64 " copies for %.1f ms\n", qos->launches_throttled,
+                   qos->launch_wait_ns / 1e6, qos->copies_throttled,
+                   qos->copy_wait_ns / 1e6);
+}
+
+void hmp_info_qcuda(Monitor *mon, const QDict *qdict)
+{
+    QcudaStatsList *list, *dev;
+    QcudaCommandStatsList *cmd;
+    Error *err = NULL;
+
+    list = qmp_query_qcuda_stats(&err);
+    if (err != NULL) {
+        hmp_handle_error(mon, &err);
+        return;
+    }
+
+    for (dev = list; dev; dev = dev->next) {
+        monitor_printf(mon, "%s:\n", dev->value->device);
+        hmp_print_qcuda_alloc(mon, dev->value->allocator);
+        if (dev->value->has_swap) {
+            hmp_print_qcuda_swap(mon, dev->value->swap);
+        }
+        hmp_print_qcuda_qos(mon, dev->value->qos);
+        for (cmd = dev->value->commands; cmd; cmd = cmd->next) {
+            monitor_printf(mon, "  %s (%" PRId64 "): %" PRIu64 " calls\n",
+                           cmd->value->name, cmd->value->cmd,
+                           cmd->value->count);
+            hmp_print_qcuda_latency(mon, "queue-wait", cmd->value->queue_wait);
+            hmp_print_qcuda_latency(mon, "translate", cmd->value->translate);
+            hmp_print_qcuda_latency(mon, "execute", cmd->value->execute);
+            hmp_print_qcuda_latency(mon, "complete", cmd->value->complete);
+        }
+    }
+
+    qapi_free_QcudaStatsList(list);
+}
@@ -628,7 +628,9 @@ static void complete_pdu(V9fsState *s, V9fsPDU *pdu, ssize_t len)
     pdu->id = id;
 
     /* push onto queue and notify */
-    virtqueue_push(s->vq, &pdu->elem, len);
+    virtqueue_push(s->vq, pdu->elem, len);
+    virtqueue_element_free(pdu->elem);
+    pdu->elem = NULL;
 
     /* FIXME: we should batch these completions */
     virtio_notify(VIRTIO_DEVICE(s), s->vq);
@@ -1577,7 +1579,7 @@ static int v9fs_xattr_read(V9fsState *s, V9fsPDU *pdu, V9fsFidState *fidp,
         return err;
     }
     offset += err;
-    err = v9fs_pack(pdu->elem.in_sg, pdu->elem.in_num, offset,
+    err = v9fs_pack(pdu->elem->in_sg, pdu->elem->in_num, offset,
                     ((char *)fidp->fs.xattr.value) + off,
                     read_count);
     if (err < 0) {
@@ -1668,11 +1670,11 @@ static void v9fs_init_qiov_from_pdu(QEMUIOVector *qiov, V9fsPDU *pdu,
     unsigned int niov;
 
     if (is_write) {
-        iov = pdu->elem.out_sg;
-        niov = pdu->elem.out_num;
+        iov = pdu->elem->out_sg;
+        niov = pdu->elem->out_num;
     } else {
-        iov = pdu->elem.in_sg;
-        niov = pdu->elem.in_num;
+        iov = pdu->elem->in_sg;
+        niov = pdu->elem->in_num;
     }
 
     qemu_iovec_init_external(&elem, iov, niov);
@@ -3258,10 +3260,9 @@ void handle_9p_output(VirtIODevice *vdev, VirtQueue *vq)
 {
     V9fsState *s = (V9fsState *)vdev;
     V9fsPDU *pdu;
-    ssize_t len;
 
     while ((pdu = alloc_pdu(s)) &&
-            (len = virtqueue_pop(vq, &pdu->elem)) != 0) {
+            (pdu->elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
         struct {
             uint32_t size_le;
             uint8_t id;
@@ -3270,10 +3271,10 @@ void handle_9p_output(VirtIODevice *vdev, VirtQueue *vq)
         int len;
 
         pdu->s = s;
-        BUG_ON(pdu->elem.out_num == 0 || pdu->elem.in_num == 0);
+        BUG_ON(pdu->elem->out_num == 0 || pdu->elem->in_num == 0);
         QEMU_BUILD_BUG_ON(sizeof out != 7);
 
-        len = iov_to_buf(pdu->elem.out_sg, pdu->elem.out_num, 0,
+        len = iov_to_buf(pdu->elem->out_sg, pdu->elem->out_num, 0,
                          &out, sizeof out);
         BUG_ON(len != sizeof out);
 
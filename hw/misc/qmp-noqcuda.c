@@ -0,0 +1,25 @@
+/*
+ * QMP commands of virtio-qcuda for targets built without virtio
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qmp-commands.h"
+#include "qapi/qmp/qerror.h"
+
+QcudaStatsList *qmp_query_qcuda_stats(Error **errp)
+{
+    error_setg(errp, QERR_FEATURE_DISABLED, "virtio-qcuda");
+    return NULL;
+}
+
+void qmp_qcuda_set_qos(const char *device, bool has_weight, uint32_t weight,
+                       bool has_launch_rate, uint64_t launch_rate,
+                       bool has_launch_burst, uint64_t launch_burst,
+                       bool has_copy_bw, uint64_t copy_bw,
+                       bool has_copy_burst, uint64_t copy_burst, Error **errp)
+{
+    error_setg(errp, QERR_FEATURE_DISABLED, "virtio-qcuda");
+}
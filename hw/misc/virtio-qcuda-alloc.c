@@ -0,0 +1,374 @@
+/*
+ * Caching allocator for the device memory behind cudaMalloc of virtio-qcuda.
+ */
+
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/host-utils.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "hw/virtio/virtio-qcuda-alloc.h"
+
+typedef struct QCPool QCPool;
+typedef struct QCBlock QCBlock;
+
+struct QCBlock
+{
+	uint64_t addr;
+	uint64_t size;
+	uint64_t requested;
+	QCPool *pool;
+	bool allocated;
+	void *fence;		// freed, waiting in QCAlloc.pending
+	QCBlock *prev, *next;	// address neighbours within the segment
+	QTAILQ_ENTRY(QCBlock) link;	// bin or pending list
+};
+
+struct QCPool
+{
+	uint64_t stream;
+	bool large;
+	QTAILQ_HEAD(, QCBlock) bins[QCU_ALLOC_BINS];
+};
+
+struct QCAlloc
+{
+	const QCAllocOps *ops;
+	void *opaque;
+	QCAllocStats *stats;
+
+	QemuMutex lock;
+	GPtrArray *pools;
+	GHashTable *blocks;	// allocated blocks by address
+	QTAILQ_HEAD(, QCBlock) pending;
+};
+
+static inline bool qcu_block_free(QCBlock *b)
+{
+	return !b->allocated && b->fence == NULL;
+}
+
+static int qcu_alloc_bin(uint64_t size)
+{
+	int bin = 63 - clz64(size / QCU_ALLOC_ROUND);
+
+	return MIN(bin, QCU_ALLOC_BINS - 1);
+}
+
+static uint64_t qcu_alloc_segment_size(uint64_t size)
+{
+	if (size <= QCU_ALLOC_SMALL)
+		return QCU_ALLOC_SMALL_SEG;
+	if (size < QCU_ALLOC_MID)
+		return QCU_ALLOC_MID_SEG;
+	return ROUND_UP(size, QCU_ALLOC_LARGE_ROUND);
+}
+
+static QCPool *qcu_alloc_pool(QCAlloc *a, uint64_t stream, bool large)
+{
+	QCPool *pool;
+	guint i;
+	int j;
+
+	for (i = 0; i < a->pools->len; i++)
+	{
+		pool = g_ptr_array_index(a->pools, i);
+		if (pool->stream == stream && pool->large == large)
+			return pool;
+	}
+
+	pool = g_new0(QCPool, 1);
+	pool->stream = stream;
+	pool->large = large;
+	for (j = 0; j < QCU_ALLOC_BINS; j++)
+		QTAILQ_INIT(&pool->bins[j]);
+	g_ptr_array_add(a->pools, pool);
+	return pool;
+}
+
+static void qcu_bin_insert(QCBlock *b)
+{
+	QTAILQ_INSERT_HEAD(&b->pool->bins[qcu_alloc_bin(b->size)], b, link);
+}
+
+static void qcu_bin_remove(QCBlock *b)
+{
+	QTAILQ_REMOVE(&b->pool->bins[qcu_alloc_bin(b->size)], b, link);
+}
+
+/* Smallest cached block of at least size bytes. */
+static QCBlock *qcu_alloc_find(QCPool *pool, uint64_t size)
+{
+	QCBlock *b, *best = NULL;
+	int bin;
+
+	// only the first bin can hold blocks that are too small
+	for (bin = qcu_alloc_bin(size); bin < QCU_ALLOC_BINS; bin++)
+	{
+		QTAILQ_FOREACH(b, &pool->bins[bin], link)
+		{
+			if (b->size >= size && (best == NULL || b->size < best->size))
+				best = b;
+		}
+		if (best != NULL)
+			return best;
+	}
+
+	return NULL;
+}
+
+/* Put a block back into its bin, merged with free neighbours. */
+static void qcu_alloc_release(QCBlock *b)
+{
+	QCBlock *n;
+
+	if (b->prev != NULL && qcu_block_free(b->prev))
+	{
+		n = b;
+		b = b->prev;
+		qcu_bin_remove(b);
+		b->size += n->size;
+		b->next = n->next;
+		if (b->next != NULL)
+			b->next->prev = b;
+		g_free(n);
+	}
+
+	if (b->next != NULL && qcu_block_free(b->next))
+	{
+		n = b->next;
+		qcu_bin_remove(n);
+		b->size += n->size;
+		b->next = n->next;
+		if (b->next != NULL)
+			b->next->prev = b;
+		g_free(n);
+	}
+
+	qcu_bin_insert(b);
+}
+
+/* Recycle blocks whose fence has passed, or all of them if wait is set. */
+static void qcu_alloc_reap(QCAlloc *a, bool wait)
+{
+	QCBlock *b, *tmp;
+
+	QTAILQ_FOREACH_SAFE(b, &a->pending, link, tmp)
+	{
+		if (wait)
+			a->ops->fence_wait(a->opaque, b->fence);
+		else if (!a->ops->fence_done(a->opaque, b->fence))
+			break;
+
+		QTAILQ_REMOVE(&a->pending, b, link);
+		a->ops->fence_release(a->opaque, b->fence);
+		b->fence = NULL;
+		qcu_alloc_release(b);
+	}
+}
+
+/* Return completely free segments; early ones count as trims. */
+static uint64_t qcu_alloc_trim_locked(QCAlloc *a, bool early)
+{
+	QCPool *pool;
+	QCBlock *b, *tmp;
+	uint64_t released = 0;
+	guint i;
+	int bin;
+
+	for (i = 0; i < a->pools->len; i++)
+	{
+		pool = g_ptr_array_index(a->pools, i);
+		for (bin = 0; bin < QCU_ALLOC_BINS; bin++)
+		{
+			QTAILQ_FOREACH_SAFE(b, &pool->bins[bin], link, tmp)
+			{
+				if (b->prev != NULL || b->next != NULL)
+					continue;
+
+				QTAILQ_REMOVE(&pool->bins[bin], b, link);
+				a->ops->free(a->opaque, b->addr);
+				atomic_dec(&a->stats->segments);
+				atomic_sub(&a->stats->reserved, b->size);
+				if (early)
+					atomic_inc(&a->stats->trims);
+				released += b->size;
+				g_free(b);
+			}
+		}
+	}
+
+	return released;
+}
+
+QCAlloc *qcu_alloc_new(const QCAllocOps *ops, void *opaque,
+		QCAllocStats *stats)
+{
+	QCAlloc *a = g_new0(QCAlloc, 1);
+
+	a->ops = ops;
+	a->opaque = opaque;
+	a->stats = stats;
+	qemu_mutex_init(&a->lock);
+	a->pools = g_ptr_array_new_with_free_func(g_free);
+	a->blocks = g_hash_table_new(g_int64_hash, g_int64_equal);
+	QTAILQ_INIT(&a->pending);
+
+	return a;
+}
+
+void qcu_alloc_destroy(QCAlloc *a)
+{
+	GHashTableIter iter;
+	gpointer value;
+	QCBlock *b;
+
+	qemu_mutex_lock(&a->lock);
+	qcu_alloc_reap(a, true);
+
+	g_hash_table_iter_init(&iter, a->blocks);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+	{
+		b = value;
+		g_hash_table_iter_remove(&iter);
+		b->allocated = false;
+		atomic_sub(&a->stats->allocated, b->size);
+		atomic_sub(&a->stats->requested, b->requested);
+		qcu_alloc_release(b);
+	}
+
+	// every segment is a single free block now
+	qcu_alloc_trim_locked(a, false);
+	qemu_mutex_unlock(&a->lock);
+
+	g_hash_table_destroy(a->blocks);
+	g_ptr_array_free(a->pools, TRUE);
+	qemu_mutex_destroy(&a->lock);
+	g_free(a);
+}
+
+bool qcu_alloc_get(QCAlloc *a, uint64_t size, uint64_t stream,
+		uint64_t *addr)
+{
+	uint64_t rounded, seg, min_split;
+	QCPool *pool;
+	QCBlock *b, *rest;
+
+	rounded = ROUND_UP(MAX(size, 1), QCU_ALLOC_ROUND);
+	if (rounded < size)
+		return false;
+
+	qemu_mutex_lock(&a->lock);
+	qcu_alloc_reap(a, false);
+
+	pool = qcu_alloc_pool(a, stream, rounded > QCU_ALLOC_SMALL);
+	b = qcu_alloc_find(pool, rounded);
+	if (b != NULL)
+	{
+		qcu_bin_remove(b);
+		atomic_inc(&a->stats->hits);
+	}
+	else
+	{
+		seg = qcu_alloc_segment_size(rounded);
+		if (!a->ops->alloc(a->opaque, seg, addr))
+		{
+			// out of memory: give back what is cached and try once more
+			qcu_alloc_reap(a, true);
+			if (qcu_alloc_trim_locked(a, true) == 0 ||
+					!a->ops->alloc(a->opaque, seg, addr))
+			{
+				qemu_mutex_unlock(&a->lock);
+				return false;
+			}
+		}
+
+		b = g_new0(QCBlock, 1);
+		b->addr = *addr;
+		b->size = seg;
+		b->pool = pool;
+		atomic_inc(&a->stats->segments);
+		atomic_add(&a->stats->reserved, seg);
+		atomic_inc(&a->stats->misses);
+	}
+
+	// small blocks are split down to the rounding, large ones only if a
+	// useful amount is left
+	min_split = pool->large ? QCU_ALLOC_SMALL + 1 : QCU_ALLOC_ROUND;
+	if (b->size - rounded >= min_split)
+	{
+		rest = g_new0(QCBlock, 1);
+		rest->addr = b->addr + rounded;
+		rest->size = b->size - rounded;
+		rest->pool = pool;
+		rest->prev = b;
+		rest->next = b->next;
+		if (rest->next != NULL)
+			rest->next->prev = rest;
+		b->next = rest;
+		b->size = rounded;
+		qcu_bin_insert(rest);
+	}
+
+	b->allocated = true;
+	b->requested = size;
+	g_hash_table_insert(a->blocks, &b->addr, b);
+	atomic_add(&a->stats->allocated, b->size);
+	atomic_add(&a->stats->requested, size);
+	*addr = b->addr;
+
+	qemu_mutex_unlock(&a->lock);
+	return true;
+}
+
+bool qcu_alloc_put(QCAlloc *a, uint64_t addr, bool fence)
+{
+	QCBlock *b;
+
+	qemu_mutex_lock(&a->lock);
+	b = g_hash_table_lookup(a->blocks, &addr);
+	if (b == NULL)
+	{
+		qemu_mutex_unlock(&a->lock);
+		return false;
+	}
+
+	g_hash_table_remove(a->blocks, &addr);
+	b->allocated = false;
+	atomic_inc(&a->stats->frees);
+	atomic_sub(&a->stats->allocated, b->size);
+	atomic_sub(&a->stats->requested, b->requested);
+
+	if (fence)
+		b->fence = a->ops->fence_new(a->opaque);
+	if (b->fence != NULL)
+		QTAILQ_INSERT_TAIL(&a->pending, b, link);
+	else
+		qcu_alloc_release(b);
+
+	qemu_mutex_unlock(&a->lock);
+	return true;
+}
+
+bool qcu_alloc_owns(QCAlloc *a, uint64_t addr)
+{
+	bool owns;
+
+	qemu_mutex_lock(&a->lock);
+	owns = g_hash_table_lookup(a->blocks, &addr) != NULL;
+	qemu_mutex_unlock(&a->lock);
+
+	return owns;
+}
+
+uint64_t qcu_alloc_trim(QCAlloc *a)
+{
+	uint64_t released;
+
+	qemu_mutex_lock(&a->lock);
+	qcu_alloc_reap(a, false);
+	released = qcu_alloc_trim_locked(a, true);
+	qemu_mutex_unlock(&a->lock);
+
+	return released;
+}
@@ -0,0 +1,207 @@
+/*
+ * Read-only weight blobs, loaded once per GPU and shared by sessions.
+ */
+
+#include "qemu-common.h"
+#include "qemu/queue.h"
+#include "hw/virtio/virtio-qcuda-blob.h"
+#include <sys/mman.h>
+
+typedef struct QCBlob QCBlob;
+
+/* A file is the same blob as long as none of these change. */
+typedef struct QCBlobKey
+{
+	int device;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+} QCBlobKey;
+
+struct QCBlob
+{
+	QCBlobKey key;
+	uint64_t addr;
+	int refs;
+	bool loading;	// the first getter is uploading it
+	bool failed;	// and could not; no longer in the store
+	QLIST_ENTRY(QCBlob) next;
+};
+
+struct QCBlobStore
+{
+	const QCBlobOps *ops;
+	void *opaque;
+
+	QemuMutex lock;
+	QemuCond loaded;
+	QLIST_HEAD(, QCBlob) blobs;
+};
+
+QCBlobStore *qcu_blob_store_new(const QCBlobOps *ops, void *opaque)
+{
+	QCBlobStore *st = g_new0(QCBlobStore, 1);
+
+	st->ops = ops;
+	st->opaque = opaque;
+	qemu_mutex_init(&st->lock);
+	qemu_cond_init(&st->loaded);
+	QLIST_INIT(&st->blobs);
+
+	return st;
+}
+
+void qcu_blob_store_free(QCBlobStore *st)
+{
+	assert(QLIST_EMPTY(&st->blobs));
+	qemu_cond_destroy(&st->loaded);
+	qemu_mutex_destroy(&st->lock);
+	g_free(st);
+}
+
+static bool qcu_blob_key_equal(const QCBlobKey *a, const QCBlobKey *b)
+{
+	return a->device == b->device && a->dev == b->dev &&
+		a->ino == b->ino && a->size == b->size &&
+		a->mtime.tv_sec == b->mtime.tv_sec &&
+		a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+/* The guest picks the name: it must not leave the directory. */
+static bool qcu_blob_name_valid(const char *name)
+{
+	return name[0] != '\0' && strchr(name, '/') == NULL &&
+		strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+/* Map the file and hand it to the backend; pages are read as it goes. */
+static bool qcu_blob_load(QCBlobStore *st, int fd, const QCBlobKey *key,
+		uint64_t *addr)
+{
+	void *data;
+	bool ok;
+
+	data = mmap(NULL, key->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED)
+		return false;
+	posix_madvise(data, key->size, POSIX_MADV_SEQUENTIAL);
+	ok = st->ops->load(st->opaque, key->device, data, key->size, addr);
+	munmap(data, key->size);
+
+	return ok;
+}
+
+int qcu_blob_get(QCBlobStore *st, int device, const char *dir,
+		const char *name, uint64_t *addr, uint64_t *size)
+{
+	QCBlobKey key;
+	QCBlob *b;
+	struct stat sb;
+	char *path;
+	int fd, ret = 0;
+	bool loader = false, ok;
+
+	if (!qcu_blob_name_valid(name))
+		return -EINVAL;
+	path = g_build_filename(dir, name, NULL);
+	fd = qemu_open(path, O_RDONLY);
+	g_free(path);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &sb) < 0)
+	{
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+	if (!S_ISREG(sb.st_mode) || sb.st_size == 0)
+	{
+		close(fd);
+		return -EINVAL;
+	}
+
+	memset(&key, 0, sizeof(key));
+	key.device = device;
+	key.dev = sb.st_dev;
+	key.ino = sb.st_ino;
+	key.size = sb.st_size;
+	key.mtime = sb.st_mtim;
+
+	qemu_mutex_lock(&st->lock);
+	QLIST_FOREACH(b, &st->blobs, next)
+	{
+		if (qcu_blob_key_equal(&b->key, &key))
+			break;
+	}
+	if (b == NULL)
+	{
+		b = g_new0(QCBlob, 1);
+		b->key = key;
+		b->loading = true;
+		QLIST_INSERT_HEAD(&st->blobs, b, next);
+		loader = true;
+	}
+	b->refs++;
+
+	if (loader)
+	{
+		qemu_mutex_unlock(&st->lock);
+		ok = qcu_blob_load(st, fd, &key, &b->addr);
+		qemu_mutex_lock(&st->lock);
+		b->loading = false;
+		if (!ok)
+		{
+			b->failed = true;
+			QLIST_REMOVE(b, next);
+		}
+		qemu_cond_broadcast(&st->loaded);
+	}
+	while (b->loading)
+		qemu_cond_wait(&st->loaded, &st->lock);
+
+	if (b->failed)
+	{
+		ret = -EIO;
+		if (--b->refs == 0)
+			g_free(b);
+	}
+	else
+	{
+		*addr = b->addr;
+		*size = b->key.size;
+	}
+	qemu_mutex_unlock(&st->lock);
+	close(fd);
+
+	return ret;
+}
+
+bool qcu_blob_put(QCBlobStore *st, int device, uint64_t addr)
+{
+	QCBlob *b;
+
+	qemu_mutex_lock(&st->lock);
+	QLIST_FOREACH(b, &st->blobs, next)
+	{
+		if (!b->loading && b->key.device == device && b->addr == addr)
+			break;
+	}
+	if (b == NULL)
+	{
+		qemu_mutex_unlock(&st->lock);
+		return false;
+	}
+	if (--b->refs > 0)
+	{
+		qemu_mutex_unlock(&st->lock);
+		return true;
+	}
+	QLIST_REMOVE(b, next);
+	qemu_mutex_unlock(&st->lock);
+
+	st->ops->unload(st->opaque, device, b->addr, b->key.size);
+	g_free(b);
+
+	return true;
+}
@@ -0,0 +1,55 @@
+/*
+ * Guest physical address translation table for virtio-qcuda.
+ *
+ * Kept free of the memory API so that it can be unit tested on its own;
+ * the listener that feeds it lives in virtio-qcuda.c.
+ */
+
+#include "qemu-common.h"
+#include "hw/virtio/virtio-qcuda-gpa.h"
+
+static int qcu_gpa_range_cmp(const void *a, const void *b)
+{
+	const QCGpaRange *ra = a, *rb = b;
+
+	if (ra->gpa < rb->gpa)
+		return -1;
+	return ra->gpa > rb->gpa;
+}
+
+QCGpaMap *qcu_gpa_map_new(const QCGpaRange *ranges, unsigned nr)
+{
+	QCGpaMap *map;
+
+	map = g_malloc0(sizeof(QCGpaMap) + nr * sizeof(QCGpaRange));
+	map->nr = nr;
+	memcpy(map->ranges, ranges, nr * sizeof(QCGpaRange));
+	qsort(map->ranges, nr, sizeof(QCGpaRange), qcu_gpa_range_cmp);
+
+	return map;
+}
+
+void qcu_gpa_map_free(QCGpaMap *map)
+{
+	g_free(map);
+}
+
+const QCGpaRange *qcu_gpa_map_find(const QCGpaMap *map, uint64_t gpa)
+{
+	unsigned lo = 0, hi = map->nr, mid;
+	const QCGpaRange *r;
+
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		r = &map->ranges[mid];
+		if (gpa < r->gpa)
+			hi = mid;
+		else if (gpa - r->gpa >= r->len)
+			lo = mid + 1;
+		else
+			return r;
+	}
+
+	return NULL;
+}
@@ -0,0 +1,160 @@
+/*
+ * Launch sequences recorded by virtio-qcuda and replayed as one command.
+ */
+
+#include "qemu-common.h"
+#include "hw/virtio/virtio-qcuda-graph.h"
+
+QCGraph *qcu_graph_new(void)
+{
+	QCGraph *g = g_new0(QCGraph, 1);
+
+	g->nodes = g_array_new(FALSE, TRUE, sizeof(QCGraphNode));
+	return g;
+}
+
+void qcu_graph_free(QCGraph *g)
+{
+	QCGraphNode *n;
+	guint i;
+
+	for (i = 0; i < g->nodes->len; i++)
+	{
+		n = qcu_graph_node(g, i);
+		g_free(n->params);
+		g_free(n->args);
+		g_free(n->arg_size);
+	}
+	g_array_free(g->nodes, TRUE);
+	g_free(g);
+}
+
+size_t qcu_graph_params_size(const uint8_t *blob, size_t len)
+{
+	uint32_t count, size, i;
+	size_t off, space = 0;
+
+	if (len < sizeof(uint32_t))
+		return 0;
+	memcpy(&count, blob, sizeof(count));
+	if (count > QCU_GRAPH_MAX_PARAMS)
+		return 0;
+
+	off = sizeof(uint32_t);
+	for (i = 0; i < count; i++)
+	{
+		if (len - off < sizeof(uint32_t))
+			return 0;
+		memcpy(&size, blob + off, sizeof(size));
+		off += sizeof(uint32_t);
+
+		space += size;
+		if (size > len - off || space > QCU_GRAPH_PARAM_SPACE)
+			return 0;
+		off += size;
+	}
+
+	return off;
+}
+
+bool qcu_graph_add_kernel(QCGraph *g, uint32_t func, const uint64_t *conf,
+		const uint8_t *blob, size_t len)
+{
+	QCGraphNode n;
+	uint32_t size, i;
+	size_t off;
+
+	if (g->nodes->len >= QCU_GRAPH_MAX_NODES)
+		return false;
+	len = qcu_graph_params_size(blob, len);
+	if (len == 0)
+		return false;
+
+	memset(&n, 0, sizeof(n));
+	n.type = QCU_GRAPH_KERNEL;
+	n.func = func;
+	for (i = 0; i < 3; i++)
+	{
+		n.grid[i] = conf[i];
+		n.block[i] = conf[3 + i];
+	}
+	n.shared = conf[6];
+
+	memcpy(&n.nparams, blob, sizeof(uint32_t));
+	n.params = g_memdup(blob + sizeof(uint32_t), len - sizeof(uint32_t));
+	n.args = g_new(void *, MAX(n.nparams, 1));
+	n.arg_size = g_new(uint32_t, MAX(n.nparams, 1));
+
+	// sizes were checked above
+	off = 0;
+	for (i = 0; i < n.nparams; i++)
+	{
+		memcpy(&size, n.params + off, sizeof(size));
+		off += sizeof(uint32_t);
+		n.args[i] = n.params + off;
+		n.arg_size[i] = size;
+		off += size;
+	}
+
+	g_array_append_val(g->nodes, n);
+	return true;
+}
+
+bool qcu_graph_add_copy(QCGraph *g, uint64_t dst, uint64_t src,
+		uint64_t bytes)
+{
+	QCGraphNode n;
+
+	if (g->nodes->len >= QCU_GRAPH_MAX_NODES)
+		return false;
+
+	memset(&n, 0, sizeof(n));
+	n.type = QCU_GRAPH_COPY;
+	n.dst = dst;
+	n.src = src;
+	n.bytes = bytes;
+	g_array_append_val(g->nodes, n);
+	return true;
+}
+
+/* Walk a patch list; with apply unset only check it. */
+static int qcu_graph_patch_walk(QCGraph *g, const uint8_t *buf, size_t len,
+		bool apply)
+{
+	VirtIOQCGraphPatch p;
+	QCGraphNode *n;
+	size_t off = 0;
+	int count = 0;
+
+	while (off < len)
+	{
+		if (len - off < sizeof(p))
+			return -1;
+		memcpy(&p, buf + off, sizeof(p));
+		off += sizeof(p);
+
+		if (p.node >= g->nodes->len)
+			return -1;
+		n = qcu_graph_node(g, p.node);
+		if (n->type != QCU_GRAPH_KERNEL || p.param >= n->nparams ||
+				p.size != n->arg_size[p.param] || p.size > len - off)
+			return -1;
+
+		if (apply)
+		{
+			memcpy(n->args[p.param], buf + off, p.size);
+			n->dirty = true;
+		}
+		off += ROUND_UP(p.size, 8);
+		count++;
+	}
+
+	return count;
+}
+
+int qcu_graph_patch(QCGraph *g, const uint8_t *buf, size_t len)
+{
+	if (qcu_graph_patch_walk(g, buf, len, false) < 0)
+		return -1;
+	return qcu_graph_patch_walk(g, buf, len, true);
+}
@@ -0,0 +1,556 @@
+/*
+ * Tracks virtio-qcuda allocations and the device memory a migration must send.
+ */
+
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/bitmap.h"
+#include "hw/virtio/virtio-qcuda-migrate.h"
+
+/* Both the allocations and the restored mappings are kept in GTrees of
+ * structures that start with their span, keyed by themselves. */
+typedef struct QCMigSpan
+{
+	uint64_t addr;
+	uint64_t size;
+} QCMigSpan;
+
+typedef struct QCMigAlloc
+{
+	QCMigSpan span;
+	bool restored;		// mapped by qcu_mig_restore
+	bool announced;		// the destination knows about it
+	uint64_t nchunks;
+	uint64_t ndirty;
+	unsigned long *dirty;
+} QCMigAlloc;
+
+typedef struct QCMigRegion
+{
+	QCMigSpan span;
+	unsigned users;		// restored allocations that overlap it
+} QCMigRegion;
+
+struct QCMig
+{
+	const QCMigOps *ops;
+	void *opaque;
+	uint64_t granularity;
+
+	QemuMutex lock;
+	GTree *allocs;
+	GTree *regions;
+	bool logging;
+	uint64_t dirty_bytes;
+	GArray *freed;		// of uint64_t, announced allocations that went away
+	uint64_t cursor;	// where the next collect continues
+};
+
+static gint qcu_mig_span_cmp(gconstpointer a, gconstpointer b, gpointer opaque)
+{
+	const QCMigSpan *sa = a, *sb = b;
+
+	if (sa->addr < sb->addr)
+		return -1;
+	return sa->addr > sb->addr;
+}
+
+static gint qcu_mig_span_search(gconstpointer key, gconstpointer data)
+{
+	const QCMigSpan *s = key;
+	uint64_t addr = *(const uint64_t *)data;
+
+	if (addr < s->addr)
+		return -1;
+	return addr - s->addr >= s->size;
+}
+
+static void qcu_mig_alloc_free(gpointer data)
+{
+	QCMigAlloc *a = data;
+
+	g_free(a->dirty);
+	g_free(a);
+}
+
+QCMig *qcu_mig_new(const QCMigOps *ops, void *opaque, uint64_t granularity)
+{
+	QCMig *m = g_new0(QCMig, 1);
+
+	m->ops = ops;
+	m->opaque = opaque;
+	m->granularity = granularity;
+	qemu_mutex_init(&m->lock);
+	m->allocs = g_tree_new_full(qcu_mig_span_cmp, NULL, NULL,
+			qcu_mig_alloc_free);
+	m->regions = g_tree_new_full(qcu_mig_span_cmp, NULL, NULL, g_free);
+	m->freed = g_array_new(FALSE, FALSE, sizeof(uint64_t));
+
+	return m;
+}
+
+void qcu_mig_destroy(QCMig *m)
+{
+	qcu_mig_clear(m);
+	g_tree_destroy(m->regions);
+	g_tree_destroy(m->allocs);
+	g_array_free(m->freed, TRUE);
+	qemu_mutex_destroy(&m->lock);
+	g_free(m);
+}
+
+static QCMigAlloc *qcu_mig_find(QCMig *m, uint64_t addr)
+{
+	return g_tree_search(m->allocs, qcu_mig_span_search, &addr);
+}
+
+static uint64_t qcu_mig_chunk_len(QCMigAlloc *a, uint64_t i)
+{
+	return MIN(QCU_MIG_CHUNK, a->span.size - i * QCU_MIG_CHUNK);
+}
+
+static void qcu_mig_mark(QCMig *m, QCMigAlloc *a, uint64_t first,
+		uint64_t last)
+{
+	uint64_t i;
+
+	for (i = first; i <= last && a->ndirty < a->nchunks; i++)
+	{
+		if (test_bit(i, a->dirty))
+			continue;
+		set_bit(i, a->dirty);
+		a->ndirty++;
+		m->dirty_bytes += qcu_mig_chunk_len(a, i);
+	}
+}
+
+static void qcu_mig_unmark(QCMig *m, QCMigAlloc *a)
+{
+	uint64_t i;
+
+	for (i = 0; i < a->nchunks && a->ndirty > 0; i++)
+	{
+		if (!test_bit(i, a->dirty))
+			continue;
+		clear_bit(i, a->dirty);
+		a->ndirty--;
+		m->dirty_bytes -= qcu_mig_chunk_len(a, i);
+	}
+}
+
+//####################################################################
+//   restored mappings
+//####################################################################
+
+static QCMigRegion *qcu_mig_region_find(QCMig *m, uint64_t addr)
+{
+	return g_tree_search(m->regions, qcu_mig_span_search, &addr);
+}
+
+static void qcu_mig_align(QCMig *m, uint64_t addr, uint64_t size,
+		uint64_t *lo, uint64_t *hi)
+{
+	*lo = QEMU_ALIGN_DOWN(addr, m->granularity);
+	*hi = QEMU_ALIGN_UP(addr + size, m->granularity);
+}
+
+/* Drop the allocation's references to the mappings it overlaps. */
+static void qcu_mig_unrestore(QCMig *m, QCMigAlloc *a)
+{
+	QCMigRegion *r;
+	uint64_t p, hi;
+
+	qcu_mig_align(m, a->span.addr, a->span.size, &p, &hi);
+	while (p < hi)
+	{
+		r = qcu_mig_region_find(m, p);
+		if (r == NULL)
+		{
+			p += m->granularity;
+			continue;
+		}
+
+		p = r->span.addr + r->span.size;
+		if (--r->users == 0)
+		{
+			m->ops->unmap(m->opaque, r->span.addr, r->span.size);
+			g_tree_remove(m->regions, r);
+		}
+	}
+}
+
+bool qcu_mig_restore(QCMig *m, uint64_t addr, uint64_t size)
+{
+	GArray *gaps, *used;
+	QCMigSpan gap;
+	QCMigRegion *r;
+	QCMigAlloc *a;
+	uint64_t p, hi;
+	guint i, mapped;
+	bool ok = true;
+
+	if (m->ops == NULL || m->granularity == 0 || size == 0)
+		return false;
+
+	qemu_mutex_lock(&m->lock);
+	if (qcu_mig_find(m, addr) != NULL ||
+			(size > 1 && qcu_mig_find(m, addr + size - 1) != NULL))
+	{
+		qemu_mutex_unlock(&m->lock);
+		return false;
+	}
+
+	// mappings that are there already, and the runs of pages that are not
+	gaps = g_array_new(FALSE, FALSE, sizeof(QCMigSpan));
+	used = g_array_new(FALSE, FALSE, sizeof(QCMigRegion *));
+	qcu_mig_align(m, addr, size, &p, &hi);
+	while (p < hi)
+	{
+		r = qcu_mig_region_find(m, p);
+		if (r != NULL)
+		{
+			g_array_append_val(used, r);
+			p = r->span.addr + r->span.size;
+			continue;
+		}
+
+		gap.addr = p;
+		while (p < hi && qcu_mig_region_find(m, p) == NULL)
+			p += m->granularity;
+		gap.size = p - gap.addr;
+		g_array_append_val(gaps, gap);
+	}
+
+	for (mapped = 0; mapped < gaps->len && ok; mapped++)
+	{
+		gap = g_array_index(gaps, QCMigSpan, mapped);
+		ok = m->ops->map(m->opaque, gap.addr, gap.size);
+	}
+
+	if (!ok)
+	{
+		// mapped counts the one that failed as well
+		for (i = 0; i + 1 < mapped; i++)
+		{
+			gap = g_array_index(gaps, QCMigSpan, i);
+			m->ops->unmap(m->opaque, gap.addr, gap.size);
+		}
+	}
+	else
+	{
+		for (i = 0; i < used->len; i++)
+			g_array_index(used, QCMigRegion *, i)->users++;
+		for (i = 0; i < gaps->len; i++)
+		{
+			r = g_new0(QCMigRegion, 1);
+			r->span = g_array_index(gaps, QCMigSpan, i);
+			r->users = 1;
+			g_tree_insert(m->regions, r, r);
+		}
+
+		a = g_new0(QCMigAlloc, 1);
+		a->span.addr = addr;
+		a->span.size = size;
+		a->restored = true;
+		a->announced = true;
+		a->nchunks = DIV_ROUND_UP(size, QCU_MIG_CHUNK);
+		a->dirty = bitmap_new(a->nchunks);
+		g_tree_insert(m->allocs, a, a);
+	}
+	qemu_mutex_unlock(&m->lock);
+
+	g_array_free(used, TRUE);
+	g_array_free(gaps, TRUE);
+	return ok;
+}
+
+//####################################################################
+//   allocations
+//####################################################################
+
+/* Called with the lock held; returns whether the memory was restored. */
+static bool qcu_mig_remove_locked(QCMig *m, QCMigAlloc *a)
+{
+	bool restored = a->restored;
+
+	if (m->logging && a->announced)
+		g_array_append_val(m->freed, a->span.addr);
+	qcu_mig_unmark(m, a);
+	if (restored)
+		qcu_mig_unrestore(m, a);
+	g_tree_remove(m->allocs, a);
+
+	return restored;
+}
+
+void qcu_mig_add(QCMig *m, uint64_t addr, uint64_t size)
+{
+	QCMigAlloc *a, *old;
+
+	if (size == 0)
+		return;
+
+	a = g_new0(QCMigAlloc, 1);
+	a->span.addr = addr;
+	a->span.size = size;
+	a->nchunks = DIV_ROUND_UP(size, QCU_MIG_CHUNK);
+	a->dirty = bitmap_new(a->nchunks);
+
+	qemu_mutex_lock(&m->lock);
+	// an allocation that was never freed here, e.g. by a device reset
+	while ((old = qcu_mig_find(m, addr)) != NULL ||
+			(old = qcu_mig_find(m, addr + size - 1)) != NULL)
+		qcu_mig_remove_locked(m, old);
+
+	g_tree_insert(m->allocs, a, a);
+	if (m->logging)
+		qcu_mig_mark(m, a, 0, a->nchunks - 1);
+	qemu_mutex_unlock(&m->lock);
+}
+
+bool qcu_mig_remove(QCMig *m, uint64_t addr)
+{
+	QCMigAlloc *a;
+	bool restored = false;
+
+	qemu_mutex_lock(&m->lock);
+	a = qcu_mig_find(m, addr);
+	if (a != NULL && a->span.addr == addr)
+		restored = qcu_mig_remove_locked(m, a);
+	qemu_mutex_unlock(&m->lock);
+
+	return restored;
+}
+
+static gboolean qcu_mig_list_one(gpointer key, gpointer value, gpointer opaque)
+{
+	GPtrArray *list = opaque;
+
+	g_ptr_array_add(list, value);
+	return FALSE;
+}
+
+void qcu_mig_clear(QCMig *m)
+{
+	GPtrArray *list = g_ptr_array_new();
+	guint i;
+
+	qemu_mutex_lock(&m->lock);
+	g_tree_foreach(m->allocs, qcu_mig_list_one, list);
+	for (i = 0; i < list->len; i++)
+		qcu_mig_remove_locked(m, g_ptr_array_index(list, i));
+	qemu_mutex_unlock(&m->lock);
+
+	g_ptr_array_free(list, TRUE);
+}
+
+bool qcu_mig_owns(QCMig *m, uint64_t addr)
+{
+	bool found;
+
+	qemu_mutex_lock(&m->lock);
+	found = qcu_mig_find(m, addr) != NULL;
+	qemu_mutex_unlock(&m->lock);
+
+	return found;
+}
+
+//####################################################################
+//   dirty logging
+//####################################################################
+
+void qcu_mig_dirty(QCMig *m, uint64_t addr, uint64_t len)
+{
+	QCMigAlloc *a;
+	uint64_t off;
+
+	if (!atomic_read(&m->logging) || len == 0)
+		return;
+
+	qemu_mutex_lock(&m->lock);
+	a = qcu_mig_find(m, addr);
+	if (m->logging && a != NULL)
+	{
+		off = addr - a->span.addr;
+		len = MIN(len, a->span.size - off);
+		qcu_mig_mark(m, a, off / QCU_MIG_CHUNK,
+				(off + len - 1) / QCU_MIG_CHUNK);
+	}
+	qemu_mutex_unlock(&m->lock);
+}
+
+void qcu_mig_dirty_ptr(QCMig *m, uint64_t ptr)
+{
+	QCMigAlloc *a;
+
+	if (!atomic_read(&m->logging))
+		return;
+
+	qemu_mutex_lock(&m->lock);
+	a = qcu_mig_find(m, ptr);
+	if (m->logging && a != NULL)
+		qcu_mig_mark(m, a, 0, a->nchunks - 1);
+	qemu_mutex_unlock(&m->lock);
+}
+
+static gboolean qcu_mig_start_one(gpointer key, gpointer value, gpointer opaque)
+{
+	QCMigAlloc *a = value;
+
+	a->announced = false;
+	qcu_mig_mark(opaque, a, 0, a->nchunks - 1);
+	return FALSE;
+}
+
+void qcu_mig_start(QCMig *m)
+{
+	qemu_mutex_lock(&m->lock);
+	g_array_set_size(m->freed, 0);
+	m->cursor = 0;
+	g_tree_foreach(m->allocs, qcu_mig_start_one, m);
+	atomic_set(&m->logging, true);
+	qemu_mutex_unlock(&m->lock);
+}
+
+static gboolean qcu_mig_stop_one(gpointer key, gpointer value, gpointer opaque)
+{
+	qcu_mig_unmark(opaque, value);
+	return FALSE;
+}
+
+void qcu_mig_stop(QCMig *m)
+{
+	qemu_mutex_lock(&m->lock);
+	atomic_set(&m->logging, false);
+	g_tree_foreach(m->allocs, qcu_mig_stop_one, m);
+	g_array_set_size(m->freed, 0);
+	qemu_mutex_unlock(&m->lock);
+}
+
+bool qcu_mig_logging(QCMig *m)
+{
+	return atomic_read(&m->logging);
+}
+
+uint64_t qcu_mig_pending(QCMig *m)
+{
+	uint64_t pending;
+
+	qemu_mutex_lock(&m->lock);
+	pending = m->dirty_bytes;
+	qemu_mutex_unlock(&m->lock);
+
+	return pending;
+}
+
+typedef struct QCMigWalk
+{
+	QCMig *m;
+	GArray *out;
+	uint64_t max;
+	uint64_t bytes;
+	bool wrapped;		// second pass, over what is below the cursor
+	bool full;
+} QCMigWalk;
+
+static gboolean qcu_mig_announce_one(gpointer key, gpointer value,
+		gpointer opaque)
+{
+	QCMigAlloc *a = value;
+	QCMigRecord rec;
+
+	if (!a->announced)
+	{
+		rec.type = QCU_MIG_REC_ALLOC;
+		rec.addr = a->span.addr;
+		rec.len = a->span.size;
+		g_array_append_val(opaque, rec);
+		a->announced = true;
+	}
+	return FALSE;
+}
+
+/* Take runs of dirty chunks of a until the budget is used up. */
+static void qcu_mig_collect_alloc(QCMigWalk *w, QCMigAlloc *a)
+{
+	QCMigRecord rec;
+	uint64_t i, j, len;
+
+	i = 0;
+	while (a->ndirty > 0 && w->bytes < w->max)
+	{
+		i = find_next_bit(a->dirty, a->nchunks, i);
+		if (i >= a->nchunks)
+			break;
+
+		len = 0;
+		for (j = i; j < a->nchunks && test_bit(j, a->dirty) &&
+				len < QCU_MIG_RUN_MAX; j++)
+		{
+			clear_bit(j, a->dirty);
+			a->ndirty--;
+			len += qcu_mig_chunk_len(a, j);
+		}
+
+		rec.type = QCU_MIG_REC_DATA;
+		rec.addr = a->span.addr + i * QCU_MIG_CHUNK;
+		rec.len = len;
+		g_array_append_val(w->out, rec);
+		w->m->dirty_bytes -= len;
+		w->bytes += len;
+		i = j;
+	}
+}
+
+static gboolean qcu_mig_collect_one(gpointer key, gpointer value,
+		gpointer opaque)
+{
+	QCMigWalk *w = opaque;
+	QCMigAlloc *a = value;
+
+	if (w->wrapped != (a->span.addr < w->m->cursor))
+		return FALSE;
+
+	qcu_mig_collect_alloc(w, a);
+	if (w->bytes >= w->max)
+	{
+		// continue with what is left of this one
+		w->m->cursor = a->ndirty > 0 ? a->span.addr : a->span.addr + 1;
+		w->full = true;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+uint64_t qcu_mig_collect(QCMig *m, GArray *out, uint64_t max)
+{
+	QCMigWalk w = { .m = m, .out = out, .max = max };
+	QCMigRecord rec;
+	guint i;
+
+	qemu_mutex_lock(&m->lock);
+	for (i = 0; i < m->freed->len; i++)
+	{
+		rec.type = QCU_MIG_REC_FREE;
+		rec.addr = g_array_index(m->freed, uint64_t, i);
+		rec.len = 0;
+		g_array_append_val(out, rec);
+	}
+	g_array_set_size(m->freed, 0);
+	g_tree_foreach(m->allocs, qcu_mig_announce_one, out);
+
+	if (m->dirty_bytes > 0)
+	{
+		g_tree_foreach(m->allocs, qcu_mig_collect_one, &w);
+		if (!w.full)
+		{
+			w.wrapped = true;
+			g_tree_foreach(m->allocs, qcu_mig_collect_one, &w);
+		}
+		if (!w.full)
+			m->cursor = 0;
+	}
+	qemu_mutex_unlock(&m->lock);
+
+	return w.bytes;
+}
@@ -0,0 +1,286 @@
+/*
+ * GPU time arbitration between virtio-qcuda devices.
+ *
+ * Groups are looked up by name like block/throttle-groups.c does; the
+ * commands that are charged, and when, are decided in virtio-qcuda.c.
+ */
+
+#include "qemu-common.h"
+#include "qemu/timer.h"
+#include "hw/virtio/virtio-qcuda-qos.h"
+
+static QemuMutex qcu_qos_groups_lock;
+static QTAILQ_HEAD(, QCQosGroup) qcu_qos_groups =
+	QTAILQ_HEAD_INITIALIZER(qcu_qos_groups);
+
+static void __attribute__((__constructor__)) qcu_qos_init(void)
+{
+	qemu_mutex_init(&qcu_qos_groups_lock);
+}
+
+/* A bucket of the group went below its limit: let the waiters retry. */
+static void qcu_qos_timer_cb(void *opaque)
+{
+	QCQosGroup *g = opaque;
+
+	qemu_mutex_lock(&g->lock);
+	qemu_cond_broadcast(&g->cond);
+	qemu_mutex_unlock(&g->lock);
+}
+
+static QCQosGroup *qcu_qos_group_get(const char *name, AioContext *ctx)
+{
+	QCQosGroup *g = NULL, *iter;
+
+	qemu_mutex_lock(&qcu_qos_groups_lock);
+	if (name != NULL)
+	{
+		QTAILQ_FOREACH(iter, &qcu_qos_groups, next)
+		{
+			if (strcmp(iter->name, name) == 0)
+			{
+				g = iter;
+				break;
+			}
+		}
+	}
+
+	if (g == NULL)
+	{
+		g = g_new0(QCQosGroup, 1);
+		g->name = g_strdup(name);
+		qemu_mutex_init(&g->lock);
+		qemu_cond_init(&g->cond);
+		QLIST_INIT(&g->members);
+		throttle_init(&g->ts);
+		throttle_timers_init(&g->tt, ctx, QEMU_CLOCK_REALTIME,
+				qcu_qos_timer_cb, qcu_qos_timer_cb, g);
+		if (name != NULL)
+			QTAILQ_INSERT_TAIL(&qcu_qos_groups, g, next);
+	}
+	g->refcount++;
+	qemu_mutex_unlock(&qcu_qos_groups_lock);
+
+	return g;
+}
+
+static void qcu_qos_group_put(QCQosGroup *g)
+{
+	qemu_mutex_lock(&qcu_qos_groups_lock);
+	if (--g->refcount == 0)
+	{
+		if (g->name != NULL)
+			QTAILQ_REMOVE(&qcu_qos_groups, g, next);
+		throttle_timers_destroy(&g->tt);
+		qemu_cond_destroy(&g->cond);
+		qemu_mutex_destroy(&g->lock);
+		g_free(g->name);
+		g_free(g);
+	}
+	qemu_mutex_unlock(&qcu_qos_groups_lock);
+}
+
+static bool qcu_qos_limits_set(const QCQosLimits *l)
+{
+	return l->launch_rate || l->launch_burst || l->copy_bw || l->copy_burst;
+}
+
+static void qcu_qos_config_locked(QCQosGroup *g, const QCQosLimits *l)
+{
+	ThrottleConfig cfg;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.buckets[THROTTLE_BPS_READ].avg = l->launch_rate;
+	cfg.buckets[THROTTLE_BPS_READ].max = l->launch_burst;
+	cfg.buckets[THROTTLE_BPS_WRITE].avg = l->copy_bw;
+	cfg.buckets[THROTTLE_BPS_WRITE].max = l->copy_burst;
+	throttle_config(&g->ts, &g->tt, &cfg);
+
+	qemu_cond_broadcast(&g->cond);
+}
+
+void qcu_qos_register(QCQos *m, const char *name, uint32_t weight,
+		const QCQosLimits *limits, AioContext *ctx)
+{
+	QCQosGroup *g = qcu_qos_group_get(name, ctx);
+	int i;
+
+	qemu_mutex_lock(&g->lock);
+	m->group = g;
+	m->weight = MAX(MIN(weight, QCU_QOS_WEIGHT_MAX), 1);
+	m->stopped = false;
+	for (i = 0; i < QCU_QOS_KINDS; i++)
+	{
+		m->finish[i] = g->vclock[i];
+		m->waiting[i] = false;
+	}
+	QLIST_INSERT_HEAD(&g->members, m, next);
+
+	if (limits != NULL && qcu_qos_limits_set(limits))
+		qcu_qos_config_locked(g, limits);
+	qemu_mutex_unlock(&g->lock);
+}
+
+void qcu_qos_unregister(QCQos *m)
+{
+	QCQosGroup *g = m->group;
+
+	qemu_mutex_lock(&g->lock);
+	QLIST_REMOVE(m, next);
+	// a member waiting behind this one must not wait for it any more
+	qemu_cond_broadcast(&g->cond);
+	qemu_mutex_unlock(&g->lock);
+
+	qcu_qos_group_put(g);
+	m->group = NULL;
+}
+
+void qcu_qos_set_limits(QCQos *m, const QCQosLimits *limits)
+{
+	QCQosGroup *g = m->group;
+
+	qemu_mutex_lock(&g->lock);
+	qcu_qos_config_locked(g, limits);
+	qemu_mutex_unlock(&g->lock);
+}
+
+void qcu_qos_get_limits(QCQos *m, QCQosLimits *limits)
+{
+	QCQosGroup *g = m->group;
+	ThrottleConfig cfg;
+
+	qemu_mutex_lock(&g->lock);
+	throttle_get_config(&g->ts, &cfg);
+	qemu_mutex_unlock(&g->lock);
+
+	limits->launch_rate = cfg.buckets[THROTTLE_BPS_READ].avg;
+	limits->launch_burst = cfg.buckets[THROTTLE_BPS_READ].max;
+	limits->copy_bw = cfg.buckets[THROTTLE_BPS_WRITE].avg;
+	limits->copy_burst = cfg.buckets[THROTTLE_BPS_WRITE].max;
+}
+
+void qcu_qos_set_weight(QCQos *m, uint32_t weight)
+{
+	QCQosGroup *g = m->group;
+
+	qemu_mutex_lock(&g->lock);
+	m->weight = MAX(MIN(weight, QCU_QOS_WEIGHT_MAX), 1);
+	qemu_mutex_unlock(&g->lock);
+}
+
+static uint64_t qcu_qos_cost(int kind, uint64_t amount)
+{
+	if (kind == QCU_QOS_COPY)
+		amount = DIV_ROUND_UP(amount, QCU_QOS_COPY_UNIT);
+	return MAX(amount, 1);
+}
+
+static int64_t qcu_qos_admit_locked(QCQos *m, int kind, uint64_t amount,
+		int64_t now)
+{
+	QCQosGroup *g = m->group;
+	bool is_write = kind == QCU_QOS_COPY;
+	uint64_t start;
+	int64_t next;
+	bool must_wait, behind = false;
+	QCQos *o;
+
+	if (m->stopped || !throttle_enabled(&g->ts.cfg))
+		return 0;
+
+	start = MAX(g->vclock[kind], m->finish[kind]);
+	must_wait = throttle_compute_timer(&g->ts, is_write, now, &next);
+	QLIST_FOREACH(o, &g->members, next)
+	{
+		if (o != m && o->waiting[kind] && !o->stopped &&
+				o->start[kind] < start)
+		{
+			behind = true;
+			break;
+		}
+	}
+
+	if (must_wait || behind)
+	{
+		m->waiting[kind] = true;
+		m->start[kind] = start;
+		return must_wait ? MAX(next - now, 1) : -1;
+	}
+
+	m->waiting[kind] = false;
+	throttle_account(&g->ts, is_write, amount);
+	g->vclock[kind] = start;
+	m->finish[kind] = start +
+		qcu_qos_cost(kind, amount) * QCU_QOS_WEIGHT_MAX / m->weight;
+	return 0;
+}
+
+int64_t qcu_qos_admit(QCQos *m, int kind, uint64_t amount, int64_t now)
+{
+	QCQosGroup *g = m->group;
+	int64_t ret;
+
+	qemu_mutex_lock(&g->lock);
+	ret = qcu_qos_admit_locked(m, kind, amount, now);
+	qemu_mutex_unlock(&g->lock);
+	return ret;
+}
+
+void qcu_qos_wait(QCQos *m, int kind, uint64_t amount)
+{
+	QCQosGroup *g = m->group;
+	QEMUTimer *timer = g->tt.timers[kind == QCU_QOS_COPY];
+	int64_t start, now, wait;
+
+	start = now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+	qemu_mutex_lock(&g->lock);
+	while ((wait = qcu_qos_admit_locked(m, kind, amount, now)) != 0)
+	{
+		if (wait > 0)
+		{
+			if (!timer_pending(timer))
+				timer_mod(timer, now + wait);
+		}
+		else
+		{
+			// wake the member ahead of us, it may go now
+			qemu_cond_broadcast(&g->cond);
+		}
+		qemu_cond_wait(&g->cond, &g->lock);
+		now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+	}
+
+	if (now != start)
+	{
+		m->throttled[kind]++;
+		m->wait_ns[kind] += now - start;
+		// the next waiter may fit in what is left of the bucket
+		qemu_cond_broadcast(&g->cond);
+	}
+	qemu_mutex_unlock(&g->lock);
+}
+
+void qcu_qos_stop(QCQos *m)
+{
+	QCQosGroup *g = m->group;
+	int i;
+
+	qemu_mutex_lock(&g->lock);
+	m->stopped = true;
+	for (i = 0; i < QCU_QOS_KINDS; i++)
+		m->waiting[i] = false;
+	qemu_cond_broadcast(&g->cond);
+	qemu_mutex_unlock(&g->lock);
+}
+
+void qcu_qos_resume(QCQos *m)
+{
+	QCQosGroup *g = m->group;
+	int i;
+
+	qemu_mutex_lock(&g->lock);
+	m->stopped = false;
+	for (i = 0; i < QCU_QOS_KINDS; i++)
+		m->finish[i] = g->vclock[i];
+	qemu_mutex_unlock(&g->lock);
+}
@@ -0,0 +1,336 @@
+/*
+ * Oversubscribes virtio-qcuda device memory by evicting to host RAM.
+ */
+
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/queue.h"
+#include "hw/virtio/virtio-qcuda-swap.h"
+
+typedef struct QCSwapAlloc QCSwapAlloc;
+
+struct QCSwapAlloc
+{
+	uint64_t addr;
+	uint64_t size;
+	unsigned pins;
+	bool resident;
+	void *buf;		// contents while evicted, NULL if there are none
+	QTAILQ_ENTRY(QCSwapAlloc) lru;	// resident ones, coldest first
+};
+
+struct QCSwap
+{
+	const QCSwapOps *ops;
+	void *opaque;
+	uint64_t granularity;
+	uint64_t limit;
+	QCSwapStats *stats;
+
+	QemuMutex lock;
+	GTree *allocs;		// keyed by themselves, searched by address
+	QTAILQ_HEAD(, QCSwapAlloc) lru;
+	uint64_t resident;
+};
+
+static gint qcu_swap_cmp(gconstpointer a, gconstpointer b, gpointer opaque)
+{
+	const QCSwapAlloc *sa = a, *sb = b;
+
+	if (sa->addr < sb->addr)
+		return -1;
+	return sa->addr > sb->addr;
+}
+
+static gint qcu_swap_search(gconstpointer key, gconstpointer data)
+{
+	const QCSwapAlloc *a = key;
+	uint64_t addr = *(const uint64_t *)data;
+
+	if (addr < a->addr)
+		return -1;
+	return addr - a->addr >= a->size;
+}
+
+static QCSwapAlloc *qcu_swap_find(QCSwap *sw, uint64_t addr)
+{
+	return g_tree_search(sw->allocs, qcu_swap_search, &addr);
+}
+
+QCSwap *qcu_swap_new(const QCSwapOps *ops, void *opaque,
+		uint64_t granularity, uint64_t limit, QCSwapStats *stats)
+{
+	QCSwap *sw = g_new0(QCSwap, 1);
+
+	sw->ops = ops;
+	sw->opaque = opaque;
+	sw->granularity = MAX(granularity, 1);
+	sw->limit = limit;
+	sw->stats = stats;
+	qemu_mutex_init(&sw->lock);
+	sw->allocs = g_tree_new_full(qcu_swap_cmp, NULL, NULL, NULL);
+	QTAILQ_INIT(&sw->lru);
+
+	return sw;
+}
+
+/* Give back everything behind a; its device memory must be idle. */
+static void qcu_swap_drop(QCSwap *sw, QCSwapAlloc *a)
+{
+	if (a->resident)
+	{
+		sw->ops->unmap(sw->opaque, a->addr, a->size);
+		QTAILQ_REMOVE(&sw->lru, a, lru);
+		sw->resident -= a->size;
+		atomic_sub(&sw->stats->resident, a->size);
+	}
+	else if (a->buf != NULL)
+		atomic_sub(&sw->stats->swapped, a->size);
+	sw->ops->release(sw->opaque, a->addr, a->size);
+	g_free(a->buf);
+	g_free(a);
+}
+
+static gboolean qcu_swap_collect(gpointer key, gpointer value, gpointer data)
+{
+	g_ptr_array_add(data, value);
+	return FALSE;
+}
+
+void qcu_swap_destroy(QCSwap *sw)
+{
+	GPtrArray *all = g_ptr_array_new();
+	guint i;
+
+	g_tree_foreach(sw->allocs, qcu_swap_collect, all);
+	if (sw->resident > 0)
+		sw->ops->sync(sw->opaque);
+	for (i = 0; i < all->len; i++)
+		qcu_swap_drop(sw, g_ptr_array_index(all, i));
+	g_ptr_array_free(all, TRUE);
+
+	g_tree_destroy(sw->allocs);
+	qemu_mutex_destroy(&sw->lock);
+	g_free(sw);
+}
+
+/*
+ * Copy the coldest unpinned allocation out and unmap it.  The device is
+ * synchronized once per call that evicts (*synced): everything queued
+ * before was queued by a command that has unpinned its allocations, and
+ * new work needs the lock to pin them.
+ */
+static bool qcu_swap_evict(QCSwap *sw, bool *synced)
+{
+	QCSwapAlloc *a;
+	void *buf;
+
+	QTAILQ_FOREACH(a, &sw->lru, lru)
+	{
+		if (a->pins == 0)
+			break;
+	}
+	if (a == NULL)
+		return false;
+
+	buf = g_try_malloc(a->size);
+	if (buf == NULL)
+		return false;
+	if (!*synced)
+	{
+		sw->ops->sync(sw->opaque);
+		*synced = true;
+	}
+	if (!sw->ops->read(sw->opaque, a->addr, buf, a->size))
+	{
+		g_free(buf);
+		return false;
+	}
+	sw->ops->unmap(sw->opaque, a->addr, a->size);
+
+	QTAILQ_REMOVE(&sw->lru, a, lru);
+	a->resident = false;
+	a->buf = buf;
+	sw->resident -= a->size;
+	atomic_sub(&sw->stats->resident, a->size);
+	atomic_add(&sw->stats->swapped, a->size);
+	atomic_inc(&sw->stats->evictions);
+	atomic_add(&sw->stats->bytes_out, a->size);
+	return true;
+}
+
+/* Back a with device memory again, making room as needed; a is pinned. */
+static bool qcu_swap_fault(QCSwap *sw, QCSwapAlloc *a, bool *synced)
+{
+	while (sw->limit > 0 && sw->resident + a->size > sw->limit)
+	{
+		if (!qcu_swap_evict(sw, synced))
+			return false;
+	}
+	while (!sw->ops->map(sw->opaque, a->addr, a->size))
+	{
+		if (!qcu_swap_evict(sw, synced))
+			return false;
+	}
+
+	if (a->buf != NULL)
+	{
+		if (!sw->ops->write(sw->opaque, a->addr, a->buf, a->size))
+		{
+			sw->ops->unmap(sw->opaque, a->addr, a->size);
+			return false;
+		}
+		g_free(a->buf);
+		a->buf = NULL;
+		atomic_sub(&sw->stats->swapped, a->size);
+		atomic_inc(&sw->stats->faults);
+		atomic_add(&sw->stats->bytes_in, a->size);
+	}
+
+	a->resident = true;
+	QTAILQ_INSERT_TAIL(&sw->lru, a, lru);
+	sw->resident += a->size;
+	atomic_add(&sw->stats->resident, a->size);
+	return true;
+}
+
+bool qcu_swap_alloc(QCSwap *sw, uint64_t size, uint64_t *addr)
+{
+	QCSwapAlloc *a;
+	bool synced = false, ok;
+
+	size = QEMU_ALIGN_UP(size, sw->granularity);
+	if (size == 0 || (sw->limit > 0 && size > sw->limit))
+		return false;
+
+	qemu_mutex_lock(&sw->lock);
+	a = g_new0(QCSwapAlloc, 1);
+	a->size = size;
+	a->pins = 1;
+	ok = sw->ops->reserve(sw->opaque, size, &a->addr);
+	if (ok && !qcu_swap_fault(sw, a, &synced))
+	{
+		sw->ops->release(sw->opaque, a->addr, size);
+		ok = false;
+	}
+	if (ok)
+	{
+		a->pins = 0;
+		g_tree_insert(sw->allocs, a, a);
+		*addr = a->addr;
+	}
+	else
+		g_free(a);
+	qemu_mutex_unlock(&sw->lock);
+
+	return ok;
+}
+
+bool qcu_swap_free(QCSwap *sw, uint64_t addr)
+{
+	QCSwapAlloc *a;
+
+	qemu_mutex_lock(&sw->lock);
+	a = qcu_swap_find(sw, addr);
+	if (a == NULL || a->addr != addr)
+	{
+		qemu_mutex_unlock(&sw->lock);
+		return false;
+	}
+
+	g_tree_remove(sw->allocs, a);
+	// like cudaFree, wait until the device is done with the memory
+	if (a->resident)
+		sw->ops->sync(sw->opaque);
+	qcu_swap_drop(sw, a);
+	qemu_mutex_unlock(&sw->lock);
+
+	return true;
+}
+
+bool qcu_swap_owns(QCSwap *sw, uint64_t addr)
+{
+	bool owns;
+
+	qemu_mutex_lock(&sw->lock);
+	owns = qcu_swap_find(sw, addr) != NULL;
+	qemu_mutex_unlock(&sw->lock);
+
+	return owns;
+}
+
+static void qcu_swap_unpin_locked(QCSwap *sw, const uint64_t *ptrs,
+		unsigned n)
+{
+	QCSwapAlloc *a;
+	unsigned i;
+
+	for (i = 0; i < n; i++)
+	{
+		a = qcu_swap_find(sw, ptrs[i]);
+		if (a != NULL && a->pins > 0)
+			a->pins--;
+	}
+}
+
+bool qcu_swap_pin(QCSwap *sw, const uint64_t *ptrs, unsigned n)
+{
+	QCSwapAlloc *a;
+	bool synced = false, ok = true;
+	unsigned i;
+
+	qemu_mutex_lock(&sw->lock);
+
+	// pin all of them first, so that paging one in cannot evict another
+	for (i = 0; i < n; i++)
+	{
+		a = qcu_swap_find(sw, ptrs[i]);
+		if (a == NULL)
+			continue;
+		a->pins++;
+		if (a->resident)
+		{
+			QTAILQ_REMOVE(&sw->lru, a, lru);
+			QTAILQ_INSERT_TAIL(&sw->lru, a, lru);
+		}
+	}
+
+	for (i = 0; i < n && ok; i++)
+	{
+		a = qcu_swap_find(sw, ptrs[i]);
+		if (a != NULL && !a->resident)
+			ok = qcu_swap_fault(sw, a, &synced);
+	}
+
+	if (!ok)
+		qcu_swap_unpin_locked(sw, ptrs, n);
+	qemu_mutex_unlock(&sw->lock);
+
+	return ok;
+}
+
+void qcu_swap_unpin(QCSwap *sw, const uint64_t *ptrs, unsigned n)
+{
+	qemu_mutex_lock(&sw->lock);
+	qcu_swap_unpin_locked(sw, ptrs, n);
+	qemu_mutex_unlock(&sw->lock);
+}
+
+bool qcu_swap_copy_out(QCSwap *sw, uint64_t addr, void *buf, uint64_t len)
+{
+	QCSwapAlloc *a;
+	bool ok;
+
+	qemu_mutex_lock(&sw->lock);
+	a = qcu_swap_find(sw, addr);
+	ok = a != NULL && len <= a->size - (addr - a->addr);
+	if (ok && a->resident)
+		ok = sw->ops->read(sw->opaque, addr, buf, len);
+	else if (ok && a->buf != NULL)
+		memcpy(buf, (uint8_t *)a->buf + (addr - a->addr), len);
+	else if (ok)
+		memset(buf, 0, len);	// never written
+	qemu_mutex_unlock(&sw->lock);
+
+	return ok;
+}
@@ -1,10 +1,27 @@
 #include "qemu-common.h"
 #include "qemu/iov.h"
 #include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
+#include "qemu/processor.h"
 #include "hw/virtio/virtio.h"
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-qcuda.h"
+#include "hw/virtio/virtio-qcuda-gpa.h"
+#include "hw/virtio/virtio-qcuda-defer.h"
+#include "hw/virtio/virtio-access.h"
+#include "exec/address-spaces.h"
+#include "qemu/timer.h"
+#include "qemu/host-utils.h"
+#include "qemu/bitmap.h"
+#include "qmp-commands.h"
+#include "migration/migration.h"
+#include "sysemu/sysemu.h"
+#include "sysemu/kvm.h"
+#include "trace.h"
+#include "elf.h"
 #include <sys/mman.h>
+#include <sys/syscall.h>
 
 #ifdef CONFIG_CUDA
 #include <cuda.h>
@@ -12,18 +29,6 @@
 #include <builtin_types.h>
 #endif
 
-#if 1
-#define pfunc() printf("### %s at line %d\n", __func__, __LINE__)
-#else
-#define pfunc()
-#endif
-
-#if 1
-#define ptrace(fmt, arg...) \
-	printf("    " fmt, ##arg)
-#else
-#define ptrace(fmt, arg...)
-#endif
 
 
 #include "../../../qcu-driver/qcuda_common.h"
@@ -38,68 +43,520 @@
 #define VIRTHM_DEV_PATH "/dev/vf0"
 #define MAP_MAX_LENGTH (1956480*1024) //1.9 GB
 
-uint32_t BLOCK_SIZE;
-
-char *deviceSpace = NULL;
-uint32_t deviceSpaceSize = 0;
-
 //void *testdev;
 //char *buf; //cocotion test
 
+/*
+ * GPA -> HVA translation.  Guest RAM does not depend on the device, so one
+ * table, rebuilt by a memory listener on every change of the system
+ * address space, serves all instances.  Lookups take no locks and never
+ * touch the flat view; see virtio-qcuda-gpa.h.
+ */
+static QCGpaMap *qcu_gpa_map;
+static QLIST_HEAD(, VirtIOQC) virtio_qcuda_devices =
+	QLIST_HEAD_INITIALIZER(virtio_qcuda_devices);
+
+/* time the current worker spent resolving gather lists, for the stats */
+static __thread int64_t qcu_translate_ns;
+static GArray *qcu_gpa_building; // of QCGpaRange, between begin and commit
+static int qcu_gpa_users;
+
+static void qcu_gpa_map_release(QCGpaMap *map)
+{
+	unsigned i;
+
+	for (i = 0; i < map->nr; i++)
+		memory_region_unref(map->ranges[i].opaque);
+	qcu_gpa_map_free(map);
+}
+
+static void qcu_gpa_publish(QCGpaMap *map)
+{
+	QCGpaMap *old = qcu_gpa_map;
+
+	atomic_rcu_set(&qcu_gpa_map, map);
+	if (old != NULL)
+		call_rcu(old, qcu_gpa_map_release, rcu);
+}
+
+static void qcu_gpa_begin(MemoryListener *listener)
+{
+	g_array_set_size(qcu_gpa_building, 0);
+}
+
+static void qcu_gpa_region_add(MemoryListener *listener,
+		MemoryRegionSection *section)
+{
+	QCGpaRange r;
+
+	if (!memory_region_is_ram(section->mr))
+		return;
+
+	r.gpa = section->offset_within_address_space;
+	r.len = int128_get64(section->size);
+	r.hva = (uint8_t*)memory_region_get_ram_ptr(section->mr) +
+		section->offset_within_region;
+	r.opaque = section->mr;
+	r.offset = section->offset_within_region;
+	memory_region_ref(section->mr);
+	g_array_append_val(qcu_gpa_building, r);
+}
+
+static void qcu_gpa_commit(MemoryListener *listener)
+{
+	qcu_gpa_publish(qcu_gpa_map_new((QCGpaRange*)qcu_gpa_building->data,
+				qcu_gpa_building->len));
+	g_array_set_size(qcu_gpa_building, 0);
+}
+
+static MemoryListener qcu_gpa_listener = {
+	.begin = qcu_gpa_begin,
+	.commit = qcu_gpa_commit,
+	.region_add = qcu_gpa_region_add,
+	.region_nop = qcu_gpa_region_add,
+};
+
+static void qcu_gpa_listener_ref(void)
+{
+	if (qcu_gpa_users++ > 0)
+		return;
+
+	qcu_gpa_building = g_array_new(FALSE, FALSE, sizeof(QCGpaRange));
+	// registering replays region_add for the current map, but no commit
+	memory_listener_register(&qcu_gpa_listener, &address_space_memory);
+	qcu_gpa_commit(&qcu_gpa_listener);
+}
+
+static void qcu_gpa_listener_unref(void)
+{
+	if (--qcu_gpa_users > 0)
+		return;
+
+	memory_listener_unregister(&qcu_gpa_listener);
+	qcu_gpa_publish(NULL);
+	g_array_free(qcu_gpa_building, TRUE);
+	qcu_gpa_building = NULL;
+}
+
+/* The returned pointer is only valid inside the caller's RCU read
+ * section, which virtio_qcuda_cmd_exec holds around every command, or
+ * while the caller keeps the iothread lock.  *avail is set to the bytes
+ * from pa on that are contiguous in host memory. */
+static void *gpa_to_hva_avail(uint64_t pa, uint64_t *avail)
+{
+	const QCGpaRange *r = NULL;
+	QCGpaMap *map;
+	void *hva = NULL;
+
+	*avail = 0;
+	rcu_read_lock();
+	map = atomic_rcu_read(&qcu_gpa_map);
+	if (map != NULL)
+		r = qcu_gpa_map_find(map, pa);
+	if (r != NULL)
+	{
+		hva = qcu_gpa_range_hva(r, pa);
+		*avail = qcu_gpa_range_avail(r, pa);
+	}
+	rcu_read_unlock();
+
+	if (hva == NULL)
+		error("addr %p is not guest RAM\n", (void*)pa);
+
+	return hva;
+}
+
 static void* gpa_to_hva(uint64_t pa)
 {
-	MemoryRegionSection section;
+	uint64_t avail;
 
-	section = memory_region_find(get_system_memory(), (ram_addr_t)pa, 1);
-	if ( !int128_nz(section.size) || !memory_region_is_ram(section.mr)){
-		error("addr %p in rom\n", (void*)pa);
-		return 0;
+	return gpa_to_hva_avail(pa, &avail);
+}
+
+/*
+ * The device writes guest RAM through host pointers, behind the back of
+ * the memory API, so migration and display updates would miss the pages.
+ * Writes are entered in the dirty bitmaps once they have completed, one
+ * memory_region_set_dirty() per contiguous run instead of page by page.
+ */
+typedef struct QCDirtyRun
+{
+	MemoryRegion *mr;
+	hwaddr offset;
+	hwaddr len;
+} QCDirtyRun;
+
+/* Add a written run to runs, or mark it right away if runs is NULL.
+ * Runs keep a reference to their region until qcu_dirty_after has
+ * marked them. */
+static void qcu_dirty_add(GArray *runs, MemoryRegion *mr, hwaddr offset,
+		hwaddr len)
+{
+	QCDirtyRun r, *last;
+
+	if (runs == NULL)
+	{
+		memory_region_set_dirty(mr, offset, len);
+		return;
+	}
+
+	if (runs->len > 0)
+	{
+		last = &g_array_index(runs, QCDirtyRun, runs->len - 1);
+		if (last->mr == mr && last->offset + last->len == offset)
+		{
+			last->len += len;
+			return;
+		}
+	}
+	memory_region_ref(mr);
+	r.mr = mr;
+	r.offset = offset;
+	r.len = len;
+	g_array_append_val(runs, r);
+}
+
+/* Collect (or mark, see above) len bytes of guest RAM at gpa; whatever is
+ * not RAM is skipped, it was not written either. */
+static void qcu_dirty_gpa(GArray *runs, uint64_t gpa, uint64_t len)
+{
+	const QCGpaRange *r;
+	QCGpaMap *map;
+	uint64_t piece;
+
+	rcu_read_lock();
+	map = atomic_rcu_read(&qcu_gpa_map);
+	while (map != NULL && len > 0 &&
+			(r = qcu_gpa_map_find(map, gpa)) != NULL)
+	{
+		piece = MIN(len, qcu_gpa_range_avail(r, gpa));
+		qcu_dirty_add(runs, r->opaque, r->offset + (gpa - r->gpa), piece);
+		gpa += piece;
+		len -= piece;
+	}
+	rcu_read_unlock();
+}
+
+/* Anonymous shared memory of the given size, for the shm BAR and for the
+ * files handed out by CMD_MMAPCTL. */
+static int qcu_shm_open(uint64_t size)
+{
+	char name[64];
+	int fd = -1;
+
+#if defined(CONFIG_LINUX) && defined(__NR_memfd_create)
+	fd = syscall(__NR_memfd_create, "virtio-qcuda", 1 /* MFD_CLOEXEC */);
+#endif
+	if (fd < 0)
+	{
+		snprintf(name, sizeof(name), "/virtio-qcuda.%d.%p", getpid(), &fd);
+		fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+		if (fd >= 0)
+			shm_unlink(name);
+	}
+	if (fd < 0)
+	{
+		error("cannot create shared memory: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (ftruncate(fd, size) < 0)
+	{
+		error("cannot size shared memory to %"PRIu64": %s\n",
+				size, strerror(errno));
+		close(fd);
+		return -1;
 	}
 
-	return (memory_region_get_ram_ptr(section.mr) + section.offset_within_region);
+	return fd;
 }
 
 #ifdef CONFIG_CUDA
-CUdevice cudaDeviceCurrent;
-CUcontext cudaContext;
-// CUmodule cudaModule;
+/*
+ * Guest visible handles are indices into a growable array of host
+ * objects; freed slots are reused so the array stays as large as the
+ * peak number of live handles.  The table has its own lock because
+ * lookups happen on every queue worker while other commands of the same
+ * session may create or destroy handles.  Every slot also has a tag for
+ * what migration needs to recreate the object (flags, owning device).
+ */
+typedef struct QCHandleTable
+{
+	QemuMutex lock;
+	GPtrArray *slots;
+	GArray *tags;
+	GArray *free_slots;
+} QCHandleTable;
+
+static void qcu_handles_init(QCHandleTable *t, uint32_t reserved)
+{
+	qemu_mutex_init(&t->lock);
+	t->slots = g_ptr_array_new();
+	t->tags = g_array_new(FALSE, TRUE, sizeof(uint64_t));
+	t->free_slots = g_array_new(FALSE, FALSE, sizeof(uint32_t));
+	// reserved slots are never handed out (stream 0 is the default stream)
+	g_ptr_array_set_size(t->slots, reserved);
+	g_array_set_size(t->tags, reserved);
+}
+
+static void qcu_handles_destroy(QCHandleTable *t)
+{
+	g_array_free(t->free_slots, TRUE);
+	g_array_free(t->tags, TRUE);
+	g_ptr_array_free(t->slots, TRUE);
+	qemu_mutex_destroy(&t->lock);
+}
+
+static uint32_t qcu_handle_alloc_tagged(QCHandleTable *t, void *obj,
+		uint64_t tag)
+{
+	uint32_t idx;
+
+	qemu_mutex_lock(&t->lock);
+	if (t->free_slots->len > 0)
+	{
+		idx = g_array_index(t->free_slots, uint32_t, t->free_slots->len - 1);
+		g_array_set_size(t->free_slots, t->free_slots->len - 1);
+		g_ptr_array_index(t->slots, idx) = obj;
+		g_array_index(t->tags, uint64_t, idx) = tag;
+	}
+	else
+	{
+		idx = t->slots->len;
+		g_ptr_array_add(t->slots, obj);
+		g_array_append_val(t->tags, tag);
+	}
+	qemu_mutex_unlock(&t->lock);
 
-int cudaContext_count;
+	return idx;
+}
+
+static uint32_t qcu_handle_alloc(QCHandleTable *t, void *obj)
+{
+	return qcu_handle_alloc_tagged(t, obj, 0);
+}
+
+/* Put obj under the index it had on the migration source. */
+static void qcu_handle_restore(QCHandleTable *t, uint32_t idx, void *obj,
+		uint64_t tag)
+{
+	uint32_t i;
+
+	qemu_mutex_lock(&t->lock);
+	for (i = 0; i < t->free_slots->len; i++)
+	{
+		if (g_array_index(t->free_slots, uint32_t, i) == idx)
+		{
+			g_array_remove_index_fast(t->free_slots, i);
+			break;
+		}
+	}
+	for (i = t->slots->len; i <= idx; i++)
+	{
+		g_ptr_array_add(t->slots, NULL);
+		g_array_set_size(t->tags, i + 1);
+		if (i < idx)
+			g_array_append_val(t->free_slots, i);
+	}
+	g_ptr_array_index(t->slots, idx) = obj;
+	g_array_index(t->tags, uint64_t, idx) = tag;
+	qemu_mutex_unlock(&t->lock);
+}
 
-#define cudaFunctionMaxNum 8
-// CUfunction cudaFunction[cudaFunctionMaxNum];
-// uint32_t cudaFunctionId[cudaFunctionMaxNum];
-uint32_t cudaFunctionNum;
+static void *qcu_handle_get(QCHandleTable *t, uint64_t idx)
+{
+	void *obj = NULL;
+
+	qemu_mutex_lock(&t->lock);
+	if (idx < t->slots->len)
+		obj = g_ptr_array_index(t->slots, idx);
+	qemu_mutex_unlock(&t->lock);
+
+	return obj;
+}
+
+/* Returns the object that was stored under idx, or NULL. */
+static void *qcu_handle_free(QCHandleTable *t, uint64_t idx)
+{
+	void *obj = NULL;
+	uint32_t slot = idx;
+
+	qemu_mutex_lock(&t->lock);
+	if (idx < t->slots->len && g_ptr_array_index(t->slots, idx) != NULL)
+	{
+		obj = g_ptr_array_index(t->slots, idx);
+		g_ptr_array_index(t->slots, idx) = NULL;
+		g_array_append_val(t->free_slots, slot);
+	}
+	qemu_mutex_unlock(&t->lock);
 
-#define cudaEventMaxNum 16
-cudaEvent_t cudaEvent[cudaEventMaxNum];
-uint32_t cudaEventNum;
+	return obj;
+}
 
-#define cudaStreamMaxNum 32
-cudaStream_t cudaStream[cudaStreamMaxNum];
-uint32_t cudaStreamNum;
+/*
+ * A fatbinary, cubin or PTX image registered by the guest.  Images are
+ * copied out of guest memory and keyed by the SHA-256 of their contents,
+ * so all functions of one image share a single module per device and the
+ * JIT output can be cached on disk across runs.
+ */
+typedef struct QCImage {
+	char *hash;
+	void *data;
+	size_t size;
+	CUjitInputType type;
+} QCImage;
 
 typedef struct kernelInfo {
-	void *fatBin;
+	QCImage *image;
 	char *functionName;
 	uint32_t funcId;
 	// VirtioQCArg theArg;
 } kernelInfo;
 
+/* Argument buffer layout of a function, see VIRTQC_CMD_LAUNCH_LAYOUT.
+ * A registered layout is never modified, but UnregisterFatBinary and
+ * CLOSE drop the table; launches hold a reference while they use one. */
+typedef struct QCLaunchLayout {
+	int refs;
+	uint32_t size;
+	uint32_t nparams;
+	VirtIOQCLaunchParam params[];
+} QCLaunchLayout;
+
+/* the launch arena of the queue the current worker serves */
+static __thread VirtIOQCLaunchArena *qcu_launch_arena;
+
+/*
+ * Bounce buffers for copies that cannot DMA from guest memory directly
+ * (guest RAM not page-locked).  The slots are used round robin on a
+ * stream of their own, so that while the device transfers one slot the
+ * worker already gathers or scatters the next; each slot's event tells
+ * when its buffer may be touched again.
+ */
+#define QCU_STAGING_SLOTS	2
+#define QCU_STAGING_SIZE	(4 << 20)
+
+typedef struct QCStaging
+{
+	QemuMutex lock;		// one transfer at a time
+	CUstream stream;
+	void *buf[QCU_STAGING_SLOTS];
+	CUevent done[QCU_STAGING_SLOTS];
+} QCStaging;
+
 typedef struct cudaDev {
 	CUdevice device;
 	CUcontext context;
-	uint32_t cudaFunctionId[cudaFunctionMaxNum];
-	CUfunction cudaFunction[cudaFunctionMaxNum];
-	CUmodule module;
-	int kernelsLoaded;
+	GHashTable *functions; // funcId -> CUfunction
+	GHashTable *modules; // image hash -> CUmodule
+	/* s->kernels[0..kernels_loaded) are loaded here, under table_lock */
+	uint32_t kernels_loaded;
+	bool loading; // a background loader owns the device
+	QCStaging *staging; // created on first unpinned copy
+	QCAlloc *alloc; // cudaMalloc cache, created on first use
+	QCSwap *swap; // oversubscribed cudaMalloc, instead of the cache
+	GPtrArray *fences; // idle CUevents for the allocator's fences
+	GHashTable *blobs; // blob device pointer -> references held
+	CUstream sync_stream; // waits on events for deferred requests, table_lock
 	// cudaStream_t stream;
 } cudaDev;
 
+/* Graphs are replayed as CUDA graphs where the driver has them, with
+ * parameters updated in place; older drivers get one launch per node. */
+#if CUDA_VERSION >= 10010
+#define QCU_HAVE_GRAPHS
+#endif
+
+/* A recorded graph and what it is set up as on one device. */
+typedef struct QCGraphExec
+{
+	QemuMutex lock;		// one replay at a time
+	int refs;		// the handle's and those of commands using it
+	QCGraph *graph;
+	int device;		// func (and exec) are for this device, -1 if none
+	CUfunction *func;	// per node
+#ifdef QCU_HAVE_GRAPHS
+	CUgraph cugraph;
+	CUgraphExec exec;	// NULL: launch the nodes one by one
+	CUgraphNode *nodes;
+#endif
+} QCGraphExec;
+
 int totalDevices;
-cudaDev *cudaDevices;
-cudaDev zeroedDevice;
-kernelInfo devicesKernels[cudaFunctionMaxNum];
+#endif
+
+/*
+ * Everything a guest process owns on the host: its contexts, registered
+ * kernels, stream and event handles and the staging buffer of the
+ * read/write commands.  Sessions are keyed by the id the guest driver
+ * sends in VirtIOQCArgExt; requests without one use session 0.
+ */
+typedef struct QCSession
+{
+	VirtIOQC *qcu;
+	uint32_t id;
+	int refcount;
+	bool closed;
+	/* commands running on the queue workers, and whether one that tears
+	 * the session down waits for them; under qcu->session_lock */
+	int active;
+	bool quiescing;
+	QemuCond active_cond;
+	/* serializes commands that change this session's tables */
+	QemuMutex lock;
+
+	uint32_t block_size;
+	char *device_space;
+	uint32_t device_space_size;
+	uint32_t device_space_cap;
+
+	/* guest blocks each CMD_MMAP file is mapped over, fd -> GArray of
+	 * their addresses, to mark them when the device writes the file */
+	QemuMutex mmap_lock;
+	GHashTable *mmaps;
+
+#ifdef CONFIG_CUDA
+	int fatbin_count;
+	CUdevice device_current;
+	cudaDev *devices;
+
+	/* kernels and the per device function maps are guarded by table_lock */
+	QemuMutex table_lock;
+	GArray *kernels; // of kernelInfo, replayed when switching devices
+	GHashTable *layouts; // funcId -> QCLaunchLayout
+	GHashTable *images; // hash -> QCImage, only used by serial commands
+	GHashTable *image_gpas; // guest address -> QCImage of the fatbinary
+	QemuCond load_cond; // a background loader finished, with table_lock
+
+	QCHandleTable events;
+	QCHandleTable streams;
+	QCHandleTable graphs;
+
+	/* streams being recorded: stream index -> QCGraph, under table_lock;
+	 * capturing counts them so launches can skip the lookup */
+	GHashTable *captures;
+	int capturing;
+
+	/* guest RAM and shm blocks this session holds in VirtIOQC.pinned,
+	 * under table_lock */
+	bool pin_guest_ram;
+	GHashTable *pinned;
+
+	/* the guest's allocations per device, kept from the first time the
+	 * devices are opened until the session goes away */
+	QCMig **mig;
+	bool mig_seen;	// the incoming migration sent this session's state
+#endif
+} QCSession;
+
+#ifdef CONFIG_CUDA
+
+static bool qcu_req_defer(QCSession *s, VirtIOQCReq *req, CUevent ev);
+static void qcu_graphs_drop_device(QCSession *s, int devId);
+static void qcu_graph_exec_put(QCGraphExec *ge);
+static bool qcu_swap_use(QCSession *s, const uint64_t *ptrs, unsigned n);
+static void qcu_swap_done(QCSession *s, const uint64_t *ptrs, unsigned n);
+static void qcu_blobs_drop_device(QCSession *s, cudaDev *dev);
 
 #define cudaError(err) __cudaErrorCheck(err, __LINE__)
 static inline void __cudaErrorCheck(cudaError_t err, const int line)
@@ -124,1351 +581,6469 @@ static inline void __cuErrorCheck(CUresult err, const int line)
 	}
 }
 
-////////////////////////////////////////////////////////////////////////////////
-///	Module & Execution control (driver API)
-////////////////////////////////////////////////////////////////////////////////
-
-static void qcu_cudaRegisterFatBinary(VirtioQCArg *arg)
+/* CUDA contexts are current per host thread, and commands may run on any
+ * queue worker: make sure this one uses the device the guest selected. */
+static void qcu_bind_context(QCSession *s)
 {
-	uint32_t i;
-	pfunc();
+	CUcontext ctx, cur;
 
-	// for(i=0; i<cudaFunctionMaxNum; i++)
-	// 	memset(&cudaFunction[i], 0, sizeof(CUfunction));
+	if (s->devices == NULL || s->device_current >= totalDevices)
+		return;
 
-	for(i=0; i<cudaEventMaxNum; i++)
-		memset(&cudaEvent[i], 0, sizeof(cudaEvent_t));
+	ctx = s->devices[s->device_current].context;
+	if (ctx == NULL)
+		return;
 
-	for(i=0; i<cudaStreamMaxNum; i++)
-		memset(&cudaStream[i], 0, sizeof(cudaStream_t));
+	if (cuCtxGetCurrent(&cur) != CUDA_SUCCESS || cur != ctx)
+		cuError( cuCtxSetCurrent(ctx) );
+}
 
-	cuError( cuInit(0) );
-	cuError( cuDeviceGetCount(&totalDevices) );
-	cudaDevices = (cudaDev *) malloc(totalDevices * sizeof(cudaDev));
-	memset(&zeroedDevice, 0, sizeof(cudaDev));
+static cudaStream_t qcu_stream(QCSession *s, uint64_t idx)
+{
+	if (idx == (uint64_t)-1)
+		return NULL;
+	return qcu_handle_get(&s->streams, idx);
+}
 
-	i = totalDevices;
-	// the last created context is the one used & associated with the device
-	// so do this in reverse order
-	// while(i-- != 0)
-	while(i-- != 0)
-	{
-		printf("creating context for device %d\n", i);
-		memset(&cudaDevices[i], 0, sizeof(cudaDev));
-		cuError( cuDeviceGet(&cudaDevices[i].device, i) );
-		cuError( cuCtxCreate(&cudaDevices[i].context, 0, cudaDevices[i].device) );
-		memset(&cudaDevices[i].cudaFunction, 0, sizeof(CUfunction) * cudaFunctionMaxNum);
-		cudaDevices[i].kernelsLoaded = 0;
-		// cuError( cudaStreamCreate(&cudaDevices[i].stream) );
-	}
+static cudaEvent_t qcu_event(QCSession *s, uint64_t idx)
+{
+	return qcu_handle_get(&s->events, idx);
+}
 
-	cudaDeviceCurrent = cudaDevices[0].device; //used when calling cudaGetDevice
+static void qcu_function_add(QCSession *s, cudaDev *dev, uint32_t funcId,
+		CUfunction func)
+{
+	qemu_mutex_lock(&s->table_lock);
+	if (dev->functions == NULL)
+		dev->functions = g_hash_table_new(g_direct_hash, g_direct_equal);
+	g_hash_table_insert(dev->functions, GUINT_TO_POINTER(funcId), func);
+	qemu_mutex_unlock(&s->table_lock);
+}
 
-	// cuError( cuDeviceGet(&cudaDeviceCurrent, 0) );
-	// cuError( cuCtxCreate(&cudaContext, 0, cudaDeviceCurrent) );
-//	cudaSetDevice(0);
-	cudaFunctionNum = 0;
-	cudaEventNum = 0;
+static CUfunction qcu_function_lookup(QCSession *s, cudaDev *dev,
+		uint32_t funcId)
+{
+	CUfunction func = NULL;
 
-	cudaStreamNum = 1;
+	qemu_mutex_lock(&s->table_lock);
+	if (dev->functions != NULL)
+		func = g_hash_table_lookup(dev->functions, GUINT_TO_POINTER(funcId));
+	qemu_mutex_unlock(&s->table_lock);
 
-	cudaContext_count = 1;
+	return func;
 }
 
-static void qcu_cudaUnregisterFatBinary(VirtioQCArg *arg)
+static void qcu_layout_put(gpointer data)
 {
-	uint32_t i;
-	pfunc();
-
-	for(i=0; i<cudaEventMaxNum; i++)
-	{
-		if( cudaEvent[i] != 0 ){
-			cudaError( cudaEventDestroy(cudaEvent[i]));
-		}
-	}
+	QCLaunchLayout *l = data;
 
-	for(i = 0; i < totalDevices; i++)
-	{
-		// get rid of default context if any
-		// when a device is reset there will be no context
-		if( memcmp( &zeroedDevice, &cudaDevices[i], sizeof(cudaDev) ) != 0 )
-		{
-			printf("Destroying context for dev %d\n", i);
-			// cudaError( cudaStreamDestroy(cudaDevices[i].stream) );
-			cudaError( cuCtxDestroy(cudaDevices[i].context) );
-		}
-	}
+	if (atomic_fetch_dec(&l->refs) == 1)
+		g_free(l);
+}
 
-	free(cudaDevices);
+/* Same, together with a reference to the function's argument layout (or
+ * NULL), to be dropped with qcu_layout_put. */
+static CUfunction qcu_launch_lookup(QCSession *s, cudaDev *dev,
+		uint32_t funcId, QCLaunchLayout **layout)
+{
+	CUfunction func = NULL;
 
-	// cuCtxDestroy(cudaContext);
+	qemu_mutex_lock(&s->table_lock);
+	if (dev->functions != NULL)
+		func = g_hash_table_lookup(dev->functions, GUINT_TO_POINTER(funcId));
+	*layout = g_hash_table_lookup(s->layouts, GUINT_TO_POINTER(funcId));
+	if (*layout != NULL)
+		atomic_inc(&(*layout)->refs);
+	qemu_mutex_unlock(&s->table_lock);
 
-//	cuCtxDestroy(cudaContext[0]);
-//	cuCtxDestroy(cudaContext[1]);
-//	cuCtxDestroy(cudaContext[2]);
-//	cuCtxDestroy(cudaContext[3]);
+	return func;
+}
 
-//	for(i = cudaContext_count-1; i >0; i--)
-//	{
-		printf("cocotion pop current ctx\n");
-		//cuError(cuCtxPopCurrent(&cudaContext[0])) ; //cocotion test
-//		cuCtxDestroy(cudaContext[i]);
-//	}
-/*
-	cuCtxDestroy(cudaContext);
+/* Needs the context the staging area was created in to be current. */
+static void qcu_staging_free(QCStaging *st)
+{
+	int i;
 
-	for(i = cudaContext_count-1; i >0; i--)
+	for (i = 0; i < QCU_STAGING_SLOTS; i++)
 	{
-		printf("cocotion pop current ctx\n");
-		cuError(cuCtxPopCurrent(&cudaContext)) ; //cocotion test
-		cuCtxDestroy(cudaContext);
+		if (st->done[i] != NULL)
+			cuError( cuEventDestroy(st->done[i]) );
+		if (st->buf[i] != NULL)
+			cuError( cuMemFreeHost(st->buf[i]) );
 	}
-*/
-
+	if (st->stream != NULL)
+		cuError( cuStreamDestroy(st->stream) );
+	qemu_mutex_destroy(&st->lock);
+	g_free(st);
 }
 
-void loadModuleKernels(int devId, void *fBin, char *fName,  uint32_t fId, uint32_t fNum)
+static void qcu_event_destroy(gpointer ev, gpointer opaque)
 {
-	pfunc();
-	ptrace("loading module.... fatBin= %16p ,name= '%s', fId = '%d'\n", fBin, fName, fId);
-	// cuCtxSetCurrent(cudaDevices[devId].context);
-	cuError( cuModuleLoadData( &cudaDevices[devId].module, fBin ));
-	cuError( cuModuleGetFunction(&cudaDevices[devId].cudaFunction[fNum],
-				cudaDevices[devId].module, fName) );
-	cudaDevices[devId].cudaFunctionId[fNum] = fId;
-
-	cudaDevices[devId].kernelsLoaded = 1;
+	cuError( cuEventDestroy(ev) );
 }
 
-void reloadAllKernels(void)
+/* Drop everything owned by a device, e.g. after cudaDeviceReset; its
+ * context must be current. */
+static void qcu_device_clear(QCSession *s, cudaDev *dev)
 {
-	pfunc();
-	uint32_t i = 0;
-	for( i = 0; i < cudaFunctionNum; i++ )
+	GHashTableIter iter;
+	gpointer mod;
+
+	qcu_graphs_drop_device(s, dev - s->devices);
+	qcu_blobs_drop_device(s, dev);
+	// the allocations went with the context, restored ones are unmapped
+	if (s->mig != NULL)
+		qcu_mig_clear(s->mig[dev - s->devices]);
+
+	qemu_mutex_lock(&s->table_lock);
+	if (dev->functions != NULL)
+		g_hash_table_destroy(dev->functions);
+	if (dev->modules != NULL)
 	{
-		// void *fb = gpa_to_hva( devicesKernels[i].theArg.pA );
-		// char *fn = gpa_to_hva( devicesKernels[i].theArg.pB );
-
-		loadModuleKernels( cudaDeviceCurrent, devicesKernels[i].fatBin,
-			devicesKernels[i].functionName, devicesKernels[i].funcId, i );
+		g_hash_table_iter_init(&iter, dev->modules);
+		while (g_hash_table_iter_next(&iter, NULL, &mod))
+			cuError( cuModuleUnload(mod) );
+		g_hash_table_destroy(dev->modules);
+	}
+	if (dev->staging != NULL)
+		qcu_staging_free(dev->staging);
+	if (dev->alloc != NULL)
+		qcu_alloc_destroy(dev->alloc);
+	if (dev->swap != NULL)
+		qcu_swap_destroy(dev->swap);
+	if (dev->fences != NULL)
+	{
+		g_ptr_array_foreach(dev->fences, qcu_event_destroy, NULL);
+		g_ptr_array_free(dev->fences, TRUE);
+	}
+	if (dev->sync_stream != NULL)
+	{
+		// let parked requests complete before the context goes away
+		cuError( cuStreamSynchronize(dev->sync_stream) );
+		cuError( cuStreamDestroy(dev->sync_stream) );
 	}
+	memset(dev, 0, sizeof(cudaDev));
+	qemu_mutex_unlock(&s->table_lock);
 }
 
-static void qcu_cudaRegisterFunction(VirtioQCArg *arg)
+/* Wait until no background loader uses the device. */
+static void qcu_device_wait(QCSession *s, int devId)
 {
-	void *fatBin;
-	char *functionName;
-	uint32_t funcId;
-	int i = 0;
-	pfunc();
+	qemu_mutex_lock(&s->table_lock);
+	while (s->devices[devId].loading)
+		qemu_cond_wait(&s->load_cond, &s->table_lock);
+	qemu_mutex_unlock(&s->table_lock);
+}
 
-	// assume fatbin size is less equal 4MB
-	fatBin       = gpa_to_hva(arg->pA);
-	functionName = gpa_to_hva(arg->pB);
-	funcId		 = arg->flag;
+////////////////////////////////////////////////////////////////////////////////
+///	Module & Execution control (driver API)
+////////////////////////////////////////////////////////////////////////////////
+
+static bool qcu_device_eager(QCSession *s, int devId)
+{
+	return devId < 64 && (s->qcu->conf.eager_mask & (1ULL << devId));
+}
 
-	devicesKernels[cudaFunctionNum].fatBin = fatBin;
-	devicesKernels[cudaFunctionNum].funcId = funcId;
-	devicesKernels[cudaFunctionNum].functionName = (char*) malloc( sizeof(char)*(strlen(functionName)+1) );
-	strcpy( devicesKernels[cudaFunctionNum].functionName, functionName );
-	// memcpy( &devicesKernels[cudaFunctionNum].theArg, arg, sizeof(VirtioQCArg) );
+typedef struct QCDeviceOpen
+{
+	QCSession *s;
+	int devId;
+	QemuThread thread;
+} QCDeviceOpen;
 
-	ptrace("fatBin= %16p ,name= '%s', fId = '%d'\n", fatBin, functionName, funcId);
-	// for(i = 0; i < totalDevices; i++)
-	// {
-	// 	cuError( cuCtxSetCurrent(cudaDevices[i].context) );
-		// loadModuleKernels( i, fatBin, functionName, funcId, cudaFunctionNum );
-		cuError( cuModuleLoadData( &cudaDevices[cudaDeviceCurrent].module, fatBin ) );
-		cuError( cuModuleGetFunction(&cudaDevices[cudaDeviceCurrent].cudaFunction[cudaFunctionNum],
-					cudaDevices[cudaDeviceCurrent].module, functionName) );
-		cudaDevices[cudaDeviceCurrent].cudaFunctionId[cudaFunctionNum] = funcId;
-	// }
-	// cuError( cuCtxSetCurrent(cudaDevices[cudaDeviceCurrent].context) );
+static void qcu_device_open(QCSession *s, int devId)
+{
+	cudaDev *dev = &s->devices[devId];
 
-	cudaFunctionNum++;
+	trace_virtio_qcuda_context_create(s->id, devId);
+	cuError( cuDeviceGet(&dev->device, devId) );
+	cuError( cuCtxCreate(&dev->context, 0, dev->device) );
 }
 
-static void qcu_cudaLaunch(VirtioQCArg *arg)
+static void *qcu_device_open_thread(void *opaque)
 {
-	//unsigned int *conf;
-	uint64_t *conf;
-	uint8_t *para;
-	uint32_t funcId, paraNum, paraIdx, funcIdx;
-	void **paraBuf;
-	int i;
-	pfunc();
+	QCDeviceOpen *op = opaque;
+	CUcontext ctx;
 
-	conf = gpa_to_hva(arg->pA);
-	para = gpa_to_hva(arg->pB);
-	paraNum = *((uint32_t*)para);
-	funcId = arg->flag;
+	qcu_device_open(op->s, op->devId);
+	// leave the context floating, the worker binds it later
+	cuError( cuCtxPopCurrent(&ctx) );
+	return NULL;
+}
 
-	ptrace("paraNum= %u\n", paraNum);
+/* Incoming migrations map device memory at the addresses the source
+ * had, which takes the virtual memory management API. */
+#if CUDA_VERSION >= 10020
+#define QCU_HAVE_VMM
+#endif
 
-	paraBuf = malloc(paraNum*sizeof(void*));
-	paraIdx = sizeof(uint32_t);
+#ifdef QCU_HAVE_VMM
+static void qcu_mig_prop(CUmemAllocationProp *prop, int devId)
+{
+	memset(prop, 0, sizeof(*prop));
+	prop->type = CU_MEM_ALLOCATION_TYPE_PINNED;
+	prop->location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+	prop->location.id = devId;
+}
 
-	for(i=0; i<paraNum; i++)
+/* Back reserved address space with memory of devId; runs with a context
+ * of the device current.  The memory lives as long as it is mapped, so
+ * the allocation handle is released right away. */
+static CUresult qcu_vmm_map(uint64_t addr, uint64_t size, int devId)
+{
+	CUmemAllocationProp prop;
+	CUmemAccessDesc access;
+	CUmemGenericAllocationHandle handle;
+	CUresult err;
+
+	qcu_mig_prop(&prop, devId);
+	err = cuMemCreate(&handle, size, &prop, 0);
+	if (err == CUDA_SUCCESS)
 	{
-		paraBuf[i] = &para[paraIdx+sizeof(uint32_t)];
-		ptrace("arg %d = 0x%llx size= %u byte\n", i,
-			*(unsigned long long*)paraBuf[i], *(unsigned int*)&para[paraIdx]);
+		err = cuMemMap(addr, size, 0, handle, 0);
+		cuError( cuMemRelease(handle) );
+		if (err == CUDA_SUCCESS)
+		{
+			access.location = prop.location;
+			access.flags = CU_MEM_ACCESS_FLAGS_PROT_READWRITE;
+			err = cuMemSetAccess(addr, size, &access, 1);
+			if (err != CUDA_SUCCESS)
+				cuError( cuMemUnmap(addr, size) );
+		}
+	}
+	return err;
+}
+
+static bool qcu_mig_map(void *opaque, uint64_t addr, uint64_t size)
+{
+	CUdeviceptr ptr;
+	CUresult err;
 
-		paraIdx += *((uint32_t*)&para[paraIdx]) + sizeof(uint32_t);
+	err = cuMemAddressReserve(&ptr, size, 0, addr, 0);
+	if (err != CUDA_SUCCESS)
+	{
+		cuError(err);
+		return false;
+	}
+	if (ptr != addr)
+	{
+		// the range is taken, e.g. by an allocation of another session
+		cuError( cuMemAddressFree(ptr, size) );
+		return false;
 	}
 
-	for(funcIdx=0; funcIdx<cudaFunctionNum; funcIdx++)
+	err = qcu_vmm_map(ptr, size, GPOINTER_TO_INT(opaque));
+	if (err != CUDA_SUCCESS)
 	{
-		if( cudaDevices[cudaDeviceCurrent].cudaFunctionId[funcIdx] == funcId )
-			break;
+		cuError(err);
+		cuError( cuMemAddressFree(ptr, size) );
+		return false;
 	}
+	return true;
+}
 
-	ptrace("grid (%u %u %u) block(%u %u %u) sharedMem(%u)\n",
-			conf[0], conf[1], conf[2], conf[3], conf[4], conf[5], conf[6]);
+static void qcu_mig_unmap(void *opaque, uint64_t addr, uint64_t size)
+{
+	// like cudaFree, wait until the device is done with the memory
+	cuError( cuCtxSynchronize() );
+	cuError( cuMemUnmap(addr, size) );
+	cuError( cuMemAddressFree(addr, size) );
+}
 
-//	cuError( cuLaunchKernel(cudaFunction[funcIdx],
-//				conf[0], conf[1], conf[2],
-//				conf[3], conf[4], conf[5],
-//				conf[6], NULL, paraBuf, NULL)); // not suppoer stream yeat
+static const QCMigOps qcu_mig_ops = {
+	.map = qcu_mig_map,
+	.unmap = qcu_mig_unmap,
+};
+#endif
 
-// cudaDevices[cudaDeviceCurrent].stream
+/* Set up allocation tracking for every device; if a migration is running
+ * the new trackers log from the start. */
+static void qcu_session_track(QCSession *s)
+{
+	VirtIOQC *qcu = s->qcu;
+	const QCMigOps *ops = NULL;
+	uint64_t granularity = 0;
+	QCMig **mig;
+	int i;
+#ifdef QCU_HAVE_VMM
+	CUmemAllocationProp prop;
+	size_t gran;
+#endif
 
-	cuError( cuLaunchKernel(cudaDevices[cudaDeviceCurrent].cudaFunction[funcIdx],
-				conf[0], conf[1], conf[2],
-				conf[3], conf[4], conf[5],
-				conf[6], (conf[7]==(uint64_t)-1)?NULL:cudaStream[conf[7]], paraBuf, NULL)); // not suppoer stream yeat
+	if (s->mig != NULL)
+		return;
 
-	free(paraBuf);
-}
+	mig = g_new0(QCMig *, totalDevices);
+	for (i = 0; i < totalDevices; i++)
+	{
+#ifdef QCU_HAVE_VMM
+		qcu_mig_prop(&prop, i);
+		if (cuMemGetAllocationGranularity(&gran, &prop,
+					CU_MEM_ALLOC_GRANULARITY_MINIMUM) == CUDA_SUCCESS)
+		{
+			ops = &qcu_mig_ops;
+			granularity = gran;
+		}
+#endif
+		mig[i] = qcu_mig_new(ops, GINT_TO_POINTER(i), granularity);
+	}
 
-////////////////////////////////////////////////////////////////////////////////
-/// Memory Management (runtime API)
-////////////////////////////////////////////////////////////////////////////////
+	qemu_mutex_lock(&qcu->session_lock);
+	s->mig = mig;
+	for (i = 0; qcu->migrating && i < totalDevices; i++)
+		qcu_mig_start(mig[i]);
+	qemu_mutex_unlock(&qcu->session_lock);
+}
 
-static void qcu_cudaMalloc(VirtioQCArg *arg)
+static bool qcu_mig_active(QCSession *s)
 {
-	cudaError_t err;
-	uint32_t count;
-	void* devPtr;
-	pfunc();
+	return s->mig != NULL && atomic_read(&s->qcu->migrating);
+}
 
-	count = arg->flag;
-	cudaError((err = cudaMalloc( &devPtr, count )));
-	arg->cmd = err;
-	arg->pA = (uint64_t)devPtr;
+/* Mark device memory a command wrote for the running migration.  The
+ * session's allocations do not overlap across devices, so it is marked
+ * in whichever tracker has it. */
+static void qcu_mig_write(QCSession *s, uint64_t addr, uint64_t len)
+{
+	int i;
 
-	ptrace("ptr= %p ,count= %u\n", (void*)arg->pA, count);
+	if (!qcu_mig_active(s))
+		return;
+	for (i = 0; i < totalDevices; i++)
+		qcu_mig_dirty(s->mig[i], addr, len);
 }
 
-static void qcu_cudaMemset(VirtioQCArg *arg)
+/* A kernel parameter that may be a device pointer. */
+static void qcu_mig_write_arg(QCSession *s, const void *arg, uint32_t size)
 {
-	cudaError_t err;
-	void* dst;
+	uint64_t ptr;
+	int i;
 
-	dst = (void*)arg->pA;
-	cudaError((err = cudaMemset(dst, arg->para, arg->pASize)));
-	arg->cmd = err;
+	if (size != sizeof(uint64_t))
+		return;
+	memcpy(&ptr, arg, sizeof(ptr));
+	for (i = 0; i < totalDevices; i++)
+		qcu_mig_dirty_ptr(s->mig[i], ptr);
 }
 
-static void qcu_cudaMemcpy(VirtioQCArg *arg)
+/* Create the session's contexts, one per host GPU. */
+static void qcu_session_open_devices(QCSession *s)
 {
-	//int fd;
-	uint32_t size, len, i;
+	QCDeviceOpen *ops;
+	int i, n = 0;
 
-	cudaError_t err;
-	void *dst, *src;
-	uint64_t *gpa_array;
+	cuError( cuInit(0) );
+	cuError( cuDeviceGetCount(&totalDevices) );
+	s->devices = (cudaDev *) calloc(totalDevices, sizeof(cudaDev));
 
-	pfunc();
+	// context creation takes long and does not serialize across devices,
+	// so the eager ones are created side by side
+	ops = g_new0(QCDeviceOpen, totalDevices);
+	for (i = 0; i < totalDevices; i++)
+	{
+		if (!qcu_device_eager(s, i))
+			continue;
+		ops[n].s = s;
+		ops[n].devId = i;
+		qemu_thread_create(&ops[n].thread, "virtio-qcuda/ctx",
+				qcu_device_open_thread, &ops[n], QEMU_THREAD_JOINABLE);
+		n++;
+	}
+	for (i = 0; i < totalDevices; i++)
+	{
+		if (!qcu_device_eager(s, i))
+			qcu_device_open(s, i);
+	}
+	while (n-- > 0)
+		qemu_thread_join(&ops[n].thread);
+	g_free(ops);
 
-	if( arg->flag == cudaMemcpyHostToDevice )
+	s->device_current = s->devices[0].device; //used when calling cudaGetDevice
+	cuError( cuCtxSetCurrent(s->devices[0].context) );
+	qcu_session_track(s);
+}
+
+static void qcu_cudaRegisterFatBinary(QCSession *s, VirtioQCArg *arg)
+{
+	// a new library may reuse the guest addresses of one unloaded before
+	g_hash_table_remove_all(s->image_gpas);
+
+	// every fatbinary of a process shares the session's contexts
+	if( s->fatbin_count++ > 0 )
+		return;
+
+	qcu_session_open_devices(s);
+}
+
+/* State of a host memory block in VirtIOQC.pinned. */
+enum
+{
+	QC_PIN_OWNED = 1,	// registered by this device
+	QC_PIN_SHARED,		// already page-locked by someone else
+	QC_PIN_FAILED,		// driver refused, copies stay pageable
+};
+
+typedef struct QCPin
+{
+	int state;
+	int refs;	// sessions that have copied through the block
+} QCPin;
+
+/* Page-lock a block of host memory the first time a copy touches it, so
+ * that later copies can DMA straight out of it.  Blocks are shared by all
+ * sessions of the device and unregistered when the last one lets go.
+ * Returns whether the block is page-locked. */
+static bool qcu_pin_host(QCSession *s, void *base, uint64_t size)
+{
+	VirtIOQC *qcu = s->qcu;
+	QCPin *pin;
+	CUresult err;
+	int state;
+
+	qemu_mutex_lock(&s->table_lock);
+	qemu_mutex_lock(&qcu->pin_lock);
+	pin = g_hash_table_lookup(qcu->pinned, base);
+	if (pin == NULL)
 	{
-		dst = (void*)arg->pA;
-		size = arg->pBSize;
-#ifdef USER_KERNEL_COPY
-		if( size > QCU_KMALLOC_MAX_SIZE)
+		pin = g_new0(QCPin, 1);
+		err = cuMemHostRegister(base, size, CU_MEMHOSTREGISTER_PORTABLE);
+		if (err == CUDA_SUCCESS)
+			pin->state = QC_PIN_OWNED;
+		else if (err == CUDA_ERROR_HOST_MEMORY_ALREADY_REGISTERED)
+			pin->state = QC_PIN_SHARED;
+		else
 		{
-#endif
-   			if(arg->para)
-			{
-				src = gpa_to_hva(arg->pB);
-				//src = gpa_to_hva(arg->rnd);
-				err = cuMemcpyHtoD((CUdeviceptr)dst, src, size);
-			}
-			else
-			{
-				gpa_array = gpa_to_hva(arg->pB);
+			cuError(err);
+			pin->state = QC_PIN_FAILED;
+		}
+		g_hash_table_insert(qcu->pinned, base, pin);
+	}
+	if (g_hash_table_lookup(s->pinned, base) == NULL)
+	{
+		pin->refs++;
+		g_hash_table_insert(s->pinned, base, base);
+	}
+	state = pin->state;
+	qemu_mutex_unlock(&qcu->pin_lock);
+	qemu_mutex_unlock(&s->table_lock);
+
+	return state != QC_PIN_FAILED;
+}
 
-				uint32_t offset   	 = arg->pASize;
-				uint32_t start_offset = offset%BLOCK_SIZE;
-				uint32_t rsize = BLOCK_SIZE - start_offset;
+static bool qcu_pin_region(QCSession *s, MemoryRegion *mr)
+{
+	return qcu_pin_host(s, memory_region_get_ram_ptr(mr),
+			memory_region_size(mr));
+}
 
-				src = gpa_to_hva(gpa_array[0]);
-            	len = MIN(size, rsize);
-			//err = cudaMemcpy(dst, src, len, cudaMemcpyHostToDevice);
-				err = cuMemcpyHtoD((CUdeviceptr)dst, src, len);
+/* Drop the session's hold on the blocks it copied through; a context
+ * must be current for the last holder to unregister them. */
+static void qcu_unpin_all(QCSession *s)
+{
+	VirtIOQC *qcu = s->qcu;
+	GHashTableIter iter;
+	gpointer base;
+	QCPin *pin;
+
+	qemu_mutex_lock(&s->table_lock);
+	qemu_mutex_lock(&qcu->pin_lock);
+	g_hash_table_iter_init(&iter, s->pinned);
+	while (g_hash_table_iter_next(&iter, &base, NULL))
+	{
+		pin = g_hash_table_lookup(qcu->pinned, base);
+		if (--pin->refs > 0)
+			continue;
+		if (pin->state == QC_PIN_OWNED)
+			cuError( cuMemHostUnregister(base) );
+		g_hash_table_remove(qcu->pinned, base);
+	}
+	qemu_mutex_unlock(&qcu->pin_lock);
+	g_hash_table_remove_all(s->pinned);
+	qemu_mutex_unlock(&s->table_lock);
+}
 
-				size -= len;
-				dst += len;
+/* Release every CUDA object the session still owns. */
+static void qcu_session_release_cuda(QCSession *s)
+{
+	uint32_t i;
+	void *obj;
+	CUcontext ctx;
 
-            	for(i=0; size>0; i++)
-            	{
-            		src = gpa_to_hva(gpa_array[i+1]);
-                	len = MIN(size, BLOCK_SIZE);
-				//err = cudaMemcpy(dst, src, len, cudaMemcpyHostToDevice);
-					err = cuMemcpyHtoD((CUdeviceptr)dst, src, len);
+	for(i = 0; s->devices != NULL && i < totalDevices; i++)
+		qcu_device_wait(s, i);
 
-					size -= len;
-                	dst  += len;
-            	}
+	for(i=0; i<s->events.slots->len; i++)
+	{
+		if( (obj = qcu_handle_free(&s->events, i)) != NULL )
+			cudaError( cudaEventDestroy(obj) );
+	}
 
-			}
+	for(i=1; i<s->graphs.slots->len; i++)
+	{
+		if( (obj = qcu_handle_free(&s->graphs, i)) != NULL )
+			qcu_graph_exec_put(obj);
+	}
+	g_hash_table_remove_all(s->captures);
+	atomic_set(&s->capturing, 0);
 
-#ifdef USER_KERNEL_COPY
-		}
-		else
+	for(i=1; i<s->streams.slots->len; i++)
+	{
+		if( (obj = qcu_handle_free(&s->streams, i)) != NULL )
+			cudaError( cudaStreamDestroy(obj) );
+	}
+
+	qemu_mutex_lock(&s->table_lock);
+	for(i=0; i<s->kernels->len; i++)
+	{
+		g_free(g_array_index(s->kernels, kernelInfo, i).functionName);
+	}
+	g_array_set_size(s->kernels, 0);
+	g_hash_table_remove_all(s->layouts);
+	qemu_mutex_unlock(&s->table_lock);
+	g_hash_table_remove_all(s->image_gpas);
+	g_hash_table_remove_all(s->images);
+
+	if( s->devices == NULL )
+		return;
+
+	qcu_bind_context(s);
+	qcu_unpin_all(s);
+
+	for(i = 0; i < totalDevices; i++)
+	{
+		// get rid of default context if any
+		// when a device is reset there will be no context
+		ctx = s->devices[i].context;
+		if( ctx != NULL )
+			cuError( cuCtxSetCurrent(ctx) );
+		qcu_device_clear(s, &s->devices[i]);
+		if( ctx != NULL )
 		{
-			src = gpa_to_hva(arg->pB);
-			//err = cudaMemcpy(dst, src, size, cudaMemcpyHostToDevice);
-			err = cuMemcpyHtoD((CUdeviceptr)dst, src, size);
+			trace_virtio_qcuda_context_destroy(s->id, i);
+			// cudaError( cudaStreamDestroy(s->devices[i].stream) );
+			cudaError( cuCtxDestroy(ctx) );
 		}
-#endif
 	}
-	else if(arg->flag == cudaMemcpyDeviceToHost )
+
+	free(s->devices);
+	s->devices = NULL;
+	s->fatbin_count = 0;
+}
+
+static void qcu_cudaUnregisterFatBinary(QCSession *s, VirtioQCArg *arg)
+{
+	g_hash_table_remove_all(s->image_gpas);
+
+	if( s->fatbin_count == 0 || --s->fatbin_count > 0 )
+		return;
+
+	qcu_session_release_cuda(s);
+}
+
+/* Header of a fatbinary container as produced by fatbinary/nvcc. */
+#define QCU_FATBIN_MAGIC	0xba55ed50
+#define QCU_IMAGE_MAX		(256 << 20)
+
+typedef struct QCFatbinHeader
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_size;
+	uint64_t fat_size;
+} QCFatbinHeader;
+
+/* Work out the type and length of an image that has at most avail bytes
+ * of guest RAM behind it; returns 0 if it does not fit. */
+static size_t qcu_image_size(const uint8_t *p, uint64_t avail,
+		CUjitInputType *type)
+{
+	const QCFatbinHeader *fh = (const QCFatbinHeader*)p;
+	const Elf64_Ehdr *eh = (const Elf64_Ehdr*)p;
+	uint64_t size;
+
+	if (avail >= sizeof(*fh) && fh->magic == QCU_FATBIN_MAGIC)
 	{
-		src = (void*)arg->pB;
-		size = arg->pASize;
+		*type = CU_JIT_INPUT_FATBINARY;
+		if (fh->fat_size > avail)
+			return 0;
+		size = fh->header_size + fh->fat_size;
+	}
+	else if (avail >= sizeof(*eh) && memcmp(eh->e_ident, ELFMAG, SELFMAG) == 0)
+	{
+		*type = CU_JIT_INPUT_CUBIN;
+		size = eh->e_shoff + (uint64_t)eh->e_shnum * eh->e_shentsize;
+	}
+	else
+	{
+		*type = CU_JIT_INPUT_PTX;
+		size = strnlen((const char*)p, avail) + 1;
+	}
 
-#ifdef USER_KERNEL_COPY
-		if( size > QCU_KMALLOC_MAX_SIZE)
-		{
-#endif
-			/*
-			fd 	   = ldl_p(&arg->pBSize);
-			offset = arg->pA;
+	return size <= avail ? size : 0;
+}
 
-    		dst = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
-			err = cudaMemcpy(dst, src, size, cudaMemcpyDeviceToHost);
-			*/
+static void qcu_image_free(gpointer data)
+{
+	QCImage *img = data;
 
-			if(arg->para)
-			{
-				dst = gpa_to_hva(arg->pA);
-				//dst = gpa_to_hva(arg->rnd);
-				err = cuMemcpyDtoH(dst, (CUdeviceptr)src, size);
-			}
-			else
-			{
-        		gpa_array = gpa_to_hva(arg->pA);
-
-				uint32_t offset   	 = arg->pBSize;
-				uint32_t start_offset = offset%BLOCK_SIZE;
-				uint32_t rsize = BLOCK_SIZE - start_offset;
-
-				dst = gpa_to_hva(gpa_array[0]);
-            	len = MIN(size, rsize);
-			//err = cudaMemcpy(dst, src, len, cudaMemcpyDeviceToHost);
-				err = cuMemcpyDtoH(dst, (CUdeviceptr)src, len);
-
-				size -= len;
-				src+=len;
-
-				for(i=0; size>0; i++)
-  	            {
-     		       	dst = gpa_to_hva(gpa_array[i+1]);
-                	len = MIN(size, BLOCK_SIZE);
-				//err = cudaMemcpy(dst, src, len, cudaMemcpyDeviceToHost);
-					err = cuMemcpyDtoH(dst, (CUdeviceptr)src, len);
-
-					size -= len;
-              		src  += len;
-            	}
-			}
-#ifdef USER_KERNEL_COPY
+	g_free(img->hash);
+	g_free(img->data);
+	g_free(img);
+}
+
+/* Look up the image at guest address gpa, copying it the first time.
+ * Every function of a fatbinary names the same address, so the image is
+ * only hashed once per fatbinary registration. */
+static QCImage *qcu_image_get(QCSession *s, uint64_t gpa)
+{
+	const QCGpaRange *r = NULL;
+	CUjitInputType type;
+	QCGpaMap *map;
+	QCImage *img;
+	size_t size = 0;
+	uint8_t *hva;
+	char *hash;
+
+	img = g_hash_table_lookup(s->image_gpas, GSIZE_TO_POINTER(gpa));
+	if (img != NULL)
+		return img;
+
+	rcu_read_lock();
+	map = atomic_rcu_read(&qcu_gpa_map);
+	if (map != NULL)
+		r = qcu_gpa_map_find(map, gpa);
+	if (r != NULL)
+	{
+		hva = qcu_gpa_range_hva(r, gpa);
+		size = qcu_image_size(hva, MIN(qcu_gpa_range_avail(r, gpa),
+					QCU_IMAGE_MAX), &type);
+	}
+	if (size > 0)
+	{
+		hash = g_compute_checksum_for_data(G_CHECKSUM_SHA256, hva, size);
+		img = g_hash_table_lookup(s->images, hash);
+		if (img == NULL)
+		{
+			img = g_new0(QCImage, 1);
+			img->hash = hash;
+			img->data = g_memdup(hva, size);
+			img->size = size;
+			img->type = type;
+			g_hash_table_insert(s->images, img->hash, img);
 		}
 		else
+			g_free(hash);
+		g_hash_table_insert(s->image_gpas, GSIZE_TO_POINTER(gpa), img);
+	}
+	rcu_read_unlock();
+
+	if (img == NULL)
+		error("no valid module image at %p\n", (void*)gpa);
+
+	return img;
+}
+
+/*
+ * JIT compile an image for the current device and load the result,
+ * going through the module-cache directory if one is configured.  The
+ * cached cubin is keyed by image hash, compute capability and driver
+ * version, since the JIT output depends on all three.
+ */
+static CUresult qcu_module_load(QCSession *s, cudaDev *dev, QCImage *img,
+		CUmodule *mod)
+{
+	const char *dir = s->qcu->conf.module_cache;
+	CUlinkState link;
+	GError *gerr = NULL;
+	char *path, *cubin;
+	gsize cubin_size;
+	void *out;
+	size_t out_size;
+	int major = 0, minor = 0, version = 0;
+	CUresult err;
+
+	// a cubin needs no JIT, nothing to cache
+	if (dir == NULL || img->type == CU_JIT_INPUT_CUBIN)
+		return cuModuleLoadData(mod, img->data);
+
+	cuError( cuDeviceGetAttribute(&major,
+				CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MAJOR, dev->device) );
+	cuError( cuDeviceGetAttribute(&minor,
+				CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MINOR, dev->device) );
+	cuError( cuDriverGetVersion(&version) );
+	path = g_strdup_printf("%s/%s-sm%d%d-%d.cubin", dir, img->hash,
+			major, minor, version);
+
+	if (g_file_get_contents(path, &cubin, &cubin_size, NULL))
+	{
+		err = cuModuleLoadData(mod, cubin);
+		g_free(cubin);
+		trace_virtio_qcuda_module_cache(s->id, path, "hit", err);
+		if (err == CUDA_SUCCESS)
 		{
-			dst = gpa_to_hva(arg->pA);
-			//err = cudaMemcpy(dst, src, size, cudaMemcpyDeviceToHost);
-			err = cuMemcpyDtoH(dst, (CUdeviceptr)src, size);
+			g_free(path);
+			return err;
 		}
-#endif
+		// stale or truncated entry, compile again and overwrite it
 	}
-	else if( arg->flag == cudaMemcpyDeviceToDevice )
+
+	err = cuLinkCreate(0, NULL, NULL, &link);
+	if (err == CUDA_SUCCESS)
 	{
-		dst = (void*)arg->pA;
-		src = (void*)arg->pB;
-		size = arg->pBSize;
-		//cudaError(( err = cudaMemcpy(dst, src, size, cudaMemcpyDeviceToDevice)));
-		cudaError(( err = cuMemcpyDtoD((CUdeviceptr)dst, (CUdeviceptr)src, size)));
+		err = cuLinkAddData(link, img->type, img->data, img->size,
+				img->hash, 0, NULL, NULL);
+		if (err == CUDA_SUCCESS)
+			err = cuLinkComplete(link, &out, &out_size);
+		if (err == CUDA_SUCCESS)
+			err = cuModuleLoadData(mod, out);
+		if (err == CUDA_SUCCESS &&
+			!g_file_set_contents(path, out, out_size, &gerr))
+		{
+			error_report("virtio-qcuda: cannot write %s: %s", path,
+					gerr->message);
+			g_error_free(gerr);
+		}
+		cuError( cuLinkDestroy(link) );
 	}
+	trace_virtio_qcuda_module_cache(s->id, path, "miss", err);
+	g_free(path);
 
-	arg->cmd = err;
-	ptrace("size= %u\n", size);
+	if (err != CUDA_SUCCESS)
+		err = cuModuleLoadData(mod, img->data);
+	return err;
 }
 
-static void qcu_cudaMemcpyAsync(VirtioQCArg *arg)
+/* The module of an image on a device, loaded on first use. */
+static CUmodule qcu_module_get(QCSession *s, int devId, QCImage *img)
 {
-	int fd;
-	uint64_t offset;
-	uint32_t size;
-	void *ptr, *device;
-	cudaError_t err;
-	//cudaStream_t stream = (cudaStream_t)arg->rnd;
-	uint64_t streamIdx = arg->rnd;
-	cudaStream_t stream = (streamIdx==(uint64_t)-1)?NULL:cudaStream[streamIdx];
-  // cudaStream_t stream = (streamIdx==(uint64_t)-1)?cudaDevices[cudaDeviceCurrent].stream:cudaStream[streamIdx];
+	cudaDev *dev = &s->devices[devId];
+	CUmodule mod;
+	CUresult err;
 
-	if( arg->flag == cudaMemcpyHostToDevice )
+	if (dev->modules == NULL)
+		dev->modules = g_hash_table_new_full(g_str_hash, g_str_equal,
+				g_free, NULL);
+
+	mod = g_hash_table_lookup(dev->modules, img->hash);
+	if (mod != NULL)
+		return mod;
+
+	trace_virtio_qcuda_load_module(s->id, devId, img->hash, img->size);
+	err = qcu_module_load(s, dev, img, &mod);
+	if (err != CUDA_SUCCESS)
 	{
-		fd = ldl_p(&arg->pASize);
-		offset = arg->pB;
-		size = arg->pBSize;
+		cuError(err);
+		return NULL;
+	}
 
-		device = (void*)arg->pA;
+	g_hash_table_insert(dev->modules, g_strdup(img->hash), mod);
+	return mod;
+}
 
-		//char *buf = (char*)malloc(sizeof(char)*size); //test
-	//	pread(fd, buf, size, offset); //test
+static void loadModuleKernels(QCSession *s, int devId, kernelInfo *k)
+{
+	CUfunction func;
+	CUmodule mod;
 
-		//ptr = mmap(0, arg->para, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
-		ptr = mmap(0, arg->para, PROT_READ, MAP_PRIVATE, fd, offset);
-		err = cudaMemcpyAsync(device, ptr, size, cudaMemcpyHostToDevice, stream);
+	mod = qcu_module_get(s, devId, k->image);
+	if (mod == NULL)
+		return;
 
-	//	err = cudaMemcpyAsync(device, buf, size, cudaMemcpyHostToDevice, stream); //text
+	cuError( cuModuleGetFunction(&func, mod, k->functionName) );
+	qcu_function_add(s, &s->devices[devId], k->funcId, func);
+}
 
-	//	free(buf); //test
+/* Load the kernels registered since the device was last brought up to
+ * date.  Called with table_lock held, which is dropped while loading. */
+static void qcu_device_load_locked(QCSession *s, int devId)
+{
+	cudaDev *dev = &s->devices[devId];
+	kernelInfo k;
+
+	while (dev->kernels_loaded < s->kernels->len)
+	{
+		k = g_array_index(s->kernels, kernelInfo, dev->kernels_loaded);
+		qemu_mutex_unlock(&s->table_lock);
+		loadModuleKernels(s, devId, &k);
+		qemu_mutex_lock(&s->table_lock);
+		dev->kernels_loaded++;
 	}
-	else if(arg->flag == cudaMemcpyDeviceToHost )
+}
+
+static void reloadAllKernels(QCSession *s)
+{
+	qemu_mutex_lock(&s->table_lock);
+	qcu_device_load_locked(s, s->device_current);
+	qemu_mutex_unlock(&s->table_lock);
+}
+
+typedef struct QCDeviceLoader
+{
+	QCSession *s;
+	int devId;
+} QCDeviceLoader;
+
+static void *qcu_device_loader(void *opaque)
+{
+	QCDeviceLoader *ld = opaque;
+	QCSession *s = ld->s;
+	int devId = ld->devId;
+
+	g_free(ld);
+	cuError( cuCtxSetCurrent(s->devices[devId].context) );
+
+	qemu_mutex_lock(&s->table_lock);
+	qcu_device_load_locked(s, devId);
+	s->devices[devId].loading = false;
+	qemu_cond_broadcast(&s->load_cond);
+	qemu_mutex_unlock(&s->table_lock);
+
+	cuError( cuCtxSetCurrent(NULL) );
+	return NULL;
+}
+
+/* Bring an eager device up to date on a thread of its own, so that a
+ * later cudaSetDevice only has to switch contexts. */
+static void qcu_device_prefetch(QCSession *s, int devId)
+{
+	cudaDev *dev = &s->devices[devId];
+	QCDeviceLoader *ld;
+	QemuThread thread;
+
+	qemu_mutex_lock(&s->table_lock);
+	if (!dev->loading && dev->context != NULL &&
+			dev->kernels_loaded < s->kernels->len)
 	{
-		fd = ldl_p(&arg->pBSize);
-		offset = arg->pA;
-		size = arg->pASize;
+		dev->loading = true;
+		ld = g_new(QCDeviceLoader, 1);
+		ld->s = s;
+		ld->devId = devId;
+		qemu_thread_create(&thread, "virtio-qcuda/load", qcu_device_loader,
+				ld, QEMU_THREAD_DETACHED);
+	}
+	qemu_mutex_unlock(&s->table_lock);
+}
 
-		device = (void*)arg->pB;
+/* Longest kernel name the guest may register, mangled names included. */
+#define QCU_FUNC_NAME_MAX	4096
 
-	//	char *buf = (char*)malloc(sizeof(char)*size); //test
+static void qcu_cudaRegisterFunction(QCSession *s, VirtioQCArg *arg)
+{
+	char *functionName;
+	size_t len;
+	kernelInfo k;
+	int i;
 
-		//ptr = mmap(0, arg->para, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
-		ptr = mmap(0, arg->para, PROT_WRITE, MAP_SHARED, fd, offset);
-		msync(ptr, arg->para, MS_ASYNC);
-		err = cudaMemcpyAsync(ptr, device, size, cudaMemcpyDeviceToHost, stream);
+	k.image = qcu_image_get(s, arg->pA);
+	if (k.image == NULL)
+	{
+		arg->cmd = cudaErrorInvalidKernelImage;
+		return;
+	}
 
-//		err = cudaMemcpyAsync(buf, device, size, cudaMemcpyDeviceToHost, stream); //test
-//		pwrite(fd, buf, size, offset); //test
-	//	free(buf); //test
+	functionName = gpa_to_hva(arg->pB);
+	len = functionName != NULL ? strnlen(functionName, QCU_FUNC_NAME_MAX) : 0;
+	if (len == 0 || len == QCU_FUNC_NAME_MAX)
+	{
+		error("bad kernel name at %"PRIx64"\n", arg->pB);
+		arg->cmd = cudaErrorInvalidValue;
+		return;
 	}
-	else if( arg->flag == cudaMemcpyDeviceToDevice )
+	k.funcId = arg->flag;
+	k.functionName = g_strndup(functionName, len);
+
+	qemu_mutex_lock(&s->table_lock);
+	g_array_append_val(s->kernels, k);
+	qemu_mutex_unlock(&s->table_lock);
+
+	trace_virtio_qcuda_register_function(s->id, k.image->hash,
+			k.functionName, k.funcId);
+	reloadAllKernels(s);
+
+	for (i = 0; i < totalDevices; i++)
 	{
-		ptr = (void*)arg->pA;
-		device = (void*)arg->pB;
-		size = arg->pBSize;
-		cudaError(( err = cudaMemcpyAsync(device, ptr, size, cudaMemcpyDeviceToDevice, stream)));
+		if (i != s->device_current && qcu_device_eager(s, i))
+			qcu_device_prefetch(s, i);
+	}
+}
+
+/* The graph stream idx is recording into, if any. */
+static QCGraph *qcu_graph_capture(QCSession *s, uint64_t idx)
+{
+	QCGraph *g;
+
+	if (atomic_read(&s->capturing) == 0)
+		return NULL;
+
+	qemu_mutex_lock(&s->table_lock);
+	g = g_hash_table_lookup(s->captures, GSIZE_TO_POINTER(idx));
+	qemu_mutex_unlock(&s->table_lock);
+
+	return g;
+}
+
+/* Queue func on stream conf[7] once the allocations ptrs[0..nptrs)
+ * point into are resident. */
+static CUresult qcu_launch_submit(QCSession *s, CUfunction func,
+		const uint64_t *conf, void **params, void **extra,
+		const uint64_t *ptrs, unsigned nptrs)
+{
+	CUresult err;
+
+	if (!qcu_swap_use(s, ptrs, nptrs))
+		return CUDA_ERROR_OUT_OF_MEMORY;
+
+	err = cuLaunchKernel(func,
+				conf[0], conf[1], conf[2],
+				conf[3], conf[4], conf[5],
+				conf[6], qcu_stream(s, conf[7]), params, extra);
+	qcu_swap_done(s, ptrs, nptrs);
+	cuError(err);
+
+	return err;
+}
+
+/*
+ * The parameter blob is walked once and not copied: the arena's pointer
+ * array points into it, and pointer sized parameters are collected on the
+ * way for paging in and for migration.
+ */
+static void qcu_cudaLaunch(QCSession *s, VirtioQCArg *arg)
+{
+	VirtIOQCLaunchArena *a = qcu_launch_arena;
+	uint64_t *conf;
+	uint8_t *para;
+	uint32_t funcId, paraNum, paraIdx, size;
+	uint64_t value, len;
+	CUfunction func;
+	CUresult err;
+	unsigned nptrs = 0;
+	QCGraph *g;
+	int i;
+
+	conf = gpa_to_hva_avail(arg->pA, &len);
+	if (conf != NULL && len < 8 * sizeof(uint64_t))
+		conf = NULL;
+	para = gpa_to_hva_avail(arg->pB, &len);
+	funcId = arg->flag;
+	// the blob is walked in place, so all of it has to be contiguous
+	if (para != NULL)
+		len = qcu_graph_params_size(para, MIN(len, QCU_GRAPH_BLOB_MAX));
+	if (conf == NULL || para == NULL || len == 0)
+	{
+		arg->cmd = cudaErrorInvalidValue;
+		return;
+	}
+
+	g = qcu_graph_capture(s, conf[7]);
+	if (g != NULL)
+	{
+		if (qcu_function_lookup(s, &s->devices[s->device_current], funcId) == NULL)
+			arg->cmd = cudaErrorInvalidDeviceFunction;
+		else if (!qcu_graph_add_kernel(g, funcId, conf, para, len))
+			arg->cmd = cudaErrorInvalidValue;
+		else
+			arg->cmd = cudaSuccess;
+		return;
+	}
+
+	func = qcu_function_lookup(s, &s->devices[s->device_current], funcId);
+	if( func == NULL )
+	{
+		error("function %u is not registered\n", funcId);
+		arg->cmd = cudaErrorInvalidDeviceFunction;
+		return;
+	}
+	if (conf[7] != (uint64_t)-1 && qcu_stream(s, conf[7]) == NULL)
+	{
+		arg->cmd = cudaErrorInvalidResourceHandle;
+		return;
+	}
+
+	// qcu_graph_params_size has checked the count and every size
+	paraNum = ldl_he_p(para);
+	paraIdx = sizeof(uint32_t);
+	for(i=0; i<paraNum; i++)
+	{
+		size = ldl_he_p(&para[paraIdx]);
+		a->params[i] = &para[paraIdx+sizeof(uint32_t)];
+		value = 0;
+		memcpy(&value, a->params[i], MIN(size, sizeof(value)));
+		trace_virtio_qcuda_launch_param(i, value, size);
+		// pointer sized parameters decide what has to be resident
+		if (size == sizeof(uint64_t))
+			a->ptrs[nptrs++] = value;
+
+		paraIdx += size + sizeof(uint32_t);
+	}
+
+	trace_virtio_qcuda_launch(s->id, funcId, paraNum, conf[6], conf[7]);
+	trace_virtio_qcuda_launch_dims(conf[0], conf[1], conf[2],
+			conf[3], conf[4], conf[5]);
+
+	err = qcu_launch_submit(s, func, conf, a->params, NULL, a->ptrs, nptrs);
+	arg->cmd = err;
+
+	for (i = 0; err == CUDA_SUCCESS && qcu_mig_active(s) && i < nptrs; i++)
+		qcu_mig_write_arg(s, &a->ptrs[i], sizeof(uint64_t));
+}
+
+static void qcu_cmd_launch_layout(QCSession *s, VirtioQCArg *arg)
+{
+	VirtIOQCLaunchParam *p = NULL;
+	QCLaunchLayout *l, *old;
+	uint32_t i, n, end = 0;
+	bool same = false;
+
+	n = arg->pASize;
+	if (n > 0 && n <= VIRTIO_QC_LAUNCH_PARAMS_MAX)
+		p = gpa_to_hva(arg->pA);
+	if ((n > 0 && p == NULL) || arg->pBSize > VIRTIO_QC_LAUNCH_ARGS_MAX)
+	{
+		arg->cmd = cudaErrorInvalidValue;
+		return;
+	}
+
+	l = g_malloc(sizeof(*l) + n * sizeof(l->params[0]));
+	l->refs = 1;
+	l->size = arg->pBSize;
+	l->nparams = n;
+	if (n > 0)
+		memcpy(l->params, p, n * sizeof(l->params[0]));
+
+	for (i = 0; i < n; i++)
+	{
+		if (l->params[i].size == 0 || l->params[i].offset < end ||
+				l->params[i].offset > l->size ||
+				l->params[i].size > l->size - l->params[i].offset)
+		{
+			g_free(l);
+			arg->cmd = cudaErrorInvalidValue;
+			return;
+		}
+		end = l->params[i].offset + l->params[i].size;
+	}
+
+	// a registered layout is never replaced, only registered again
+	qemu_mutex_lock(&s->table_lock);
+	old = g_hash_table_lookup(s->layouts, GUINT_TO_POINTER(arg->flag));
+	if (old == NULL)
+		g_hash_table_insert(s->layouts, GUINT_TO_POINTER(arg->flag), l);
+	else
+		same = old->size == l->size && old->nparams == l->nparams &&
+			memcmp(old->params, l->params, n * sizeof(l->params[0])) == 0;
+	qemu_mutex_unlock(&s->table_lock);
+
+	if (old != NULL)
+	{
+		g_free(l);
+		if (!same)
+		{
+			arg->cmd = cudaErrorInvalidValue;
+			return;
+		}
+	}
+
+	trace_virtio_qcuda_launch_layout(s->id, arg->flag, n, arg->pBSize);
+	arg->cmd = cudaSuccess;
+}
+
+/* Graphs keep cudaLaunch blobs; capture is no hot path, so convert. */
+static bool qcu_launch_capture(QCGraph *g, uint32_t funcId,
+		const uint64_t *conf, const QCLaunchLayout *l, const uint8_t *args)
+{
+	uint8_t *blob, *p;
+	uint32_t i;
+	bool ok;
+
+	blob = g_malloc(sizeof(uint32_t) * (1 + l->nparams) + l->size);
+	stl_he_p(blob, l->nparams);
+	p = blob + sizeof(uint32_t);
+	for (i = 0; i < l->nparams; i++)
+	{
+		stl_he_p(p, l->params[i].size);
+		memcpy(p + sizeof(uint32_t), args + l->params[i].offset,
+				l->params[i].size);
+		p += sizeof(uint32_t) + l->params[i].size;
+	}
+	ok = qcu_graph_add_kernel(g, funcId, conf, blob, p - blob);
+	g_free(blob);
+
+	return ok;
+}
+
+/*
+ * A launch with a registered layout: the argument buffer is copied into
+ * the arena as a whole and handed to the driver as is.
+ */
+static void qcu_cmd_launch(QCSession *s, VirtioQCArg *arg)
+{
+	VirtIOQCLaunchArena *a = qcu_launch_arena;
+	size_t size = arg->pBSize;
+	void *extra[] = {
+		CU_LAUNCH_PARAM_BUFFER_POINTER, a->args,
+		CU_LAUNCH_PARAM_BUFFER_SIZE, &size,
+		CU_LAUNCH_PARAM_END
+	};
+	QCLaunchLayout *l;
+	uint64_t *conf;
+	uint8_t *args = NULL;
+	uint64_t len;
+	CUfunction func;
+	CUresult err;
+	unsigned nptrs = 0;
+	QCGraph *g;
+	uint32_t i;
+
+	conf = gpa_to_hva_avail(arg->pA, &len);
+	if (conf != NULL && len < 8 * sizeof(uint64_t))
+		conf = NULL;
+	if (size > 0 && size <= VIRTIO_QC_LAUNCH_ARGS_MAX)
+	{
+		args = gpa_to_hva_avail(arg->pB, &len);
+		if (args != NULL && len < size)
+			args = NULL;
+	}
+	if (conf == NULL || (size > 0 && args == NULL))
+	{
+		arg->cmd = cudaErrorInvalidValue;
+		return;
+	}
+
+	func = qcu_launch_lookup(s, &s->devices[s->device_current], arg->flag, &l);
+	if (func == NULL)
+	{
+		error("function %u is not registered\n", arg->flag);
+		arg->cmd = cudaErrorInvalidDeviceFunction;
+		return;
+	}
+	if (l == NULL || l->size != size)
+	{
+		if (l != NULL)
+			qcu_layout_put(l);
+		arg->cmd = cudaErrorInvalidValue;
+		return;
+	}
+
+	g = qcu_graph_capture(s, conf[7]);
+	if (g != NULL)
+	{
+		arg->cmd = qcu_launch_capture(g, arg->flag, conf, l, args) ?
+			cudaSuccess : cudaErrorInvalidValue;
+		qcu_layout_put(l);
+		return;
+	}
+	if (conf[7] != (uint64_t)-1 && qcu_stream(s, conf[7]) == NULL)
+	{
+		qcu_layout_put(l);
+		arg->cmd = cudaErrorInvalidResourceHandle;
+		return;
+	}
+
+	if (size > 0)
+		memcpy(a->args, args, size);
+	for (i = 0; i < l->nparams; i++)
+	{
+		if (l->params[i].size == sizeof(uint64_t))
+			a->ptrs[nptrs++] = ldq_he_p((uint8_t *)a->args +
+					l->params[i].offset);
+	}
+
+	trace_virtio_qcuda_launch(s->id, arg->flag, l->nparams, conf[6], conf[7]);
+	qcu_layout_put(l);
+	trace_virtio_qcuda_launch_dims(conf[0], conf[1], conf[2],
+			conf[3], conf[4], conf[5]);
+
+	err = qcu_launch_submit(s, func, conf, NULL, extra, a->ptrs, nptrs);
+	arg->cmd = err;
+
+	for (i = 0; err == CUDA_SUCCESS && qcu_mig_active(s) && i < nptrs; i++)
+		qcu_mig_write_arg(s, &a->ptrs[i], sizeof(uint64_t));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Launch graphs
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef QCU_HAVE_GRAPHS
+/* Fall back to launching the nodes one by one. */
+static void qcu_graph_native_clear(QCGraphExec *ge)
+{
+	if (ge->exec != NULL)
+		cuError( cuGraphExecDestroy(ge->exec) );
+	if (ge->cugraph != NULL)
+		cuError( cuGraphDestroy(ge->cugraph) );
+	g_free(ge->nodes);
+	ge->exec = NULL;
+	ge->cugraph = NULL;
+	ge->nodes = NULL;
+}
+#endif
+
+static void qcu_graph_exec_clear(QCGraphExec *ge)
+{
+#ifdef QCU_HAVE_GRAPHS
+	qcu_graph_native_clear(ge);
+#endif
+	g_free(ge->func);
+	ge->func = NULL;
+	ge->device = -1;
+}
+
+static void qcu_graph_exec_free(QCGraphExec *ge)
+{
+	qcu_graph_exec_clear(ge);
+	qcu_graph_free(ge->graph);
+	qemu_mutex_destroy(&ge->lock);
+	g_free(ge);
+}
+
+/* Graph idx with a reference taken, NULL if there is none.  The handle
+ * holds one reference, so a graph destroyed meanwhile on another queue
+ * stays valid until the last user puts it. */
+static QCGraphExec *qcu_graph_exec_get(QCSession *s, uint64_t idx)
+{
+	QCGraphExec *ge = NULL;
+
+	qemu_mutex_lock(&s->graphs.lock);
+	if (idx != 0 && idx < s->graphs.slots->len)
+		ge = g_ptr_array_index(s->graphs.slots, idx);
+	if (ge != NULL)
+		atomic_inc(&ge->refs);
+	qemu_mutex_unlock(&s->graphs.lock);
+
+	return ge;
+}
+
+/* Needs a context of the session to be current. */
+static void qcu_graph_exec_put(QCGraphExec *ge)
+{
+	if (atomic_fetch_dec(&ge->refs) == 1)
+		qcu_graph_exec_free(ge);
+}
+
+/* Forget what graphs were set up as on a device that is going away. */
+static void qcu_graphs_drop_device(QCSession *s, int devId)
+{
+	QCGraphExec *ge;
+	uint32_t i;
+
+	for (i = 1; i < s->graphs.slots->len; i++)
+	{
+		ge = qcu_graph_exec_get(s, i);
+		if (ge == NULL)
+			continue;
+
+		qemu_mutex_lock(&ge->lock);
+		if (ge->device == devId)
+			qcu_graph_exec_clear(ge);
+		qemu_mutex_unlock(&ge->lock);
+		qcu_graph_exec_put(ge);
+	}
+}
+
+#ifdef QCU_HAVE_GRAPHS
+static void qcu_graph_kernel_params(QCGraphExec *ge, uint32_t i,
+		CUDA_KERNEL_NODE_PARAMS *p)
+{
+	QCGraphNode *n = qcu_graph_node(ge->graph, i);
+
+	memset(p, 0, sizeof(*p));
+	p->func = ge->func[i];
+	p->gridDimX = n->grid[0];
+	p->gridDimY = n->grid[1];
+	p->gridDimZ = n->grid[2];
+	p->blockDimX = n->block[0];
+	p->blockDimY = n->block[1];
+	p->blockDimZ = n->block[2];
+	p->sharedMemBytes = n->shared;
+	p->kernelParams = n->args;
+}
+
+/* Build the nodes into a chain, in recording order, and instantiate it. */
+static CUresult qcu_graph_build(QCGraphExec *ge, CUcontext ctx)
+{
+	CUDA_KERNEL_NODE_PARAMS kp;
+	CUDA_MEMCPY3D cp;
+	CUgraphNode *prev;
+	QCGraphNode *n;
+	CUresult err;
+	uint32_t i;
+
+	err = cuGraphCreate(&ge->cugraph, 0);
+	if (err != CUDA_SUCCESS)
+		return err;
+
+	ge->nodes = g_new0(CUgraphNode, MAX(ge->graph->nodes->len, 1));
+	for (i = 0; i < ge->graph->nodes->len; i++)
+	{
+		n = qcu_graph_node(ge->graph, i);
+		prev = i > 0 ? &ge->nodes[i - 1] : NULL;
+
+		if (n->type == QCU_GRAPH_KERNEL)
+		{
+			qcu_graph_kernel_params(ge, i, &kp);
+			err = cuGraphAddKernelNode(&ge->nodes[i], ge->cugraph,
+					prev, prev != NULL, &kp);
+		}
+		else
+		{
+			memset(&cp, 0, sizeof(cp));
+			cp.srcMemoryType = CU_MEMORYTYPE_DEVICE;
+			cp.srcDevice = n->src;
+			cp.dstMemoryType = CU_MEMORYTYPE_DEVICE;
+			cp.dstDevice = n->dst;
+			cp.WidthInBytes = n->bytes;
+			cp.Height = 1;
+			cp.Depth = 1;
+			err = cuGraphAddMemcpyNode(&ge->nodes[i], ge->cugraph,
+					prev, prev != NULL, &cp, ctx);
+		}
+		if (err != CUDA_SUCCESS)
+			return err;
+		n->dirty = false;
+	}
+
+#if CUDA_VERSION >= 12000
+	return cuGraphInstantiate(&ge->exec, ge->cugraph, 0);
+#else
+	return cuGraphInstantiate(&ge->exec, ge->cugraph, NULL, NULL, 0);
+#endif
+}
+#endif
+
+/*
+ * Resolve the graph's functions on the current device and, where the
+ * driver supports it, instantiate it there.  A graph the driver will not
+ * take is still replayed, one launch per node.
+ */
+static CUresult qcu_graph_setup(QCSession *s, QCGraphExec *ge, uint32_t idx)
+{
+	cudaDev *dev = &s->devices[s->device_current];
+	QCGraphNode *n;
+	uint32_t i;
+#ifdef QCU_HAVE_GRAPHS
+	CUresult err;
+#endif
+
+	qcu_graph_exec_clear(ge);
+
+	ge->func = g_new0(CUfunction, MAX(ge->graph->nodes->len, 1));
+	for (i = 0; i < ge->graph->nodes->len; i++)
+	{
+		n = qcu_graph_node(ge->graph, i);
+		if (n->type != QCU_GRAPH_KERNEL)
+			continue;
+		ge->func[i] = qcu_function_lookup(s, dev, n->func);
+		if (ge->func[i] == NULL)
+		{
+			qcu_graph_exec_clear(ge);
+			return CUDA_ERROR_NOT_FOUND;
+		}
+	}
+	ge->device = s->device_current;
+
+#ifdef QCU_HAVE_GRAPHS
+	err = qcu_graph_build(ge, dev->context);
+	trace_virtio_qcuda_graph_instantiate(s->id, idx, ge->device, err);
+	if (err != CUDA_SUCCESS)
+		qcu_graph_native_clear(ge);
+#endif
+
+	return CUDA_SUCCESS;
+}
+
+/* Replay without a graph exec: the nodes' arguments are ready to use. */
+static CUresult qcu_graph_replay(QCGraphExec *ge, CUstream stream)
+{
+	QCGraphNode *n;
+	CUresult err = CUDA_SUCCESS;
+	uint32_t i;
+
+	for (i = 0; i < ge->graph->nodes->len && err == CUDA_SUCCESS; i++)
+	{
+		n = qcu_graph_node(ge->graph, i);
+		if (n->type == QCU_GRAPH_KERNEL)
+			err = cuLaunchKernel(ge->func[i],
+					n->grid[0], n->grid[1], n->grid[2],
+					n->block[0], n->block[1], n->block[2],
+					n->shared, stream, n->args, NULL);
+		else
+			err = cuMemcpyDtoDAsync(n->dst, n->src, n->bytes, stream);
+		n->dirty = false;
+	}
+
+	return err;
+}
+
+#ifdef QCU_HAVE_GRAPHS
+/* Push patched parameters into the exec; false if the driver refuses. */
+static bool qcu_graph_update(QCGraphExec *ge)
+{
+	CUDA_KERNEL_NODE_PARAMS kp;
+	QCGraphNode *n;
+	uint32_t i;
+
+	for (i = 0; i < ge->graph->nodes->len; i++)
+	{
+		n = qcu_graph_node(ge->graph, i);
+		if (!n->dirty)
+			continue;
+
+		qcu_graph_kernel_params(ge, i, &kp);
+		if (cuGraphExecKernelNodeSetParams(ge->exec, ge->nodes[i], &kp) !=
+				CUDA_SUCCESS)
+			return false;
+		n->dirty = false;
+	}
+
+	return true;
+}
+#endif
+
+static void qcu_cmd_graph_begin(QCSession *s, VirtioQCArg *arg)
+{
+	uint64_t idx = arg->rnd;
+
+	if (idx != (uint64_t)-1 && qcu_stream(s, idx) == NULL)
+	{
+		arg->cmd = cudaErrorInvalidResourceHandle;
+		return;
+	}
+
+	qemu_mutex_lock(&s->table_lock);
+	if (g_hash_table_lookup(s->captures, GSIZE_TO_POINTER(idx)) != NULL)
+		arg->cmd = cudaErrorInvalidValue;
+	else
+	{
+		g_hash_table_insert(s->captures, GSIZE_TO_POINTER(idx),
+				qcu_graph_new());
+		atomic_inc(&s->capturing);
+		arg->cmd = cudaSuccess;
+	}
+	qemu_mutex_unlock(&s->table_lock);
+
+	trace_virtio_qcuda_graph(s->id, "begin", idx, 0);
+}
+
+static void qcu_cmd_graph_end(QCSession *s, VirtioQCArg *arg)
+{
+	uint64_t stream = arg->rnd;
+	QCGraphExec *ge;
+	QCGraph *g;
+	uint32_t idx;
+
+	qemu_mutex_lock(&s->table_lock);
+	g = g_hash_table_lookup(s->captures, GSIZE_TO_POINTER(stream));
+	if (g != NULL)
+	{
+		g_hash_table_remove(s->captures, GSIZE_TO_POINTER(stream));
+		atomic_dec(&s->capturing);
+	}
+	qemu_mutex_unlock(&s->table_lock);
+
+	if (g == NULL)
+	{
+		arg->cmd = cudaErrorInvalidValue;
+		return;
+	}
+
+	ge = g_new0(QCGraphExec, 1);
+	qemu_mutex_init(&ge->lock);
+	ge->graph = g;
+	ge->device = -1;
+	ge->refs = 2;	// the handle's and ours, it is visible from here on
+	idx = qcu_handle_alloc(&s->graphs, ge);
+
+	// functions were checked while recording, so this only fails if the
+	// driver does; the first launch tries again
+	qemu_mutex_lock(&ge->lock);
+	qcu_graph_setup(s, ge, idx);
+	qemu_mutex_unlock(&ge->lock);
+
+	arg->pA = idx;
+	arg->pB = g->nodes->len;
+	arg->cmd = cudaSuccess;
+	trace_virtio_qcuda_graph(s->id, "end", idx, g->nodes->len);
+	qcu_graph_exec_put(ge);
+}
+
+/* What a replay of g may have written. */
+static void qcu_mig_write_graph(QCSession *s, QCGraph *g)
+{
+	QCGraphNode *n;
+	uint32_t i, j;
+
+	if (!qcu_mig_active(s))
+		return;
+
+	for (i = 0; i < g->nodes->len; i++)
+	{
+		n = qcu_graph_node(g, i);
+		if (n->type == QCU_GRAPH_COPY)
+			qcu_mig_write(s, n->dst, n->bytes);
+		for (j = 0; n->type == QCU_GRAPH_KERNEL && j < n->nparams; j++)
+			qcu_mig_write_arg(s, n->args[j], n->arg_size[j]);
+	}
+}
+
+/* The device pointers a replay of g uses, to page them in. */
+static GArray *qcu_graph_ptrs(QCGraph *g)
+{
+	GArray *ptrs = g_array_new(FALSE, FALSE, sizeof(uint64_t));
+	QCGraphNode *n;
+	uint32_t i, j;
+
+	for (i = 0; i < g->nodes->len; i++)
+	{
+		n = qcu_graph_node(g, i);
+		if (n->type == QCU_GRAPH_COPY)
+		{
+			g_array_append_val(ptrs, n->dst);
+			g_array_append_val(ptrs, n->src);
+		}
+		for (j = 0; n->type == QCU_GRAPH_KERNEL && j < n->nparams; j++)
+		{
+			if (n->arg_size[j] == sizeof(uint64_t))
+				g_array_append_vals(ptrs, n->args[j], 1);
+		}
+	}
+
+	return ptrs;
+}
+
+static void qcu_cmd_graph_launch(QCSession *s, VirtioQCArg *arg)
+{
+	uint32_t idx = arg->pA;
+	CUstream stream = qcu_stream(s, arg->rnd);
+	QCGraphExec *ge;
+	GArray *ptrs = NULL;
+	uint8_t *patch;
+	int patches = 0;
+	bool native = false, pinned = false;
+	CUresult err;
+
+	ge = qcu_graph_exec_get(s, idx);
+	if (ge == NULL)
+	{
+		arg->cmd = cudaErrorInvalidResourceHandle;
+		return;
+	}
+
+	qemu_mutex_lock(&ge->lock);
+	if (arg->pBSize > 0)
+	{
+		patch = arg->pBSize <= VIRTIO_QC_GRAPH_PATCH_MAX ?
+			gpa_to_hva(arg->pB) : NULL;
+		if (patch == NULL ||
+				(patches = qcu_graph_patch(ge->graph, patch, arg->pBSize)) < 0)
+		{
+			qemu_mutex_unlock(&ge->lock);
+			qcu_graph_exec_put(ge);
+			arg->cmd = cudaErrorInvalidValue;
+			return;
+		}
+	}
+
+	err = CUDA_SUCCESS;
+	if (s->qcu->conf.oversubscribe)
+	{
+		ptrs = qcu_graph_ptrs(ge->graph);
+		pinned = qcu_swap_use(s, (uint64_t*)ptrs->data, ptrs->len);
+		if (!pinned)
+			err = CUDA_ERROR_OUT_OF_MEMORY;
+	}
+	if (err == CUDA_SUCCESS && ge->device != s->device_current)
+		err = qcu_graph_setup(s, ge, idx);
+
+#ifdef QCU_HAVE_GRAPHS
+	if (err == CUDA_SUCCESS && ge->exec != NULL)
+	{
+		// the patches stay in the nodes if the driver refuses them
+		native = qcu_graph_update(ge);
+		if (native)
+			err = cuGraphLaunch(ge->exec, stream);
+		else
+			qcu_graph_native_clear(ge);
+	}
+#endif
+	if (err == CUDA_SUCCESS && !native)
+		err = qcu_graph_replay(ge, stream);
+	if (err == CUDA_SUCCESS)
+		qcu_mig_write_graph(s, ge->graph);
+	if (pinned)
+		qcu_swap_done(s, (uint64_t*)ptrs->data, ptrs->len);
+	qemu_mutex_unlock(&ge->lock);
+	qcu_graph_exec_put(ge);
+	if (ptrs != NULL)
+		g_array_free(ptrs, TRUE);
+
+	trace_virtio_qcuda_graph_launch(s->id, idx, patches, native);
+	if (err == CUDA_ERROR_NOT_FOUND)
+	{
+		arg->cmd = cudaErrorInvalidDeviceFunction;
+		return;
+	}
+	cuError(err);
+	arg->cmd = err;
+}
+
+static void qcu_cmd_graph_destroy(QCSession *s, VirtioQCArg *arg)
+{
+	uint32_t idx = arg->pA;
+	QCGraphExec *ge;
+
+	ge = idx != 0 ? qcu_handle_free(&s->graphs, idx) : NULL;
+	if (ge == NULL)
+	{
+		arg->cmd = cudaErrorInvalidResourceHandle;
+		return;
+	}
+
+	trace_virtio_qcuda_graph(s->id, "destroy", idx, ge->graph->nodes->len);
+	// a launch on another queue may still hold it
+	qcu_graph_exec_put(ge);
+	arg->cmd = cudaSuccess;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Memory Management (runtime API)
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Backend of the cudaMalloc cache.  The allocator runs on the worker that
+ * issues the call, with the device's context current.
+ */
+static bool qcu_alloc_segment(void *opaque, uint64_t size, uint64_t *addr)
+{
+	CUdeviceptr ptr;
+	CUresult err;
+
+	err = cuMemAlloc(&ptr, size);
+	if (err != CUDA_SUCCESS)
+	{
+		if (err != CUDA_ERROR_OUT_OF_MEMORY)
+			cuError(err);
+		return false;
+	}
+
+	*addr = ptr;
+	return true;
+}
+
+static void qcu_alloc_segment_free(void *opaque, uint64_t addr)
+{
+	cuError( cuMemFree(addr) );
+}
+
+/* An event on the legacy default stream, which waits for the work of all
+ * blocking streams, so every stream is done with the block once it has
+ * passed.  This replaces the implicit device synchronization of cudaFree. */
+static void *qcu_alloc_fence_new(void *opaque)
+{
+	cudaDev *dev = opaque;
+	CUevent ev;
+
+	if (dev->fences->len > 0)
+		ev = g_ptr_array_remove_index_fast(dev->fences, dev->fences->len - 1);
+	else if (cuEventCreate(&ev, CU_EVENT_DISABLE_TIMING) != CUDA_SUCCESS)
+	{
+		cuError( cuCtxSynchronize() );
+		return NULL;
+	}
+
+	if (cuEventRecord(ev, NULL) != CUDA_SUCCESS)
+	{
+		g_ptr_array_add(dev->fences, ev);
+		cuError( cuCtxSynchronize() );
+		return NULL;
+	}
+
+	return ev;
+}
+
+static bool qcu_alloc_fence_done(void *opaque, void *fence)
+{
+	return cuEventQuery(fence) != CUDA_ERROR_NOT_READY;
+}
+
+static void qcu_alloc_fence_wait(void *opaque, void *fence)
+{
+	cuError( cuEventSynchronize(fence) );
+}
+
+static void qcu_alloc_fence_release(void *opaque, void *fence)
+{
+	cudaDev *dev = opaque;
+
+	g_ptr_array_add(dev->fences, fence);
+}
+
+static const QCAllocOps qcu_alloc_ops = {
+	.alloc = qcu_alloc_segment,
+	.free = qcu_alloc_segment_free,
+	.fence_new = qcu_alloc_fence_new,
+	.fence_done = qcu_alloc_fence_done,
+	.fence_wait = qcu_alloc_fence_wait,
+	.fence_release = qcu_alloc_fence_release,
+};
+
+/* The allocator of the current device, NULL if caching is off. */
+static QCAlloc *qcu_device_alloc(QCSession *s)
+{
+	cudaDev *dev;
+
+	if (!s->qcu->conf.alloc_cache || s->devices == NULL)
+		return NULL;
+
+	dev = &s->devices[s->device_current];
+	qemu_mutex_lock(&s->table_lock);
+	if (dev->alloc == NULL)
+	{
+		dev->fences = g_ptr_array_new();
+		dev->alloc = qcu_alloc_new(&qcu_alloc_ops, dev, &s->qcu->alloc_stats);
+	}
+	qemu_mutex_unlock(&s->table_lock);
+
+	return dev->alloc;
+}
+
+#ifdef QCU_HAVE_VMM
+/*
+ * Backend of oversubscription: every allocation is address space of its
+ * own, reserved once, with device memory mapped and unmapped behind it.
+ * Runs on the worker that issues the call, with the device's context
+ * current; opaque is the device number.
+ */
+static bool qcu_swap_reserve(void *opaque, uint64_t size, uint64_t *addr)
+{
+	CUdeviceptr ptr;
+	CUresult err;
+
+	err = cuMemAddressReserve(&ptr, size, 0, 0, 0);
+	cuError(err);
+	*addr = ptr;
+	return err == CUDA_SUCCESS;
+}
+
+static void qcu_swap_release(void *opaque, uint64_t addr, uint64_t size)
+{
+	cuError( cuMemAddressFree(addr, size) );
+}
+
+static bool qcu_swap_map(void *opaque, uint64_t addr, uint64_t size)
+{
+	CUresult err;
+
+	err = qcu_vmm_map(addr, size, GPOINTER_TO_INT(opaque));
+	if (err != CUDA_SUCCESS && err != CUDA_ERROR_OUT_OF_MEMORY)
+		cuError(err);
+	return err == CUDA_SUCCESS;
+}
+
+static void qcu_swap_unmap(void *opaque, uint64_t addr, uint64_t size)
+{
+	cuError( cuMemUnmap(addr, size) );
+}
+
+static void qcu_swap_sync(void *opaque)
+{
+	cuError( cuCtxSynchronize() );
+}
+
+static bool qcu_swap_read(void *opaque, uint64_t addr, void *buf,
+		uint64_t size)
+{
+	CUresult err = cuMemcpyDtoH(buf, addr, size);
+
+	cuError(err);
+	return err == CUDA_SUCCESS;
+}
+
+static bool qcu_swap_write(void *opaque, uint64_t addr, const void *buf,
+		uint64_t size)
+{
+	CUresult err = cuMemcpyHtoD(addr, buf, size);
+
+	cuError(err);
+	return err == CUDA_SUCCESS;
+}
+
+static const QCSwapOps qcu_swap_ops = {
+	.reserve = qcu_swap_reserve,
+	.release = qcu_swap_release,
+	.map = qcu_swap_map,
+	.unmap = qcu_swap_unmap,
+	.sync = qcu_swap_sync,
+	.read = qcu_swap_read,
+	.write = qcu_swap_write,
+};
+#endif
+
+/* Oversubscription of the current device, NULL if it is off or the
+ * driver cannot map memory at chosen addresses. */
+static QCSwap *qcu_device_swap(QCSession *s)
+{
+	cudaDev *dev;
+#ifdef QCU_HAVE_VMM
+	CUmemAllocationProp prop;
+	size_t gran;
+#endif
+
+	if (!s->qcu->conf.oversubscribe || s->devices == NULL)
+		return NULL;
+
+	dev = &s->devices[s->device_current];
+#ifdef QCU_HAVE_VMM
+	qemu_mutex_lock(&s->table_lock);
+	if (dev->swap == NULL)
+	{
+		qcu_mig_prop(&prop, s->device_current);
+		if (cuMemGetAllocationGranularity(&gran, &prop,
+					CU_MEM_ALLOC_GRANULARITY_MINIMUM) == CUDA_SUCCESS)
+			dev->swap = qcu_swap_new(&qcu_swap_ops,
+					GINT_TO_POINTER(s->device_current), gran,
+					s->qcu->conf.resident_limit, &s->qcu->swap_stats);
+	}
+	qemu_mutex_unlock(&s->table_lock);
+#endif
+
+	return dev->swap;
+}
+
+/*
+ * Page in and pin the allocations of the current device that a command
+ * is about to use; false if they do not fit on the GPU together.  The
+ * pins are dropped with qcu_swap_done() once the work has been queued.
+ */
+static bool qcu_swap_use(QCSession *s, const uint64_t *ptrs, unsigned n)
+{
+	QCSwap *sw;
+
+	if (!s->qcu->conf.oversubscribe || s->devices == NULL)
+		return true;
+	sw = s->devices[s->device_current].swap;
+	return sw == NULL || qcu_swap_pin(sw, ptrs, n);
+}
+
+static void qcu_swap_done(QCSession *s, const uint64_t *ptrs, unsigned n)
+{
+	QCSwap *sw;
+
+	if (!s->qcu->conf.oversubscribe || s->devices == NULL)
+		return;
+	sw = s->devices[s->device_current].swap;
+	if (sw != NULL)
+		qcu_swap_unpin(sw, ptrs, n);
+}
+
+/* The device side of a copy command: pA to device, pB from device. */
+static unsigned qcu_copy_ptrs(VirtioQCArg *arg, uint64_t *ptrs)
+{
+	unsigned n = 0;
+
+	if (arg->flag == cudaMemcpyHostToDevice ||
+			arg->flag == cudaMemcpyDeviceToDevice)
+		ptrs[n++] = arg->pA;
+	if (arg->flag == cudaMemcpyDeviceToHost ||
+			arg->flag == cudaMemcpyDeviceToDevice)
+		ptrs[n++] = arg->pB;
+	return n;
+}
+
+static void qcu_cudaMalloc(QCSession *s, VirtioQCArg *arg)
+{
+	cudaError_t err;
+	uint32_t count;
+	void* devPtr;
+	QCAlloc *a;
+	QCSwap *sw;
+	uint64_t addr;
+
+	count = arg->flag;
+	sw = qcu_device_swap(s);
+	a = sw == NULL ? qcu_device_alloc(s) : NULL;
+	if ((sw != NULL || a != NULL) && count > 0)
+	{
+		// guest allocations carry no stream, they share the default pool
+		if (sw != NULL ? qcu_swap_alloc(sw, count, &addr) :
+				qcu_alloc_get(a, count, 0, &addr))
+		{
+			err = cudaSuccess;
+			devPtr = (void*)addr;
+		}
+		else
+		{
+			err = cudaErrorMemoryAllocation;
+			devPtr = NULL;
+		}
+	}
+	else
+		cudaError((err = cudaMalloc( &devPtr, count )));
+	arg->cmd = err;
+	arg->pA = (uint64_t)devPtr;
+
+	if (err == cudaSuccess && s->mig != NULL)
+		qcu_mig_add(s->mig[s->device_current], arg->pA, count);
+
+	trace_virtio_qcuda_malloc(s->id, arg->pA, count);
+}
+
+static void qcu_cudaMemset(QCSession *s, VirtioQCArg *arg)
+{
+	cudaError_t err;
+	void* dst;
+
+	dst = (void*)arg->pA;
+	if (!qcu_swap_use(s, &arg->pA, 1))
+	{
+		arg->cmd = cudaErrorMemoryAllocation;
+		return;
+	}
+	cudaError((err = cudaMemset(dst, arg->para, arg->pASize)));
+	qcu_swap_done(s, &arg->pA, 1);
+	if (err == cudaSuccess)
+		qcu_mig_write(s, arg->pA, arg->pASize);
+	arg->cmd = err;
+}
+
+/*
+ * Host side of a guest gather list.  The guest passes an array with the
+ * physical address of every block_size chunk of its buffer (the first one
+ * starting 'offset' bytes into its block).  qcu_sg_map() turns the whole
+ * list into host ranges in one pass: the translation table is only
+ * searched when a chunk leaves the guest RAM range found last, and chunks
+ * that end up adjacent in host memory are merged into one range.
+ */
+typedef struct QCHostRange
+{
+	uint8_t *hva;
+	size_t len;
+	MemoryRegion *mr;	// for marking the range dirty
+	hwaddr offset;
+} QCHostRange;
+
+static void qcu_sg_add(GArray *ranges, const QCGpaRange *gr, uint64_t gpa,
+		size_t len)
+{
+	QCHostRange r, *last;
+	uint8_t *hva = qcu_gpa_range_hva(gr, gpa);
+
+	if (ranges->len > 0)
+	{
+		last = &g_array_index(ranges, QCHostRange, ranges->len - 1);
+		if (last->hva + last->len == hva && last->mr == gr->opaque)
+		{
+			last->len += len;
+			return;
+		}
+	}
+	r.hva = hva;
+	r.len = len;
+	r.mr = gr->opaque;
+	r.offset = gr->offset + (gpa - gr->gpa);
+	g_array_append_val(ranges, r);
+}
+
+/* The ranges were written by a copy that has completed. */
+static void qcu_sg_dirty(GArray *ranges)
+{
+	QCHostRange *r;
+	guint i;
+
+	for (i = 0; i < ranges->len; i++)
+	{
+		r = &g_array_index(ranges, QCHostRange, i);
+		memory_region_set_dirty(r->mr, r->offset, r->len);
+	}
+}
+
+static GArray *qcu_sg_map(QCSession *s, uint64_t *gpa_array,
+		uint32_t offset, uint32_t size, bool *pinned)
+{
+	GArray *ranges;
+	QCGpaMap *map;
+	const QCGpaRange *r = NULL;
+	uint64_t gpa;
+	uint32_t chunk, piece, i;
+	int64_t start;
+
+	// no CMD_OPEN yet, or the page list is not guest RAM
+	if (s->block_size == 0 || gpa_array == NULL)
+		return NULL;
+
+	start = get_clock();
+	ranges = g_array_new(FALSE, FALSE, sizeof(QCHostRange));
+	chunk = MIN(size, s->block_size - offset % s->block_size);
+	*pinned = s->pin_guest_ram;
+
+	rcu_read_lock();
+	map = atomic_rcu_read(&qcu_gpa_map);
+
+	for (i = 0; size > 0; i++)
+	{
+		gpa = gpa_array[i];
+		size -= chunk;
+
+		while (chunk > 0)
+		{
+			if (r == NULL || gpa < r->gpa || gpa - r->gpa >= r->len)
+			{
+				r = map ? qcu_gpa_map_find(map, gpa) : NULL;
+				if (r == NULL)
+				{
+					rcu_read_unlock();
+					error("addr %p is not guest RAM\n", (void*)gpa);
+					g_array_free(ranges, TRUE);
+					qcu_translate_ns += get_clock() - start;
+					return NULL;
+				}
+				if (s->pin_guest_ram && !qcu_pin_region(s, r->opaque))
+					*pinned = false;
+			}
+
+			piece = MIN(chunk, qcu_gpa_range_avail(r, gpa));
+			qcu_sg_add(ranges, r, gpa, piece);
+			gpa += piece;
+			chunk -= piece;
+		}
+
+		chunk = MIN(size, s->block_size);
+	}
+
+	rcu_read_unlock();
+	qcu_translate_ns += get_clock() - start;
+	return ranges;
+}
+
+/* Move up to n bytes between buf and the host ranges, starting at the
+ * cursor (*idx, *off) and advancing it. */
+static size_t qcu_sg_xfer(GArray *ranges, guint *idx, size_t *off,
+		uint8_t *buf, size_t n, bool to_buf)
+{
+	QCHostRange *r;
+	size_t done = 0, len;
+
+	while (done < n && *idx < ranges->len)
+	{
+		r = &g_array_index(ranges, QCHostRange, *idx);
+		len = MIN(n - done, r->len - *off);
+		if (to_buf)
+			memcpy(buf + done, r->hva + *off, len);
+		else
+			memcpy(r->hva + *off, buf + done, len);
+		done += len;
+		*off += len;
+		if (*off == r->len)
+		{
+			(*idx)++;
+			*off = 0;
+		}
+	}
+
+	return done;
+}
+
+/* Bounce buffers in the current context, NULL if they cannot be had. */
+static QCStaging *qcu_staging_new(void)
+{
+	QCStaging *st;
+	CUresult err;
+	int i;
+
+	st = g_new0(QCStaging, 1);
+	qemu_mutex_init(&st->lock);
+	err = cuStreamCreate(&st->stream, 0);
+	for (i = 0; i < QCU_STAGING_SLOTS && err == CUDA_SUCCESS; i++)
+	{
+		err = cuMemAllocHost(&st->buf[i], QCU_STAGING_SIZE);
+		if (err == CUDA_SUCCESS)
+			err = cuEventCreate(&st->done[i], CU_EVENT_DISABLE_TIMING);
+	}
+	if (err != CUDA_SUCCESS)
+	{
+		cuError(err);
+		qcu_staging_free(st);
+		st = NULL;
+	}
+
+	return st;
+}
+
+static QCStaging *qcu_staging_get(QCSession *s)
+{
+	cudaDev *dev;
+	QCStaging *st;
+
+	if (s->devices == NULL || s->device_current >= totalDevices)
+		return NULL;
+	dev = &s->devices[s->device_current];
+
+	qemu_mutex_lock(&s->table_lock);
+	if (dev->staging == NULL)
+		dev->staging = qcu_staging_new();
+	st = dev->staging;
+	qemu_mutex_unlock(&s->table_lock);
+
+	return st;
+}
+
+/* Gather slot k while the device is still reading slot k-1. */
+static CUresult qcu_staging_htod(QCStaging *st, GArray *ranges,
+		CUdeviceptr dev)
+{
+	CUresult err = CUDA_SUCCESS, sync;
+	size_t off = 0, fill;
+	guint idx = 0;
+	int slot = 0;
+
+	qemu_mutex_lock(&st->lock);
+	while (idx < ranges->len && err == CUDA_SUCCESS)
+	{
+		err = cuEventSynchronize(st->done[slot]);
+		if (err != CUDA_SUCCESS)
+			break;
+
+		fill = qcu_sg_xfer(ranges, &idx, &off, st->buf[slot],
+				QCU_STAGING_SIZE, true);
+		err = cuMemcpyHtoDAsync(dev, st->buf[slot], fill, st->stream);
+		if (err == CUDA_SUCCESS)
+			err = cuEventRecord(st->done[slot], st->stream);
+
+		dev += fill;
+		slot = (slot + 1) % QCU_STAGING_SLOTS;
+	}
+
+	sync = cuStreamSynchronize(st->stream);
+	qemu_mutex_unlock(&st->lock);
+
+	return err != CUDA_SUCCESS ? err : sync;
+}
+
+/* Keep every slot in flight; scatter slot k, then reuse it for the piece
+ * QCU_STAGING_SLOTS further on. */
+static CUresult qcu_staging_dtoh(QCStaging *st, GArray *ranges,
+		CUdeviceptr dev)
+{
+	CUresult err = CUDA_SUCCESS, sync;
+	size_t total = 0, off = 0, len;
+	uint64_t k, pieces;
+	guint idx = 0, i;
+	int slot;
+
+	for (i = 0; i < ranges->len; i++)
+		total += g_array_index(ranges, QCHostRange, i).len;
+	pieces = DIV_ROUND_UP(total, QCU_STAGING_SIZE);
+
+	qemu_mutex_lock(&st->lock);
+	for (k = 0; k < pieces + QCU_STAGING_SLOTS && err == CUDA_SUCCESS; k++)
+	{
+		slot = k % QCU_STAGING_SLOTS;
+
+		if (k >= QCU_STAGING_SLOTS)
+		{
+			// piece k - SLOTS lives in this slot
+			err = cuEventSynchronize(st->done[slot]);
+			if (err != CUDA_SUCCESS)
+				break;
+			qcu_sg_xfer(ranges, &idx, &off, st->buf[slot],
+					QCU_STAGING_SIZE, false);
+		}
+
+		if (k < pieces)
+		{
+			len = MIN(QCU_STAGING_SIZE, total - k * QCU_STAGING_SIZE);
+			err = cuMemcpyDtoHAsync(st->buf[slot],
+					dev + k * QCU_STAGING_SIZE, len, st->stream);
+			if (err == CUDA_SUCCESS)
+				err = cuEventRecord(st->done[slot], st->stream);
+		}
+	}
+
+	sync = cuStreamSynchronize(st->stream);
+	qemu_mutex_unlock(&st->lock);
+
+	return err != CUDA_SUCCESS ? err : sync;
+}
+
+/* Copy between device memory and the host ranges of a gather list.
+ * Page-locked guest memory is copied directly: one async copy per range
+ * on the legacy default stream and a single wait at the end, keeping
+ * cudaMemcpy's synchronous semantics.  Anything else goes through the
+ * staging buffers. */
+static CUresult qcu_sg_copy(QCSession *s, GArray *ranges, bool pinned,
+		CUdeviceptr dev, bool to_device)
+{
+	QCHostRange *r;
+	QCStaging *st;
+	CUresult err = CUDA_SUCCESS, sync;
+	guint i;
+
+	if (!pinned && (st = qcu_staging_get(s)) != NULL)
+	{
+		err = to_device ? qcu_staging_htod(st, ranges, dev) :
+			qcu_staging_dtoh(st, ranges, dev);
+		cuError(err);
+		return err;
+	}
+
+	for (i = 0; i < ranges->len && err == CUDA_SUCCESS; i++)
+	{
+		r = &g_array_index(ranges, QCHostRange, i);
+		if (to_device)
+			err = cuMemcpyHtoDAsync(dev, r->hva, r->len, NULL);
+		else
+			err = cuMemcpyDtoHAsync(r->hva, dev, r->len, NULL);
+		dev += r->len;
+	}
+
+	sync = cuStreamSynchronize(NULL);
+	if (err == CUDA_SUCCESS)
+		err = sync;
+	cuError(err);
+	return err;
+}
+
+static void qcu_cudaMemcpy(QCSession *s, VirtioQCArg *arg)
+{
+	//int fd;
+	uint32_t size;
+
+	cudaError_t err;
+	void *dst, *src;
+	uint64_t *gpa_array;
+	GArray *ranges;
+	bool pinned;
+	uint64_t used[2];
+	unsigned nused;
+
+	nused = qcu_copy_ptrs(arg, used);
+	if (!qcu_swap_use(s, used, nused))
+	{
+		arg->cmd = cudaErrorMemoryAllocation;
+		return;
+	}
+
+	if( arg->flag == cudaMemcpyHostToDevice )
+	{
+		dst = (void*)arg->pA;
+		size = arg->pBSize;
+#ifdef USER_KERNEL_COPY
+		if( size > QCU_KMALLOC_MAX_SIZE)
+		{
+#endif
+   			if(arg->para)
+			{
+				src = gpa_to_hva(arg->pB);
+				//src = gpa_to_hva(arg->rnd);
+				if (src == NULL)
+					err = cudaErrorInvalidValue;
+				else
+					err = cuMemcpyHtoD((CUdeviceptr)dst, src, size);
+			}
+			else
+			{
+				gpa_array = gpa_to_hva(arg->pB);
+				ranges = qcu_sg_map(s, gpa_array, arg->pASize, size, &pinned);
+				if (ranges == NULL)
+					err = cudaErrorInvalidValue;
+				else
+				{
+					err = qcu_sg_copy(s, ranges, pinned, (CUdeviceptr)dst, true);
+					g_array_free(ranges, TRUE);
+				}
+			}
+
+#ifdef USER_KERNEL_COPY
+		}
+		else
+		{
+			src = gpa_to_hva(arg->pB);
+			//err = cudaMemcpy(dst, src, size, cudaMemcpyHostToDevice);
+			err = cuMemcpyHtoD((CUdeviceptr)dst, src, size);
+		}
+#endif
+	}
+	else if(arg->flag == cudaMemcpyDeviceToHost )
+	{
+		src = (void*)arg->pB;
+		size = arg->pASize;
+
+#ifdef USER_KERNEL_COPY
+		if( size > QCU_KMALLOC_MAX_SIZE)
+		{
+#endif
+			/*
+			fd 	   = ldl_p(&arg->pBSize);
+			offset = arg->pA;
+
+    		dst = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+			err = cudaMemcpy(dst, src, size, cudaMemcpyDeviceToHost);
+			*/
+
+			if(arg->para)
+			{
+				dst = gpa_to_hva(arg->pA);
+				//dst = gpa_to_hva(arg->rnd);
+				if (dst == NULL)
+					err = cudaErrorInvalidValue;
+				else
+				{
+					err = cuMemcpyDtoH(dst, (CUdeviceptr)src, size);
+					// a failed copy may still have written part of it
+					qcu_dirty_gpa(NULL, arg->pA, size);
+				}
+			}
+			else
+			{
+				gpa_array = gpa_to_hva(arg->pA);
+				ranges = qcu_sg_map(s, gpa_array, arg->pBSize, size, &pinned);
+				if (ranges == NULL)
+					err = cudaErrorInvalidValue;
+				else
+				{
+					err = qcu_sg_copy(s, ranges, pinned, (CUdeviceptr)src, false);
+					qcu_sg_dirty(ranges);
+					g_array_free(ranges, TRUE);
+				}
+			}
+#ifdef USER_KERNEL_COPY
+		}
+		else
+		{
+			dst = gpa_to_hva(arg->pA);
+			//err = cudaMemcpy(dst, src, size, cudaMemcpyDeviceToHost);
+			err = cuMemcpyDtoH(dst, (CUdeviceptr)src, size);
+			qcu_dirty_gpa(NULL, arg->pA, size);
+		}
+#endif
+	}
+	else if( arg->flag == cudaMemcpyDeviceToDevice )
+	{
+		dst = (void*)arg->pA;
+		src = (void*)arg->pB;
+		size = arg->pBSize;
+		//cudaError(( err = cudaMemcpy(dst, src, size, cudaMemcpyDeviceToDevice)));
+		cudaError(( err = cuMemcpyDtoD((CUdeviceptr)dst, (CUdeviceptr)src, size)));
+	}
+	qcu_swap_done(s, used, nused);
+
+	if (err == cudaSuccess && arg->flag != cudaMemcpyDeviceToHost)
+		qcu_mig_write(s, arg->pA, size);
+	arg->cmd = err;
+	trace_virtio_qcuda_memcpy(s->id, arg->flag, size);
+}
+
+typedef struct QCDirtyLater
+{
+	GArray *runs;
+	QEMUBH *bh;
+} QCDirtyLater;
+
+/* Mark the runs of a completed copy from the main loop, where the memory
+ * map cannot change under us, and let go of their regions. */
+static void qcu_dirty_bh(void *opaque)
+{
+	QCDirtyLater *dl = opaque;
+	QCDirtyRun *r;
+	guint i;
+
+	for (i = 0; i < dl->runs->len; i++)
+	{
+		r = &g_array_index(dl->runs, QCDirtyRun, i);
+		memory_region_set_dirty(r->mr, r->offset, r->len);
+		memory_region_unref(r->mr);
+	}
+	g_array_free(dl->runs, TRUE);
+	qemu_bh_delete(dl->bh);
+	g_free(dl);
+}
+
+/* Stream callback behind an asynchronous copy into guest RAM; runs on a
+ * driver thread, so it only hands the runs to the main loop. */
+static void qcu_dirty_done(CUstream stream, CUresult status, void *opaque)
+{
+	QCDirtyLater *dl = opaque;
+
+	dl->bh = qemu_bh_new(qcu_dirty_bh, dl);
+	qemu_bh_schedule(dl->bh);
+}
+
+/* Mark runs once the work queued on stream so far has completed. */
+static void qcu_dirty_after(CUstream stream, GArray *runs)
+{
+	QCDirtyLater *dl;
+
+	if (runs->len == 0)
+	{
+		g_array_free(runs, TRUE);
+		return;
+	}
+
+	dl = g_new0(QCDirtyLater, 1);
+	dl->runs = runs;
+	if (cuStreamAddCallback(stream, qcu_dirty_done, dl, 0) != CUDA_SUCCESS)
+	{
+		cuStreamSynchronize(stream);
+		qcu_dirty_done(stream, CUDA_SUCCESS, dl);
+	}
+}
+
+/* The guest RAM behind size bytes at offset of a CMD_MMAP file. */
+static GArray *qcu_mmap_runs(QCSession *s, int fd, uint64_t offset,
+		uint64_t size)
+{
+	GArray *runs, *blocks;
+	uint64_t i, off, piece;
+
+	runs = g_array_new(FALSE, FALSE, sizeof(QCDirtyRun));
+	if (s->block_size == 0)
+		return runs;
+
+	qemu_mutex_lock(&s->mmap_lock);
+	blocks = g_hash_table_lookup(s->mmaps, GINT_TO_POINTER(fd));
+	i = offset / s->block_size;
+	off = offset % s->block_size;
+	while (blocks != NULL && size > 0 && i < blocks->len)
+	{
+		piece = MIN(size, s->block_size - off);
+		qcu_dirty_gpa(runs, g_array_index(blocks, uint64_t, i) + off, piece);
+		size -= piece;
+		off = 0;
+		i++;
+	}
+	qemu_mutex_unlock(&s->mmap_lock);
+
+	return runs;
+}
+
+static void qcu_cudaMemcpyAsync(QCSession *s, VirtioQCArg *arg)
+{
+	int fd;
+	uint64_t offset;
+	uint32_t size;
+	void *ptr, *device;
+	cudaError_t err;
+	//cudaStream_t stream = (cudaStream_t)arg->rnd;
+	uint64_t streamIdx = arg->rnd;
+	cudaStream_t stream = qcu_stream(s, streamIdx);
+	QCGraph *g;
+	uint64_t used[2];
+	unsigned nused;
+
+	nused = qcu_copy_ptrs(arg, used);
+	if (!qcu_swap_use(s, used, nused))
+	{
+		arg->cmd = cudaErrorMemoryAllocation;
+		return;
+	}
+
+	if( arg->flag == cudaMemcpyHostToDevice )
+	{
+		fd = ldl_p(&arg->pASize);
+		offset = arg->pB;
+		size = arg->pBSize;
+
+		device = (void*)arg->pA;
+
+		//char *buf = (char*)malloc(sizeof(char)*size); //test
+	//	pread(fd, buf, size, offset); //test
+
+		//ptr = mmap(0, arg->para, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+		ptr = mmap(0, arg->para, PROT_READ, MAP_PRIVATE, fd, offset);
+		err = cudaMemcpyAsync(device, ptr, size, cudaMemcpyHostToDevice, stream);
+		if (err == cudaSuccess)
+			qcu_mig_write(s, arg->pA, size);
+
+	//	err = cudaMemcpyAsync(device, buf, size, cudaMemcpyHostToDevice, stream); //text
+
+	//	free(buf); //test
+	}
+	else if(arg->flag == cudaMemcpyDeviceToHost )
+	{
+		fd = ldl_p(&arg->pBSize);
+		offset = arg->pA;
+		size = arg->pASize;
+
+		device = (void*)arg->pB;
+
+	//	char *buf = (char*)malloc(sizeof(char)*size); //test
+
+		//ptr = mmap(0, arg->para, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+		ptr = mmap(0, arg->para, PROT_WRITE, MAP_SHARED, fd, offset);
+		msync(ptr, arg->para, MS_ASYNC);
+		err = cudaMemcpyAsync(ptr, device, size, cudaMemcpyDeviceToHost, stream);
+		// the file may be mapped over guest RAM
+		if (err == cudaSuccess)
+			qcu_dirty_after(stream, qcu_mmap_runs(s, fd, offset, size));
+
+//		err = cudaMemcpyAsync(buf, device, size, cudaMemcpyDeviceToHost, stream); //test
+//		pwrite(fd, buf, size, offset); //test
+	//	free(buf); //test
+	}
+	else if( arg->flag == cudaMemcpyDeviceToDevice )
+	{
+		ptr = (void*)arg->pA;
+		device = (void*)arg->pB;
+		size = arg->pBSize;
+		g = qcu_graph_capture(s, streamIdx);
+		if (g != NULL)
+			err = qcu_graph_add_copy(g, arg->pB, arg->pA, size) ?
+				cudaSuccess : cudaErrorInvalidValue;
+		else
+		{
+			cudaError(( err = cudaMemcpyAsync(device, ptr, size, cudaMemcpyDeviceToDevice, stream)));
+			if (err == cudaSuccess)
+				qcu_mig_write(s, arg->pB, size);
+		}
+	}
+/*
+	uint32_t size, len, i;
+
+	cudaError_t err;
+	void *dst, *src;
+	uint64_t *gpa_array;
+
+	cudaStream_t stream = (cudaStream_t)arg->rnd;
+
+	if( arg->flag == cudaMemcpyHostToDevice )
+	{
+		dst = (void*)arg->pA;
+		size = arg->pBSize;
+
+        gpa_array = gpa_to_hva(arg->pB);
+
+		uint32_t offset   	 = arg->pASize;
+		uint32_t start_offset = offset%s->block_size;
+		uint32_t rsize = s->block_size - start_offset;
+
+		src = gpa_to_hva(gpa_array[0]);
+        len = MIN(size, rsize);
+		err = cudaMemcpyAsync(dst, src, len, cudaMemcpyHostToDevice, stream);
+
+		size -= len;
+		dst += len;
+
+		for(i=0; size>0; i++)
+        {
+        	src = gpa_to_hva(gpa_array[i+1]);
+            len = MIN(size, s->block_size);
+			err = cudaMemcpyAsync(dst, src, len, cudaMemcpyHostToDevice, stream);
+
+			size -= len;
+            dst  += len;
+        }
+	}
+	else if(arg->flag == cudaMemcpyDeviceToHost )
+	{
+		src = (void*)arg->pB;
+		size = arg->pASize;
+
+		gpa_array = gpa_to_hva(arg->pA);
+
+		uint32_t offset   	 = arg->pBSize;
+		uint32_t start_offset = offset%s->block_size;
+		uint32_t rsize = s->block_size - start_offset;
+
+		dst = gpa_to_hva(gpa_array[0]);
+        len = MIN(size, rsize);
+		err = cudaMemcpyAsync(dst, src, len, cudaMemcpyDeviceToHost, stream);
+
+		size -= len;
+		src+=len;
+
+		for(i=0; size>0; i++)
+        {
+        	dst = gpa_to_hva(gpa_array[i+1]);
+            len = MIN(size, s->block_size);
+			err = cudaMemcpyAsync(dst, src, len, cudaMemcpyDeviceToHost, stream);
+
+			size -= len;
+            src  += len;
+        }
+	}
+	else if( arg->flag == cudaMemcpyDeviceToDevice )
+	{
+		dst = (void*)arg->pA;
+		src = (void*)arg->pB;
+		size = arg->pBSize;
+		cudaError(( err = cudaMemcpyAsync(dst, src, size, cudaMemcpyDeviceToDevice, stream)));
+	}
+
+	arg->cmd = err;
+*/
+	qcu_swap_done(s, used, nused);
+	arg->cmd = err;
+}
+
+/* Copy between device memory and the shared memory BAR; the BAR is
+ * page-locked once per device, so this is a single DMA. */
+static void qcu_cmd_shm_memcpy(QCSession *s, VirtioQCArg *arg)
+{
+	VirtIOQC *qcu = s->qcu;
+	CUdeviceptr dev = (CUdeviceptr)arg->pA;
+	uint64_t offset = arg->pB;
+	uint32_t size = arg->pBSize;
+	CUstream stream = qcu_stream(s, arg->rnd);
+	uint8_t *host;
+	GArray *runs;
+	CUresult err;
+
+	if (qcu->shm_ptr == NULL || offset > qcu->conf.mem_size ||
+			size > qcu->conf.mem_size - offset)
+	{
+		error("shm copy of %u bytes at %"PRIx64" out of range\n",
+				size, offset);
+		arg->cmd = cudaErrorInvalidValue;
+		return;
+	}
+
+	qcu_pin_host(s, qcu->shm_ptr, qcu->conf.mem_size);
+	host = qcu->shm_ptr + offset;
+
+	if (!qcu_swap_use(s, &arg->pA, 1))
+	{
+		arg->cmd = cudaErrorMemoryAllocation;
+		return;
+	}
+	if (arg->flag == cudaMemcpyHostToDevice)
+		err = cuMemcpyHtoDAsync(dev, host, size, stream);
+	else if (arg->flag == cudaMemcpyDeviceToHost)
+		err = cuMemcpyDtoHAsync(host, dev, size, stream);
+	else
+		err = CUDA_ERROR_INVALID_VALUE;
+	qcu_swap_done(s, &arg->pA, 1);
+
+	if (err == CUDA_SUCCESS && arg->flag == cudaMemcpyHostToDevice)
+		qcu_mig_write(s, dev, size);
+
+	// on the default stream this behaves like cudaMemcpy
+	if (err == CUDA_SUCCESS && stream == NULL)
+		err = cuStreamSynchronize(NULL);
+
+	if (err == CUDA_SUCCESS && arg->flag == cudaMemcpyDeviceToHost)
+	{
+		if (stream == NULL)
+			qcu_dirty_add(NULL, &qcu->shm, offset, size);
+		else
+		{
+			runs = g_array_sized_new(FALSE, FALSE, sizeof(QCDirtyRun), 1);
+			qcu_dirty_add(runs, &qcu->shm, offset, size);
+			qcu_dirty_after(stream, runs);
+		}
+	}
+
+	cuError(err);
+	arg->cmd = err;
+}
+
+
+/* Give a block back to the allocator of whichever device it came from. */
+static bool qcu_cached_free(QCSession *s, uint64_t addr)
+{
+	cudaDev *dev;
+	CUcontext ctx;
+	bool found = false;
+	int i;
+
+	if (!s->qcu->conf.alloc_cache || s->devices == NULL)
+		return false;
+
+	dev = &s->devices[s->device_current];
+	if (dev->alloc != NULL && qcu_alloc_put(dev->alloc, addr, true))
+		return true;
+
+	for (i = 0; i < totalDevices && !found; i++)
+	{
+		dev = &s->devices[i];
+		if (i == s->device_current || dev->alloc == NULL ||
+				!qcu_alloc_owns(dev->alloc, addr))
+			continue;
+
+		// the fence has to be recorded in the owner's context
+		cuError( cuCtxPushCurrent(dev->context) );
+		found = qcu_alloc_put(dev->alloc, addr, true);
+		cuError( cuCtxPopCurrent(&ctx) );
+	}
+
+	return found;
+}
+
+/* Free an oversubscribed allocation of whichever device has it. */
+static bool qcu_swap_put(QCSession *s, uint64_t addr)
+{
+	cudaDev *dev;
+	CUcontext ctx;
+	bool found = false;
+	int i;
+
+	if (!s->qcu->conf.oversubscribe || s->devices == NULL)
+		return false;
+
+	for (i = 0; i < totalDevices && !found; i++)
+	{
+		dev = &s->devices[i];
+		if (dev->swap == NULL || !qcu_swap_owns(dev->swap, addr))
+			continue;
+
+		// unmapping waits for the owner's context
+		if (i != s->device_current)
+			cuError( cuCtxPushCurrent(dev->context) );
+		found = qcu_swap_free(dev->swap, addr);
+		if (i != s->device_current)
+			cuError( cuCtxPopCurrent(&ctx) );
+	}
+
+	return found;
+}
+
+/*
+ * Weight blobs (VIRTQC_CMD_BLOB_LOAD) belong to no session: they are
+ * mapped with the virtual memory management API, so every context of the
+ * process can use them, and set up from the device's primary context,
+ * which each blob keeps retained.  Kernels get read access only.  A
+ * session counts the references it holds per device in dev->blobs.
+ */
+#ifdef QCU_HAVE_VMM
+static QCBlobStore *qcu_blobs;
+
+/* Address space for size bytes of blob on devId, 0 if none. */
+static uint64_t qcu_blob_span(int devId, uint64_t size)
+{
+	CUmemAllocationProp prop;
+	size_t gran;
+
+	qcu_mig_prop(&prop, devId);
+	if (cuMemGetAllocationGranularity(&gran, &prop,
+				CU_MEM_ALLOC_GRANULARITY_MINIMUM) != CUDA_SUCCESS)
+		return 0;
+	return ROUND_UP(size, gran);
+}
+
+/* Stream the mapped file through the staging buffers, so that reading
+ * the next piece from disk overlaps with the transfer of the last. */
+static CUresult qcu_blob_upload(CUdeviceptr ptr, const void *data,
+		uint64_t size)
+{
+	QCHostRange r = { .hva = (uint8_t *)data, .len = size };
+	QCStaging *st;
+	GArray *ranges;
+	CUresult err;
+
+	st = qcu_staging_new();
+	if (st == NULL)
+		return cuMemcpyHtoD(ptr, data, size);
+
+	ranges = g_array_new(FALSE, FALSE, sizeof(QCHostRange));
+	g_array_append_val(ranges, r);
+	err = qcu_staging_htod(st, ranges, ptr);
+	g_array_free(ranges, TRUE);
+	qcu_staging_free(st);
+
+	return err;
+}
+
+static bool qcu_blob_dev_load(void *opaque, int devId, const void *data,
+		uint64_t size, uint64_t *addr)
+{
+	CUmemAccessDesc access;
+	CUdevice device;
+	CUcontext ctx, popped;
+	CUdeviceptr ptr = 0;
+	uint64_t span;
+	CUresult err;
+
+	err = cuDeviceGet(&device, devId);
+	if (err == CUDA_SUCCESS)
+		err = cuDevicePrimaryCtxRetain(&ctx, device);
+	if (err != CUDA_SUCCESS)
+	{
+		cuError(err);
+		return false;
+	}
+	cuError( cuCtxPushCurrent(ctx) );
+
+	span = qcu_blob_span(devId, size);
+	err = span ? cuMemAddressReserve(&ptr, span, 0, 0, 0) :
+		CUDA_ERROR_INVALID_VALUE;
+	if (err == CUDA_SUCCESS)
+	{
+		err = qcu_vmm_map(ptr, span, devId);
+		if (err != CUDA_SUCCESS)
+		{
+			cuError( cuMemAddressFree(ptr, span) );
+			ptr = 0;
+		}
+	}
+	if (err == CUDA_SUCCESS)
+		err = qcu_blob_upload(ptr, data, size);
+	if (err == CUDA_SUCCESS)
+	{
+		access.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+		access.location.id = devId;
+		access.flags = CU_MEM_ACCESS_FLAGS_PROT_READ;
+		err = cuMemSetAccess(ptr, span, &access, 1);
+	}
+
+	if (err != CUDA_SUCCESS && ptr != 0)
+	{
+		cuError( cuMemUnmap(ptr, span) );
+		cuError( cuMemAddressFree(ptr, span) );
+	}
+	cuError( cuCtxPopCurrent(&popped) );
+	if (err != CUDA_SUCCESS)
+	{
+		if (err != CUDA_ERROR_OUT_OF_MEMORY)
+			cuError(err);
+		cuError( cuDevicePrimaryCtxRelease(device) );
+		return false;
+	}
+
+	*addr = ptr;
+	return true;
+}
+
+static void qcu_blob_dev_unload(void *opaque, int devId, uint64_t addr,
+		uint64_t size)
+{
+	uint64_t span = qcu_blob_span(devId, size);
+	CUdevice device;
+	CUcontext ctx;
+
+	cuError( cuDeviceGet(&device, devId) );
+	cuError( cuDevicePrimaryCtxRetain(&ctx, device) );
+	cuError( cuCtxPushCurrent(ctx) );
+	cuError( cuMemUnmap(addr, span) );
+	cuError( cuMemAddressFree(addr, span) );
+	cuError( cuCtxPopCurrent(&ctx) );
+	// once for this call, once for the load
+	cuError( cuDevicePrimaryCtxRelease(device) );
+	cuError( cuDevicePrimaryCtxRelease(device) );
+}
+
+static const QCBlobOps qcu_blob_ops = {
+	.load = qcu_blob_dev_load,
+	.unload = qcu_blob_dev_unload,
+};
+#endif
+
+/*
+ * Drop one of the session's references to a blob of the device, after
+ * its work is done like cudaFree would.  Runs with the device's context
+ * current.
+ */
+static bool qcu_blob_put_dev(QCSession *s, cudaDev *dev, uint64_t addr)
+{
+#ifdef QCU_HAVE_VMM
+	gpointer refs;
+
+	qemu_mutex_lock(&s->table_lock);
+	if (dev->blobs == NULL ||
+			!g_hash_table_lookup_extended(dev->blobs, GSIZE_TO_POINTER(addr),
+				NULL, &refs))
+	{
+		qemu_mutex_unlock(&s->table_lock);
+		return false;
+	}
+	if (GPOINTER_TO_INT(refs) > 1)
+		g_hash_table_insert(dev->blobs, GSIZE_TO_POINTER(addr),
+				GINT_TO_POINTER(GPOINTER_TO_INT(refs) - 1));
+	else
+		g_hash_table_remove(dev->blobs, GSIZE_TO_POINTER(addr));
+	qemu_mutex_unlock(&s->table_lock);
+
+	cuError( cuCtxSynchronize() );
+	qcu_blob_put(qcu_blobs, dev - s->devices, addr);
+	atomic_dec(&s->qcu->blobs_held);
+	return true;
+#else
+	return false;
+#endif
+}
+
+/* Release every blob reference the session has on a device. */
+static void qcu_blobs_drop_device(QCSession *s, cudaDev *dev)
+{
+#ifdef QCU_HAVE_VMM
+	GHashTableIter iter;
+	gpointer addr, refs;
+	int n;
+
+	if (dev->blobs == NULL)
+		return;
+	cuError( cuCtxSynchronize() );
+	g_hash_table_iter_init(&iter, dev->blobs);
+	while (g_hash_table_iter_next(&iter, &addr, &refs))
+	{
+		for (n = GPOINTER_TO_INT(refs); n > 0; n--)
+		{
+			qcu_blob_put(qcu_blobs, dev - s->devices,
+					GPOINTER_TO_SIZE(addr));
+			atomic_dec(&s->qcu->blobs_held);
+		}
+	}
+	g_hash_table_destroy(dev->blobs);
+	dev->blobs = NULL;
+#endif
+}
+
+static bool qcu_blob_free(QCSession *s, uint64_t addr)
+{
+	cudaDev *dev;
+	CUcontext ctx;
+	bool found = false;
+	int i;
+
+	for (i = 0; s->devices != NULL && i < totalDevices && !found; i++)
+	{
+		dev = &s->devices[i];
+		if (dev->blobs == NULL)
+			continue;
+		if (i != s->device_current)
+			cuError( cuCtxPushCurrent(dev->context) );
+		found = qcu_blob_put_dev(s, dev, addr);
+		if (i != s->device_current)
+			cuError( cuCtxPopCurrent(&ctx) );
+	}
+
+	return found;
+}
+
+/* pA/pASize: the blob's name in guest memory. */
+static void qcu_cmd_blob_load(QCSession *s, VirtioQCArg *arg)
+{
+	VirtIOQC *qcu = s->qcu;
+	cudaDev *dev;
+	uint64_t addr = 0, size = 0;
+	char *name, *hva;
+	gpointer refs;
+	int ret;
+
+	arg->pB = 0;
+	if (qcu->conf.blob_dir == NULL || s->devices == NULL)
+	{
+		arg->cmd = cudaErrorNotSupported;
+		return;
+	}
+	hva = arg->pASize > 0 && arg->pASize <= NAME_MAX ?
+		gpa_to_hva(arg->pA) : NULL;
+	if (hva == NULL)
+	{
+		arg->cmd = cudaErrorInvalidValue;
+		return;
+	}
+	name = g_strndup(hva, arg->pASize);
+
+#ifdef QCU_HAVE_VMM
+	// migration has no way to move them; see virtio_qcuda_migrate_set()
+	qemu_mutex_lock(&qcu->session_lock);
+	ret = qcu->migrating ? -EBUSY : 0;
+	if (ret == 0)
+		atomic_inc(&qcu->blobs_held);
+	qemu_mutex_unlock(&qcu->session_lock);
+	if (ret == 0)
+	{
+		ret = qcu_blob_get(qcu_blobs, s->device_current, qcu->conf.blob_dir,
+				name, &addr, &size);
+		if (ret < 0)
+			atomic_dec(&qcu->blobs_held);
+	}
+#else
+	ret = -ENOTSUP;
+#endif
+
+	trace_virtio_qcuda_blob_load(s->id, name, addr, size, ret);
+	g_free(name);
+	switch (ret)
+	{
+		case 0:
+			break;
+		case -EIO:
+			arg->cmd = cudaErrorMemoryAllocation;
+			return;
+		case -EBUSY:
+		case -ENOTSUP:
+			arg->cmd = cudaErrorNotSupported;
+			return;
+		default:
+			arg->cmd = cudaErrorInvalidValue;
+			arg->pB = -ret;
+			return;
+	}
+
+	dev = &s->devices[s->device_current];
+	qemu_mutex_lock(&s->table_lock);
+	if (dev->blobs == NULL)
+		dev->blobs = g_hash_table_new(g_direct_hash, g_direct_equal);
+	refs = g_hash_table_lookup(dev->blobs, GSIZE_TO_POINTER(addr));
+	g_hash_table_insert(dev->blobs, GSIZE_TO_POINTER(addr),
+			GINT_TO_POINTER(GPOINTER_TO_INT(refs) + 1));
+	qemu_mutex_unlock(&s->table_lock);
+
+	arg->pA = addr;
+	arg->para = size;
+	arg->cmd = cudaSuccess;
+}
+
+/* Forget an allocation; true if it was restored by an incoming migration,
+ * which also releases its memory. */
+static bool qcu_mig_free(QCSession *s, uint64_t addr)
+{
+	int i;
+
+	for (i = 0; s->mig != NULL && i < totalDevices; i++)
+	{
+		if (qcu_mig_owns(s->mig[i], addr))
+			return qcu_mig_remove(s->mig[i], addr);
+	}
+	return false;
+}
+
+static void qcu_cudaFree(QCSession *s, VirtioQCArg *arg)
+{
+	cudaError_t err;
+	void* dst;
+
+	dst = (void*)arg->pA;
+	if (qcu_mig_free(s, arg->pA))
+		err = cudaSuccess;
+	else if (qcu_blob_free(s, arg->pA))
+		err = cudaSuccess;
+	else if (qcu_swap_put(s, arg->pA) || qcu_cached_free(s, arg->pA))
+		err = cudaSuccess;
+	else
+		cudaError((err = cudaFree(dst)));
+	//cudaError((err = cuMemFree(dst)));
+	arg->cmd = err;
+
+	trace_virtio_qcuda_free(s->id, arg->pA);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+///	Device Management
+////////////////////////////////////////////////////////////////////////////////
+
+static void qcu_cudaGetDevice(QCSession *s, VirtioQCArg *arg)
+{
+	cudaError_t err;
+//	int device;
+
+	//cudaError((err = cudaGetDevice( &device )));
+	err = 0;
+	arg->cmd = err;
+	//arg->pA = (uint64_t)device;
+	arg->pA = (uint64_t)s->device_current;
+
+
+	trace_virtio_qcuda_device(s->id, "get", s->device_current);
+}
+
+static void qcu_cudaGetDeviceCount(QCSession *s, VirtioQCArg *arg)
+{
+	cudaError_t err;
+	int device;
+
+	cudaError((err = cudaGetDeviceCount( &device )));
+	arg->cmd = err;
+	arg->pA = (uint64_t)device;
+
+	trace_virtio_qcuda_device(s->id, "count", device);
+}
+
+static void qcu_cudaSetDevice(QCSession *s, VirtioQCArg *arg)
+{
+	cudaError_t err;
+	int device;
+
+	device = (int)arg->pA;
+
+	if( device < 0 || device >= totalDevices || s->devices == NULL )
+	{
+		arg->cmd = cudaErrorInvalidDevice;
+		trace_virtio_qcuda_device(s->id, "set-invalid", device);
+	} else {
+		s->device_current = device;
+		if( s->devices[device].context == NULL ) // device was reset therefore no context
+		{
+			cuError( cuDeviceGet(&s->devices[device].device, device) );
+			cuError( cuCtxCreate(&s->devices[device].context, 0, s->devices[device].device) );
+		} else {
+			// cuError( cuCtxPopCurrent(&s->devices[s->device_current].context) );
+			// cuError( cuCtxPushCurrent(s->devices[device].context) );
+			cuError( cuCtxSetCurrent(s->devices[device].context) );
+		}
+
+		// an eager device is normally loaded already
+		qcu_device_wait(s, device);
+		reloadAllKernels(s);
+
+	//	cudaError((err = cudaSetDevice( device )));
+
+	//	cuError(cuCtxPushCurrent(cudaContext));	//now test
+
+	//	cuError(cuCtxPopCurrent(&cudaContext)) ; //cocotion test
+
+		// cuError( cuDeviceGet(&s->device_current, device) );// cocotion test
+	//	cuError( cuCtxCreate(&cudaContext, 0, cudaDevice) ); //cocotion test
+
+		//cuError(cuCtxPopCurrent(&cudaContext)) ; //cocotion test
+
+
+	//	cuError(cuCtxPushCurrent(cudaContext)); //now test
+
+		err = 0; //cocotion test
+
+		arg->cmd = err;
+
+		trace_virtio_qcuda_device(s->id, "set", device);
+	}
+}
+
+static void qcu_cudaGetDeviceProperties(QCSession *s, VirtioQCArg *arg)
+{
+	cudaError_t err;
+	struct cudaDeviceProp *prop;
+	int device;
+
+	prop = gpa_to_hva(arg->pA);
+	device = (int)arg->pB;
+	if (prop == NULL)
+	{
+		arg->cmd = cudaErrorInvalidValue;
+		return;
+	}
+
+	cudaError((err = cudaGetDeviceProperties( prop, device )));
+	qcu_dirty_gpa(NULL, arg->pA, sizeof(*prop));
+	arg->cmd = err;
+
+	trace_virtio_qcuda_device(s->id, "properties", device);
+}
+
+static void qcu_cudaDeviceSynchronize(QCSession *s, VirtioQCArg *arg,
+		VirtIOQCReq *req)
+{
+	cudaError_t err;
+	CUevent ev;
+	bool deferred = false;
+
+	// an event on the legacy default stream passes once every blocking
+	// stream is idle, so waiting for it is waiting for the device
+	if (req != NULL &&
+			cuEventCreate(&ev, CU_EVENT_DISABLE_TIMING) == CUDA_SUCCESS)
+	{
+		if (cuEventRecord(ev, NULL) == CUDA_SUCCESS)
+			deferred = qcu_req_defer(s, req, ev);
+		// still valid for the wait queued on it
+		cuError( cuEventDestroy(ev) );
+	}
+	if (deferred)
+		return;
+
+	cudaError((err = cudaDeviceSynchronize()));
+	//err = cuCtxSynchronize(); //cocotion test
+	arg->cmd = err;
+}
+
+static void qcu_cudaDeviceReset(QCSession *s, VirtioQCArg *arg)
+{
+	cudaError_t err;
+	if( s->devices != NULL )
+		qcu_device_clear(s, &s->devices[s->device_current]);
+	cudaError((err = cudaDeviceReset()));
+	arg->cmd = err;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+///	Version Management
+////////////////////////////////////////////////////////////////////////////////
+
+static void qcu_cudaDriverGetVersion(QCSession *s, VirtioQCArg *arg)
+{
+	cudaError_t err;
+	int version;
+
+	cudaError((err = cudaDriverGetVersion( &version )));
+	arg->cmd = err;
+	arg->pA = (uint64_t)version;
+
+	trace_virtio_qcuda_version("driver", version);
+}
+
+static void qcu_cudaRuntimeGetVersion(QCSession *s, VirtioQCArg *arg)
+{
+	cudaError_t err;
+	int version;
+
+	cudaError((err = cudaRuntimeGetVersion( &version )));
+	arg->cmd = err;
+	arg->pA = (uint64_t)version;
+
+	trace_virtio_qcuda_version("runtime", version);
+}
+
+//////////////////////////////////////////////////
+//static void qcu_checkCudaCapabilities(QCSession *s, VirtioQCArg *arg)
+//{
+//	cudaError_t err;
+//	err = checkCudaCapabilities(arg->pA, arg->pB);
+//	arg->cmd = err;
+//}
+
+//////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
+///	Event Management
+////////////////////////////////////////////////////////////////////////////////
+
+/* Event handles are tagged with their device and creation flags. */
+#define QCU_EVENT_TAG(dev, flags)	((uint64_t)(dev) << 32 | (uint32_t)(flags))
+
+static void qcu_cudaEventCreate(QCSession *s, VirtioQCArg *arg)
+{
+	cudaError_t err;
+	cudaEvent_t event = NULL;
+	uint32_t idx;
+
+	cudaError((err = cudaEventCreate(&event)));
+	idx = qcu_handle_alloc_tagged(&s->events, event,
+			QCU_EVENT_TAG(s->device_current, cudaEventDefault));
+	arg->cmd = err;
+	arg->pA = (uint64_t)idx;
+
+	trace_virtio_qcuda_event(s->id, "create", idx);
+}
+
+static void qcu_cudaEventCreateWithFlags(QCSession *s, VirtioQCArg *arg)
+{
+	cudaError_t err;
+	cudaEvent_t event = NULL;
+	uint32_t idx;
+
+	cudaError((err = cudaEventCreateWithFlags(&event, arg->flag)));
+	idx = qcu_handle_alloc_tagged(&s->events, event,
+			QCU_EVENT_TAG(s->device_current, arg->flag));
+	arg->cmd = err;
+	arg->pA = (uint64_t)idx;
+
+	trace_virtio_qcuda_event(s->id, "create", idx);
+}
+
+static void qcu_cudaEventRecord(QCSession *s, VirtioQCArg *arg)
+{
+	cudaError_t err;
+	uint32_t eventIdx;
+//	uint32_t streamIdx;
+	uint64_t streamIdx;
+
+	eventIdx  = arg->pA;
+	streamIdx = arg->pB;
+	cudaError((err = cudaEventRecord(qcu_event(s, eventIdx), qcu_stream(s, streamIdx))));
+
+	arg->cmd = err;
+
+	trace_virtio_qcuda_event(s->id, "record", eventIdx);
+}
+
+static void qcu_cudaEventSynchronize(QCSession *s, VirtioQCArg *arg,
+		VirtIOQCReq *req)
+{
+	cudaError_t err;
+	cudaEvent_t ev;
+	uint32_t idx;
+
+	idx = arg->pA;
+	ev = qcu_event(s, idx);
+	trace_virtio_qcuda_event(s->id, "synchronize", idx);
+
+	if (req != NULL && ev != NULL && qcu_req_defer(s, req, (CUevent)ev))
+		return;
+
+	cudaError((err = cudaEventSynchronize( ev )));
+	arg->cmd = err;
+}
+
+static void qcu_cudaEventElapsedTime(QCSession *s, VirtioQCArg *arg)
+{
+	cudaError_t err;
+	uint32_t startIdx;
+	uint32_t endIdx;
+	float ms;
+
+	startIdx = arg->pA;
+	endIdx   = arg->pB;
+	cudaError((err = cudaEventElapsedTime(&ms, qcu_event(s, startIdx), qcu_event(s, endIdx))));
+	arg->cmd = err;
+	memcpy(&arg->flag, &ms, sizeof(float));
+
+	trace_virtio_qcuda_event_elapsed(s->id, startIdx, endIdx,
+			(uint64_t)(ms * 1000));
+}
+
+static void qcu_cudaEventDestroy(QCSession *s, VirtioQCArg *arg)
+{
+	cudaError_t err;
+	uint32_t idx;
+
+	idx = arg->pA;
+	cudaError((err = cudaEventDestroy(qcu_handle_free(&s->events, idx))));
+	arg->cmd = err;
+
+	trace_virtio_qcuda_event(s->id, "destroy", idx);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+///	Error Handling
+////////////////////////////////////////////////////////////////////////////////
+
+static void qcu_cudaGetLastError(QCSession *s, VirtioQCArg *arg)
+{
+	cudaError_t err;
+
+	err =  cudaGetLastError();
+	arg->cmd = err;
+	trace_virtio_qcuda_last_error(s->id, err);
+}
+
+//////////zero-copy////////
+
+static void qcu_cudaHostRegister(QCSession *s, VirtioQCArg *arg)
+{
+	int fd = ldl_p(&arg->pBSize);
+	uint64_t offset = arg->pA;
+	uint32_t size = arg->pASize;
+
+	void *ptr = mmap(0, arg->pB, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+
+	cudaError_t err;
+	err = cudaHostRegister(ptr, size, arg->flag);
+	//err = cuMemHostRegister(ptr, size, CU_MEMHOSTREGISTER_DEVICEMAP);
+	arg->pA = (uint64_t)ptr;
+	arg->cmd = err;
+}
+
+static void qcu_cudaHostGetDevicePointer(QCSession *s, VirtioQCArg *arg)
+{
+	cudaError_t err;
+	void *ptr = (void*)	arg->pB;
+	void *devPtr;
+	//CUdeviceptr devPtr;
+	err = cudaHostGetDevicePointer(&devPtr, ptr, arg->flag);
+	//err = cuMemHostGetDevicePointer(&devPtr, ptr, arg->flag);
+	arg->pA = (uint64_t)devPtr;
+	arg->cmd = err;
+}
+
+static void qcu_cudaHostUnregister(QCSession *s, VirtioQCArg *arg)
+{
+	void *ptr = (void*) arg->pB;
+
+	cudaError_t err;
+	err = cudaHostUnregister(ptr);
+	//err = cuMemHostUnregister(ptr);
+	arg->cmd = err;
+}
+
+static void qcu_cudaSetDeviceFlags(QCSession *s, VirtioQCArg *arg)
+{
+	cudaError_t err;
+//	err = cudaSetDeviceFlags(arg->flag);
+	err = 0;
+	arg->cmd = err;
+}
+
+//stream
+static void qcu_cudaStreamCreate(QCSession *s, VirtioQCArg *arg)
+{
+	cudaError_t err;
+//	void *ptr = (void*) arg->pA;
+//	err = cuStreamCreate((CUstream*)ptr,0);
+
+	cudaStream_t stream = NULL;
+
+	err = cudaStreamCreate(&stream);
+	arg->pA = qcu_handle_alloc_tagged(&s->streams, stream, s->device_current);
+ 	arg->cmd = err;
+
+
+}
+
+static void qcu_cudaStreamDestroy(QCSession *s, VirtioQCArg *arg)
+{
+	cudaError_t err;
+	uint32_t idx;
+
+	idx = arg->pA;
+	cudaError((err = cudaStreamDestroy(qcu_handle_free(&s->streams, idx))));
+	arg->cmd = err;
+}
+
+#endif // CONFIG_CUDA
+
+////////////////////////////////////////////////////////////////////////////////
+///	Sessions
+////////////////////////////////////////////////////////////////////////////////
+
+static void qcu_blocks_free(gpointer blocks)
+{
+	g_array_free(blocks, TRUE);
+}
+
+static QCSession *qcu_session_get(VirtIOQC *qcu, uint32_t id)
+{
+	QCSession *s;
+
+	qemu_mutex_lock(&qcu->session_lock);
+	s = g_hash_table_lookup(qcu->sessions, GUINT_TO_POINTER(id));
+	if (s == NULL)
+	{
+		s = g_new0(QCSession, 1);
+		s->qcu = qcu;
+		s->id = id;
+		s->refcount = 1; // owned by the table until the guest closes it
+		qemu_cond_init(&s->active_cond);
+		qemu_mutex_init(&s->lock);
+		qemu_mutex_init(&s->mmap_lock);
+		s->mmaps = g_hash_table_new_full(NULL, NULL, NULL, qcu_blocks_free);
+#ifdef CONFIG_CUDA
+		qemu_mutex_init(&s->table_lock);
+		s->kernels = g_array_new(FALSE, FALSE, sizeof(kernelInfo));
+		s->layouts = g_hash_table_new_full(NULL, NULL, NULL, qcu_layout_put);
+		s->images = g_hash_table_new_full(g_str_hash, g_str_equal,
+				NULL, qcu_image_free);
+		s->image_gpas = g_hash_table_new(NULL, NULL);
+		qemu_cond_init(&s->load_cond);
+		qcu_handles_init(&s->events, 0);
+		qcu_handles_init(&s->streams, 1);
+		qcu_handles_init(&s->graphs, 1);
+		s->captures = g_hash_table_new_full(NULL, NULL, NULL,
+				(GDestroyNotify)qcu_graph_free);
+		s->pin_guest_ram = qcu->conf.pin_guest_ram;
+		s->pinned = g_hash_table_new(NULL, NULL);
+#endif
+		g_hash_table_insert(qcu->sessions, GUINT_TO_POINTER(id), s);
+		trace_virtio_qcuda_session_new(qcu, id);
+	}
+	s->refcount++;
+	qemu_mutex_unlock(&qcu->session_lock);
+
+	return s;
+}
+
+static void qcu_session_put(VirtIOQC *qcu, QCSession *s)
+{
+	bool last;
+#ifdef CONFIG_CUDA
+	int i;
+#endif
+
+	qemu_mutex_lock(&qcu->session_lock);
+	last = (--s->refcount == 0);
+	qemu_mutex_unlock(&qcu->session_lock);
+
+	if (!last)
+		return;
+
+	g_free(s->device_space);
+	g_hash_table_destroy(s->mmaps);
+	qemu_mutex_destroy(&s->mmap_lock);
+#ifdef CONFIG_CUDA
+	for (i = 0; s->mig != NULL && i < totalDevices; i++)
+		qcu_mig_destroy(s->mig[i]);
+	g_free(s->mig);
+	qcu_handles_destroy(&s->graphs);
+	g_hash_table_destroy(s->captures);
+	qcu_handles_destroy(&s->streams);
+	qcu_handles_destroy(&s->events);
+	g_hash_table_destroy(s->pinned);
+	g_array_free(s->kernels, TRUE);
+	g_hash_table_destroy(s->layouts);
+	g_hash_table_destroy(s->image_gpas);
+	g_hash_table_destroy(s->images);
+	qemu_cond_destroy(&s->load_cond);
+	qemu_mutex_destroy(&s->table_lock);
+#endif
+	qemu_mutex_destroy(&s->lock);
+	qemu_cond_destroy(&s->active_cond);
+	g_free(s);
+}
+
+/* A command of s starts running; it waits while s is being torn down. */
+static void qcu_session_enter(VirtIOQC *qcu, QCSession *s)
+{
+	qemu_mutex_lock(&qcu->session_lock);
+	while (s->quiescing)
+		qemu_cond_wait(&s->active_cond, &qcu->session_lock);
+	s->active++;
+	qemu_mutex_unlock(&qcu->session_lock);
+}
+
+static void qcu_session_leave(VirtIOQC *qcu, QCSession *s)
+{
+	qemu_mutex_lock(&qcu->session_lock);
+	if (--s->active == 0)
+		qemu_cond_broadcast(&s->active_cond);
+	qemu_mutex_unlock(&qcu->session_lock);
+}
+
+/*
+ * Run alone in s: wait until no other command of the session runs on any
+ * queue worker and keep new ones out until qcu_session_resume().  Parked
+ * requests are not running; releasing a device waits for them.
+ */
+static void qcu_session_quiesce(VirtIOQC *qcu, QCSession *s)
+{
+	qemu_mutex_lock(&qcu->session_lock);
+	while (s->quiescing)
+		qemu_cond_wait(&s->active_cond, &qcu->session_lock);
+	s->quiescing = true;
+	while (s->active > 0)
+		qemu_cond_wait(&s->active_cond, &qcu->session_lock);
+	qemu_mutex_unlock(&qcu->session_lock);
+}
+
+static void qcu_session_resume(VirtIOQC *qcu, QCSession *s)
+{
+	qemu_mutex_lock(&qcu->session_lock);
+	s->quiescing = false;
+	qemu_cond_broadcast(&s->active_cond);
+	qemu_mutex_unlock(&qcu->session_lock);
+}
+
+static void qcu_session_release(QCSession *s)
+{
+#ifdef CONFIG_CUDA
+	qcu_session_release_cuda(s);
+#endif
+	g_free(s->device_space);
+	s->device_space = NULL;
+	s->device_space_size = 0;
+	s->device_space_cap = 0;
+}
+
+/* The guest process went away: free what it owned and forget the id, so
+ * that a later process reusing it starts from a clean session.  Nothing
+ * else of the session may run, see qcu_session_quiesce(). */
+static void qcu_session_close(VirtIOQC *qcu, QCSession *s)
+{
+	// a migration may be reading the session's device memory
+	qemu_mutex_lock(&s->lock);
+	qcu_session_release(s);
+	qemu_mutex_unlock(&s->lock);
+
+	qemu_mutex_lock(&qcu->session_lock);
+	if (!s->closed)
+	{
+		s->closed = true;
+		g_hash_table_remove(qcu->sessions, GUINT_TO_POINTER(s->id));
+		s->refcount--;
+		if (qcu->migrating)
+			g_array_append_val(qcu->mig_closed, s->id);
+		trace_virtio_qcuda_session_close(qcu, s->id);
+	}
+	qemu_mutex_unlock(&qcu->session_lock);
+}
+
+/* Only called with all queues drained, so no request holds a session. */
+static void qcu_session_close_all(VirtIOQC *qcu)
+{
+	GHashTableIter iter;
+	gpointer value;
+	GSList *list = NULL, *l;
+
+	qemu_mutex_lock(&qcu->session_lock);
+	g_hash_table_iter_init(&iter, qcu->sessions);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+	{
+		list = g_slist_prepend(list, value);
+	}
+	qemu_mutex_unlock(&qcu->session_lock);
+
+	for (l = list; l != NULL; l = l->next)
+	{
+		QCSession *s = l->data;
+
+		s->refcount++;
+		qcu_session_close(qcu, s);
+		qcu_session_put(qcu, s);
+	}
+	g_slist_free(list);
+}
+
+static int qcu_cmd_write(QCSession *s, VirtioQCArg *arg)
+{
+	void   *src, *dst;
+	uint64_t *gpa_array;
+	uint64_t avail;
+	uint32_t size, len, i;
+
+	size = arg->pASize;
+
+	trace_virtio_qcuda_write(s->id, size);
+
+	// keep the buffer between writes, it only ever grows
+	if( size > s->device_space_cap )
+	{
+		s->device_space = g_realloc(s->device_space, size);
+		s->device_space_cap = size;
+	}
+
+	// more than one kmalloc chunk: pA is the array of chunk addresses
+	if( size > QCU_KMALLOC_MAX_SIZE )
+	{
+		gpa_array = gpa_to_hva_avail(arg->pA, &avail);
+		if (gpa_array == NULL ||
+				avail / sizeof(uint64_t) < DIV_ROUND_UP(size, QCU_KMALLOC_MAX_SIZE))
+			return -1;
+		dst = s->device_space;
+		for(i=0; size>0; i++)
+		{
+			len = MIN(size, QCU_KMALLOC_MAX_SIZE);
+			src = gpa_to_hva_avail(gpa_array[i], &avail);
+			if (src == NULL || avail < len)
+				return -1;
+			memcpy(dst, src, len);
+			size -= len;
+			dst  += len;
+		}
+	}
+	else
+	{
+		src = gpa_to_hva_avail(arg->pA, &avail);
+		if (src == NULL || avail < size)
+			return -1;
+		memcpy(s->device_space, src, size);
+	}
+	s->device_space_size = arg->pASize;
+	// checker ------------------------------------------------------------
+/*
+	uint64_t err;
+	if( s->device_space_size<32 )
+	{
+		for(i=0; i<s->device_space_size; i++)
+		{
+			ptrace("s->device_space[%lu]= %d\n", i, s->device_space[i]);
+		}
+	}
+	else
+	{
+		err = 0;
+		for(i=0; i<s->device_space_size; i++)
+		{
+			if( s->device_space[i] != (i%17)*7 ) err++;
+		}
+		ptrace("error= %llu\n", (unsigned long long)err);
+	}
+	ptrace("\n\n");
+	//---------------------------------------------------------------------
+*/
+	return 0;
+}
+
+static int qcu_cmd_read(QCSession *s, VirtioQCArg *arg)
+{
+	void   *src, *dst;
+	uint64_t *gpa_array;
+	uint64_t avail;
+	uint32_t size, len, i;
+
+	size = arg->pASize;
+	if(s->device_space==NULL || size > s->device_space_size)
+	{
+		return -1;
+	}
+
+	trace_virtio_qcuda_read(s->id, size);
+
+	// same chunking as qcu_cmd_write
+	if( size > QCU_KMALLOC_MAX_SIZE )
+	{
+		gpa_array = gpa_to_hva_avail(arg->pA, &avail);
+		if (gpa_array == NULL ||
+				avail / sizeof(uint64_t) < DIV_ROUND_UP(size, QCU_KMALLOC_MAX_SIZE))
+			return -1;
+		src = s->device_space;
+		for(i=0; size>0; i++)
+		{
+			len = MIN(size, QCU_KMALLOC_MAX_SIZE);
+			dst = gpa_to_hva_avail(gpa_array[i], &avail);
+			if (dst == NULL || avail < len)
+				return -1;
+			memcpy(dst, src, len);
+			qcu_dirty_gpa(NULL, gpa_array[i], len);
+			size -= len;
+			src  += len;
+		}
+	}
+	else
+	{
+		dst = gpa_to_hva_avail(arg->pA, &avail);
+		if (dst == NULL || avail < size)
+			return -1;
+		memcpy(dst, s->device_space, size);
+		qcu_dirty_gpa(NULL, arg->pA, size);
+	}
+
+	return 0;
+}
+
+static int qcu_cmd_mmapctl(QCSession *s, VirtioQCArg *arg)
+{
+	int fd;
+
+	// anonymous shared file of pBSize+1 bytes, mapped by the memcpyAsync path
+	fd = qcu_shm_open(arg->pBSize + 1);
+	if (fd < 0)
+		return -1;
+
+	stl_p(&arg->pA, fd);
+
+	return 0;
+}
+
+static int qcu_cmd_open(QCSession *s, VirtioQCArg *arg)
+{
+	s->block_size = arg->pASize;
+/*
+	int fd=open(VIRTHM_DEV_PATH, O_CREAT|O_RDWR,0666);
+    if(fd<0)
+    {
+        printf("failure to open\n");
+        exit(0);
+    }
+	if(lseek(fd,MAP_MAX_LENGTH-1,SEEK_SET)==-1) //cocotion modified
+    {
+        printf("Failure to lseek\n");
+        exit(0);
+	}
+    if(write(fd, "",1) != 1)
+    {
+        printf("Failure on write\n");
+        exit(0);
+    }
+	stl_p(&arg->pA, fd);
+
+	printf("cocotion open fd: %d in host\n", fd);
+*/
+	//arg->pA = getpid();
+	//printf("pid: %d in host\n", arg->pA);
+
+	//buf = (char*)malloc(sizeof(int)*16*1024*1024); //test
+	return 0;
+
+}
+
+static int qcu_cmd_close(QCSession *s, VirtioQCArg *arg)
+{
+	//free(buf); //cocotion test
+/*
+	int fd = ldl_p(&arg->pA);
+	printf("cocotion close fd: %d in close\n", fd);
+	int resp = close(fd);
+	stl_p(&arg->pB, resp);
+*/
+	return 0;
+}
+
+static int qcu_cmd_mmap(QCSession *s, VirtioQCArg *arg){
+
+	//arg->pA: file fd
+	//arg->pASize: numOfblocks
+	//arg->pB: gpa_array
+
+	int32_t fd = (int32_t)ldl_p(&arg->pA);
+	uint64_t *gpa_array = gpa_to_hva(arg->pB);
+	void *addr;
+	GArray *blocks;
+
+	int i;
+	for(i = 0; i < arg->pASize; i++)
+	{
+		addr = gpa_to_hva(gpa_array[i]);
+		munmap(addr, s->block_size);
+   		mmap(addr, s->block_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, i*s->block_size);
+	}
+
+	blocks = g_array_sized_new(FALSE, FALSE, sizeof(uint64_t), arg->pASize);
+	g_array_append_vals(blocks, gpa_array, arg->pASize);
+	qemu_mutex_lock(&s->mmap_lock);
+	g_hash_table_replace(s->mmaps, GINT_TO_POINTER(fd), blocks);
+	qemu_mutex_unlock(&s->mmap_lock);
+
+
+    return 0;
+}
+
+static int qcu_cmd_munmap(QCSession *s, VirtioQCArg *arg){
+   	// arg->pB: gpa_array
+	// arg->pBSize: numOfblocks
+
+	uint64_t *gpa_array = gpa_to_hva(arg->pB);
+	void *addr;
+
+	int i;
+	for(i = 0; i < arg->pBSize; i++)
+	{
+		addr    = gpa_to_hva(gpa_array[i]);
+		munmap(addr, s->block_size);
+		mmap(addr, s->block_size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+   	}
+
+	return 0;
+
+}
+
+static int qcu_cmd_mmaprelease(QCSession *s, VirtioQCArg *arg)
+{
+	int32_t fd = (int32_t)ldl_p(&arg->pBSize);
+
+	//TODO: safely check
+	qemu_mutex_lock(&s->mmap_lock);
+	g_hash_table_remove(s->mmaps, GINT_TO_POINTER(fd));
+	qemu_mutex_unlock(&s->mmap_lock);
+	close(fd);
+
+	return 0;
+}
+
+struct VirtIOQCReq
+{
+	VirtQueueElement elem;	// must be first, see virtqueue_pop()
+	VirtIOQCQueue *q;
+	QCSession *session;
+	VirtQueue *vq;
+	VirtioQCArg arg;
+	int32_t cmd;	// arg.cmd is overwritten with the status
+	/* get_clock() at pop, enqueue, worker start and end */
+	int64_t t_pop, t_queued, t_start, t_end;
+	int64_t translate_ns;
+	/* extra reply data written after arg, e.g. batch statuses */
+	int32_t *status;
+	uint32_t status_count;
+	/* completion by a stream callback instead of the worker */
+	QCDeferred defer;
+	QSIMPLEQ_ENTRY(VirtIOQCReq) next;
+};
+
+#ifdef CONFIG_CUDA
+/* Stream callback of a parked request; runs on a driver thread and must
+ * not call into CUDA. */
+static void qcu_req_sync_done(CUstream stream, CUresult status, void *opaque)
+{
+	VirtIOQCReq *req = opaque;
+	VirtIOQCQueue *q = req->q;
+
+	req->arg.cmd = status == CUDA_SUCCESS ? cudaSuccess : cudaErrorLaunchFailure;
+	req->t_end = get_clock();
+	if (!qcu_deferred_put(&req->defer))
+		return;
+
+	qemu_mutex_lock(&q->lock);
+	q->deferred--;
+	QSIMPLEQ_INSERT_TAIL(&q->done, req, next);
+	qemu_cond_broadcast(&q->idle_cond);
+	qemu_mutex_unlock(&q->lock);
+	qemu_bh_schedule(q->bh);
+}
+
+/*
+ * Complete req once ev has passed instead of blocking the worker on it.
+ * The wait is queued on a stream of the device's own, followed by a
+ * callback that hands the request back; returns false if that cannot be
+ * set up and the caller has to wait itself.
+ */
+static bool qcu_req_defer(QCSession *s, VirtIOQCReq *req, CUevent ev)
+{
+	CUstream stream;
+	cudaDev *dev;
+
+	if (s->devices == NULL)
+		return false;
+
+	// workers of several queues may get here first at the same time
+	dev = &s->devices[s->device_current];
+	qemu_mutex_lock(&s->table_lock);
+	if (dev->sync_stream == NULL &&
+			cuStreamCreate(&dev->sync_stream, CU_STREAM_NON_BLOCKING) != CUDA_SUCCESS)
+		dev->sync_stream = NULL;
+	stream = dev->sync_stream;
+	qemu_mutex_unlock(&s->table_lock);
+
+	if (stream == NULL || cuStreamWaitEvent(stream, ev, 0) != CUDA_SUCCESS)
+		return false;
+
+	trace_virtio_qcuda_cmd_defer(s->qcu, req, req->cmd);
+	qcu_deferred_arm(&req->defer);
+	if (cuStreamAddCallback(stream, qcu_req_sync_done, req, 0) !=
+			CUDA_SUCCESS)
+	{
+		qcu_deferred_disarm(&req->defer);
+		return false;
+	}
+
+	return true;
+}
+#endif
+
+/* Commands that may free everything the session owns; they must not run
+ * concurrently with any other command of the session. */
+static bool virtio_qcuda_cmd_is_exclusive(int32_t cmd)
+{
+	switch (cmd)
+	{
+		case VIRTQC_CMD_CLOSE:
+#ifdef CONFIG_CUDA
+		case VIRTQC_cudaUnregisterFatBinary:
+#endif
+			return true;
+		default:
+			return false;
+	}
+}
+
+/* Commands that change the shared handle tables or device selection; they
+ * must not run concurrently with each other on different queues. */
+static bool virtio_qcuda_cmd_is_serial(int32_t cmd)
+{
+	switch (cmd)
+	{
+		case VIRTQC_CMD_WRITE:
+		case VIRTQC_CMD_READ:
+		case VIRTQC_CMD_OPEN:
+#ifdef CONFIG_CUDA
+		case VIRTQC_cudaRegisterFatBinary:
+		case VIRTQC_cudaUnregisterFatBinary:
+		case VIRTQC_cudaRegisterFunction:
+		case VIRTQC_CMD_LAUNCH_LAYOUT:
+		case VIRTQC_cudaSetDevice:
+		case VIRTQC_cudaDeviceReset:
+		case VIRTQC_cudaStreamCreate:
+		case VIRTQC_cudaStreamDestroy:
+		case VIRTQC_cudaEventCreate:
+		case VIRTQC_cudaEventCreateWithFlags:
+		case VIRTQC_cudaEventDestroy:
+#endif
+			return true;
+		default:
+			return false;
+	}
+}
+
+#define QC_CMD_NAME(x) case VIRTQC_##x: return #x
+
+static const char *virtio_qcuda_cmd_name(int32_t cmd)
+{
+	switch (cmd)
+	{
+		QC_CMD_NAME(CMD_WRITE);
+		QC_CMD_NAME(CMD_READ);
+		QC_CMD_NAME(CMD_OPEN);
+		QC_CMD_NAME(CMD_CLOSE);
+		QC_CMD_NAME(CMD_MMAP);
+		QC_CMD_NAME(CMD_MUNMAP);
+		QC_CMD_NAME(CMD_MMAPCTL);
+		QC_CMD_NAME(CMD_MMAPRELEASE);
+		QC_CMD_NAME(CMD_BATCH);
+		QC_CMD_NAME(CMD_SHM_MEMCPY);
+		QC_CMD_NAME(CMD_GRAPH_BEGIN);
+		QC_CMD_NAME(CMD_GRAPH_END);
+		QC_CMD_NAME(CMD_GRAPH_LAUNCH);
+		QC_CMD_NAME(CMD_GRAPH_DESTROY);
+		QC_CMD_NAME(CMD_BLOB_LOAD);
+		QC_CMD_NAME(CMD_LAUNCH_LAYOUT);
+		QC_CMD_NAME(CMD_LAUNCH);
+#ifdef CONFIG_CUDA
+		QC_CMD_NAME(cudaRegisterFatBinary);
+		QC_CMD_NAME(cudaUnregisterFatBinary);
+		QC_CMD_NAME(cudaRegisterFunction);
+		QC_CMD_NAME(cudaLaunch);
+		QC_CMD_NAME(cudaMalloc);
+		QC_CMD_NAME(cudaMemset);
+		QC_CMD_NAME(cudaMemcpy);
+		QC_CMD_NAME(cudaMemcpyAsync);
+		QC_CMD_NAME(cudaFree);
+		QC_CMD_NAME(cudaGetDevice);
+		QC_CMD_NAME(cudaGetDeviceCount);
+		QC_CMD_NAME(cudaSetDevice);
+		QC_CMD_NAME(cudaGetDeviceProperties);
+		QC_CMD_NAME(cudaDeviceSynchronize);
+		QC_CMD_NAME(cudaDeviceReset);
+		QC_CMD_NAME(cudaDriverGetVersion);
+		QC_CMD_NAME(cudaRuntimeGetVersion);
+		QC_CMD_NAME(cudaStreamCreate);
+		QC_CMD_NAME(cudaStreamDestroy);
+		QC_CMD_NAME(cudaEventCreate);
+		QC_CMD_NAME(cudaEventCreateWithFlags);
+		QC_CMD_NAME(cudaEventRecord);
+		QC_CMD_NAME(cudaEventSynchronize);
+		QC_CMD_NAME(cudaEventElapsedTime);
+		QC_CMD_NAME(cudaEventDestroy);
+		QC_CMD_NAME(cudaGetLastError);
+		QC_CMD_NAME(cudaHostRegister);
+		QC_CMD_NAME(cudaHostGetDevicePointer);
+		QC_CMD_NAME(cudaHostUnregister);
+		QC_CMD_NAME(cudaSetDeviceFlags);
+#endif
+		default:
+			return "unknown";
+	}
+}
+
+static void virtio_qcuda_latency_add(VirtIOQCLatency *l, int64_t ns)
+{
+	uint64_t us;
+	int b;
+
+	if (ns < 0)
+		ns = 0;
+
+	l->count++;
+	l->total_ns += ns;
+	l->max_ns = MAX(l->max_ns, ns);
+
+	us = ns / 1000;
+	b = us ? 64 - clz64(us) : 0;
+	l->buckets[MIN(b, VIRTIO_QC_STATS_BUCKETS - 1)]++;
+}
+
+static void virtio_qcuda_stats_add(VirtIOQC *qcu, VirtIOQCReq *req, int64_t now)
+{
+	VirtIOQCCmdStats *st;
+
+	st = g_hash_table_lookup(qcu->stats, GINT_TO_POINTER(req->cmd));
+	if (st == NULL)
+	{
+		st = g_new0(VirtIOQCCmdStats, 1);
+		st->cmd = req->cmd;
+		g_hash_table_insert(qcu->stats, GINT_TO_POINTER(req->cmd), st);
+	}
+
+	st->count++;
+	virtio_qcuda_latency_add(&st->phase[VIRTIO_QC_PHASE_QUEUE],
+			req->t_start - req->t_queued);
+	virtio_qcuda_latency_add(&st->phase[VIRTIO_QC_PHASE_TRANSLATE],
+			req->t_queued - req->t_pop + req->translate_ns);
+	virtio_qcuda_latency_add(&st->phase[VIRTIO_QC_PHASE_EXECUTE],
+			req->t_end - req->t_start - req->translate_ns);
+	virtio_qcuda_latency_add(&st->phase[VIRTIO_QC_PHASE_COMPLETE],
+			now - req->t_end);
+}
+
+/* Wait for the device's share of GPU time before a launch or a copy. */
+static void virtio_qcuda_qos_charge(VirtIOQC *qcu, QCSession *s,
+		VirtioQCArg *arg)
+{
+#ifdef CONFIG_CUDA
+	QCGraphExec *ge;
+	uint64_t n;
+
+	switch (arg->cmd)
+	{
+		case VIRTQC_cudaLaunch:
+		case VIRTQC_CMD_LAUNCH:
+			qcu_qos_wait(&qcu->qos, QCU_QOS_LAUNCH, 1);
+			break;
+
+		case VIRTQC_CMD_GRAPH_LAUNCH:
+			// every node is a launch or a copy; the node count is fixed
+			ge = qcu_graph_exec_get(s, arg->pA);
+			n = ge != NULL ? ge->graph->nodes->len : 1;
+			if (ge != NULL)
+				qcu_graph_exec_put(ge);
+			qcu_qos_wait(&qcu->qos, QCU_QOS_LAUNCH, n);
+			break;
+
+		case VIRTQC_cudaMemcpy:
+		case VIRTQC_cudaMemcpyAsync:
+			n = arg->flag == cudaMemcpyDeviceToHost ? arg->pASize : arg->pBSize;
+			qcu_qos_wait(&qcu->qos, QCU_QOS_COPY, n);
+			break;
+
+		case VIRTQC_CMD_SHM_MEMCPY:
+			qcu_qos_wait(&qcu->qos, QCU_QOS_COPY, arg->pBSize);
+			break;
+
+		// writes device memory at copy speed
+		case VIRTQC_cudaMemset:
+			qcu_qos_wait(&qcu->qos, QCU_QOS_COPY, arg->pASize);
+			break;
+	}
+#endif
+}
+
+/* req is NULL when the call cannot complete later, e.g. inside a batch */
+static void virtio_qcuda_cmd_exec(VirtIOQC *qcu, QCSession *s,
+		VirtioQCArg *arg, VirtIOQCReq *req)
+{
+	bool serial = virtio_qcuda_cmd_is_serial(arg->cmd);
+	bool exclusive = virtio_qcuda_cmd_is_exclusive(arg->cmd);
+
+	virtio_qcuda_qos_charge(qcu, s, arg);
+
+	if (exclusive)
+		qcu_session_quiesce(qcu, s);
+	else
+		qcu_session_enter(qcu, s);
+	if (serial)
+		qemu_mutex_lock(&s->lock);
+
+#ifdef CONFIG_CUDA
+	if (arg->cmd != VIRTQC_cudaRegisterFatBinary)
+		qcu_bind_context(s);
+#endif
+
+	// handlers use guest RAM through gpa_to_hva until they return
+	rcu_read_lock();
+	switch( arg->cmd )
+	{
+		case VIRTQC_CMD_WRITE:
+			qcu_cmd_write(s, arg);
+			break;
+
+		case VIRTQC_CMD_READ:
+			qcu_cmd_read(s, arg);
+			break;
+
+		case VIRTQC_CMD_OPEN:
+			qcu_cmd_open(s, arg);
+			break;
+
+		case VIRTQC_CMD_CLOSE:
+			qcu_cmd_close(s, arg);
+			break;
+
+		case VIRTQC_CMD_MMAP:
+			qcu_cmd_mmap(s, arg);
+			break;
+
+		case VIRTQC_CMD_MUNMAP:
+			qcu_cmd_munmap(s, arg);
+			break;
+
+		case VIRTQC_CMD_MMAPCTL:
+			qcu_cmd_mmapctl(s, arg);
+			break;
+
+		case VIRTQC_CMD_MMAPRELEASE:
+			qcu_cmd_mmaprelease(s, arg);
+			break;
+
+#ifdef CONFIG_CUDA
+		// Module & Execution control (driver API)
+		case VIRTQC_cudaRegisterFatBinary:
+			qcu_cudaRegisterFatBinary(s, arg);
+			break;
+
+		case VIRTQC_cudaUnregisterFatBinary:
+			qcu_cudaUnregisterFatBinary(s, arg);
+			break;
+
+		case VIRTQC_cudaRegisterFunction:
+			qcu_cudaRegisterFunction(s, arg);
+			break;
+
+		case VIRTQC_cudaLaunch:
+			qcu_cudaLaunch(s, arg);
+			break;
+
+		case VIRTQC_CMD_LAUNCH_LAYOUT:
+			qcu_cmd_launch_layout(s, arg);
+			break;
+
+		case VIRTQC_CMD_LAUNCH:
+			qcu_cmd_launch(s, arg);
+			break;
+
+		// Memory Management (runtime API)
+		case VIRTQC_cudaMalloc:
+			qcu_cudaMalloc(s, arg);
+			break;
+
+		case VIRTQC_cudaMemset:
+			qcu_cudaMemset(s, arg);
+			break;
+
+		case VIRTQC_cudaMemcpy:
+			qcu_cudaMemcpy(s, arg);
+			break;
+
+		case VIRTQC_cudaMemcpyAsync:
+			qcu_cudaMemcpyAsync(s, arg);
+			break;
+
+		case VIRTQC_CMD_SHM_MEMCPY:
+			qcu_cmd_shm_memcpy(s, arg);
+			break;
+
+		case VIRTQC_CMD_GRAPH_BEGIN:
+			qcu_cmd_graph_begin(s, arg);
+			break;
+
+		case VIRTQC_CMD_GRAPH_END:
+			qcu_cmd_graph_end(s, arg);
+			break;
+
+		case VIRTQC_CMD_GRAPH_LAUNCH:
+			qcu_cmd_graph_launch(s, arg);
+			break;
+
+		case VIRTQC_CMD_GRAPH_DESTROY:
+			qcu_cmd_graph_destroy(s, arg);
+			break;
+
+		case VIRTQC_CMD_BLOB_LOAD:
+			qcu_cmd_blob_load(s, arg);
+			break;
+
+		case VIRTQC_cudaFree:
+			qcu_cudaFree(s, arg);
+			break;
+
+		// Device Management (runtime API)
+		case VIRTQC_cudaGetDevice:
+			qcu_cudaGetDevice(s, arg);
+			break;
+
+		case VIRTQC_cudaGetDeviceCount:
+			qcu_cudaGetDeviceCount(s, arg);
+			break;
+
+		case VIRTQC_cudaSetDevice:
+			qcu_cudaSetDevice(s, arg);
+			break;
+
+		case VIRTQC_cudaGetDeviceProperties:
+			qcu_cudaGetDeviceProperties(s, arg);
+			break;
+
+		case VIRTQC_cudaDeviceSynchronize:
+			qcu_cudaDeviceSynchronize(s, arg, req);
+			break;
+
+		case VIRTQC_cudaDeviceReset:
+			qcu_cudaDeviceReset(s, arg);
+			break;
+
+		// Version Management (runtime API)
+		case VIRTQC_cudaDriverGetVersion:
+			qcu_cudaDriverGetVersion(s, arg);
+			break;
+
+		case VIRTQC_cudaRuntimeGetVersion:
+			qcu_cudaRuntimeGetVersion(s, arg);
+			break;
+///////////////////////////////////////////////
+	//	case VIRTQC_checkCudaCapabilities:
+	//		qcu_checkCudaCapabilities(s, arg);
+///////////////////////////////////////////////
+
+		//stream
+		case VIRTQC_cudaStreamCreate:
+			qcu_cudaStreamCreate(s, arg);
+			break;
+
+		case VIRTQC_cudaStreamDestroy:
+			qcu_cudaStreamDestroy(s, arg);
+			break;
+
+		// Event Management (runtime API)
+		case VIRTQC_cudaEventCreate:
+			qcu_cudaEventCreate(s, arg);
+			break;
+
+		case VIRTQC_cudaEventCreateWithFlags:
+			qcu_cudaEventCreateWithFlags(s, arg);
+			break;
+
+		case VIRTQC_cudaEventRecord:
+			qcu_cudaEventRecord(s, arg);
+			break;
+
+		case VIRTQC_cudaEventSynchronize:
+			qcu_cudaEventSynchronize(s, arg, req);
+			break;
+
+		case VIRTQC_cudaEventElapsedTime:
+			qcu_cudaEventElapsedTime(s, arg);
+			break;
+
+		case VIRTQC_cudaEventDestroy:
+			qcu_cudaEventDestroy(s, arg);
+			break;
+
+		// Error Handling (runtime API)
+		case VIRTQC_cudaGetLastError:
+			qcu_cudaGetLastError(s, arg);
+			break;
+
+		//zero-copy
+		case VIRTQC_cudaHostRegister:
+			qcu_cudaHostRegister(s, arg);
+			break;
+
+		case VIRTQC_cudaHostGetDevicePointer:
+			qcu_cudaHostGetDevicePointer(s, arg);
+			break;
+
+		case VIRTQC_cudaHostUnregister:
+			qcu_cudaHostUnregister(s, arg);
+			break;
+
+		case VIRTQC_cudaSetDeviceFlags:
+			qcu_cudaSetDeviceFlags(s, arg);
+			break;
+
+		//case VIRTQC_cudaFreeHost:
+		//	qcu_cudaFreeHost(s, arg);
+		//	break;
+
+#endif
+		default:
+			error("unknow cmd= %d\n", arg->cmd);
+	}
+	rcu_read_unlock();
+
+	if (serial)
+		qemu_mutex_unlock(&s->lock);
+
+	if (arg->cmd == VIRTQC_CMD_CLOSE)
+		qcu_session_close(qcu, s);
+
+	if (exclusive)
+		qcu_session_resume(qcu, s);
+	else
+		qcu_session_leave(qcu, s);
+}
+
+/* Calls whose only result is a status; these are the ones a guest may put
+ * in a VIRTQC_CMD_BATCH. */
+static bool virtio_qcuda_cmd_batchable(int32_t cmd)
+{
+	switch (cmd)
+	{
+#ifdef CONFIG_CUDA
+		case VIRTQC_cudaLaunch:
+		case VIRTQC_CMD_LAUNCH:
+		case VIRTQC_cudaMemset:
+		case VIRTQC_cudaMemcpyAsync:
+		case VIRTQC_cudaEventRecord:
+		case VIRTQC_CMD_SHM_MEMCPY:
+		case VIRTQC_CMD_GRAPH_LAUNCH:
+			return true;
+#endif
+		default:
+			return false;
+	}
+}
+
+/* Run every entry of a batch in order and collect one status per entry;
+ * the element is completed once, with a single notification. */
+static void virtio_qcuda_batch_exec(VirtIOQC *qcu, VirtIOQCReq *req)
+{
+	VirtioQCArg *entries;
+	uint32_t i, count;
+	size_t off, len;
+	int32_t first = 0;
+
+	count = req->arg.pASize;
+	off = sizeof(VirtioQCArg) + sizeof(VirtIOQCArgExt);
+	len = (size_t)count * sizeof(VirtioQCArg);
+
+	if (count == 0 || count > VIRTIO_QC_BATCH_MAX ||
+			iov_size(req->elem.out_sg, req->elem.out_num) < off + len)
+	{
+		error("malformed batch of %u entries\n", count);
+		req->arg.cmd = VIRTIO_QC_BATCH_EINVAL;
+		return;
+	}
+
+	entries = g_new(VirtioQCArg, count);
+	iov_to_buf(req->elem.out_sg, req->elem.out_num, off, entries, len);
+
+	req->status = g_new(int32_t, count);
+	req->status_count = count;
+
+	for (i = 0; i < count; i++)
+	{
+		if (virtio_qcuda_cmd_batchable(entries[i].cmd))
+		{
+			virtio_qcuda_cmd_exec(qcu, req->session, &entries[i], NULL);
+			req->status[i] = entries[i].cmd;
+		}
+		else
+			req->status[i] = VIRTIO_QC_BATCH_EINVAL;
+
+		if (first == 0)
+			first = req->status[i];
+	}
+
+	req->arg.cmd = first;
+	g_free(entries);
+}
+
+static void virtio_qcuda_req_exec(VirtIOQC *qcu, VirtIOQCReq *req)
+{
+	if (req->arg.cmd == VIRTQC_CMD_BATCH)
+		virtio_qcuda_batch_exec(qcu, req);
+	else
+		virtio_qcuda_cmd_exec(qcu, req->session, &req->arg, req);
+}
+
+/* Runs in the main loop: hand finished requests back to the guest. */
+static void virtio_qcuda_complete_bh(void *opaque)
+{
+	VirtIOQCQueue *q = opaque;
+	VirtIODevice *vdev = VIRTIO_DEVICE(q->qcu);
+	QSIMPLEQ_HEAD(, VirtIOQCReq) done;
+	uint16_t filled[VIRTIO_QC_MAX_QUEUES] = { 0 };
+	VirtIOQCReq *req;
+	VirtQueue *vq;
+	size_t len;
+	int64_t now;
+	uint32_t i;
+
+	QSIMPLEQ_INIT(&done);
+	qemu_mutex_lock(&q->lock);
+	QSIMPLEQ_CONCAT(&done, &q->done);
+	qemu_mutex_unlock(&q->lock);
+
+	while ((req = QSIMPLEQ_FIRST(&done)) != NULL)
+	{
+		QSIMPLEQ_REMOVE_HEAD(&done, next);
+		len = iov_from_buf(req->elem.in_sg, req->elem.in_num, 0,
+				&req->arg, sizeof(VirtioQCArg));
+		if (req->status != NULL)
+			len += iov_from_buf(req->elem.in_sg, req->elem.in_num, len,
+					req->status, req->status_count * sizeof(int32_t));
+		i = virtio_get_queue_index(req->vq);
+		virtqueue_fill(req->vq, &req->elem, len, filled[i]++);
+
+		now = get_clock();
+		virtio_qcuda_stats_add(q->qcu, req, now);
+		trace_virtio_qcuda_cmd_complete(q->qcu, req, req->cmd, req->arg.cmd,
+				now - req->t_pop);
+
+		qcu_session_put(q->qcu, req->session);
+		g_free(req->status);
+		virtqueue_element_free(&req->elem);
+	}
+
+	/* one used index update and at most one interrupt per ring, however
+	 * many requests finished; with EVENT_IDX the guest decides */
+	for (i = 0; i < q->qcu->conf.num_queues; i++)
+	{
+		if (filled[i] == 0)
+			continue;
+		vq = virtio_get_queue(vdev, i);
+		virtqueue_flush(vq, filled[i]);
+		virtio_notify(vdev, vq);
+	}
+}
+
+static void *virtio_qcuda_worker(void *opaque)
+{
+	VirtIOQCQueue *q = opaque;
+	VirtIOQCReq *req;
+
+	rcu_register_thread();
+#ifdef CONFIG_CUDA
+	qcu_launch_arena = &q->arena;
+#endif
+
+	qemu_mutex_lock(&q->lock);
+	while (!q->stopping)
+	{
+		req = QSIMPLEQ_FIRST(&q->pending);
+		if (req == NULL)
+		{
+			q->busy = false;
+			qemu_cond_broadcast(&q->idle_cond);
+			qemu_cond_wait(&q->cond, &q->lock);
+			continue;
+		}
+		QSIMPLEQ_REMOVE_HEAD(&q->pending, next);
+		q->busy = true;
+		qemu_mutex_unlock(&q->lock);
+
+		req->t_start = get_clock();
+		qcu_translate_ns = 0;
+		trace_virtio_qcuda_cmd_exec(q->qcu, req, req->cmd,
+				virtio_qcuda_cmd_name(req->cmd));
+		virtio_qcuda_req_exec(q->qcu, req);
+		req->translate_ns = qcu_translate_ns;
+
+		if (!qcu_deferred_armed(&req->defer))
+			req->t_end = get_clock();
+		else if (!qcu_deferred_put(&req->defer))
+		{
+			// parked, the stream callback completes it
+			qemu_mutex_lock(&q->lock);
+			q->deferred++;
+			continue;
+		}
+
+		qemu_mutex_lock(&q->lock);
+		QSIMPLEQ_INSERT_TAIL(&q->done, req, next);
+		qemu_bh_schedule(q->bh);
 	}
-/*
-	uint32_t size, len, i;
+	q->busy = false;
+	qemu_cond_broadcast(&q->idle_cond);
+	qemu_mutex_unlock(&q->lock);
 
-	cudaError_t err;
-	void *dst, *src;
-	uint64_t *gpa_array;
+	rcu_unregister_thread();
+	return NULL;
+}
 
-	cudaStream_t stream = (cudaStream_t)arg->rnd;
+/* Pick the worker for a request: commands bound to a guest stream always
+ * go to that stream's queue, everything else stays where it arrived. */
+static VirtIOQCQueue *virtio_qcuda_cmd_queue(VirtIOQC *qcu, VirtIOQCQueue *q,
+		VirtioQCArg *arg)
+{
+	uint64_t stream;
+#ifdef CONFIG_CUDA
+	uint64_t *conf;
+#endif
 
-	if( arg->flag == cudaMemcpyHostToDevice )
+	switch (arg->cmd)
 	{
-		dst = (void*)arg->pA;
-		size = arg->pBSize;
-
-        gpa_array = gpa_to_hva(arg->pB);
+#ifdef CONFIG_CUDA
+		case VIRTQC_cudaLaunch:
+		case VIRTQC_CMD_LAUNCH:
+			conf = gpa_to_hva(arg->pA);
+			if (conf == NULL)
+				return q;
+			stream = conf[7];
+			break;
 
-		uint32_t offset   	 = arg->pASize;
-		uint32_t start_offset = offset%BLOCK_SIZE;
-		uint32_t rsize = BLOCK_SIZE - start_offset;
+		case VIRTQC_cudaMemcpyAsync:
+		case VIRTQC_CMD_SHM_MEMCPY:
+		case VIRTQC_CMD_GRAPH_BEGIN:
+		case VIRTQC_CMD_GRAPH_END:
+		case VIRTQC_CMD_GRAPH_LAUNCH:
+		case VIRTQC_CMD_GRAPH_DESTROY:
+			stream = arg->rnd;
+			break;
 
-		src = gpa_to_hva(gpa_array[0]);
-        len = MIN(size, rsize);
-		err = cudaMemcpyAsync(dst, src, len, cudaMemcpyHostToDevice, stream);
+		case VIRTQC_cudaEventRecord:
+			stream = arg->pB;
+			break;
+#endif
+		default:
+			return q;
+	}
 
-		size -= len;
-		dst += len;
+	return &qcu->queues[virtio_qcuda_stream_queue(stream, qcu->conf.num_queues)];
+}
 
-		for(i=0; size>0; i++)
-        {
-        	src = gpa_to_hva(gpa_array[i+1]);
-            len = MIN(size, BLOCK_SIZE);
-			err = cudaMemcpyAsync(dst, src, len, cudaMemcpyHostToDevice, stream);
+static void virtio_qcuda_queue_kick(VirtIOQCQueue *q)
+{
+	qemu_mutex_lock(&q->lock);
+	qemu_cond_signal(&q->cond);
+	qemu_mutex_unlock(&q->lock);
+}
 
-			size -= len;
-            dst  += len;
-        }
+/* Hand everything on q's ring to the workers; called with the iothread
+ * lock held.  Returns the number of requests. */
+static uint32_t virtio_qcuda_queue_pop(VirtIOQC *qcu, VirtIOQCQueue *q)
+{
+	VirtIODevice *vdev = VIRTIO_DEVICE(qcu);
+	VirtQueue *vq = q->vq;
+	VirtIOQCQueue *target;
+	unsigned long kicked[BITS_TO_LONGS(VIRTIO_QC_MAX_QUEUES)] = { 0 };
+	VirtIOQCArgExt ext;
+	VirtIOQCReq *req;
+	uint32_t i, session, n = 0;
+
+	for (;;)
+	{
+		req = virtqueue_pop(vq, sizeof(VirtIOQCReq));
+		if (req == NULL)
+			break;
+		// recycled from the queue's pool, only the element is set up
+		memset((uint8_t *)req + sizeof(req->elem), 0,
+				sizeof(*req) - sizeof(req->elem));
+		req->t_pop = get_clock();
+		req->vq = vq;
+		iov_to_buf(req->elem.out_sg, req->elem.out_num, 0,
+				&req->arg, sizeof(VirtioQCArg));
+		req->cmd = req->arg.cmd;
+
+		session = 0;
+		if (iov_to_buf(req->elem.out_sg, req->elem.out_num,
+					sizeof(VirtioQCArg), &ext, sizeof(ext)) == sizeof(ext))
+			session = virtio_ldl_p(vdev, &ext.session);
+		req->session = qcu_session_get(qcu, session);
+
+		target = virtio_qcuda_cmd_queue(qcu, q, &req->arg);
+		req->q = target;
+		trace_virtio_qcuda_cmd_queue(qcu, req, req->cmd, session, target->index);
+		req->t_queued = get_clock();
+
+		qemu_mutex_lock(&target->lock);
+		QSIMPLEQ_INSERT_TAIL(&target->pending, req, next);
+		qemu_mutex_unlock(&target->lock);
+		set_bit(target->index, kicked);
+		n++;
 	}
-	else if(arg->flag == cudaMemcpyDeviceToHost )
+
+	for (i = 0; i < qcu->conf.num_queues; i++)
 	{
-		src = (void*)arg->pB;
-		size = arg->pASize;
+		if (test_bit(i, kicked))
+			virtio_qcuda_queue_kick(&qcu->queues[i]);
+	}
 
-		gpa_array = gpa_to_hva(arg->pA);
+	return n;
+}
 
-		uint32_t offset   	 = arg->pBSize;
-		uint32_t start_offset = offset%BLOCK_SIZE;
-		uint32_t rsize = BLOCK_SIZE - start_offset;
+/* A kick that reached the main loop (or a vCPU): the doorbell thread does
+ * not own the ioeventfds, but it can still poll after this request. */
+static void virtio_qcuda_cmd_handle(VirtIODevice *vdev, VirtQueue *vq)
+{
+	VirtIOQC *qcu = VIRTIO_QC(vdev);
+	VirtIOQCDoorbell *db = &qcu->doorbell;
 
-		dst = gpa_to_hva(gpa_array[0]);
-        len = MIN(size, rsize);
-		err = cudaMemcpyAsync(dst, src, len, cudaMemcpyDeviceToHost, stream);
+	virtio_qcuda_queue_pop(qcu, &qcu->queues[virtio_get_queue_index(vq)]);
+	if (qcu->conf.poll_us > 0 && !db->polling)
+		event_notifier_set(&db->wake);
+}
 
-		size -= len;
-		src+=len;
+//####################################################################
+//   doorbell
+//####################################################################
 
-		for(i=0; size>0; i++)
-        {
-        	dst = gpa_to_hva(gpa_array[i+1]);
-            len = MIN(size, BLOCK_SIZE);
-			err = cudaMemcpyAsync(dst, src, len, cudaMemcpyDeviceToHost, stream);
+static bool virtio_qcuda_doorbell_ready(VirtIOQC *qcu)
+{
+	VirtIODevice *vdev = VIRTIO_DEVICE(qcu);
 
-			size -= len;
-            src  += len;
-        }
+	return vdev->vm_running && (vdev->status & VIRTIO_CONFIG_S_DRIVER_OK) &&
+		!atomic_read(&qcu->doorbell.stopping);
+}
+
+/* Turn guest notifications off on every ring while polling, and back on
+ * when done; under the iothread lock. */
+static void virtio_qcuda_poll_set(VirtIOQC *qcu, bool on)
+{
+	VirtQueue *vq;
+	uint32_t i;
+
+	if (qcu->doorbell.polling == on)
+		return;
+	for (i = 0; i < qcu->conf.num_queues; i++)
+	{
+		vq = qcu->queues[i].vq;
+		if (virtio_queue_ready(vq))
+			virtio_queue_set_notification(vq, !on);
 	}
-	else if( arg->flag == cudaMemcpyDeviceToDevice )
+	qcu->doorbell.polling = on;
+}
+
+/* Where to watch each ring's avail index without the iothread lock, and
+ * the value that means there is nothing new.  Called with the iothread
+ * lock held and inside an RCU read section; the pointers are good until
+ * that section ends or the returned map is replaced. */
+static QCGpaMap *virtio_qcuda_poll_snapshot(VirtIOQC *qcu, uint16_t **avail,
+		uint16_t *last)
+{
+	VirtIODevice *vdev = VIRTIO_DEVICE(qcu);
+	hwaddr addr;
+	uint32_t i;
+
+	for (i = 0; i < qcu->conf.num_queues; i++)
 	{
-		dst = (void*)arg->pA;
-		src = (void*)arg->pB;
-		size = arg->pBSize;
-		cudaError(( err = cudaMemcpyAsync(dst, src, size, cudaMemcpyDeviceToDevice, stream)));
+		addr = virtio_queue_get_avail_addr(vdev, i);
+		avail[i] = NULL;
+		if (addr != 0)
+			avail[i] = gpa_to_hva(addr + offsetof(struct vring_avail, idx));
+		last[i] = virtio_queue_get_last_avail_idx(vdev, i);
 	}
 
-	arg->cmd = err;
-*/
-	arg->cmd = err;
+	return atomic_rcu_read(&qcu_gpa_map);
 }
 
-
-static void qcu_cudaFree(VirtioQCArg *arg)
+/*
+ * Pop what the kicked rings hold and, with polling on, keep watching all
+ * rings until they have been empty for poll_us.  The rings are peeked at
+ * without the iothread lock, inside an RCU read section that keeps the
+ * snapshot valid; the lock is only taken when there is work or the
+ * memory map changed.
+ */
+static void virtio_qcuda_doorbell_run(VirtIOQC *qcu,
+		const unsigned long *rings)
 {
-	cudaError_t err;
-	void* dst;
-	pfunc();
+	VirtIODevice *vdev = VIRTIO_DEVICE(qcu);
+	VirtIOQCDoorbell *db = &qcu->doorbell;
+	int64_t poll_ns = (int64_t)qcu->conf.poll_us * SCALE_US;
+	unsigned long busy[BITS_TO_LONGS(VIRTIO_QC_MAX_QUEUES)];
+	uint16_t *avail[VIRTIO_QC_MAX_QUEUES];
+	uint16_t last[VIRTIO_QC_MAX_QUEUES];
+	QCGpaMap *map;
+	int64_t start, now, deadline;
+	uint32_t i, found = 0;
+	bool any, remap;
+
+	qemu_mutex_lock_iothread();
+	if (!virtio_qcuda_doorbell_ready(qcu))
+	{
+		qemu_mutex_unlock_iothread();
+		return;
+	}
+	for (i = 0; i < qcu->conf.num_queues; i++)
+	{
+		if (test_bit(i, rings))
+			virtio_qcuda_queue_pop(qcu, &qcu->queues[i]);
+	}
+	if (poll_ns == 0)
+	{
+		qemu_mutex_unlock_iothread();
+		return;
+	}
+	virtio_qcuda_poll_set(qcu, true);
+	rcu_read_lock();
+	map = virtio_qcuda_poll_snapshot(qcu, avail, last);
+	qemu_mutex_unlock_iothread();
+
+	start = get_clock();
+	deadline = start + poll_ns;
+	for (;;)
+	{
+		any = false;
+		remap = atomic_rcu_read(&qcu_gpa_map) != map;
+		bitmap_zero(busy, VIRTIO_QC_MAX_QUEUES);
+		for (i = 0; !remap && i < qcu->conf.num_queues; i++)
+		{
+			if (avail[i] != NULL &&
+					virtio_tswap16(vdev, atomic_read(avail[i])) != last[i])
+			{
+				set_bit(i, busy);
+				any = true;
+			}
+		}
+		now = get_clock();
+		if (!any && !remap && now < deadline)
+		{
+			cpu_relax();
+			continue;
+		}
 
-	dst = (void*)arg->pA;
-	cudaError((err = cudaFree(dst)));
-	//cudaError((err = cuMemFree(dst)));
-	arg->cmd = err;
+		// the RCU section is not held while waiting for the lock
+		rcu_read_unlock();
+		qemu_mutex_lock_iothread();
+		// a reset or a VM stop ends the window and turns notifications on
+		if (!db->polling || !virtio_qcuda_doorbell_ready(qcu))
+		{
+			virtio_qcuda_poll_set(qcu, false);
+			qemu_mutex_unlock_iothread();
+			break;
+		}
+		if (!any && now >= deadline)
+		{
+			// notifications on first, then catch what raced with that
+			virtio_qcuda_poll_set(qcu, false);
+			for (i = 0; i < qcu->conf.num_queues; i++)
+			{
+				if (virtio_queue_ready(qcu->queues[i].vq) &&
+						!virtio_queue_empty(qcu->queues[i].vq))
+				{
+					set_bit(i, busy);
+					any = true;
+				}
+			}
+			if (!any)
+			{
+				qemu_mutex_unlock_iothread();
+				break;
+			}
+			virtio_qcuda_poll_set(qcu, true);
+		}
+		for (i = 0; i < qcu->conf.num_queues; i++)
+		{
+			if (test_bit(i, busy))
+				found += virtio_qcuda_queue_pop(qcu, &qcu->queues[i]);
+		}
+		rcu_read_lock();
+		map = virtio_qcuda_poll_snapshot(qcu, avail, last);
+		qemu_mutex_unlock_iothread();
+		if (any)
+			deadline = get_clock() + poll_ns;
+	}
 
-	ptrace("ptr= %16p\n", dst);
+	trace_virtio_qcuda_poll(qcu, get_clock() - start, found);
 }
 
-////////////////////////////////////////////////////////////////////////////////
-///	Device Management
-////////////////////////////////////////////////////////////////////////////////
-
-static void qcu_cudaGetDevice(VirtioQCArg *arg)
+static void *virtio_qcuda_doorbell(void *opaque)
 {
-	cudaError_t err;
-//	int device;
-	pfunc();
+	VirtIOQC *qcu = opaque;
+	VirtIOQCDoorbell *db = &qcu->doorbell;
+	GPollFD fds[VIRTIO_QC_MAX_QUEUES + 1];
+	unsigned long rings[BITS_TO_LONGS(VIRTIO_QC_MAX_QUEUES)];
+	EventNotifier *n;
+	uint32_t i, nfds;
 
-	//cudaError((err = cudaGetDevice( &device )));
-	err = 0;
-	arg->cmd = err;
-	//arg->pA = (uint64_t)device;
-	arg->pA = (uint64_t)cudaDeviceCurrent;
+	rcu_register_thread();
 
+	qemu_mutex_lock(&db->lock);
+	while (!db->stopping)
+	{
+		memset(fds, 0, sizeof(fds));
+		fds[0].fd = event_notifier_get_fd(&db->wake);
+		fds[0].events = G_IO_IN;
+		nfds = 1;
+		for (i = 0; db->notifiers && i < qcu->conf.num_queues; i++)
+		{
+			n = virtio_queue_get_host_notifier(qcu->queues[i].vq);
+			fds[nfds].fd = event_notifier_get_fd(n);
+			fds[nfds].events = G_IO_IN;
+			nfds++;
+		}
+		db->in_poll = true;
+		qemu_mutex_unlock(&db->lock);
 
-	ptrace("device= %d\n", (int)cudaDeviceCurrent);
-}
+		qemu_poll_ns(fds, nfds, -1);
 
-static void qcu_cudaGetDeviceCount(VirtioQCArg *arg)
-{
-	cudaError_t err;
-	int device;
-	pfunc();
+		qemu_mutex_lock(&db->lock);
+		event_notifier_test_and_clear(&db->wake);
+		bitmap_zero(rings, VIRTIO_QC_MAX_QUEUES);
+		for (i = 1; i < nfds; i++)
+		{
+			n = virtio_queue_get_host_notifier(qcu->queues[i - 1].vq);
+			if (fds[i].revents && event_notifier_test_and_clear(n))
+				set_bit(i - 1, rings);
+		}
+		// the notifiers may go away from here on
+		db->in_poll = false;
+		qemu_cond_broadcast(&db->cond);
+		if (db->stopping)
+			break;
+		qemu_mutex_unlock(&db->lock);
 
-	cudaError((err = cudaGetDeviceCount( &device )));
-	arg->cmd = err;
-	arg->pA = (uint64_t)device;
+		virtio_qcuda_doorbell_run(qcu, rings);
+
+		qemu_mutex_lock(&db->lock);
+	}
+	qemu_mutex_unlock(&db->lock);
 
-	ptrace("device count=%d\n", device);
+	rcu_unregister_thread();
+	return NULL;
 }
 
-static void qcu_cudaSetDevice(VirtioQCArg *arg)
+/*
+ * Take the ioeventfds over from the transport while the driver is up and
+ * the VM runs, and give them back otherwise; like vhost, this needs KVM.
+ * Without them kicks keep arriving in virtio_qcuda_cmd_handle().
+ */
+static void virtio_qcuda_doorbell_set(VirtIOQC *qcu, bool start)
 {
-	cudaError_t err;
-	int device;
-	pfunc();
+	VirtIODevice *vdev = VIRTIO_DEVICE(qcu);
+	BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+	VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+	VirtIOQCDoorbell *db = &qcu->doorbell;
+	uint32_t i;
+	int ret;
 
-	device = (int)arg->pA;
-	cudaDeviceCurrent = device;
+	if (!db->running)
+		return;
+	if (!start)
+		virtio_qcuda_poll_set(qcu, false);
+	if (db->notifiers == start || !kvm_has_many_ioeventfds() ||
+			!k->set_host_notifier)
+		return;
 
-	if( device >= totalDevices )
+	if (!start)
 	{
-		arg->cmd = cudaErrorInvalidDevice;
-		ptrace("error setting device= %d\n", device);
-	} else {
-		if( !memcmp( &zeroedDevice, &cudaDevices[device], sizeof(cudaDev) ) ) // device was reset therefore no context
+		qemu_mutex_lock(&db->lock);
+		db->notifiers = false;
+		event_notifier_set(&db->wake);
+		while (db->in_poll)
+			qemu_cond_wait(&db->cond, &db->lock);
+		qemu_mutex_unlock(&db->lock);
+
+		for (i = 0; i < qcu->conf.num_queues; i++)
+			k->set_host_notifier(qbus->parent, i, false);
+		return;
+	}
+
+	for (i = 0; i < qcu->conf.num_queues; i++)
+	{
+		ret = k->set_host_notifier(qbus->parent, i, true);
+		if (ret < 0)
 		{
-			printf("::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::\n\n");
-			cuError( cuDeviceGet(&cudaDevices[device].device, device) );
-			cuError( cuCtxCreate(&cudaDevices[device].context, 0, cudaDevices[device].device) );
-		} else {
-			// cuError( cuCtxPopCurrent(&cudaDevices[cudaDeviceCurrent].context) );
-			// cuError( cuCtxPushCurrent(cudaDevices[device].context) );
-			cuError( cuCtxSetCurrent(cudaDevices[device].context) );
-			printf("***************************************************************\n");
-			printf("cuda device %d\n", cudaDevices[device].device);
+			error_report("virtio-qcuda: cannot use ioeventfd for queue %u: %s",
+					i, strerror(-ret));
+			while (i-- > 0)
+				k->set_host_notifier(qbus->parent, i, false);
+			return;
 		}
+	}
+	qemu_mutex_lock(&db->lock);
+	db->notifiers = true;
+	qemu_mutex_unlock(&db->lock);
+	event_notifier_set(&db->wake);
+}
 
-		if( cudaDevices[cudaDeviceCurrent].kernelsLoaded == 0 )
-			reloadAllKernels();
-
-	//	cudaError((err = cudaSetDevice( device )));
+static void virtio_qcuda_doorbell_stop(VirtIOQC *qcu)
+{
+	VirtIOQCDoorbell *db = &qcu->doorbell;
+
+	virtio_qcuda_doorbell_set(qcu, false);
+
+	qemu_mutex_lock(&db->lock);
+	db->stopping = true;
+	qemu_mutex_unlock(&db->lock);
+	event_notifier_set(&db->wake);
+	// it may be waiting for the iothread lock to pop
+	qemu_mutex_unlock_iothread();
+	qemu_thread_join(&db->thread);
+	qemu_mutex_lock_iothread();
+
+	event_notifier_cleanup(&db->wake);
+	qemu_cond_destroy(&db->cond);
+	qemu_mutex_destroy(&db->lock);
+	db->running = false;
+}
 
-	//	cuError(cuCtxPushCurrent(cudaContext));	//now test
+/* Wait for a worker to finish everything that was queued and complete it
+ * before the rings go away. */
+static void virtio_qcuda_queue_drain(VirtIOQCQueue *q)
+{
+	qemu_mutex_lock(&q->lock);
+	while (q->busy || !QSIMPLEQ_EMPTY(&q->pending) || q->deferred > 0)
+	{
+		qemu_cond_wait(&q->idle_cond, &q->lock);
+	}
+	qemu_mutex_unlock(&q->lock);
 
-	//	cuError(cuCtxPopCurrent(&cudaContext)) ; //cocotion test
+	virtio_qcuda_complete_bh(q);
+}
 
-		// cuError( cuDeviceGet(&cudaDeviceCurrent, device) );// cocotion test
-	//	cuError( cuCtxCreate(&cudaContext, 0, cudaDevice) ); //cocotion test
+static void virtio_qcuda_drain(VirtIOQC *qcu)
+{
+	uint32_t i;
 
-		cudaContext_count++;
-		//cuError(cuCtxPopCurrent(&cudaContext)) ; //cocotion test
+	for (i = 0; i < qcu->conf.num_queues; i++)
+		virtio_qcuda_queue_drain(&qcu->queues[i]);
+}
 
+//####################################################################
+//   migration
+//####################################################################
 
-	//	cuError(cuCtxPushCurrent(cudaContext)); //now test
+/* Requests still running when the guest stops for a migration or a
+ * snapshot complete now, so that their results are in guest memory and
+ * on the rings before either is saved. */
+static void virtio_qcuda_vm_state_change(void *opaque, int running,
+		RunState state)
+{
+	VirtIOQC *qcu = opaque;
 
-		printf("cocotion in cudaSetDevice\n");
-		err = 0; //cocotion test
+	if (running ||
+			(state != RUN_STATE_FINISH_MIGRATE && state != RUN_STATE_SAVE_VM))
+		return;
 
-		arg->cmd = err;
+	qcu_qos_stop(&qcu->qos);
+	virtio_qcuda_drain(qcu);
+	qcu_qos_resume(&qcu->qos);
+}
 
-		ptrace("set device= %d\n", device);
-	}
+static void virtio_qcuda_save(QEMUFile *f, void *opaque)
+{
+	virtio_save(VIRTIO_DEVICE(opaque), f);
 }
 
-static void qcu_cudaGetDeviceProperties(VirtioQCArg *arg)
+static int virtio_qcuda_load(QEMUFile *f, void *opaque, int version_id)
 {
-	cudaError_t err;
-	struct cudaDeviceProp *prop;
-	int device;
-	pfunc();
+	if (version_id != 1)
+		return -EINVAL;
+	return virtio_load(VIRTIO_DEVICE(opaque), f, version_id);
+}
 
-	prop = gpa_to_hva(arg->pA);
-	device = (int)arg->pB;
+#ifdef CONFIG_CUDA
+/*
+ * What the sessions have on the GPUs travels in a live section of its
+ * own, as a series of records:
+ *
+ *   BEGIN     the destination drops the sessions it has
+ *   CLOSE     a session went away
+ *   FREE      an allocation went away
+ *   ALLOC     an allocation, mapped at the same address on the destination
+ *   DATA      device memory contents
+ *   SESSION   the rest of a session: images, kernels, launch layouts,
+ *             streams, events and graphs, recreated under the same handles
+ *   DONE      sessions without a SESSION record are closed
+ *
+ * While the guest runs, every round sends what the trackers collect
+ * within the rate limit.  Once it is stopped the last round sends what
+ * was written since, then the sessions, so the downtime grows with what
+ * the guest wrote during the final round rather than with what it has
+ * allocated.  Events come back unrecorded.
+ */
+enum
+{
+	VIRTIO_QC_MIG_EOS,
+	VIRTIO_QC_MIG_BEGIN,
+	VIRTIO_QC_MIG_CLOSE,
+	VIRTIO_QC_MIG_FREE,
+	VIRTIO_QC_MIG_ALLOC,
+	VIRTIO_QC_MIG_DATA,
+	VIRTIO_QC_MIG_SESSION,
+	VIRTIO_QC_MIG_DONE,
+};
 
-	cudaError((err = cudaGetDeviceProperties( prop, device )));
-	arg->cmd = err;
+#define VIRTIO_QC_MIG_STRING_MAX	4096
+#define VIRTIO_QC_MIG_HANDLE_MAX	(1 << 24)
 
-	ptrace("get prop for device %d\n", device);
+static void virtio_qcuda_put_record(QEMUFile *f, int type, uint32_t session,
+		int device, uint64_t addr, uint64_t len)
+{
+	qemu_put_be32(f, type);
+	qemu_put_be32(f, session);
+	qemu_put_be32(f, device);
+	qemu_put_be64(f, addr);
+	qemu_put_be64(f, len);
 }
 
-static void qcu_cudaDeviceSynchronize(VirtioQCArg *arg)
+static void virtio_qcuda_put_string(QEMUFile *f, const char *str)
 {
-	cudaError_t err;
-	pfunc();
-	cudaError((err = cudaDeviceSynchronize()));
-	//err = cuCtxSynchronize(); //cocotion test
-	arg->cmd = err;
+	size_t len = strlen(str);
+
+	qemu_put_be32(f, len);
+	qemu_put_buffer(f, (const uint8_t *)str, len);
 }
 
-static void qcu_cudaDeviceReset(VirtioQCArg *arg)
+static char *virtio_qcuda_get_string(QEMUFile *f)
 {
-	cudaError_t err;
-	pfunc();
-	cudaError((err = cudaDeviceReset()));
-	memset( &cudaDevices[cudaDeviceCurrent], 0, sizeof(cudaDev) );
-	arg->cmd = err;
-}
+	uint32_t len = qemu_get_be32(f);
+	char *str;
 
-////////////////////////////////////////////////////////////////////////////////
-///	Version Management
-////////////////////////////////////////////////////////////////////////////////
+	if (len > VIRTIO_QC_MIG_STRING_MAX)
+		return NULL;
+	str = g_malloc(len + 1);
+	qemu_get_buffer(f, (uint8_t *)str, len);
+	str[len] = '\0';
+	return str;
+}
 
-static void qcu_cudaDriverGetVersion(VirtioQCArg *arg)
+/* The open sessions, each with a reference. */
+static GPtrArray *virtio_qcuda_sessions(VirtIOQC *qcu)
 {
-	cudaError_t err;
-	int version;
-	pfunc();
+	GPtrArray *list = g_ptr_array_new();
+	GHashTableIter iter;
+	gpointer value;
 
-	cudaError((err = cudaDriverGetVersion( &version )));
-	arg->cmd = err;
-	arg->pA = (uint64_t)version;
+	qemu_mutex_lock(&qcu->session_lock);
+	g_hash_table_iter_init(&iter, qcu->sessions);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+	{
+		((QCSession *)value)->refcount++;
+		g_ptr_array_add(list, value);
+	}
+	qemu_mutex_unlock(&qcu->session_lock);
 
-	ptrace("driver version= %d\n", version);
+	return list;
 }
 
-static void qcu_cudaRuntimeGetVersion(VirtioQCArg *arg)
+static void virtio_qcuda_sessions_put(VirtIOQC *qcu, GPtrArray *list)
 {
-	cudaError_t err;
-	int version;
-	pfunc();
+	guint i;
 
-	cudaError((err = cudaRuntimeGetVersion( &version )));
-	arg->cmd = err;
-	arg->pA = (uint64_t)version;
+	for (i = 0; i < list->len; i++)
+		qcu_session_put(qcu, g_ptr_array_index(list, i));
+	g_ptr_array_free(list, TRUE);
+}
 
-	ptrace("runtime driver= %d\n", version);
+/* Start or stop dirty logging on every tracker.  Starting fails while
+ * sessions hold weight blobs, which are not part of any session's
+ * state; no new ones are handed out until migration stops. */
+static bool virtio_qcuda_migrate_set(VirtIOQC *qcu, bool on)
+{
+	GHashTableIter iter;
+	gpointer value;
+	QCSession *s;
+	int i;
+
+	qemu_mutex_lock(&qcu->session_lock);
+	if (on && atomic_read(&qcu->blobs_held) > 0)
+	{
+		qemu_mutex_unlock(&qcu->session_lock);
+		return false;
+	}
+	atomic_set(&qcu->migrating, on);
+	g_array_set_size(qcu->mig_closed, 0);
+	g_hash_table_iter_init(&iter, qcu->sessions);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+	{
+		s = value;
+		for (i = 0; s->mig != NULL && i < totalDevices; i++)
+		{
+			if (on)
+				qcu_mig_start(s->mig[i]);
+			else
+				qcu_mig_stop(s->mig[i]);
+		}
+	}
+	qemu_mutex_unlock(&qcu->session_lock);
+	return true;
 }
 
-//////////////////////////////////////////////////
-//static void qcu_checkCudaCapabilities(VirtioQCArg *arg)
-//{
-//	cudaError_t err;
-//	err = checkCudaCapabilities(arg->pA, arg->pB);
-//	arg->cmd = err;
-//}
+/*
+ * Send allocation changes and up to max bytes of dirty device memory of
+ * a session, with its lock held.  Chunks are read only after the context
+ * is synchronized, so writes queued before they were collected are in.
+ */
+static uint64_t virtio_qcuda_save_memory(QEMUFile *f, QCSession *s,
+		uint64_t max, uint8_t *buf)
+{
+	GArray *recs = g_array_new(FALSE, FALSE, sizeof(QCMigRecord));
+	QCMigRecord *r;
+	QCSwap *sw;
+	CUcontext ctx, cur;
+	CUresult err;
+	uint64_t sent = 0;
+	guint j;
+	int i;
 
-//////////////////////////////////////////////////
+	for (i = 0; s->mig != NULL && i < totalDevices && sent < max; i++)
+	{
+		g_array_set_size(recs, 0);
+		sent += qcu_mig_collect(s->mig[i], recs, max - sent);
+		if (recs->len == 0)
+			continue;
 
-////////////////////////////////////////////////////////////////////////////////
-///	Event Management
-////////////////////////////////////////////////////////////////////////////////
+		ctx = s->devices != NULL ? s->devices[i].context : NULL;
+		if (ctx != NULL)
+		{
+			cuError( cuCtxPushCurrent(ctx) );
+			cuError( cuCtxSynchronize() );
+		}
+
+		for (j = 0; j < recs->len; j++)
+		{
+			r = &g_array_index(recs, QCMigRecord, j);
+			if (r->type == QCU_MIG_REC_FREE)
+			{
+				virtio_qcuda_put_record(f, VIRTIO_QC_MIG_FREE, s->id, i,
+						r->addr, 0);
+				continue;
+			}
+			if (r->type == QCU_MIG_REC_ALLOC)
+			{
+				virtio_qcuda_put_record(f, VIRTIO_QC_MIG_ALLOC, s->id, i,
+						r->addr, r->len);
+				continue;
+			}
 
-static void qcu_cudaEventCreate(VirtioQCArg *arg)
-{
-	cudaError_t err;
-	uint32_t idx;
-	pfunc();
+			sw = s->devices != NULL ? s->devices[i].swap : NULL;
+			if (sw != NULL && qcu_swap_copy_out(sw, r->addr, buf, r->len))
+				err = CUDA_SUCCESS;
+			else
+				err = ctx != NULL ? cuMemcpyDtoH(buf, r->addr, r->len) :
+					CUDA_ERROR_INVALID_CONTEXT;
+			// freed while we were reading: its FREE record follows
+			if (err != CUDA_SUCCESS)
+				memset(buf, 0, r->len);
+			virtio_qcuda_put_record(f, VIRTIO_QC_MIG_DATA, s->id, i,
+					r->addr, r->len);
+			qemu_put_buffer(f, buf, r->len);
+		}
 
-	idx = cudaEventNum;
-	cudaError((err = cudaEventCreate(&cudaEvent[idx])));
-	arg->cmd = err;
-	arg->pA = (uint64_t)idx;
+		if (ctx != NULL)
+			cuError( cuCtxPopCurrent(&cur) );
+	}
 
-	cudaEventNum++;
-	ptrace("create event %u\n", idx);
+	g_array_free(recs, TRUE);
+	return sent;
 }
 
-static void qcu_cudaEventCreateWithFlags(VirtioQCArg *arg)
+/* One round: closed sessions, then device memory of the open ones. */
+static uint64_t virtio_qcuda_save_round(QEMUFile *f, VirtIOQC *qcu,
+		uint64_t max)
 {
-	cudaError_t err;
-	uint32_t idx;
-
-	idx = cudaEventNum;
-	cudaError((err = cudaEventCreateWithFlags(&cudaEvent[idx], arg->flag)));
-	arg->cmd = err;
-	arg->pA = (uint64_t)idx;
+	GPtrArray *list;
+	GArray *closed;
+	uint8_t *buf;
+	QCSession *s;
+	uint64_t sent = 0;
+	guint i;
+
+	qemu_mutex_lock(&qcu->session_lock);
+	closed = qcu->mig_closed;
+	qcu->mig_closed = g_array_new(FALSE, FALSE, sizeof(uint32_t));
+	qemu_mutex_unlock(&qcu->session_lock);
+
+	for (i = 0; i < closed->len; i++)
+		virtio_qcuda_put_record(f, VIRTIO_QC_MIG_CLOSE,
+				g_array_index(closed, uint32_t, i), 0, 0, 0);
+	g_array_free(closed, TRUE);
+
+	buf = g_malloc(QCU_MIG_RUN_MAX);
+	list = virtio_qcuda_sessions(qcu);
+	for (i = 0; i < list->len && sent < max; i++)
+	{
+		s = g_ptr_array_index(list, i);
+		qemu_mutex_lock(&s->lock);
+		if (!s->closed)
+			sent += virtio_qcuda_save_memory(f, s, max - sent, buf);
+		qemu_mutex_unlock(&s->lock);
+	}
+	virtio_qcuda_sessions_put(qcu, list);
+	g_free(buf);
 
-	cudaEventNum++;
-	ptrace("create event %u\n", idx);
+	return sent;
 }
 
-static void qcu_cudaEventRecord(VirtioQCArg *arg)
+static void virtio_qcuda_put_graph(QEMUFile *f, QCGraph *g)
 {
-	cudaError_t err;
-	uint32_t eventIdx;
-//	uint32_t streamIdx;
-	uint64_t streamIdx;
-	pfunc();
+	QCGraphNode *n;
+	uint32_t i, j, len;
 
-	eventIdx  = arg->pA;
-	streamIdx = arg->pB;
-//	cudaError((err = cudaEventRecord(cudaEvent[eventIdx], cudaStream[streamIdx])));
-	cudaError((err = cudaEventRecord(cudaEvent[eventIdx], (streamIdx==(uint64_t)-1)?NULL:cudaStream[streamIdx]  )));
-	// cudaError((err = cudaEventRecord(cudaEvent[eventIdx], (streamIdx==(uint64_t)-1)?cudaDevices[cudaDeviceCurrent].stream:cudaStream[streamIdx]  )));
-
-	arg->cmd = err;
+	qemu_put_be32(f, g->nodes->len);
+	for (i = 0; i < g->nodes->len; i++)
+	{
+		n = qcu_graph_node(g, i);
+		qemu_put_be32(f, n->type);
+		if (n->type == QCU_GRAPH_COPY)
+		{
+			qemu_put_be64(f, n->dst);
+			qemu_put_be64(f, n->src);
+			qemu_put_be64(f, n->bytes);
+			continue;
+		}
 
-	ptrace("event record %u\n", eventIdx);
+		qemu_put_be32(f, n->func);
+		for (j = 0; j < 3; j++)
+			qemu_put_be32(f, n->grid[j]);
+		for (j = 0; j < 3; j++)
+			qemu_put_be32(f, n->block[j]);
+		qemu_put_be32(f, n->shared);
+		// the parameters as the guest sent them, patches applied
+		len = 0;
+		for (j = 0; j < n->nparams; j++)
+			len += sizeof(uint32_t) + n->arg_size[j];
+		qemu_put_be32(f, n->nparams);
+		qemu_put_be32(f, len);
+		qemu_put_buffer(f, n->params, len);
+	}
 }
 
-static void qcu_cudaEventSynchronize(VirtioQCArg *arg)
+static QCGraph *virtio_qcuda_get_graph(QEMUFile *f)
 {
-	cudaError_t err;
-	uint32_t idx;
-	pfunc();
+	QCGraph *g = qcu_graph_new();
+	uint64_t conf[7], dst, src, bytes;
+	uint32_t i, j, count, func, nparams, len;
+	uint8_t *blob;
+	bool ok = true;
+
+	count = qemu_get_be32(f);
+	for (i = 0; i < count && ok; i++)
+	{
+		if (qemu_get_be32(f) == QCU_GRAPH_COPY)
+		{
+			dst = qemu_get_be64(f);
+			src = qemu_get_be64(f);
+			bytes = qemu_get_be64(f);
+			ok = qcu_graph_add_copy(g, dst, src, bytes);
+			continue;
+		}
 
-	idx = arg->pA;
-	cudaError((err = cudaEventSynchronize( cudaEvent[idx] )));
-	arg->cmd = err;
+		func = qemu_get_be32(f);
+		for (j = 0; j < 7; j++)
+			conf[j] = qemu_get_be32(f);
+		nparams = qemu_get_be32(f);
+		len = qemu_get_be32(f);
+		if (len > QCU_GRAPH_BLOB_MAX - sizeof(uint32_t))
+		{
+			ok = false;
+			break;
+		}
+		blob = g_malloc(sizeof(uint32_t) + len);
+		memcpy(blob, &nparams, sizeof(uint32_t));
+		qemu_get_buffer(f, blob + sizeof(uint32_t), len);
+		ok = qcu_graph_add_kernel(g, func, conf, blob, sizeof(uint32_t) + len);
+		g_free(blob);
+	}
 
-	ptrace("sync event %u\n", idx);
+	if (!ok)
+	{
+		qcu_graph_free(g);
+		return NULL;
+	}
+	return g;
 }
 
-static void qcu_cudaEventElapsedTime(VirtioQCArg *arg)
+/* Handles in use with their tags. */
+static void virtio_qcuda_put_handles(QEMUFile *f, QCHandleTable *t)
 {
-	cudaError_t err;
-	uint32_t startIdx;
-	uint32_t endIdx;
-	float ms;
-	pfunc();
-
-	startIdx = arg->pA;
-	endIdx   = arg->pB;
-	cudaError((err = cudaEventElapsedTime(&ms, cudaEvent[startIdx], cudaEvent[endIdx])));
-	arg->cmd = err;
-	memcpy(&arg->flag, &ms, sizeof(float));
+	uint32_t i, n = 0;
 
-	ptrace("event elapse time= %f, start= %u, end= %u\n",
-			ms, startIdx, endIdx);
+	qemu_mutex_lock(&t->lock);
+	for (i = 0; i < t->slots->len; i++)
+		n += g_ptr_array_index(t->slots, i) != NULL;
+	qemu_put_be32(f, n);
+	for (i = 0; i < t->slots->len; i++)
+	{
+		if (g_ptr_array_index(t->slots, i) == NULL)
+			continue;
+		qemu_put_be32(f, i);
+		qemu_put_be64(f, g_array_index(t->tags, uint64_t, i));
+	}
+	qemu_mutex_unlock(&t->lock);
 }
 
-static void qcu_cudaEventDestroy(VirtioQCArg *arg)
+/* Everything but device memory; the guest is stopped. */
+static void virtio_qcuda_save_session(QEMUFile *f, QCSession *s)
 {
-	cudaError_t err;
-	uint32_t idx;
-	pfunc();
+	GHashTableIter iter;
+	gpointer key, value;
+	QCLaunchLayout *layout;
+	QCGraphExec *ge;
+	QCImage *img;
+	kernelInfo *k;
+	uint32_t i, j;
+
+	virtio_qcuda_put_record(f, VIRTIO_QC_MIG_SESSION, s->id, 0, 0, 0);
+	qemu_put_be32(f, s->block_size);
+	qemu_put_be32(f, s->device_space_size);
+	qemu_put_buffer(f, (uint8_t *)s->device_space, s->device_space_size);
+	qemu_put_be32(f, s->devices != NULL ? s->fatbin_count : 0);
+	qemu_put_be32(f, s->devices != NULL ? s->device_current : 0);
+
+	qemu_put_be32(f, g_hash_table_size(s->images));
+	g_hash_table_iter_init(&iter, s->images);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+	{
+		img = value;
+		qemu_put_be32(f, img->type);
+		qemu_put_be32(f, img->size);
+		qemu_put_buffer(f, img->data, img->size);
+	}
 
-	idx = arg->pA;
-	cudaError((err = cudaEventDestroy(cudaEvent[idx])));
-	arg->cmd = err;
-	memset(&cudaEvent[idx], 0, sizeof(cudaEvent_t));
+	qemu_mutex_lock(&s->table_lock);
+	qemu_put_be32(f, s->kernels->len);
+	for (i = 0; i < s->kernels->len; i++)
+	{
+		k = &g_array_index(s->kernels, kernelInfo, i);
+		qemu_put_be32(f, k->funcId);
+		virtio_qcuda_put_string(f, k->functionName);
+		virtio_qcuda_put_string(f, k->image->hash);
+	}
+	qemu_put_be32(f, g_hash_table_size(s->layouts));
+	g_hash_table_iter_init(&iter, s->layouts);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+	{
+		layout = value;
+		qemu_put_be32(f, GPOINTER_TO_UINT(key));
+		qemu_put_be32(f, layout->size);
+		qemu_put_be32(f, layout->nparams);
+		for (j = 0; j < layout->nparams; j++)
+		{
+			qemu_put_be32(f, layout->params[j].offset);
+			qemu_put_be32(f, layout->params[j].size);
+		}
+	}
+	qemu_mutex_unlock(&s->table_lock);
 
-	ptrace("destroy event %u\n", idx);
-}
+	virtio_qcuda_put_handles(f, &s->streams);
+	virtio_qcuda_put_handles(f, &s->events);
 
-////////////////////////////////////////////////////////////////////////////////
-///	Error Handling
-////////////////////////////////////////////////////////////////////////////////
+	qemu_mutex_lock(&s->graphs.lock);
+	for (i = 1; i < s->graphs.slots->len; i++)
+	{
+		ge = g_ptr_array_index(s->graphs.slots, i);
+		if (ge == NULL)
+			continue;
+		qemu_put_be32(f, i);
+		virtio_qcuda_put_graph(f, ge->graph);
+	}
+	qemu_mutex_unlock(&s->graphs.lock);
+	qemu_put_be32(f, 0);
+
+	qemu_mutex_lock(&s->table_lock);
+	qemu_put_be32(f, g_hash_table_size(s->captures));
+	g_hash_table_iter_init(&iter, s->captures);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+	{
+		qemu_put_be64(f, GPOINTER_TO_SIZE(key));
+		virtio_qcuda_put_graph(f, value);
+	}
+	qemu_mutex_unlock(&s->table_lock);
+}
 
-static void qcu_cudaGetLastError(VirtioQCArg *arg)
+static int virtio_qcuda_gpu_save_setup(QEMUFile *f, void *opaque)
 {
-	cudaError_t err;
-	pfunc();
+	VirtIOQC *qcu = opaque;
 
-	err =  cudaGetLastError();
-	arg->cmd = err;
-	ptrace("lasr cudaError %d\n", err);
+	if (!virtio_qcuda_migrate_set(qcu, true))
+	{
+		error_report("virtio-qcuda: cannot migrate while weight blobs "
+				"are loaded");
+		return -EBUSY;
+	}
+	virtio_qcuda_put_record(f, VIRTIO_QC_MIG_BEGIN, 0, 0, 0, 0);
+	qemu_put_be32(f, VIRTIO_QC_MIG_EOS);
+	return 0;
 }
 
-//////////zero-copy////////
-
-static void qcu_cudaHostRegister(VirtioQCArg *arg)
+static uint64_t virtio_qcuda_gpu_save_pending(QEMUFile *f, void *opaque,
+		uint64_t max_size)
 {
-	int fd = ldl_p(&arg->pBSize);
-	uint64_t offset = arg->pA;
-	uint32_t size = arg->pASize;
+	VirtIOQC *qcu = opaque;
+	GHashTableIter iter;
+	gpointer value;
+	QCSession *s;
+	uint64_t pending = 0;
+	int i;
 
-	void *ptr = mmap(0, arg->pB, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+	qemu_mutex_lock(&qcu->session_lock);
+	g_hash_table_iter_init(&iter, qcu->sessions);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+	{
+		s = value;
+		for (i = 0; s->mig != NULL && i < totalDevices; i++)
+			pending += qcu_mig_pending(s->mig[i]);
+	}
+	qemu_mutex_unlock(&qcu->session_lock);
 
-	cudaError_t err;
-	err = cudaHostRegister(ptr, size, arg->flag);
-	//err = cuMemHostRegister(ptr, size, CU_MEMHOSTREGISTER_DEVICEMAP);
-	arg->pA = (uint64_t)ptr;
-	arg->cmd = err;
+	return pending;
 }
 
-static void qcu_cudaHostGetDevicePointer(VirtioQCArg *arg)
+static int virtio_qcuda_gpu_save_iterate(QEMUFile *f, void *opaque)
 {
-	cudaError_t err;
-	void *ptr = (void*)	arg->pB;
-	void *devPtr;
-	//CUdeviceptr devPtr;
-	err = cudaHostGetDevicePointer(&devPtr, ptr, arg->flag);
-	//err = cuMemHostGetDevicePointer(&devPtr, ptr, arg->flag);
-	arg->pA = (uint64_t)devPtr;
-	arg->cmd = err;
-}
+	VirtIOQC *qcu = opaque;
+	int64_t limit = qemu_file_get_rate_limit(f);
+	uint64_t sent, pending;
 
-static void qcu_cudaHostUnregister(VirtioQCArg *arg)
-{
-	void *ptr = (void*) arg->pB;
+	sent = virtio_qcuda_save_round(f, qcu,
+			limit > 0 ? MAX(limit, QCU_MIG_CHUNK) : UINT64_MAX);
+	qemu_put_be32(f, VIRTIO_QC_MIG_EOS);
 
-	cudaError_t err;
-	err = cudaHostUnregister(ptr);
-	//err = cuMemHostUnregister(ptr);
-	arg->cmd = err;
+	pending = virtio_qcuda_gpu_save_pending(f, qcu, 0);
+	trace_virtio_qcuda_migrate(qcu, "iterate", sent, pending);
+	return pending == 0;
 }
 
-static void qcu_cudaSetDeviceFlags(VirtioQCArg *arg)
+static int virtio_qcuda_gpu_save_complete(QEMUFile *f, void *opaque)
 {
-	cudaError_t err;
-//	err = cudaSetDeviceFlags(arg->flag);
-	err = 0;
-	arg->cmd = err;
-}
+	VirtIOQC *qcu = opaque;
+	GPtrArray *list;
+	QCSession *s;
+	uint64_t sent;
+	guint i;
 
-//stream
-static void qcu_cudaStreamCreate(VirtioQCArg *arg)
-{
-	cudaError_t err;
-//	void *ptr = (void*) arg->pA;
-//	err = cuStreamCreate((CUstream*)ptr,0);
+	sent = virtio_qcuda_save_round(f, qcu, UINT64_MAX);
 
-	err = cudaStreamCreate(&cudaStream[cudaStreamNum]);
-	arg->pA = cudaStreamNum;
-	cudaStreamNum++;
- 	arg->cmd = err;
+	list = virtio_qcuda_sessions(qcu);
+	for (i = 0; i < list->len; i++)
+	{
+		s = g_ptr_array_index(list, i);
+		qemu_mutex_lock(&s->lock);
+		if (!s->closed)
+			virtio_qcuda_save_session(f, s);
+		qemu_mutex_unlock(&s->lock);
+	}
+	virtio_qcuda_sessions_put(qcu, list);
 
+	virtio_qcuda_put_record(f, VIRTIO_QC_MIG_DONE, 0, 0, 0, 0);
+	qemu_put_be32(f, VIRTIO_QC_MIG_EOS);
+	trace_virtio_qcuda_migrate(qcu, "complete", sent, 0);
 
+	virtio_qcuda_migrate_set(qcu, false);
+	return 0;
 }
 
-static void qcu_cudaStreamDestroy(VirtioQCArg *arg)
+static void virtio_qcuda_gpu_save_cancel(void *opaque)
 {
-	cudaError_t err;
-	uint32_t idx;
+	virtio_qcuda_migrate_set(opaque, false);
+}
 
-	idx = arg->pA;
-	cudaError((err = cudaStreamDestroy(cudaStream[idx])));
-	arg->cmd = err;
-	memset(&cudaStream[idx], 0, sizeof(cudaStream_t));
+/* Push the context of a device on this thread, if it has one. */
+static bool virtio_qcuda_load_push(QCSession *s, uint64_t device)
+{
+	if (s->devices == NULL || device >= totalDevices ||
+			s->devices[device].context == NULL)
+	{
+		error_report("virtio-qcuda: session %u has no GPU %"PRIu64,
+				s->id, device);
+		return false;
+	}
+	cuError( cuCtxPushCurrent(s->devices[device].context) );
+	return true;
 }
 
-#endif // CONFIG_CUDA
+static void virtio_qcuda_load_pop(void)
+{
+	CUcontext ctx;
+
+	cuError( cuCtxPopCurrent(&ctx) );
+}
 
-static int qcu_cmd_write(VirtioQCArg *arg)
+static int virtio_qcuda_load_memory(QEMUFile *f, QCSession *s, int type,
+		uint32_t device, uint64_t addr, uint64_t len)
 {
-	void   *src, *dst;
-	uint64_t *gpa_array;
-	uint32_t size, len, i;
+	uint8_t *buf;
+	CUresult err;
+	QCMig *m;
+	int ret = 0;
+
+	if (s->devices == NULL)
+		qcu_session_open_devices(s);
+	if (s->mig == NULL || !virtio_qcuda_load_push(s, device))
+		return -EINVAL;
+	m = s->mig[device];
+
+	switch (type)
+	{
+		case VIRTIO_QC_MIG_FREE:
+			qcu_mig_remove(m, addr);
+			break;
 
-	size = arg->pASize;
+		case VIRTIO_QC_MIG_ALLOC:
+			if (!qcu_mig_restore(m, addr, len))
+			{
+				error_report("virtio-qcuda: cannot map %"PRIu64" bytes of "
+						"device memory at 0x%"PRIx64, len, addr);
+				ret = -ENOMEM;
+			}
+			break;
 
-	ptrace("szie= %u\n", size);
+		case VIRTIO_QC_MIG_DATA:
+			if (len > QCU_MIG_RUN_MAX || !qcu_mig_owns(m, addr) ||
+					!qcu_mig_owns(m, addr + len - 1))
+			{
+				ret = -EINVAL;
+				break;
+			}
+			buf = g_malloc(len);
+			qemu_get_buffer(f, buf, len);
+			err = cuMemcpyHtoD(addr, buf, len);
+			g_free(buf);
+			if (err != CUDA_SUCCESS)
+			{
+				cuError(err);
+				ret = -EIO;
+			}
+			break;
 
-	if(deviceSpace!=NULL)
-	{
-		free(deviceSpace);
+		default:
+			ret = -EINVAL;
 	}
 
-	deviceSpaceSize = size;
-	deviceSpace = (char*)malloc(deviceSpaceSize);
+	virtio_qcuda_load_pop();
+	return ret;
+}
+
+static int virtio_qcuda_load_handles(QEMUFile *f, QCSession *s,
+		QCHandleTable *t, uint32_t first, bool events)
+{
+	uint32_t i, n, idx, flags;
+	uint64_t tag, device;
+	cudaError_t err;
+	void *obj;
 
-	if( size > deviceSpaceSize )
+	n = qemu_get_be32(f);
+	for (i = 0; i < n; i++)
 	{
-		gpa_array = gpa_to_hva(arg->pA);
-		dst = deviceSpace;
-		for(i=0; size>0; i++)
+		idx = qemu_get_be32(f);
+		tag = qemu_get_be64(f);
+		device = events ? tag >> 32 : tag;
+		flags = tag;
+		if (idx < first || idx >= VIRTIO_QC_MIG_HANDLE_MAX ||
+				!virtio_qcuda_load_push(s, device))
+			return -EINVAL;
+
+		obj = NULL;
+		if (events)
+			err = cudaEventCreateWithFlags((cudaEvent_t *)&obj, flags);
+		else
+			err = cudaStreamCreate((cudaStream_t *)&obj);
+		virtio_qcuda_load_pop();
+		if (err != cudaSuccess)
 		{
-			len = MIN(size, QCU_KMALLOC_MAX_SIZE);
-			src = gpa_to_hva(gpa_array[i]);
-			memcpy(dst, src, len);
-			size -= len;
-			dst  += len;
+			cudaError(err);
+			return -EIO;
 		}
+		qcu_handle_restore(t, idx, obj, tag);
 	}
-	else
+
+	return 0;
+}
+
+static int virtio_qcuda_load_session(QEMUFile *f, QCSession *s)
+{
+	uint32_t i, j, n, size, fatbins, current, idx, funcId, count;
+	QCLaunchLayout *layout;
+	QCGraphExec *ge;
+	QCImage *img;
+	QCGraph *g;
+	kernelInfo k;
+	uint64_t stream;
+	char *hash;
+	int ret;
+
+	s->block_size = qemu_get_be32(f);
+	size = qemu_get_be32(f);
+	if (size > s->device_space_cap)
 	{
-		src = gpa_to_hva(arg->pA);
-		memcpy(deviceSpace, src, size);
+		s->device_space = g_realloc(s->device_space, size);
+		s->device_space_cap = size;
 	}
-	// checker ------------------------------------------------------------
-/*
-	uint64_t err;
-	if( deviceSpaceSize<32 )
+	s->device_space_size = size;
+	qemu_get_buffer(f, (uint8_t *)s->device_space, size);
+
+	fatbins = qemu_get_be32(f);
+	current = qemu_get_be32(f);
+	if (fatbins > 0 && s->devices == NULL)
+		qcu_session_open_devices(s);
+	else if (fatbins == 0 && s->devices != NULL)
+		qcu_session_release_cuda(s);
+	s->fatbin_count = fatbins;
+	if (fatbins > 0)
 	{
-		for(i=0; i<deviceSpaceSize; i++)
-		{
-			ptrace("deviceSpace[%lu]= %d\n", i, deviceSpace[i]);
-		}
+		if (current >= totalDevices)
+			return -EINVAL;
+		s->device_current = current;
 	}
-	else
+
+	n = qemu_get_be32(f);
+	for (i = 0; i < n; i++)
 	{
-		err = 0;
-		for(i=0; i<deviceSpaceSize; i++)
+		img = g_new0(QCImage, 1);
+		img->type = qemu_get_be32(f);
+		img->size = qemu_get_be32(f);
+		if (img->size > QCU_IMAGE_MAX)
 		{
-			if( deviceSpace[i] != (i%17)*7 ) err++;
+			g_free(img);
+			return -EINVAL;
 		}
-		ptrace("error= %llu\n", (unsigned long long)err);
+		img->data = g_malloc(img->size);
+		qemu_get_buffer(f, img->data, img->size);
+		img->hash = g_compute_checksum_for_data(G_CHECKSUM_SHA256,
+				img->data, img->size);
+		g_hash_table_replace(s->images, img->hash, img);
 	}
-	ptrace("\n\n");
-	//---------------------------------------------------------------------
-*/
-	return 0;
-}
-
-static int qcu_cmd_read(VirtioQCArg *arg)
-{
-	void   *src, *dst;
-	uint64_t *gpa_array;
-	uint32_t size, len, i;
 
-	if(deviceSpace==NULL)
+	n = qemu_get_be32(f);
+	for (i = 0; i < n; i++)
 	{
-		return -1;
-	}
-
-	size = arg->pASize;
+		k.funcId = qemu_get_be32(f);
+		k.functionName = virtio_qcuda_get_string(f);
+		hash = virtio_qcuda_get_string(f);
+		k.image = hash != NULL ? g_hash_table_lookup(s->images, hash) : NULL;
+		g_free(hash);
+		if (k.functionName == NULL || k.image == NULL)
+		{
+			g_free(k.functionName);
+			return -EINVAL;
+		}
 
-	ptrace("szie= %u\n", size);
+		qemu_mutex_lock(&s->table_lock);
+		g_array_append_val(s->kernels, k);
+		qemu_mutex_unlock(&s->table_lock);
+	}
 
-	if( size > deviceSpaceSize )
+	n = qemu_get_be32(f);
+	for (i = 0; i < n; i++)
 	{
-		gpa_array = gpa_to_hva(arg->pA);
-		src = deviceSpace;
-		for(i=0; size>0; i++)
+		funcId = qemu_get_be32(f);
+		size = qemu_get_be32(f);
+		count = qemu_get_be32(f);
+		if (size > VIRTIO_QC_LAUNCH_ARGS_MAX ||
+				count > VIRTIO_QC_LAUNCH_PARAMS_MAX)
+			return -EINVAL;
+		layout = g_malloc(sizeof(*layout) + count * sizeof(layout->params[0]));
+		layout->refs = 1;
+		layout->size = size;
+		layout->nparams = count;
+		for (j = 0; j < count; j++)
 		{
-			len = MIN(size, QCU_KMALLOC_MAX_SIZE);
-			dst = gpa_to_hva(gpa_array[i]);
-			memcpy(dst, src, len);
-			size -= len;
-			src  += len;
+			layout->params[j].offset = qemu_get_be32(f);
+			layout->params[j].size = qemu_get_be32(f);
 		}
+		qemu_mutex_lock(&s->table_lock);
+		g_hash_table_replace(s->layouts, GUINT_TO_POINTER(funcId), layout);
+		qemu_mutex_unlock(&s->table_lock);
 	}
-	else
-	{
-		dst = gpa_to_hva(arg->pA);
-		memcpy(dst, deviceSpace, size);
-	}
-
-	return 0;
-}
-
-static int qcu_cmd_mmapctl(VirtioQCArg *arg)
-{
 
-	int pid = getpid();
-	char vfname[100];
+	ret = virtio_qcuda_load_handles(f, s, &s->streams, 1, false);
+	if (ret == 0)
+		ret = virtio_qcuda_load_handles(f, s, &s->events, 0, true);
+	if (ret < 0)
+		return ret;
 
-	sprintf(vfname, "/home/coldfunction/qcuvf/vm%d_%lx", pid, arg->pB);
-
-	int fd=open(vfname, O_CREAT|O_RDWR,0666);
-    if(fd<0)
-    {
-        printf("failure to open\n");
-        exit(0);
-    }
-	if(lseek(fd,arg->pBSize,SEEK_SET)==-1) //cocotion modified
-    {
-        printf("Failure to lseek\n");
-        exit(0);
+	while ((idx = qemu_get_be32(f)) != 0)
+	{
+		g = idx < VIRTIO_QC_MIG_HANDLE_MAX ? virtio_qcuda_get_graph(f) : NULL;
+		if (g == NULL)
+			return -EINVAL;
+		ge = g_new0(QCGraphExec, 1);
+		qemu_mutex_init(&ge->lock);
+		ge->graph = g;
+		ge->device = -1;
+		ge->refs = 1;
+		qcu_handle_restore(&s->graphs, idx, ge, 0);
 	}
-    if(write(fd, "",1) != 1)
-    {
-        printf("Failure on write\n");
-        exit(0);
-    }
-
-	stl_p(&arg->pA, fd);
-
-	return 0;
-}
 
-static int qcu_cmd_open(VirtioQCArg *arg)
-{
-	BLOCK_SIZE = arg->pASize;
-/*
-	int fd=open(VIRTHM_DEV_PATH, O_CREAT|O_RDWR,0666);
-    if(fd<0)
-    {
-        printf("failure to open\n");
-        exit(0);
-    }
-	if(lseek(fd,MAP_MAX_LENGTH-1,SEEK_SET)==-1) //cocotion modified
-    {
-        printf("Failure to lseek\n");
-        exit(0);
+	n = qemu_get_be32(f);
+	for (i = 0; i < n; i++)
+	{
+		stream = qemu_get_be64(f);
+		g = virtio_qcuda_get_graph(f);
+		if (g == NULL)
+			return -EINVAL;
+		qemu_mutex_lock(&s->table_lock);
+		g_hash_table_replace(s->captures, GSIZE_TO_POINTER(stream), g);
+		atomic_set(&s->capturing, g_hash_table_size(s->captures));
+		qemu_mutex_unlock(&s->table_lock);
 	}
-    if(write(fd, "",1) != 1)
-    {
-        printf("Failure on write\n");
-        exit(0);
-    }
-	stl_p(&arg->pA, fd);
-
-	printf("cocotion open fd: %d in host\n", fd);
-*/
-	//arg->pA = getpid();
-	//printf("pid: %d in host\n", arg->pA);
 
-	//buf = (char*)malloc(sizeof(int)*16*1024*1024); //test
-	return 0;
+	if (s->fatbin_count > 0 && virtio_qcuda_load_push(s, s->device_current))
+	{
+		reloadAllKernels(s);
+		virtio_qcuda_load_pop();
+	}
 
+	s->mig_seen = true;
+	return qemu_file_get_error(f);
 }
 
-static int qcu_cmd_close(VirtioQCArg *arg)
+/* Close the sessions the source did not have (any more). */
+static void virtio_qcuda_load_done(VirtIOQC *qcu)
 {
-	//free(buf); //cocotion test
-/*
-	int fd = ldl_p(&arg->pA);
-	printf("cocotion close fd: %d in close\n", fd);
-	int resp = close(fd);
-	stl_p(&arg->pB, resp);
-*/
-	return 0;
-}
+	GPtrArray *list = virtio_qcuda_sessions(qcu);
+	QCSession *s;
+	guint i;
 
-static int qcu_cmd_mmap(VirtioQCArg *arg){
+	for (i = 0; i < list->len; i++)
+	{
+		s = g_ptr_array_index(list, i);
+		if (!s->mig_seen)
+			qcu_session_close(qcu, s);
+		s->mig_seen = false;
+	}
+	virtio_qcuda_sessions_put(qcu, list);
+}
 
-	//arg->pA: file fd
-	//arg->pASize: numOfblocks
-	//arg->pB: gpa_array
+static int virtio_qcuda_gpu_load(QEMUFile *f, void *opaque, int version_id)
+{
+	VirtIOQC *qcu = opaque;
+	uint32_t type, id, device;
+	uint64_t addr, len;
+	QCSession *s;
+	int ret = 0;
 
-	int32_t fd = (int32_t)ldl_p(&arg->pA);
-	uint64_t *gpa_array = gpa_to_hva(arg->pB);
-	void *addr;
+	if (version_id != 1)
+		return -EINVAL;
 
-	int i;
-	for(i = 0; i < arg->pASize; i++)
+	while (ret == 0 && (type = qemu_get_be32(f)) != VIRTIO_QC_MIG_EOS)
 	{
-		addr = gpa_to_hva(gpa_array[i]);
-		munmap(addr, BLOCK_SIZE);
-   		mmap(addr, BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, i*BLOCK_SIZE);
+		id = qemu_get_be32(f);
+		device = qemu_get_be32(f);
+		addr = qemu_get_be64(f);
+		len = qemu_get_be64(f);
+		ret = qemu_file_get_error(f);
+		if (ret < 0)
+			break;
+		trace_virtio_qcuda_migrate_load(qcu, type, id, device, addr, len);
+
+		switch (type)
+		{
+			case VIRTIO_QC_MIG_BEGIN:
+				virtio_qcuda_drain(qcu);
+				qcu_session_close_all(qcu);
+				break;
+
+			case VIRTIO_QC_MIG_DONE:
+				virtio_qcuda_load_done(qcu);
+				break;
+
+			case VIRTIO_QC_MIG_CLOSE:
+				qemu_mutex_lock(&qcu->session_lock);
+				s = g_hash_table_lookup(qcu->sessions, GUINT_TO_POINTER(id));
+				if (s != NULL)
+					s->refcount++;
+				qemu_mutex_unlock(&qcu->session_lock);
+				if (s != NULL)
+				{
+					qcu_session_close(qcu, s);
+					qcu_session_put(qcu, s);
+				}
+				break;
+
+			case VIRTIO_QC_MIG_SESSION:
+				s = qcu_session_get(qcu, id);
+				ret = virtio_qcuda_load_session(f, s);
+				qcu_session_put(qcu, s);
+				break;
+
+			default:
+				s = qcu_session_get(qcu, id);
+				ret = virtio_qcuda_load_memory(f, s, type, device, addr, len);
+				qcu_session_put(qcu, s);
+		}
 	}
 
+	if (ret < 0)
+		error_report("virtio-qcuda: cannot load GPU state: %s", strerror(-ret));
+	return ret;
+}
+
+static SaveVMHandlers savevm_virtio_qcuda_gpu = {
+	.save_live_setup = virtio_qcuda_gpu_save_setup,
+	.save_live_iterate = virtio_qcuda_gpu_save_iterate,
+	.save_live_complete = virtio_qcuda_gpu_save_complete,
+	.save_live_pending = virtio_qcuda_gpu_save_pending,
+	.cancel = virtio_qcuda_gpu_save_cancel,
+	.load_state = virtio_qcuda_gpu_load,
+};
+#endif
 
-    return 0;
+//####################################################################
+//   external backend (vhost-user)
+//####################################################################
+
+#ifdef CONFIG_LINUX
+static const int virtio_qcuda_vhost_feature_bits[] = {
+	VIRTIO_F_NOTIFY_ON_EMPTY,
+	VIRTIO_RING_F_INDIRECT_DESC,
+	VIRTIO_RING_F_EVENT_IDX,
+	VHOST_INVALID_FEATURE_BIT
+};
+
+/* The backend processes the rings; nothing to do for a kick that still
+ * reaches QEMU (ioeventfd not available). */
+static void virtio_qcuda_vhost_handle(VirtIODevice *vdev, VirtQueue *vq)
+{
 }
 
-static int qcu_cmd_munmap(VirtioQCArg *arg){
-   	// arg->pB: gpa_array
-	// arg->pBSize: numOfblocks
+static int virtio_qcuda_vhost_init(VirtIOQC *qcu, Error **errp)
+{
+	VirtIODevice *vdev = VIRTIO_DEVICE(qcu);
+	uint32_t i;
+	int ret;
 
-	uint64_t *gpa_array = gpa_to_hva(arg->pB);
-	void *addr;
+	for (i = 0; i < qcu->conf.num_queues; i++)
+		virtio_add_queue(vdev, VIRTIO_QC_VQ_SIZE, virtio_qcuda_vhost_handle);
 
-	int i;
-	for(i = 0; i < arg->pBSize; i++)
+	qcu->vhost.nvqs = qcu->conf.num_queues;
+	qcu->vhost.vqs = g_new0(struct vhost_virtqueue, qcu->vhost.nvqs);
+	qcu->vhost.vq_index = 0;
+	qcu->vhost.backend_features = 0;
+
+	ret = vhost_dev_init(&qcu->vhost, qcu->conf.chardev,
+			VHOST_BACKEND_TYPE_USER);
+	if (ret < 0)
 	{
-		addr    = gpa_to_hva(gpa_array[i]);
-		munmap(addr, BLOCK_SIZE);
-		mmap(addr, BLOCK_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
-   	}
+		error_setg(errp, "vhost-user backend initialization failed: %s",
+				strerror(-ret));
+		g_free(qcu->vhost.vqs);
+		qcu->vhost.vqs = NULL;
+		return ret;
+	}
 
 	return 0;
+}
 
+static void virtio_qcuda_vhost_cleanup(VirtIOQC *qcu)
+{
+	vhost_dev_cleanup(&qcu->vhost);
+	g_free(qcu->vhost.vqs);
+	qcu->vhost.vqs = NULL;
 }
 
-static int qcu_cmd_mmaprelease(VirtioQCArg *arg)
+static int virtio_qcuda_vhost_start(VirtIOQC *qcu)
 {
-	close(ldl_p(&arg->pBSize));
+	VirtIODevice *vdev = VIRTIO_DEVICE(qcu);
+	BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+	VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+	int i, ret;
 
-	//TODO: safely check
+	if (!k->set_guest_notifiers)
+	{
+		error_report("virtio-qcuda: binding does not support guest notifiers");
+		return -ENOSYS;
+	}
+
+	ret = vhost_dev_enable_notifiers(&qcu->vhost, vdev);
+	if (ret < 0)
+		return ret;
 
-	int pid = getpid();
-	char vfname[100];
-	sprintf(vfname, "/home/coldfunction/qcuvf/vm%d_%lx", pid, arg->pA);
+	qcu->vhost.acked_features = vdev->guest_features;
+	ret = vhost_dev_start(&qcu->vhost, vdev);
+	if (ret < 0)
+		goto err_notifiers;
 
-	unlink(vfname);
+	ret = k->set_guest_notifiers(qbus->parent, qcu->vhost.nvqs, true);
+	if (ret < 0)
+		goto err_stop;
+
+	for (i = 0; i < qcu->vhost.nvqs; i++)
+		vhost_virtqueue_mask(&qcu->vhost, vdev, i, false);
 
 	return 0;
+
+err_stop:
+	vhost_dev_stop(&qcu->vhost, vdev);
+err_notifiers:
+	vhost_dev_disable_notifiers(&qcu->vhost, vdev);
+	return ret;
 }
 
-static void virtio_qcuda_cmd_handle(VirtIODevice *vdev, VirtQueue *vq)
+static void virtio_qcuda_vhost_stop(VirtIOQC *qcu)
 {
-	VirtQueueElement elem;
-	VirtioQCArg *arg;
+	VirtIODevice *vdev = VIRTIO_DEVICE(qcu);
+	BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+	VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+	int ret;
 
-	arg = malloc( sizeof(VirtioQCArg));
-	while( virtqueue_pop(vq, &elem) )
-	{
-		iov_to_buf(elem.out_sg, elem.out_num, 0, arg, sizeof(VirtioQCArg));
+	ret = k->set_guest_notifiers(qbus->parent, qcu->vhost.nvqs, false);
+	if (ret < 0)
+		error_report("virtio-qcuda: guest notifier cleanup failed: %d", ret);
 
-		switch( arg->cmd )
-		{
-			case VIRTQC_CMD_WRITE:
-				qcu_cmd_write(arg);
-				break;
+	vhost_dev_stop(&qcu->vhost, vdev);
+	vhost_dev_disable_notifiers(&qcu->vhost, vdev);
+}
 
-			case VIRTQC_CMD_READ:
-				qcu_cmd_read(arg);
-				break;
+/* Hand the rings to the backend once the driver is ready, and take them
+ * back when it resets the device. */
+static void virtio_qcuda_vhost_set_status(VirtIOQC *qcu, bool start)
+{
+	int ret;
 
-			case VIRTQC_CMD_OPEN:
-				qcu_cmd_open(arg);
-				break;
+	if (qcu->vhost.started == start)
+		return;
 
-			case VIRTQC_CMD_CLOSE:
-				qcu_cmd_close(arg);
-				break;
+	trace_virtio_qcuda_vhost(qcu, start);
+	if (!start)
+	{
+		virtio_qcuda_vhost_stop(qcu);
+		return;
+	}
 
-			case VIRTQC_CMD_MMAP:
-				qcu_cmd_mmap(arg);
-				break;
+	ret = virtio_qcuda_vhost_start(qcu);
+	if (ret < 0)
+		error_report("virtio-qcuda: unable to start the vhost-user backend: %s",
+				strerror(-ret));
+}
+#endif
 
-			case VIRTQC_CMD_MUNMAP:
-				qcu_cmd_munmap(arg);
-				break;
+//####################################################################
+//   class basic callback functions
+//####################################################################
 
-			case VIRTQC_CMD_MMAPCTL:
-				qcu_cmd_mmapctl(arg);
-				break;
+static void virtio_qcuda_set_status(VirtIODevice *vdev, uint8_t status)
+{
+	VirtIOQC *qcu = VIRTIO_QC(vdev);
+	bool start = (status & VIRTIO_CONFIG_S_DRIVER_OK) && vdev->vm_running;
 
-			case VIRTQC_CMD_MMAPRELEASE:
-				qcu_cmd_mmaprelease(arg);
-				break;
+#ifdef CONFIG_LINUX
+	if (qcu->conf.chardev != NULL)
+	{
+		virtio_qcuda_vhost_set_status(qcu, start);
+		return;
+	}
+#endif
+	virtio_qcuda_doorbell_set(qcu, start);
+}
 
-#ifdef CONFIG_CUDA
-			// Module & Execution control (driver API)
-			case VIRTQC_cudaRegisterFatBinary:
-				qcu_cudaRegisterFatBinary(arg);
-				break;
+static QcudaLatency *virtio_qcuda_latency_info(const VirtIOQCLatency *l)
+{
+	QcudaLatency *info = g_new0(QcudaLatency, 1);
+	uint64List *b, **tail = &info->buckets;
+	int i;
 
-			case VIRTQC_cudaUnregisterFatBinary:
-				qcu_cudaUnregisterFatBinary(arg);
-				break;
+	info->count = l->count;
+	info->total_ns = l->total_ns;
+	info->max_ns = l->max_ns;
+	for (i = 0; i < VIRTIO_QC_STATS_BUCKETS; i++)
+	{
+		b = g_new0(uint64List, 1);
+		b->value = l->buckets[i];
+		*tail = b;
+		tail = &b->next;
+	}
 
-			case VIRTQC_cudaRegisterFunction:
-				qcu_cudaRegisterFunction(arg);
-				break;
+	return info;
+}
 
-			case VIRTQC_cudaLaunch:
-				qcu_cudaLaunch(arg);
-				break;
+static QcudaAllocStats *virtio_qcuda_alloc_info(QCAllocStats *st)
+{
+	QcudaAllocStats *info = g_new0(QcudaAllocStats, 1);
+
+	info->hits = atomic_read(&st->hits);
+	info->misses = atomic_read(&st->misses);
+	info->frees = atomic_read(&st->frees);
+	info->trims = atomic_read(&st->trims);
+	info->segments = atomic_read(&st->segments);
+	info->reserved = atomic_read(&st->reserved);
+	info->allocated = atomic_read(&st->allocated);
+	info->requested = atomic_read(&st->requested);
+
+	return info;
+}
 
-			// Memory Management (runtime API)
-			case VIRTQC_cudaMalloc:
-				qcu_cudaMalloc(arg);
-				break;
+static QcudaSwapStats *virtio_qcuda_swap_info(QCSwapStats *st)
+{
+	QcudaSwapStats *info = g_new0(QcudaSwapStats, 1);
 
-			case VIRTQC_cudaMemset:
-				qcu_cudaMemset(arg);
-				break;
+	info->resident = atomic_read(&st->resident);
+	info->swapped = atomic_read(&st->swapped);
+	info->evictions = atomic_read(&st->evictions);
+	info->faults = atomic_read(&st->faults);
+	info->bytes_out = atomic_read(&st->bytes_out);
+	info->bytes_in = atomic_read(&st->bytes_in);
 
-			case VIRTQC_cudaMemcpy:
-				qcu_cudaMemcpy(arg);
-				break;
+	return info;
+}
 
-			case VIRTQC_cudaMemcpyAsync:
-				qcu_cudaMemcpyAsync(arg);
-				break;
+static QcudaQos *virtio_qcuda_qos_info(VirtIOQC *qcu)
+{
+	QcudaQos *info = g_new0(QcudaQos, 1);
+	QCQos *m = &qcu->qos;
+	QCQosLimits l;
+
+	qcu_qos_get_limits(m, &l);
+	info->has_group = m->group->name != NULL;
+	info->group = g_strdup(m->group->name);
+	info->weight = m->weight;
+	info->launch_rate = l.launch_rate;
+	info->launch_burst = l.launch_burst;
+	info->copy_bw = l.copy_bw;
+	info->copy_burst = l.copy_burst;
+	info->launches_throttled = atomic_read(&m->throttled[QCU_QOS_LAUNCH]);
+	info->launch_wait_ns = atomic_read(&m->wait_ns[QCU_QOS_LAUNCH]);
+	info->copies_throttled = atomic_read(&m->throttled[QCU_QOS_COPY]);
+	info->copy_wait_ns = atomic_read(&m->wait_ns[QCU_QOS_COPY]);
+
+	return info;
+}
 
-			case VIRTQC_cudaFree:
-				qcu_cudaFree(arg);
-				break;
+static gint virtio_qcuda_stats_cmp(gconstpointer a, gconstpointer b)
+{
+	const VirtIOQCCmdStats *sa = a, *sb = b;
 
-			// Device Management (runtime API)
-			case VIRTQC_cudaGetDevice:
-				qcu_cudaGetDevice(arg);
-				break;
+	return sa->cmd - sb->cmd;
+}
 
-			case VIRTQC_cudaGetDeviceCount:
-				qcu_cudaGetDeviceCount(arg);
-				break;
+QcudaStatsList *qmp_query_qcuda_stats(Error **errp)
+{
+	QcudaStatsList *head = NULL, **tail = &head, *e;
+	QcudaCommandStatsList **ctail, *c;
+	QcudaCommandStats *info;
+	VirtIOQCCmdStats *st;
+	VirtIOQC *qcu;
+	GList *list, *l;
+
+	QLIST_FOREACH(qcu, &virtio_qcuda_devices, next)
+	{
+		e = g_new0(QcudaStatsList, 1);
+		e->value = g_new0(QcudaStats, 1);
+		e->value->device = object_get_canonical_path(OBJECT(qcu));
+		e->value->allocator = virtio_qcuda_alloc_info(&qcu->alloc_stats);
+		e->value->has_swap = qcu->conf.oversubscribe;
+		if (qcu->conf.oversubscribe)
+			e->value->swap = virtio_qcuda_swap_info(&qcu->swap_stats);
+		e->value->qos = virtio_qcuda_qos_info(qcu);
+		ctail = &e->value->commands;
+
+		list = g_list_sort(g_hash_table_get_values(qcu->stats),
+				virtio_qcuda_stats_cmp);
+		for (l = list; l; l = l->next)
+		{
+			st = l->data;
+			info = g_new0(QcudaCommandStats, 1);
+			info->cmd = st->cmd;
+			info->name = g_strdup(virtio_qcuda_cmd_name(st->cmd));
+			info->count = st->count;
+			info->queue_wait = virtio_qcuda_latency_info(
+					&st->phase[VIRTIO_QC_PHASE_QUEUE]);
+			info->translate = virtio_qcuda_latency_info(
+					&st->phase[VIRTIO_QC_PHASE_TRANSLATE]);
+			info->execute = virtio_qcuda_latency_info(
+					&st->phase[VIRTIO_QC_PHASE_EXECUTE]);
+			info->complete = virtio_qcuda_latency_info(
+					&st->phase[VIRTIO_QC_PHASE_COMPLETE]);
+
+			c = g_new0(QcudaCommandStatsList, 1);
+			c->value = info;
+			*ctail = c;
+			ctail = &c->next;
+		}
+		g_list_free(list);
 
-			case VIRTQC_cudaSetDevice:
-				qcu_cudaSetDevice(arg);
-				break;
+		*tail = e;
+		tail = &e->next;
+	}
 
-			case VIRTQC_cudaGetDeviceProperties:
-				qcu_cudaGetDeviceProperties(arg);
-				break;
+	return head;
+}
 
-			case VIRTQC_cudaDeviceSynchronize:
-				qcu_cudaDeviceSynchronize(arg);
-				break;
+/* device is the id of the proxy or the QOM path of either object */
+static VirtIOQC *virtio_qcuda_find(const char *device)
+{
+	DeviceState *proxy;
+	VirtIOQC *qcu;
+	Object *obj;
 
-			case VIRTQC_cudaDeviceReset:
-				qcu_cudaDeviceReset(arg);
-				break;
+	obj = object_resolve_path(device, NULL);
+	QLIST_FOREACH(qcu, &virtio_qcuda_devices, next)
+	{
+		proxy = qdev_get_parent_bus(DEVICE(qcu))->parent;
+		if (obj == OBJECT(qcu) || obj == OBJECT(proxy) ||
+				(proxy->id != NULL && strcmp(proxy->id, device) == 0))
+			return qcu;
+	}
+	return NULL;
+}
 
-			// Version Management (runtime API)
-			case VIRTQC_cudaDriverGetVersion:
-				qcu_cudaDriverGetVersion(arg);
-				break;
+void qmp_qcuda_set_qos(const char *device, bool has_weight, uint32_t weight,
+		bool has_launch_rate, uint64_t launch_rate,
+		bool has_launch_burst, uint64_t launch_burst,
+		bool has_copy_bw, uint64_t copy_bw,
+		bool has_copy_burst, uint64_t copy_burst, Error **errp)
+{
+	VirtIOQC *qcu = virtio_qcuda_find(device);
+	QCQosLimits l;
 
-			case VIRTQC_cudaRuntimeGetVersion:
-				qcu_cudaRuntimeGetVersion(arg);
-				break;
-///////////////////////////////////////////////
-		//	case VIRTQC_checkCudaCapabilities:
-		//		qcu_checkCudaCapabilities(arg);
-///////////////////////////////////////////////
+	if (qcu == NULL)
+	{
+		error_set(errp, ERROR_CLASS_DEVICE_NOT_FOUND,
+				"Device '%s' is not a virtio-qcuda device", device);
+		return;
+	}
+	if (has_weight && (weight < 1 || weight > QCU_QOS_WEIGHT_MAX))
+	{
+		error_setg(errp, "'weight' must be between 1 and %d",
+				QCU_QOS_WEIGHT_MAX);
+		return;
+	}
 
-			//stream
-			case VIRTQC_cudaStreamCreate:
-				qcu_cudaStreamCreate(arg);
-				break;
+	if (has_weight)
+		qcu_qos_set_weight(&qcu->qos, weight);
 
-			case VIRTQC_cudaStreamDestroy:
-				qcu_cudaStreamDestroy(arg);
-				break;
+	qcu_qos_get_limits(&qcu->qos, &l);
+	if (has_launch_rate || has_launch_burst || has_copy_bw || has_copy_burst)
+	{
+		if (has_launch_rate)
+			l.launch_rate = launch_rate;
+		if (has_launch_burst)
+			l.launch_burst = launch_burst;
+		if (has_copy_bw)
+			l.copy_bw = copy_bw;
+		if (has_copy_burst)
+			l.copy_burst = copy_burst;
+		qcu_qos_set_limits(&qcu->qos, &l);
+	}
 
-			// Event Management (runtime API)
-			case VIRTQC_cudaEventCreate:
-				qcu_cudaEventCreate(arg);
-				break;
+	trace_virtio_qcuda_qos(qcu, qcu->qos.weight, l.launch_rate, l.copy_bw);
+}
 
-			case VIRTQC_cudaEventCreateWithFlags:
-				qcu_cudaEventCreateWithFlags(arg);
-				break;
+/* eager-devices is "all" or a comma separated list of host GPU numbers */
+static bool virtio_qcuda_parse_eager(VirtIOQC *qcu, Error **errp)
+{
+	const char *list = qcu->conf.eager_devices;
+	unsigned long long id;
+	char *p, *end;
+
+	qcu->conf.eager_mask = 0;
+	if (list == NULL || *list == '\0')
+		return true;
+	if (strcmp(list, "all") == 0)
+	{
+		qcu->conf.eager_mask = ~0ULL;
+		return true;
+	}
 
-			case VIRTQC_cudaEventRecord:
-				qcu_cudaEventRecord(arg);
-				break;
+	p = (char*)list;
+	for (;;)
+	{
+		if (parse_uint(p, &id, &end, 10) < 0 || id >= 64 ||
+				(*end != ',' && *end != '\0'))
+		{
+			error_setg(errp, "'eager-devices' must be 'all' or a list of "
+					"GPU numbers below 64, not '%s'", list);
+			return false;
+		}
+		qcu->conf.eager_mask |= 1ULL << id;
+		if (*end == '\0')
+			return true;
+		p = end + 1;
+	}
+}
 
-			case VIRTQC_cudaEventSynchronize:
-				qcu_cudaEventSynchronize(arg);
-				break;
+static void virtio_qcuda_device_realize(DeviceState *dev, Error **errp)
+{
+	VirtIODevice *vdev = VIRTIO_DEVICE(dev);
+	VirtIOQC *qcu = VIRTIO_QC(dev);
+	VirtIOQCDoorbell *db;
+	VirtIOQCQueue *q;
+	char name[32];
+	uint32_t i;
+	//Error *err = NULL;
 
-			case VIRTQC_cudaEventElapsedTime:
-				qcu_cudaEventElapsedTime(arg);
-				break;
+	//ptrace("GPU mem size=%"PRIu64"\n", qcu->conf.mem_size);
 
-			case VIRTQC_cudaEventDestroy:
-				qcu_cudaEventDestroy(arg);
-				break;
+	if (qcu->conf.num_queues == 0 ||
+			qcu->conf.num_queues > VIRTIO_QC_MAX_QUEUES)
+	{
+		error_setg(errp, "'queues' must be between 1 and %d",
+				VIRTIO_QC_MAX_QUEUES);
+		return;
+	}
 
-			// Error Handling (runtime API)
-			case VIRTQC_cudaGetLastError:
-				qcu_cudaGetLastError(arg);
-				break;
+	if (!virtio_qcuda_parse_eager(qcu, errp))
+		return;
 
-			//zero-copy
-			case VIRTQC_cudaHostRegister:
-				qcu_cudaHostRegister(arg);
-				break;
+	if (qcu->conf.weight < 1 || qcu->conf.weight > QCU_QOS_WEIGHT_MAX)
+	{
+		error_setg(errp, "'weight' must be between 1 and %d",
+				QCU_QOS_WEIGHT_MAX);
+		return;
+	}
 
-			case VIRTQC_cudaHostGetDevicePointer:
-				qcu_cudaHostGetDevicePointer(arg);
-				break;
+	if (qcu->conf.blob_dir != NULL &&
+			!g_file_test(qcu->conf.blob_dir, G_FILE_TEST_IS_DIR))
+	{
+		error_setg(errp, "'blob-dir' %s is not a directory",
+				qcu->conf.blob_dir);
+		return;
+	}
 
-			case VIRTQC_cudaHostUnregister:
-				qcu_cudaHostUnregister(arg);
-				break;
+	if (qcu->conf.chardev != NULL)
+	{
+#ifdef CONFIG_LINUX
+		if (qcu->conf.mem_size)
+		{
+			error_setg(errp, "'size' cannot be used with an external backend");
+			return;
+		}
+		if (qcu->conf.doorbell_thread || qcu->conf.poll_us > 0)
+		{
+			error_setg(errp, "the backend serves the rings itself, "
+					"'doorbell-thread' and 'poll-us' cannot be used with it");
+			return;
+		}
+		if (qcu->conf.blob_dir != NULL)
+		{
+			error_setg(errp, "'blob-dir' cannot be used with an external "
+					"backend");
+			return;
+		}
+#else
+		error_setg(errp, "external backends need vhost-user support");
+		return;
+#endif
+	}
 
-			case VIRTQC_cudaSetDeviceFlags:
-				qcu_cudaSetDeviceFlags(arg);
-				break;
+	if (qcu->conf.mem_size)
+	{
+		qcu->shm_fd = qcu_shm_open(qcu->conf.mem_size);
+		if (qcu->shm_fd < 0)
+		{
+			error_setg(errp, "cannot allocate %"PRIu64" bytes of shared memory",
+					qcu->conf.mem_size);
+			return;
+		}
+		qcu->shm_ptr = mmap(NULL, qcu->conf.mem_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED, qcu->shm_fd, 0);
+		if (qcu->shm_ptr == MAP_FAILED)
+		{
+			error_setg_errno(errp, errno, "cannot map shared memory");
+			qcu->shm_ptr = NULL;
+			close(qcu->shm_fd);
+			qcu->shm_fd = -1;
+			return;
+		}
+		memory_region_init_ram_ptr(&qcu->shm, OBJECT(qcu), "virtio-qcuda.shm",
+				qcu->conf.mem_size, qcu->shm_ptr);
+		vmstate_register_ram(&qcu->shm, dev);
+	}
 
-			//case VIRTQC_cudaFreeHost:
-			//	qcu_cudaFreeHost(arg);
-			//	break;
+	virtio_init(vdev, "virtio-qcuda", VIRTIO_ID_QC,
+			sizeof(struct virtio_qcuda_config));
 
-#endif
-			default:
-				error("unknow cmd= %d\n", arg->cmd);
+#ifdef CONFIG_LINUX
+	if (qcu->conf.chardev != NULL)
+	{
+		if (virtio_qcuda_vhost_init(qcu, errp) < 0)
+		{
+			virtio_cleanup(vdev);
+			return;
 		}
+		// the rings and GPU state live in the backend
+		error_setg(&qcu->migration_blocker,
+				"virtio-qcuda with an external backend does not support "
+				"migration");
+		migrate_add_blocker(qcu->migration_blocker);
+		return;
+	}
+#endif
 
-		iov_from_buf(elem.in_sg, elem.in_num, 0, arg, sizeof(VirtioQCArg));
-		virtqueue_push(vq, &elem, sizeof(VirtioQCArg));
-		virtio_notify(vdev, vq);
+	qcu_gpa_listener_ref();
+#ifdef QCU_HAVE_VMM
+	// shared by every instance, like the loaded blobs
+	if (qcu->conf.blob_dir != NULL && qcu_blobs == NULL)
+		qcu_blobs = qcu_blob_store_new(&qcu_blob_ops, NULL);
+#endif
+
+	qemu_mutex_init(&qcu->session_lock);
+	qcu->sessions = g_hash_table_new(g_direct_hash, g_direct_equal);
+	qemu_mutex_init(&qcu->pin_lock);
+	qcu->pinned = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+	qcu->stats = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+			NULL, g_free);
+	QLIST_INSERT_HEAD(&virtio_qcuda_devices, qcu, next);
+	qcu_qos_register(&qcu->qos, qcu->conf.qos_group, qcu->conf.weight,
+			&qcu->conf.qos, qemu_get_aio_context());
+	qcu->queues = g_new0(VirtIOQCQueue, qcu->conf.num_queues);
+
+	for (i = 0; i < qcu->conf.num_queues; i++)
+	{
+		q = &qcu->queues[i];
+		q->qcu = qcu;
+		q->index = i;
+		q->vq = virtio_add_queue(vdev, VIRTIO_QC_VQ_SIZE,
+				virtio_qcuda_cmd_handle);
+
+		qemu_mutex_init(&q->lock);
+		qemu_cond_init(&q->cond);
+		qemu_cond_init(&q->idle_cond);
+		QSIMPLEQ_INIT(&q->pending);
+		QSIMPLEQ_INIT(&q->done);
+		q->bh = qemu_bh_new(virtio_qcuda_complete_bh, q);
+
+		snprintf(name, sizeof(name), "virtio-qcuda/%u", i);
+		qemu_thread_create(&q->thread, name, virtio_qcuda_worker,
+				q, QEMU_THREAD_JOINABLE);
 	}
-		free(arg);
-}
 
-//####################################################################
-//   class basic callback functions
-//####################################################################
+	if (qcu->conf.doorbell_thread || qcu->conf.poll_us > 0)
+	{
+		db = &qcu->doorbell;
+		qemu_mutex_init(&db->lock);
+		qemu_cond_init(&db->cond);
+		event_notifier_init(&db->wake, 0);
+		db->running = true;
+		qemu_thread_create(&db->thread, "virtio-qcuda/doorbell",
+				virtio_qcuda_doorbell, qcu, QEMU_THREAD_JOINABLE);
+	}
 
-static void virtio_qcuda_device_realize(DeviceState *dev, Error **errp)
+	qcu->mig_closed = g_array_new(FALSE, FALSE, sizeof(uint32_t));
+	qcu->vmstate = qemu_add_vm_change_state_handler(
+			virtio_qcuda_vm_state_change, qcu);
+	register_savevm(dev, "virtio-qcuda", -1, 1, virtio_qcuda_save,
+			virtio_qcuda_load, qcu);
+#ifdef CONFIG_CUDA
+	register_savevm_live(dev, "virtio-qcuda-gpu", -1, 1,
+			&savevm_virtio_qcuda_gpu, qcu);
+#endif
+}
+
+static void virtio_qcuda_device_unrealize(DeviceState *dev, Error **errp)
 {
 	VirtIODevice *vdev = VIRTIO_DEVICE(dev);
 	VirtIOQC *qcu = VIRTIO_QC(dev);
-	//Error *err = NULL;
+	VirtIOQCQueue *q;
+	uint32_t i;
 
-	//ptrace("GPU mem size=%"PRIu64"\n", qcu->conf.mem_size);
+#ifdef CONFIG_LINUX
+	if (qcu->conf.chardev != NULL)
+	{
+		migrate_del_blocker(qcu->migration_blocker);
+		error_free(qcu->migration_blocker);
+		virtio_qcuda_set_status(vdev, 0);
+		virtio_qcuda_vhost_cleanup(qcu);
+		virtio_cleanup(vdev);
+		return;
+	}
+#endif
+
+#ifdef CONFIG_CUDA
+	unregister_savevm(dev, "virtio-qcuda-gpu", qcu);
+#endif
+	unregister_savevm(dev, "virtio-qcuda", qcu);
+	qemu_del_vm_change_state_handler(qcu->vmstate);
+
+	if (qcu->doorbell.running)
+		virtio_qcuda_doorbell_stop(qcu);
+
+	qcu_qos_stop(&qcu->qos);
+	virtio_qcuda_drain(qcu);
+	qcu_session_close_all(qcu);
 
-	virtio_init(vdev, "virtio-qcuda", VIRTIO_ID_QC, sizeof(VirtIOQCConf));
+	for (i = 0; i < qcu->conf.num_queues; i++)
+	{
+		q = &qcu->queues[i];
+
+		qemu_mutex_lock(&q->lock);
+		q->stopping = true;
+		qemu_cond_signal(&q->cond);
+		qemu_mutex_unlock(&q->lock);
+		qemu_thread_join(&q->thread);
+
+		qemu_bh_delete(q->bh);
+		qemu_cond_destroy(&q->idle_cond);
+		qemu_cond_destroy(&q->cond);
+		qemu_mutex_destroy(&q->lock);
+	}
+
+	g_free(qcu->queues);
+	g_array_free(qcu->mig_closed, TRUE);
+	g_hash_table_destroy(qcu->sessions);
+	qemu_mutex_destroy(&qcu->session_lock);
+	g_hash_table_destroy(qcu->pinned);
+	qemu_mutex_destroy(&qcu->pin_lock);
+	QLIST_REMOVE(qcu, next);
+	qcu_qos_unregister(&qcu->qos);
+	g_hash_table_destroy(qcu->stats);
+	qcu_gpa_listener_unref();
+	if (qcu->shm_ptr != NULL)
+		vmstate_unregister_ram(&qcu->shm, dev);
+	virtio_cleanup(vdev);
+}
+
+static void virtio_qcuda_reset(VirtIODevice *vdev)
+{
+	VirtIOQC *qcu = VIRTIO_QC(vdev);
+
+	// sessions of an external backend end with its rings
+	if (qcu->conf.chardev != NULL)
+		return;
+
+	// a throttled guest must not hold up its own reset
+	qcu_qos_stop(&qcu->qos);
+	virtio_qcuda_drain(qcu);
+	qcu_session_close_all(qcu);
+	qcu_qos_resume(&qcu->qos);
+}
+
+static void virtio_qcuda_get_config(VirtIODevice *vdev, uint8_t *config_data)
+{
+	VirtIOQC *qcu = VIRTIO_QC(vdev);
+	struct virtio_qcuda_config config;
 
-	qcu->vq  = virtio_add_queue(vdev, 1024, virtio_qcuda_cmd_handle);
+	memset(&config, 0, sizeof(config));
+	virtio_stq_p(vdev, &config.mem_size, qcu->conf.mem_size);
+	virtio_stl_p(vdev, &config.num_queues, qcu->conf.num_queues);
+	memcpy(config_data, &config, sizeof(config));
 }
 
 static uint64_t virtio_qcuda_get_features(VirtIODevice *vdev, uint64_t features, Error **errp)
 {
 	//ptrace("feature=%"PRIu64"\n", features);
+#ifdef CONFIG_LINUX
+	VirtIOQC *qcu = VIRTIO_QC(vdev);
+
+	if (qcu->conf.chardev != NULL)
+		return vhost_get_features(&qcu->vhost,
+				virtio_qcuda_vhost_feature_bits, features);
+#endif
 	return features;
 }
 
 /*
-   static void virtio_qcuda_device_unrealize(DeviceState *dev, Error **errp)
-   {
-   ptrace("\n");
-   }
-
-   static void virtio_qcuda_get_config(VirtIODevice *vdev, uint8_t *config)
-   {
-   ptrace("\n");
-   }
-
    static void virtio_qcuda_set_config(VirtIODevice *vdev, const uint8_t *config)
    {
    ptrace("\n");
    }
 
-   static void virtio_qcuda_reset(VirtIODevice *vdev)
-   {
-   ptrace("\n");
-   }
-
    static void virtio_qcuda_save_device(VirtIODevice *vdev, QEMUFile *f)
    {
    ptrace("\n");
@@ -1494,6 +7069,23 @@ DEFINE_PROP_SIZE(config name, device struce, element, default value)
 static Property virtio_qcuda_properties[] =
 {
 	DEFINE_PROP_SIZE("size", VirtIOQC, conf.mem_size, 0),
+	DEFINE_PROP_UINT32("queues", VirtIOQC, conf.num_queues, 1),
+	DEFINE_PROP_BOOL("pin-guest-ram", VirtIOQC, conf.pin_guest_ram, false),
+	DEFINE_PROP_STRING("module-cache", VirtIOQC, conf.module_cache),
+	DEFINE_PROP_STRING("eager-devices", VirtIOQC, conf.eager_devices),
+	DEFINE_PROP_BOOL("alloc-cache", VirtIOQC, conf.alloc_cache, true),
+	DEFINE_PROP_BOOL("oversubscribe", VirtIOQC, conf.oversubscribe, false),
+	DEFINE_PROP_SIZE("resident-limit", VirtIOQC, conf.resident_limit, 0),
+	DEFINE_PROP_BOOL("doorbell-thread", VirtIOQC, conf.doorbell_thread, false),
+	DEFINE_PROP_UINT32("poll-us", VirtIOQC, conf.poll_us, 0),
+	DEFINE_PROP_STRING("blob-dir", VirtIOQC, conf.blob_dir),
+	DEFINE_PROP_CHR("chardev", VirtIOQC, conf.chardev),
+	DEFINE_PROP_STRING("qos-group", VirtIOQC, conf.qos_group),
+	DEFINE_PROP_UINT32("weight", VirtIOQC, conf.weight, QCU_QOS_WEIGHT_DEFAULT),
+	DEFINE_PROP_UINT64("launch-rate", VirtIOQC, conf.qos.launch_rate, 0),
+	DEFINE_PROP_UINT64("launch-burst", VirtIOQC, conf.qos.launch_burst, 0),
+	DEFINE_PROP_UINT64("copy-bw", VirtIOQC, conf.qos.copy_bw, 0),
+	DEFINE_PROP_UINT64("copy-burst", VirtIOQC, conf.qos.copy_burst, 0),
 	DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -1509,22 +7101,35 @@ static void virtio_qcuda_class_init(ObjectClass *klass, void *data)
 	vdc->get_features = virtio_qcuda_get_features;
 
 	vdc->realize = virtio_qcuda_device_realize;
+	vdc->unrealize = virtio_qcuda_device_unrealize;
+	vdc->reset = virtio_qcuda_reset;
+	vdc->get_config = virtio_qcuda_get_config;
+	vdc->set_status = virtio_qcuda_set_status;
 	/*
-		vdc->unrealize = virtio_qcuda_device_unrealize;
-
-		vdc->get_config = virtio_qcuda_get_config;
 		vdc->set_config = virtio_qcuda_set_config;
 
 		vdc->save = virtio_qcuda_save_device;
 		vdc->load = virtio_qcuda_load_device;
-
-		vdc->set_status = virtio_qcuda_set_status;
-		vdc->reset = virtio_qcuda_reset;
 	 */
 }
 
 static void virtio_qcuda_instance_init(Object *obj)
 {
+	VirtIOQC *qcu = VIRTIO_QC(obj);
+
+	qcu->shm_fd = -1;
+}
+
+/* The shm region may still be referenced by a flat view after unrealize;
+ * the mapping goes away only with the last reference to the device. */
+static void virtio_qcuda_instance_finalize(Object *obj)
+{
+	VirtIOQC *qcu = VIRTIO_QC(obj);
+
+	if (qcu->shm_ptr != NULL)
+		munmap(qcu->shm_ptr, qcu->conf.mem_size);
+	if (qcu->shm_fd >= 0)
+		close(qcu->shm_fd);
 }
 
 static const TypeInfo virtio_qcuda_device_info = {
@@ -1532,6 +7137,7 @@ static const TypeInfo virtio_qcuda_device_info = {
 	.parent = TYPE_VIRTIO_DEVICE,
 	.instance_size = sizeof(VirtIOQC),
 	.instance_init = virtio_qcuda_instance_init,
+	.instance_finalize = virtio_qcuda_instance_finalize,
 	.class_init = virtio_qcuda_class_init,
 };
 
@@ -88,6 +88,7 @@ bool vring_setup(Vring *vring, VirtIODevice *vdev, int n)
     vring->last_used_idx = vring_get_used_idx(vdev, vring);
     vring->signalled_used = 0;
     vring->signalled_used_valid = false;
+    vring->pool = virtqueue_element_pool_new(vring->vr.num);
 
     trace_vring_setup(virtio_queue_get_ring_addr(vdev, n),
                       vring->vr.desc, vring->vr.avail, vring->vr.used);
@@ -99,6 +100,8 @@ void vring_teardown(Vring *vring, VirtIODevice *vdev, int n)
     virtio_queue_set_last_avail_idx(vdev, n, vring->last_avail_idx);
     virtio_queue_invalidate_signalled_used(vdev, n);
 
+    virtqueue_element_pool_release(vring->pool);
+    vring->pool = NULL;
     memory_region_unref(vring->mr);
 }
 
@@ -309,22 +312,23 @@ static void vring_unmap_element(VirtQueueElement *elem)
  * number of output then some number of input descriptors, it's actually two
  * iovecs, but we pack them into one and note how many of each there were.
  *
- * This function returns the descriptor number found, or vq->num (which is
- * never a valid descriptor number) if none was found.  A negative code is
- * returned on error.
+ * This function returns a request of sz bytes that starts with the element,
+ * see virtqueue_pop(), or NULL if none was found or on error; the vring is
+ * broken after an error.
  *
  * Stolen from linux/drivers/vhost/vhost.c.
  */
-int vring_pop(VirtIODevice *vdev, Vring *vring,
-              VirtQueueElement *elem)
+void *vring_pop(VirtIODevice *vdev, Vring *vring, size_t sz)
 {
     struct vring_desc desc;
     unsigned int i, head, found = 0, num = vring->vr.num;
     uint16_t avail_idx, last_avail_idx;
+    VirtQueueElement *elem, *s;
     int ret;
 
-    /* Initialize elem so it can be safely unmapped */
-    elem->in_num = elem->out_num = 0;
+    /* Descriptors are collected in the scratch element, which starts out
+     * empty so it can be safely unmapped */
+    s = virtqueue_element_pool_scratch(vring->pool);
 
     /* If there was a fatal error then refuse operation */
     if (vring->broken) {
@@ -357,7 +361,7 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
      * the index we've seen. */
     head = vring_get_avail_ring(vdev, vring, last_avail_idx % num);
 
-    elem->index = head;
+    s->index = head;
 
     /* If their number is silly, that's an error. */
     if (unlikely(head >= num)) {
@@ -385,14 +389,14 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
         barrier();
 
         if (desc.flags & VRING_DESC_F_INDIRECT) {
-            ret = get_indirect(vdev, vring, elem, &desc);
+            ret = get_indirect(vdev, vring, s, &desc);
             if (ret < 0) {
                 goto out;
             }
             continue;
         }
 
-        ret = get_desc(vring, elem, &desc);
+        ret = get_desc(vring, s, &desc);
         if (ret < 0) {
             goto out;
         }
@@ -407,15 +411,22 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
             virtio_tswap16(vdev, vring->last_avail_idx);
     }
 
-    return head;
+    /* Now that the size is known, move the mappings to the element */
+    elem = virtqueue_alloc_element(vring->pool, sz, s->out_num, s->in_num);
+    elem->index = s->index;
+    memcpy(elem->in_addr, s->in_addr, s->in_num * sizeof(s->in_addr[0]));
+    memcpy(elem->out_addr, s->out_addr, s->out_num * sizeof(s->out_addr[0]));
+    memcpy(elem->in_sg, s->in_sg, s->in_num * sizeof(s->in_sg[0]));
+    memcpy(elem->out_sg, s->out_sg, s->out_num * sizeof(s->out_sg[0]));
+    return elem;
 
 out:
     assert(ret < 0);
     if (ret == -EFAULT) {
         vring->broken = true;
     }
-    vring_unmap_element(elem);
-    return ret;
+    vring_unmap_element(s);
+    return NULL;
 }
 
 /* After we've used one of their buffers, we tell them about it.
@@ -1060,15 +1060,38 @@ static void virtio_qcuda_pci_realize(VirtIOPCIProxy *vpci_dev, Error **errp)
 {
     VirtIOQCPCI *qcu= VIRTIO_QC_PCI(vpci_dev);
     DeviceState *vdev = DEVICE(&qcu->vdev);
+    Error *err = NULL;
+    uint64_t size = qcu->vdev.conf.mem_size;
+
+    if (vpci_dev->nvectors == DEV_NVECTORS_UNSPECIFIED) {
+        vpci_dev->nvectors = qcu->vdev.conf.num_queues + 1;
+    }
 
     qdev_set_parent_bus(vdev, BUS(&vpci_dev->bus));
-    object_property_set_bool(OBJECT(vdev), true, "realized", errp);
+    object_property_set_bool(OBJECT(vdev), true, "realized", &err);
+    if (err) {
+        error_propagate(errp, err);
+        return;
+    }
+
+    if (size) {
+        /* BARs are a power of two, the shared memory need not be */
+        memory_region_init(&qcu->shm_bar, OBJECT(qcu), "virtio-qcuda-shm-bar",
+                           pow2ceil(size));
+        memory_region_add_subregion(&qcu->shm_bar, 0, &qcu->vdev.shm);
+        pci_register_bar(&vpci_dev->pci_dev, VIRTIO_QC_SHM_BAR,
+                         PCI_BASE_ADDRESS_SPACE_MEMORY |
+                         PCI_BASE_ADDRESS_MEM_PREFETCH |
+                         PCI_BASE_ADDRESS_MEM_TYPE_64,
+                         &qcu->shm_bar);
+    }
 }
 
 static Property virtio_qcuda_pci_properties[] = {
     DEFINE_PROP_BIT("ioeventfd", VirtIOPCIProxy, flags,
                     VIRTIO_PCI_FLAG_USE_IOEVENTFD_BIT, true),
-    DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors, 2),
+    DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors,
+                       DEV_NVECTORS_UNSPECIFIED),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -301,6 +301,7 @@ struct VirtIOGPUPCI {
 struct VirtIOQCPCI {
     VirtIOPCIProxy parent_obj;
     VirtIOQC vdev;
+    MemoryRegion shm_bar;
 };
 
 /* Virtio ABI version, if we increment this, we break the guest driver. */
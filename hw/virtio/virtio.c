@@ -16,6 +16,7 @@
 #include "trace.h"
 #include "exec/address-spaces.h"
 #include "qemu/error-report.h"
+#include "qemu/host-utils.h"
 #include "hw/virtio/virtio.h"
 #include "qemu/atomic.h"
 #include "hw/virtio/virtio-bus.h"
@@ -88,9 +89,42 @@ struct VirtQueue
     VirtIODevice *vdev;
     EventNotifier guest_notifier;
     EventNotifier host_notifier;
+    VirtQueueElementPool *pool;
     QLIST_ENTRY(VirtQueue) node;
 };
 
+/*
+ * Elements are sized for the request they carry: their arrays are rounded
+ * up to a power of two entries per direction, and every queue keeps the
+ * elements its device frees, by size class, to hand them out again.  A
+ * queue in steady state does not allocate at all.  Elements may be freed
+ * from any thread and may outlive their queue, so the pool is locked and
+ * counts the elements it has out.
+ */
+#define VIRTQUEUE_POOL_CLASSES 11       /* 1 to VIRTQUEUE_MAX_SIZE entries */
+
+typedef struct VirtQueueScratch {
+    VirtQueueElement elem;
+    hwaddr in_addr[VIRTQUEUE_MAX_SIZE];
+    hwaddr out_addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec in_sg[VIRTQUEUE_MAX_SIZE];
+    struct iovec out_sg[VIRTQUEUE_MAX_SIZE];
+} VirtQueueScratch;
+
+struct VirtQueueElementPool {
+    QemuMutex lock;
+    int refs;                   /* the owner and every element out */
+    bool orphaned;              /* the owner is gone, cache nothing */
+    size_t sz;                  /* request size of the cached elements */
+    unsigned int cached;
+    unsigned int max_cached;
+    QSLIST_HEAD(, VirtQueueElement) free[VIRTQUEUE_POOL_CLASSES];
+
+    /* Descriptors are collected here until the element can be sized.
+     * Only whoever pops from the queue uses it, so it is not locked. */
+    VirtQueueScratch *scratch;
+};
+
 /* virt queue functions */
 void virtio_queue_update_rings(VirtIODevice *vdev, int n)
 {
@@ -434,6 +468,165 @@ int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
     return in_bytes <= in_total && out_bytes <= out_total;
 }
 
+VirtQueueElementPool *virtqueue_element_pool_new(unsigned int max_cached)
+{
+    VirtQueueElementPool *pool = g_new0(VirtQueueElementPool, 1);
+
+    qemu_mutex_init(&pool->lock);
+    pool->refs = 1;
+    pool->max_cached = max_cached;
+    return pool;
+}
+
+/* Called with the pool lock held; returns true if pool must be freed. */
+static bool virtqueue_element_pool_unref(VirtQueueElementPool *pool)
+{
+    return --pool->refs == 0;
+}
+
+static void virtqueue_element_pool_free(VirtQueueElementPool *pool)
+{
+    qemu_mutex_destroy(&pool->lock);
+    g_free(pool);
+}
+
+/* Drop the owner's reference; elements still out free themselves. */
+void virtqueue_element_pool_release(VirtQueueElementPool *pool)
+{
+    VirtQueueElement *elem;
+    bool last;
+    int i;
+
+    if (!pool) {
+        return;
+    }
+
+    qemu_mutex_lock(&pool->lock);
+    pool->orphaned = true;
+    for (i = 0; i < VIRTQUEUE_POOL_CLASSES; i++) {
+        while ((elem = QSLIST_FIRST(&pool->free[i])) != NULL) {
+            QSLIST_REMOVE_HEAD(&pool->free[i], pool_next);
+            g_free(elem);
+        }
+    }
+    pool->cached = 0;
+    g_free(pool->scratch);
+    pool->scratch = NULL;
+    last = virtqueue_element_pool_unref(pool);
+    qemu_mutex_unlock(&pool->lock);
+
+    if (last) {
+        virtqueue_element_pool_free(pool);
+    }
+}
+
+/* An empty element with room for VIRTQUEUE_MAX_SIZE descriptors in each
+ * direction, to collect a request in before it is copied out with
+ * virtqueue_alloc_element(). */
+VirtQueueElement *virtqueue_element_pool_scratch(VirtQueueElementPool *pool)
+{
+    VirtQueueScratch *s = pool->scratch;
+
+    if (!s) {
+        s = pool->scratch = g_new(VirtQueueScratch, 1);
+        s->elem.in_addr = s->in_addr;
+        s->elem.out_addr = s->out_addr;
+        s->elem.in_sg = s->in_sg;
+        s->elem.out_sg = s->out_sg;
+        s->elem.pool = NULL;
+    }
+    s->elem.in_num = s->elem.out_num = 0;
+    return &s->elem;
+}
+
+static unsigned int virtqueue_element_class(unsigned int num)
+{
+    return num <= 1 ? 0 : 32 - clz32(num - 1);
+}
+
+/*
+ * Allocate a request of sz bytes that starts with a VirtQueueElement, with
+ * room for out_num and in_num descriptors, from pool if it is not NULL.
+ * The arrays are left for the caller to fill, and so is the rest of the
+ * request, which is not cleared.
+ */
+void *virtqueue_alloc_element(VirtQueueElementPool *pool, size_t sz,
+                              unsigned int out_num, unsigned int in_num)
+{
+    unsigned int cls = virtqueue_element_class(MAX(out_num, in_num));
+    size_t num = (size_t)1 << cls;
+    size_t addr_ofs = QEMU_ALIGN_UP(sz, __alignof__(hwaddr));
+    size_t sg_ofs = QEMU_ALIGN_UP(addr_ofs + 2 * num * sizeof(hwaddr),
+                                  __alignof__(struct iovec));
+    VirtQueueElement *elem = NULL;
+    VirtQueueElementPool *owner = NULL;
+
+    assert(sz >= sizeof(VirtQueueElement));
+    assert(cls < VIRTQUEUE_POOL_CLASSES);
+
+    if (pool) {
+        qemu_mutex_lock(&pool->lock);
+        if (pool->sz == 0) {
+            pool->sz = sz;
+        }
+        /* a queue carries one kind of request; anything else bypasses it */
+        if (pool->sz == sz && !pool->orphaned) {
+            elem = QSLIST_FIRST(&pool->free[cls]);
+            if (elem) {
+                QSLIST_REMOVE_HEAD(&pool->free[cls], pool_next);
+                pool->cached--;
+            }
+            pool->refs++;
+            owner = pool;
+        }
+        qemu_mutex_unlock(&pool->lock);
+    }
+
+    if (!elem) {
+        elem = g_malloc(sg_ofs + 2 * num * sizeof(struct iovec));
+    }
+    elem->pool = owner;
+    elem->pool_class = cls;
+    elem->out_num = out_num;
+    elem->in_num = in_num;
+    elem->in_addr = (void *)elem + addr_ofs;
+    elem->out_addr = elem->in_addr + num;
+    elem->in_sg = (void *)elem + sg_ofs;
+    elem->out_sg = elem->in_sg + num;
+    return elem;
+}
+
+/* Free a request allocated by virtqueue_pop() or virtqueue_alloc_element(),
+ * after it has been pushed or discarded. */
+void virtqueue_element_free(VirtQueueElement *elem)
+{
+    VirtQueueElementPool *pool;
+    bool last;
+
+    if (!elem) {
+        return;
+    }
+    pool = elem->pool;
+    if (!pool) {
+        g_free(elem);
+        return;
+    }
+
+    qemu_mutex_lock(&pool->lock);
+    if (!pool->orphaned && pool->cached < pool->max_cached) {
+        QSLIST_INSERT_HEAD(&pool->free[elem->pool_class], elem, pool_next);
+        pool->cached++;
+        elem = NULL;
+    }
+    last = virtqueue_element_pool_unref(pool);
+    qemu_mutex_unlock(&pool->lock);
+
+    g_free(elem);
+    if (last) {
+        virtqueue_element_pool_free(pool);
+    }
+}
+
 void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
     size_t num_sg, int is_write)
 {
@@ -456,17 +649,47 @@ void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
     }
 }
 
-int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
+/* Copy the descriptors collected in s to an element sized for them and
+ * map them. */
+static void *virtqueue_element_copy(VirtQueueElementPool *pool, size_t sz,
+                                    const VirtQueueElement *s)
+{
+    VirtQueueElement *elem;
+    unsigned int i;
+
+    elem = virtqueue_alloc_element(pool, sz, s->out_num, s->in_num);
+    elem->index = s->index;
+    memcpy(elem->in_addr, s->in_addr, s->in_num * sizeof(s->in_addr[0]));
+    memcpy(elem->out_addr, s->out_addr, s->out_num * sizeof(s->out_addr[0]));
+    for (i = 0; i < s->in_num; i++) {
+        elem->in_sg[i].iov_len = s->in_sg[i].iov_len;
+    }
+    for (i = 0; i < s->out_num; i++) {
+        elem->out_sg[i].iov_len = s->out_sg[i].iov_len;
+    }
+
+    virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
+    virtqueue_map_sg(elem->out_sg, elem->out_addr, elem->out_num, 0);
+    return elem;
+}
+
+/*
+ * Take the next request off vq, or return NULL if there is none.  The
+ * result is a request of sz bytes that starts with the VirtQueueElement,
+ * free it with virtqueue_element_free().
+ */
+void *virtqueue_pop(VirtQueue *vq, size_t sz)
 {
     unsigned int i, head, max;
     hwaddr desc_pa = vq->vring.desc;
     VirtIODevice *vdev = vq->vdev;
+    VirtQueueElement *s, *elem;
 
     if (!virtqueue_num_heads(vq, vq->last_avail_idx))
-        return 0;
+        return NULL;
 
     /* When we start there are none of either input nor output. */
-    elem->out_num = elem->in_num = 0;
+    s = virtqueue_element_pool_scratch(vq->pool);
 
     max = vq->vring.num;
 
@@ -492,40 +715,98 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
         struct iovec *sg;
 
         if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_WRITE) {
-            if (elem->in_num >= ARRAY_SIZE(elem->in_sg)) {
+            if (s->in_num >= VIRTQUEUE_MAX_SIZE) {
                 error_report("Too many write descriptors in indirect table");
                 exit(1);
             }
-            elem->in_addr[elem->in_num] = vring_desc_addr(vdev, desc_pa, i);
-            sg = &elem->in_sg[elem->in_num++];
+            s->in_addr[s->in_num] = vring_desc_addr(vdev, desc_pa, i);
+            sg = &s->in_sg[s->in_num++];
         } else {
-            if (elem->out_num >= ARRAY_SIZE(elem->out_sg)) {
+            if (s->out_num >= VIRTQUEUE_MAX_SIZE) {
                 error_report("Too many read descriptors in indirect table");
                 exit(1);
             }
-            elem->out_addr[elem->out_num] = vring_desc_addr(vdev, desc_pa, i);
-            sg = &elem->out_sg[elem->out_num++];
+            s->out_addr[s->out_num] = vring_desc_addr(vdev, desc_pa, i);
+            sg = &s->out_sg[s->out_num++];
         }
 
         sg->iov_len = vring_desc_len(vdev, desc_pa, i);
 
         /* If we've got too many, that implies a descriptor loop. */
-        if ((elem->in_num + elem->out_num) > max) {
+        if ((s->in_num + s->out_num) > max) {
             error_report("Looped descriptor");
             exit(1);
         }
     } while ((i = virtqueue_next_desc(vdev, desc_pa, i, max)) != max);
 
-    /* Now map what we have collected */
-    virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
-    virtqueue_map_sg(elem->out_sg, elem->out_addr, elem->out_num, 0);
-
-    elem->index = head;
+    /* Now size the element and map what we have collected */
+    s->index = head;
+    elem = virtqueue_element_copy(vq->pool, sz, s);
 
     vq->inuse++;
 
     trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
-    return elem->in_num + elem->out_num;
+    return elem;
+}
+
+/*
+ * Reading and writing a structure directly to QEMUFile is what QEMU has
+ * always done for the requests devices have in flight.  Elements have no
+ * fixed layout any more, so they are marshalled to and from the one that
+ * was used before.
+ */
+typedef struct VirtQueueElementOld {
+    unsigned int index;
+    unsigned int out_num;
+    unsigned int in_num;
+    hwaddr in_addr[VIRTQUEUE_MAX_SIZE];
+    hwaddr out_addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec in_sg[VIRTQUEUE_MAX_SIZE];
+    struct iovec out_sg[VIRTQUEUE_MAX_SIZE];
+} VirtQueueElementOld;
+
+void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
+{
+    VirtQueueElementOld *data = g_new0(VirtQueueElementOld, 1);
+
+    data->index = elem->index;
+    data->in_num = elem->in_num;
+    data->out_num = elem->out_num;
+    memcpy(data->in_addr, elem->in_addr,
+           elem->in_num * sizeof(elem->in_addr[0]));
+    memcpy(data->out_addr, elem->out_addr,
+           elem->out_num * sizeof(elem->out_addr[0]));
+    memcpy(data->in_sg, elem->in_sg, elem->in_num * sizeof(elem->in_sg[0]));
+    memcpy(data->out_sg, elem->out_sg,
+           elem->out_num * sizeof(elem->out_sg[0]));
+
+    qemu_put_buffer(f, (uint8_t *)data, sizeof(*data));
+    g_free(data);
+}
+
+/* The element saved by qemu_put_virtqueue_element(), mapped again, in a
+ * request of sz bytes; NULL if the stream is corrupt. */
+void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz)
+{
+    VirtQueueElementOld *data = g_new(VirtQueueElementOld, 1);
+    VirtQueueElement s, *elem = NULL;
+
+    qemu_get_buffer(f, (uint8_t *)data, sizeof(*data));
+    if (data->in_num <= VIRTQUEUE_MAX_SIZE &&
+        data->out_num <= VIRTQUEUE_MAX_SIZE) {
+        s.index = data->index;
+        s.in_num = data->in_num;
+        s.out_num = data->out_num;
+        s.in_addr = data->in_addr;
+        s.out_addr = data->out_addr;
+        s.in_sg = data->in_sg;
+        s.out_sg = data->out_sg;
+        elem = virtqueue_element_copy(NULL, sz, &s);
+    } else {
+        error_report("virtio: invalid element in migration stream");
+    }
+    g_free(data);
+    return elem;
 }
 
 /* virtio device */
@@ -966,6 +1247,7 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
     vdev->vq[i].vring.num = queue_size;
     vdev->vq[i].vring.align = VIRTIO_PCI_VRING_ALIGN;
     vdev->vq[i].handle_output = handle_output;
+    vdev->vq[i].pool = virtqueue_element_pool_new(queue_size);
 
     return &vdev->vq[i];
 }
@@ -977,6 +1259,8 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
     }
 
     vdev->vq[n].vring.num = 0;
+    virtqueue_element_pool_release(vdev->vq[n].pool);
+    vdev->vq[n].pool = NULL;
 }
 
 void virtio_irq(VirtQueue *vq)
@@ -1356,7 +1640,12 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    int i;
+
     qemu_del_vm_change_state_handler(vdev->vmstate);
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        virtqueue_element_pool_release(vdev->vq[i].pool);
+    }
     g_free(vdev->config);
     g_free(vdev->vq);
     g_free(vdev->vector_queues);
@@ -29,6 +29,7 @@ typedef struct {
     uint16_t signalled_used;        /* EVENT_IDX state */
     bool signalled_used_valid;
     bool broken;                    /* was there a fatal error? */
+    VirtQueueElementPool *pool;     /* requests popped from the vring */
 } Vring;
 
 /* Fail future vring_pop() and vring_push() calls until reset */
@@ -42,7 +43,7 @@ void vring_teardown(Vring *vring, VirtIODevice *vdev, int n);
 void vring_disable_notification(VirtIODevice *vdev, Vring *vring);
 bool vring_enable_notification(VirtIODevice *vdev, Vring *vring);
 bool vring_should_notify(VirtIODevice *vdev, Vring *vring);
-int vring_pop(VirtIODevice *vdev, Vring *vring, VirtQueueElement *elem);
+void *vring_pop(VirtIODevice *vdev, Vring *vring, size_t sz);
 void vring_push(VirtIODevice *vdev, Vring *vring, VirtQueueElement *elem,
                 int len);
 
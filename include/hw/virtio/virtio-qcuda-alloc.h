@@ -0,0 +1,69 @@
+#ifndef _QEMU_VIRTIO_QCUDA_ALLOC_H
+#define _QEMU_VIRTIO_QCUDA_ALLOC_H
+
+/*
+ * Caching sub-allocator for virtio-qcuda device memory.
+ *
+ * Device memory is taken from the driver in segments and carved into
+ * blocks.  Freed blocks stay cached in the size class bins of their pool
+ * (one pool per stream and per small/large class) and are merged with
+ * free neighbours; segments only go back to the driver when an
+ * allocation fails (trim on pressure), on qcu_alloc_trim() or when the
+ * allocator is destroyed.
+ *
+ * A block freed with a fence is not reused before the fence has passed,
+ * which lets the device drop the implicit synchronization of cudaFree.
+ * Fences are expected to pass in the order they were created.
+ */
+#define QCU_ALLOC_ROUND		512
+#define QCU_ALLOC_SMALL		(1 << 20)	// largest request of the small pool
+#define QCU_ALLOC_SMALL_SEG	(2 << 20)
+#define QCU_ALLOC_MID		(10 << 20)	// requests below get a mid segment
+#define QCU_ALLOC_MID_SEG	(20 << 20)
+#define QCU_ALLOC_LARGE_ROUND	(2 << 20)
+#define QCU_ALLOC_BINS		48
+
+/* Backend callbacks; all of them run under the allocator lock. */
+typedef struct QCAllocOps
+{
+	/* get and return a segment; alloc returns false when out of memory */
+	bool (*alloc)(void *opaque, uint64_t size, uint64_t *addr);
+	void (*free)(void *opaque, uint64_t addr);
+
+	/* fence after the work queued so far, NULL if all of it is done */
+	void *(*fence_new)(void *opaque);
+	bool (*fence_done)(void *opaque, void *fence);
+	void (*fence_wait)(void *opaque, void *fence);
+	void (*fence_release)(void *opaque, void *fence);
+} QCAllocOps;
+
+/* Counters, updated atomically so that several allocators can share them. */
+typedef struct QCAllocStats
+{
+	uint64_t hits;		// served from cached memory
+	uint64_t misses;	// needed a new segment
+	uint64_t frees;
+	uint64_t trims;		// segments returned before the allocator went away
+	uint64_t segments;
+	uint64_t reserved;	// bytes held in segments
+	uint64_t allocated;	// bytes in allocated blocks
+	uint64_t requested;	// bytes asked for by those allocations
+} QCAllocStats;
+
+typedef struct QCAlloc QCAlloc;
+
+QCAlloc *qcu_alloc_new(const QCAllocOps *ops, void *opaque,
+		QCAllocStats *stats);
+/* Return all memory, including blocks that are still allocated. */
+void qcu_alloc_destroy(QCAlloc *a);
+
+bool qcu_alloc_get(QCAlloc *a, uint64_t size, uint64_t stream,
+		uint64_t *addr);
+/* Returns false if addr was not allocated here. */
+bool qcu_alloc_put(QCAlloc *a, uint64_t addr, bool fence);
+bool qcu_alloc_owns(QCAlloc *a, uint64_t addr);
+
+/* Return every completely free segment; returns the bytes released. */
+uint64_t qcu_alloc_trim(QCAlloc *a);
+
+#endif
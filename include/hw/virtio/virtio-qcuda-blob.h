@@ -0,0 +1,43 @@
+#ifndef _QEMU_VIRTIO_QCUDA_BLOB_H
+#define _QEMU_VIRTIO_QCUDA_BLOB_H
+
+/*
+ * Weight blobs for virtio-qcuda.
+ *
+ * A guest names a file in the device's blob directory and gets back a
+ * device pointer to its contents.  The file is mapped and streamed to
+ * the GPU by the host, without a round trip through guest RAM.  Blobs
+ * are read-only and shared: every session in the process that loads the
+ * same file on the same GPU gets the same device memory, which is
+ * uploaded once and freed with the last reference.  A file that changed
+ * on disk (size or modification time) is a different blob.
+ */
+#include "qemu/thread.h"
+
+/* Backend callbacks, called without the store lock held. */
+typedef struct QCBlobOps
+{
+	/* copy size bytes to new device memory that kernels can only read */
+	bool (*load)(void *opaque, int device, const void *data, uint64_t size,
+			uint64_t *addr);
+	void (*unload)(void *opaque, int device, uint64_t addr, uint64_t size);
+} QCBlobOps;
+
+typedef struct QCBlobStore QCBlobStore;
+
+QCBlobStore *qcu_blob_store_new(const QCBlobOps *ops, void *opaque);
+/* Every blob must have been put back. */
+void qcu_blob_store_free(QCBlobStore *st);
+
+/*
+ * Take a reference to blob name in directory dir on device, loading it if
+ * this is the first one.  name is a plain file name.  Returns 0 with the
+ * device address and size, or a negative errno: -EINVAL for a bad name or
+ * anything but a non-empty regular file, -EIO if the backend failed.
+ */
+int qcu_blob_get(QCBlobStore *st, int device, const char *dir,
+		const char *name, uint64_t *addr, uint64_t *size);
+/* Drop a reference; false if there is no blob at addr on device. */
+bool qcu_blob_put(QCBlobStore *st, int device, uint64_t addr);
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef _QEMU_VIRTIO_QCUDA_DEFER_H
+#define _QEMU_VIRTIO_QCUDA_DEFER_H
+
+#include "qemu/atomic.h"
+
+/*
+ * Deferred completion of a virtio-qcuda request.
+ *
+ * A handler that would block until the GPU catches up instead arms the
+ * request, hands it to an asynchronous completion source (a stream
+ * callback) and returns, so that its worker can go on with the next
+ * command.  Both the worker and the completion source then drop their
+ * reference with qcu_deferred_put(); the one that drops the last one
+ * completes the request.  A request that was never armed is completed by
+ * the worker as usual.
+ */
+typedef struct QCDeferred
+{
+	int refs;
+} QCDeferred;
+
+/* Call before the completion source can possibly fire. */
+static inline void qcu_deferred_arm(QCDeferred *d)
+{
+	atomic_set(&d->refs, 2);
+}
+
+/* Undo qcu_deferred_arm() if the completion source could not be set up. */
+static inline void qcu_deferred_disarm(QCDeferred *d)
+{
+	atomic_set(&d->refs, 0);
+}
+
+static inline bool qcu_deferred_armed(QCDeferred *d)
+{
+	return atomic_read(&d->refs) != 0;
+}
+
+/* Returns true if the caller has to complete the request. */
+static inline bool qcu_deferred_put(QCDeferred *d)
+{
+	return atomic_fetch_dec(&d->refs) == 1;
+}
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef _QEMU_VIRTIO_QCUDA_GPA_H
+#define _QEMU_VIRTIO_QCUDA_GPA_H
+
+#include "qemu/rcu.h"
+
+/*
+ * Guest physical to host virtual translation for virtio-qcuda.
+ *
+ * The device keeps a sorted, immutable table of the guest RAM ranges of
+ * the system address space.  A memory listener builds a new table on
+ * every topology change and publishes it with atomic_rcu_set(); the old
+ * one is freed after a grace period.  Readers only need rcu_read_lock()
+ * around the lookup and the use of the returned range.
+ */
+typedef struct QCGpaRange
+{
+	uint64_t gpa;
+	uint64_t len;
+	uint8_t *hva;
+	void *opaque;	// owner of the mapping, e.g. its MemoryRegion
+	uint64_t offset;	// of hva within the owner
+} QCGpaRange;
+
+typedef struct QCGpaMap
+{
+	struct rcu_head rcu;
+	unsigned nr;
+	QCGpaRange ranges[];
+} QCGpaMap;
+
+/* Build a table from nr unsorted, non-overlapping ranges. */
+QCGpaMap *qcu_gpa_map_new(const QCGpaRange *ranges, unsigned nr);
+void qcu_gpa_map_free(QCGpaMap *map);
+
+/* Return the range containing gpa, or NULL if gpa is not guest RAM. */
+const QCGpaRange *qcu_gpa_map_find(const QCGpaMap *map, uint64_t gpa);
+
+static inline void *qcu_gpa_range_hva(const QCGpaRange *r, uint64_t gpa)
+{
+	return r->hva + (gpa - r->gpa);
+}
+
+/* Bytes from gpa to the end of its range. */
+static inline uint64_t qcu_gpa_range_avail(const QCGpaRange *r, uint64_t gpa)
+{
+	return r->gpa + r->len - gpa;
+}
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef _QEMU_VIRTIO_QCUDA_GRAPH_H
+#define _QEMU_VIRTIO_QCUDA_GRAPH_H
+
+/*
+ * Recorded launch sequences of virtio-qcuda.
+ *
+ * While a guest stream is recording, kernel launches and device to device
+ * copies on it are appended to a QCGraph instead of being executed.  Each
+ * kernel node keeps its own copy of the guest parameter blob, parsed once
+ * into the argument array cuLaunchKernel takes, so that a replay does no
+ * decoding beyond the patches the guest sends along with it.  Mapping a
+ * graph onto the driver (CUDA graphs, or plain launches where those are
+ * not available) is left to virtio-qcuda.c.
+ */
+#define QCU_GRAPH_MAX_NODES	65536
+#define QCU_GRAPH_MAX_PARAMS	256
+#define QCU_GRAPH_PARAM_SPACE	4096	// cuLaunchKernel's parameter limit
+#define QCU_GRAPH_BLOB_MAX	(sizeof(uint32_t) * (1 + QCU_GRAPH_MAX_PARAMS) + \
+				 QCU_GRAPH_PARAM_SPACE)
+
+/*
+ * One entry of the patch list of VIRTQC_CMD_GRAPH_LAUNCH: replace
+ * parameter param of kernel node node with the size bytes that follow.
+ * size must match the size the parameter was recorded with; entries are
+ * padded to a multiple of 8 bytes.
+ */
+typedef struct VirtIOQCGraphPatch
+{
+	uint32_t node;
+	uint32_t param;
+	uint32_t size;
+	uint32_t reserved;
+} VirtIOQCGraphPatch;
+
+enum
+{
+	QCU_GRAPH_KERNEL,
+	QCU_GRAPH_COPY,
+};
+
+typedef struct QCGraphNode
+{
+	int type;
+	bool dirty;		// patched since the last replay
+
+	/* kernel */
+	uint32_t func;
+	uint32_t grid[3];
+	uint32_t block[3];
+	uint32_t shared;
+	uint32_t nparams;
+	uint8_t *params;	// the guest blob, without its count
+	void **args;		// into params
+	uint32_t *arg_size;
+
+	/* device to device copy */
+	uint64_t dst;
+	uint64_t src;
+	uint64_t bytes;
+} QCGraphNode;
+
+typedef struct QCGraph
+{
+	GArray *nodes;		// of QCGraphNode
+} QCGraph;
+
+QCGraph *qcu_graph_new(void);
+void qcu_graph_free(QCGraph *g);
+
+static inline QCGraphNode *qcu_graph_node(QCGraph *g, uint32_t i)
+{
+	return &g_array_index(g->nodes, QCGraphNode, i);
+}
+
+/*
+ * Parse a guest parameter blob (a uint32_t count, then for every
+ * parameter a uint32_t size and its bytes) of at most len bytes.
+ * Returns the number of blob bytes used, or 0 if it is malformed.
+ */
+size_t qcu_graph_params_size(const uint8_t *blob, size_t len);
+
+/* conf is the launch configuration of cudaLaunch: grid, block, shared
+ * memory.  Return false if the graph is full or the blob malformed. */
+bool qcu_graph_add_kernel(QCGraph *g, uint32_t func, const uint64_t *conf,
+		const uint8_t *blob, size_t len);
+bool qcu_graph_add_copy(QCGraph *g, uint64_t dst, uint64_t src,
+		uint64_t bytes);
+
+/*
+ * Apply a VIRTQC_CMD_GRAPH_LAUNCH patch list of len bytes and mark the
+ * nodes it touches dirty.  The list is checked as a whole first; returns
+ * the number of entries applied, or -1 (and changes nothing) if any of
+ * them does not fit the graph.
+ */
+int qcu_graph_patch(QCGraph *g, const uint8_t *buf, size_t len);
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef _QEMU_VIRTIO_QCUDA_MIGRATE_H
+#define _QEMU_VIRTIO_QCUDA_MIGRATE_H
+
+/*
+ * Device memory bookkeeping for migrating virtio-qcuda.
+ *
+ * Every device of a session has a QCMig that knows the guest's live
+ * cudaMalloc allocations.  While a migration runs (logging), each
+ * allocation carries a bitmap of QCU_MIG_CHUNK sized chunks that have to
+ * be sent again: all of them when logging starts or the allocation is
+ * made, then those hit by a command that writes device memory.  Callers
+ * mark chunks dirty only after the command has been queued to the
+ * driver, and read a collected chunk only after synchronizing the
+ * context, so a write is either seen by the read or marks the chunk again.
+ *
+ * Kernels do not tell what they write: a launch marks every allocation
+ * one of its pointer sized parameters points into.  Memory reached only
+ * through pointers stored in device memory is not seen.
+ *
+ * On the destination the same structure restores allocations at their
+ * original addresses.  The backend maps device memory in units of the
+ * driver's granularity, so several allocations may share a mapping; a
+ * mapping goes away with the last allocation that overlaps it.
+ */
+#include "qemu/thread.h"
+
+#define QCU_MIG_CHUNK		(256 << 10)
+#define QCU_MIG_RUN_MAX		(4 << 20)	// largest DATA record
+
+/* Backend of the destination side; both run under the QCMig lock. */
+typedef struct QCMigOps
+{
+	/* map size bytes at exactly addr, both multiples of the granularity */
+	bool (*map)(void *opaque, uint64_t addr, uint64_t size);
+	void (*unmap)(void *opaque, uint64_t addr, uint64_t size);
+} QCMigOps;
+
+enum
+{
+	QCU_MIG_REC_FREE,	// addr was freed
+	QCU_MIG_REC_ALLOC,	// len bytes were allocated at addr
+	QCU_MIG_REC_DATA,	// len bytes at addr have to be sent
+};
+
+typedef struct QCMigRecord
+{
+	int type;
+	uint64_t addr;
+	uint64_t len;
+} QCMigRecord;
+
+typedef struct QCMig QCMig;
+
+/* ops may be NULL if allocations are never restored. */
+QCMig *qcu_mig_new(const QCMigOps *ops, void *opaque, uint64_t granularity);
+/* Unmaps what was restored; forgets everything else. */
+void qcu_mig_destroy(QCMig *m);
+
+void qcu_mig_add(QCMig *m, uint64_t addr, uint64_t size);
+/*
+ * Forget the allocation at addr.  Returns true if it had been restored,
+ * in which case its memory is gone and must not be freed by the caller.
+ */
+bool qcu_mig_remove(QCMig *m, uint64_t addr);
+/* Forget every allocation, e.g. when the device was reset. */
+void qcu_mig_clear(QCMig *m);
+bool qcu_mig_owns(QCMig *m, uint64_t addr);
+
+/* Mark a written range; it is clipped to the allocation it starts in. */
+void qcu_mig_dirty(QCMig *m, uint64_t addr, uint64_t len);
+/* Mark all of the allocation ptr points into, if any. */
+void qcu_mig_dirty_ptr(QCMig *m, uint64_t ptr);
+
+/* Start logging: everything is dirty and unknown to the destination. */
+void qcu_mig_start(QCMig *m);
+void qcu_mig_stop(QCMig *m);
+bool qcu_mig_logging(QCMig *m);
+uint64_t qcu_mig_pending(QCMig *m);
+
+/*
+ * Append what has to be sent next to out (of QCMigRecord): frees and new
+ * allocations first, then dirty data, at most max bytes of it unless a
+ * single record is larger.  The chunks collected are clean again; the
+ * data continues where the last call stopped.  Returns the data bytes.
+ */
+uint64_t qcu_mig_collect(QCMig *m, GArray *out, uint64_t max);
+
+/* Destination: map and record an allocation the source announced. */
+bool qcu_mig_restore(QCMig *m, uint64_t addr, uint64_t size);
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef _QEMU_VIRTIO_QCUDA_QOS_H
+#define _QEMU_VIRTIO_QCUDA_QOS_H
+
+/*
+ * GPU time arbitration between virtio-qcuda devices.
+ *
+ * Every device is a member of a QoS group.  The group owns one
+ * ThrottleState (util/throttle.c): kernel launches are accounted as reads
+ * of one unit each and limited by THROTTLE_BPS_READ, copies as writes of
+ * their size in bytes limited by THROTTLE_BPS_WRITE.  Devices without a
+ * group name get a group of their own; devices that name the same group
+ * share its limits, like block devices in a throttle group.
+ *
+ * While the group's bucket is over its limit, waiting members are let
+ * through in order of their weighted virtual time (start time fair
+ * queueing): each admitted operation advances its member's clock by its
+ * cost divided by the member's weight, so a member with twice the weight
+ * gets twice the share when everybody is busy and idle members do not
+ * build up credit.
+ */
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qemu/throttle.h"
+
+enum
+{
+	QCU_QOS_LAUNCH,		// kernel launches
+	QCU_QOS_COPY,		// bytes copied or set
+	QCU_QOS_KINDS,
+};
+
+#define QCU_QOS_WEIGHT_DEFAULT	100
+#define QCU_QOS_WEIGHT_MAX	10000
+#define QCU_QOS_COPY_UNIT	4096	// bytes of copy that cost as much as a launch
+
+typedef struct QCQosLimits
+{
+	uint64_t launch_rate;	// launches per second, 0 for no limit
+	uint64_t launch_burst;	// launches above the rate, 0 for a tenth of it
+	uint64_t copy_bw;	// bytes per second
+	uint64_t copy_burst;
+} QCQosLimits;
+
+typedef struct QCQosGroup QCQosGroup;
+typedef struct QCQos QCQos;
+
+struct QCQosGroup
+{
+	char *name;		// NULL for a private group
+
+	QemuMutex lock;		// protects everything below and the members
+	QemuCond cond;		// broadcast when a waiter may go
+	ThrottleState ts;
+	ThrottleTimers tt;
+	uint64_t vclock[QCU_QOS_KINDS];	// start tag of the last admission
+	QLIST_HEAD(, QCQos) members;
+
+	unsigned refcount;	// protected by the global group list lock
+	QTAILQ_ENTRY(QCQosGroup) next;
+};
+
+struct QCQos
+{
+	QCQosGroup *group;
+	uint32_t weight;
+	bool stopped;		// let everything through, e.g. during reset
+
+	uint64_t finish[QCU_QOS_KINDS];	// virtual time after the last admission
+	bool waiting[QCU_QOS_KINDS];
+	uint64_t start[QCU_QOS_KINDS];	// start tag while waiting
+
+	/* counters, read without the lock */
+	uint64_t throttled[QCU_QOS_KINDS];	// operations that had to wait
+	uint64_t wait_ns[QCU_QOS_KINDS];	// and for how long in total
+	QLIST_ENTRY(QCQos) next;
+};
+
+/*
+ * Join the group called name (NULL for a private one), creating it if
+ * needed; its timers run in ctx.  Limits are only applied if any of them
+ * is set, so a member without limits takes the ones of its group.
+ */
+void qcu_qos_register(QCQos *m, const char *name, uint32_t weight,
+		const QCQosLimits *limits, AioContext *ctx);
+void qcu_qos_unregister(QCQos *m);
+
+/* Limits are per group: setting them affects every member. */
+void qcu_qos_set_limits(QCQos *m, const QCQosLimits *limits);
+void qcu_qos_get_limits(QCQos *m, QCQosLimits *limits);
+void qcu_qos_set_weight(QCQos *m, uint32_t weight);
+
+/*
+ * Try to admit an operation of amount launches or bytes at time now (ns of
+ * QEMU_CLOCK_REALTIME).  Returns 0 and accounts it if it may go, otherwise
+ * marks m waiting until it is admitted and returns how long the bucket
+ * needs, or -1 if a member with an earlier virtual time waits for the
+ * same slot.
+ */
+int64_t qcu_qos_admit(QCQos *m, int kind, uint64_t amount, int64_t now);
+
+/* Block the calling thread until qcu_qos_admit lets the operation go. */
+void qcu_qos_wait(QCQos *m, int kind, uint64_t amount);
+
+/* Release the waiters of m and stop throttling it until resumed. */
+void qcu_qos_stop(QCQos *m);
+void qcu_qos_resume(QCQos *m);
+
+#endif
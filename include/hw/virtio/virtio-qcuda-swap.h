@@ -0,0 +1,77 @@
+#ifndef _QEMU_VIRTIO_QCUDA_SWAP_H
+#define _QEMU_VIRTIO_QCUDA_SWAP_H
+
+/*
+ * Device memory oversubscription for virtio-qcuda.
+ *
+ * Every guest allocation gets address space of its own, and device memory
+ * behind it only while it is resident.  Resident allocations are kept in
+ * least recently used order; when the backend runs out of device memory,
+ * or the resident bytes would go over the limit, the coldest ones are
+ * copied to host memory and unmapped.  A command pins the allocations it
+ * uses first, which pages them back in at the same address, so the device
+ * pointers the guest holds stay valid.
+ *
+ * Kernels do not tell what they use: a launch pins every allocation one of
+ * its pointer sized parameters points into.  Memory reached only through
+ * pointers stored in device memory has to be resident already.
+ */
+#include "qemu/thread.h"
+
+/* Backend callbacks; all of them run under the QCSwap lock. */
+typedef struct QCSwapOps
+{
+	/* address space for size bytes anywhere, and giving it back */
+	bool (*reserve)(void *opaque, uint64_t size, uint64_t *addr);
+	void (*release)(void *opaque, uint64_t addr, uint64_t size);
+	/* back reserved space with device memory; false when out of memory */
+	bool (*map)(void *opaque, uint64_t addr, uint64_t size);
+	void (*unmap)(void *opaque, uint64_t addr, uint64_t size);
+	/* wait until the device is done with everything queued so far */
+	void (*sync)(void *opaque);
+	/* copy between mapped device memory and host memory */
+	bool (*read)(void *opaque, uint64_t addr, void *buf, uint64_t size);
+	bool (*write)(void *opaque, uint64_t addr, const void *buf,
+			uint64_t size);
+} QCSwapOps;
+
+/* Counters, updated atomically so that several QCSwaps can share them. */
+typedef struct QCSwapStats
+{
+	uint64_t resident;	// bytes backed by device memory
+	uint64_t swapped;	// bytes held in host memory
+	uint64_t evictions;
+	uint64_t faults;	// allocations paged back in
+	uint64_t bytes_out;	// copied to host memory by evictions
+	uint64_t bytes_in;	// copied back by faults
+} QCSwapStats;
+
+typedef struct QCSwap QCSwap;
+
+/* Sizes are rounded up to granularity; limit is in bytes, 0 for none. */
+QCSwap *qcu_swap_new(const QCSwapOps *ops, void *opaque,
+		uint64_t granularity, uint64_t limit, QCSwapStats *stats);
+/* Unmap and release every allocation. */
+void qcu_swap_destroy(QCSwap *sw);
+
+/* Allocate and make resident, evicting others if needed. */
+bool qcu_swap_alloc(QCSwap *sw, uint64_t size, uint64_t *addr);
+/* Returns false if addr was not allocated here. */
+bool qcu_swap_free(QCSwap *sw, uint64_t addr);
+bool qcu_swap_owns(QCSwap *sw, uint64_t addr);
+
+/*
+ * Make the allocations the n pointers point into resident and keep them
+ * so until unpinned; pointers outside them are ignored.  Returns false,
+ * with nothing pinned, if they do not fit.
+ */
+bool qcu_swap_pin(QCSwap *sw, const uint64_t *ptrs, unsigned n);
+void qcu_swap_unpin(QCSwap *sw, const uint64_t *ptrs, unsigned n);
+
+/*
+ * Copy len bytes at addr, within one allocation, to buf without paging it
+ * in, e.g. for migration.  Returns false if addr is not allocated here.
+ */
+bool qcu_swap_copy_out(QCSwap *sw, uint64_t addr, void *buf, uint64_t len);
+
+#endif
@@ -3,8 +3,17 @@
 #define _QEMU_VIRTIO_HM_H
 
 #include "qemu/queue.h"
+#include "qemu/thread.h"
 #include "hw/virtio/virtio.h"
+#include "hw/virtio/vhost.h"
 #include "hw/pci/pci.h"
+#include "sysemu/char.h"
+#include "hw/virtio/virtio-qcuda-alloc.h"
+#include "hw/virtio/virtio-qcuda-graph.h"
+#include "hw/virtio/virtio-qcuda-qos.h"
+#include "hw/virtio/virtio-qcuda-migrate.h"
+#include "hw/virtio/virtio-qcuda-swap.h"
+#include "hw/virtio/virtio-qcuda-blob.h"
 
 #define TYPE_VIRTIO_QC "virtio-qcuda-device"
 #define VIRTIO_QC(obj)                                        \
@@ -12,19 +21,326 @@
 
 //#define VIRTIO_ID_QCUDA 69
 
+#define VIRTIO_QC_VQ_SIZE    1024
+#define VIRTIO_QC_MAX_QUEUES 64
+
 typedef struct VirtIOQCConf VirtIOQCConf;
 typedef struct VirtIOQC VirtIOQC;
+typedef struct VirtIOQCReq VirtIOQCReq;
+typedef struct VirtIOQCQueue VirtIOQCQueue;
+
+/* Device configuration space, read by the guest driver. */
+struct virtio_qcuda_config
+{
+	uint64_t mem_size;
+	uint32_t num_queues;
+	uint32_t reserved;
+};
+
+/*
+ * Queue 0 carries the default stream and every command that is not bound
+ * to a stream; guest stream indices (starting at 1) are spread over the
+ * remaining queues.  Both sides use this mapping, so all work on one
+ * stream is executed in order by the same host worker.
+ */
+static inline uint32_t virtio_qcuda_stream_queue(uint64_t stream,
+		uint32_t num_queues)
+{
+	if (stream == (uint64_t)-1 || stream == 0 || num_queues <= 1)
+		return 0;
+	return 1 + (stream - 1) % (num_queues - 1);
+}
+
+/*
+ * Optional trailer the guest driver appends after VirtioQCArg in the out
+ * buffer.  Requests without it belong to session 0, so drivers that
+ * predate sessions keep working unchanged.
+ */
+typedef struct VirtIOQCArgExt
+{
+	uint32_t session;
+	uint32_t flags;
+} VirtIOQCArgExt;
+
+/*
+ * Device-side commands, numbered well away from the qcu-driver command
+ * enum so that both can grow independently.
+ *
+ * VIRTQC_CMD_BATCH carries several calls in one virtqueue element:
+ *
+ *   out: VirtioQCArg     header, pASize = number of entries
+ *        VirtIOQCArgExt  (mandatory for a batch)
+ *        VirtioQCArg     entries[pASize]
+ *   in:  VirtioQCArg     header, cmd = first failing status or 0
+ *        int32_t         status[pASize]
+ *
+ * Entries run in order on the worker the element arrived on, so a guest
+ * should only batch calls that belong to one stream.  Only calls that
+ * return nothing but a status may be batched; anything else completes
+ * with VIRTIO_QC_BATCH_EINVAL in its slot and is not executed.
+ */
+#define VIRTQC_CMD_EXT_BASE      0x1000
+#define VIRTQC_CMD_BATCH         (VIRTQC_CMD_EXT_BASE + 0)
+
+/*
+ * With size=N the PCI function has a prefetchable 64-bit memory BAR
+ * (VIRTIO_QC_SHM_BAR) whose first N bytes are host shared memory.  The
+ * guest maps it into user space and moves bulk data with
+ * VIRTQC_CMD_SHM_MEMCPY:
+ *
+ *   flag    cudaMemcpyHostToDevice or cudaMemcpyDeviceToHost
+ *   pA      device pointer
+ *   pB      offset into the shared memory
+ *   pBSize  bytes to copy
+ *   rnd     stream index; on the default stream (-1) the reply is sent
+ *           once the copy is done, otherwise it is queued on the stream
+ *           like cudaMemcpyAsync
+ */
+#define VIRTQC_CMD_SHM_MEMCPY    (VIRTQC_CMD_EXT_BASE + 1)
+#define VIRTIO_QC_SHM_BAR        2
+
+/*
+ * Launch graphs: record the work of one iteration once, then replay it
+ * with a single command.  All four are sent like work on stream rnd.
+ *
+ * VIRTQC_CMD_GRAPH_BEGIN starts recording stream rnd.  Until the matching
+ * END, cudaLaunch and device to device cudaMemcpyAsync on that stream are
+ * recorded instead of executed; any other work on it runs as usual.
+ *
+ * VIRTQC_CMD_GRAPH_END stops recording and returns the graph handle in pA
+ * and its number of nodes in pB.  Nodes are numbered in recording order.
+ *
+ * VIRTQC_CMD_GRAPH_LAUNCH replays graph pA on stream rnd.  If pBSize is
+ * not zero, pB is the guest address of a list of VirtIOQCGraphPatch
+ * entries that change kernel parameters first; patches stay in effect
+ * for later replays.  A list that does not fit the graph fails the
+ * command with cudaErrorInvalidValue and nothing is launched.
+ *
+ * VIRTQC_CMD_GRAPH_DESTROY releases graph pA.
+ */
+#define VIRTQC_CMD_GRAPH_BEGIN   (VIRTQC_CMD_EXT_BASE + 2)
+#define VIRTQC_CMD_GRAPH_END     (VIRTQC_CMD_EXT_BASE + 3)
+#define VIRTQC_CMD_GRAPH_LAUNCH  (VIRTQC_CMD_EXT_BASE + 4)
+#define VIRTQC_CMD_GRAPH_DESTROY (VIRTQC_CMD_EXT_BASE + 5)
+#define VIRTIO_QC_GRAPH_PATCH_MAX (1 << 20)
+
+/*
+ * With blob-dir=DIR, VIRTQC_CMD_BLOB_LOAD loads the file named by the pA
+ * (guest address) and pASize (length, no terminator) bytes from DIR into
+ * memory of the current device, see virtio-qcuda-blob.h.  The reply has
+ * the device pointer in pA and the size in para.  The memory is
+ * read-only and released with cudaFree.  A name or file that cannot be
+ * used fails with cudaErrorInvalidValue and the errno in pB; the command
+ * is not supported without blob-dir or during migration, and the device
+ * cannot be migrated while blobs are loaded.
+ */
+#define VIRTQC_CMD_BLOB_LOAD     (VIRTQC_CMD_EXT_BASE + 6)
+
+/*
+ * Launches with a flat argument buffer, which the device hands to
+ * cuLaunchKernel as CU_LAUNCH_PARAM_BUFFER_POINTER without parsing it.
+ *
+ * VIRTQC_CMD_LAUNCH_LAYOUT describes the parameters of function flag,
+ * once per session:
+ *
+ *   pA      guest address of VirtIOQCLaunchParam[pASize], in order
+ *   pBSize  size of the argument buffer
+ *
+ * Parameters must not overlap or run past the buffer, which is at most
+ * VIRTIO_QC_LAUNCH_ARGS_MAX bytes.  A function keeps its first layout;
+ * registering a different one fails with cudaErrorInvalidValue.
+ *
+ * VIRTQC_CMD_LAUNCH then works like cudaLaunch of function flag with the
+ * launch configuration at pA, except that pB and pBSize are the argument
+ * buffer, pBSize bytes as registered.  It may be batched and is sent like
+ * work on stream conf[7]; graph capture records it like cudaLaunch.
+ */
+#define VIRTQC_CMD_LAUNCH_LAYOUT (VIRTQC_CMD_EXT_BASE + 7)
+#define VIRTQC_CMD_LAUNCH        (VIRTQC_CMD_EXT_BASE + 8)
+#define VIRTIO_QC_LAUNCH_ARGS_MAX   4096	// cuLaunchKernel's parameter limit
+#define VIRTIO_QC_LAUNCH_PARAMS_MAX 1024
+
+typedef struct VirtIOQCLaunchParam
+{
+	uint32_t offset;
+	uint32_t size;
+} VirtIOQCLaunchParam;
+
+#define VIRTIO_QC_BATCH_MAX      4096
+#define VIRTIO_QC_BATCH_EINVAL   11  /* cudaErrorInvalidValue */
+
+/*
+ * Per command statistics.  Each request is split into four phases: queue
+ * wait (queued until a worker picks it up), translate (request decoding
+ * and guest address resolution), execute (the CUDA call) and complete
+ * (call returned until the reply is pushed).  Histogram bucket i counts
+ * latencies in [2^(i-1), 2^i) microseconds.
+ */
+#define VIRTIO_QC_STATS_BUCKETS 24
+
+enum
+{
+	VIRTIO_QC_PHASE_QUEUE,
+	VIRTIO_QC_PHASE_TRANSLATE,
+	VIRTIO_QC_PHASE_EXECUTE,
+	VIRTIO_QC_PHASE_COMPLETE,
+	VIRTIO_QC_PHASES,
+};
+
+typedef struct VirtIOQCLatency
+{
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t buckets[VIRTIO_QC_STATS_BUCKETS];
+} VirtIOQCLatency;
+
+typedef struct VirtIOQCCmdStats
+{
+	int32_t cmd;
+	uint64_t count;
+	VirtIOQCLatency phase[VIRTIO_QC_PHASES];
+} VirtIOQCCmdStats;
 
 struct VirtIOQCConf
 {
 	uint64_t mem_size;
+	uint32_t num_queues;
+	bool pin_guest_ram;
+	char *module_cache;	// directory of JIT compiled modules, or NULL
+	/* host GPUs set up on background threads at registration time:
+	 * "all" or a comma separated list, parsed into eager_mask */
+	char *eager_devices;
+	uint64_t eager_mask;
+	bool alloc_cache;	// serve cudaMalloc from cached device memory
+	/* let cudaMalloc go beyond GPU memory, see virtio-qcuda-swap.h;
+	 * resident_limit caps each session's GPU memory, 0 for none */
+	bool oversubscribe;
+	uint64_t resident_limit;
+	/* see VirtIOQCDoorbell; poll_us is the polling window, 0 for none */
+	bool doorbell_thread;
+	uint32_t poll_us;
+	char *blob_dir;	// weight blobs, see VIRTQC_CMD_BLOB_LOAD
+	/* With chardev set the device does not run CUDA itself: the rings
+	 * and guest RAM are handed to a backend process over vhost-user, so
+	 * one daemon can serve many guests with a single context per GPU.
+	 * What the backend has to implement is described in
+	 * docs/specs/virtio-qcuda-vhost-user.txt.  Guest RAM has to be
+	 * shared, e.g. with -object memory-backend-file,share=on; the shared
+	 * memory BAR is not available.  QEMU keeps only the config space, so
+	 * such a device cannot be migrated. */
+	CharDriverState *chardev;
+	/* GPU time share, see virtio-qcuda-qos.h */
+	char *qos_group;
+	uint32_t weight;
+	QCQosLimits qos;
+};
+
+/*
+ * Scratch space a worker marshals launches in, set up with the queue so
+ * that submitting a launch allocates nothing.  The driver has copied the
+ * arguments by the time cuLaunchKernel returns, so it is reused by the
+ * next launch right away.
+ */
+typedef struct VirtIOQCLaunchArena
+{
+	uint64_t args[VIRTIO_QC_LAUNCH_ARGS_MAX / sizeof(uint64_t)];
+	void *params[VIRTIO_QC_LAUNCH_PARAMS_MAX];	// cudaLaunch blobs
+	uint64_t ptrs[VIRTIO_QC_LAUNCH_PARAMS_MAX];	// pointer sized parameters
+} VirtIOQCLaunchArena;
+
+/* One virtqueue together with the host thread that executes its commands;
+ * completed requests are handed back to the main loop through a bottom
+ * half. */
+struct VirtIOQCQueue
+{
+	VirtIOQC *qcu;
+	VirtQueue *vq;
+	uint32_t index;
+
+	QemuThread thread;
+	QemuMutex lock;
+	QemuCond cond;
+	QemuCond idle_cond;
+	bool stopping;
+	bool busy;
+	int deferred;	// requests parked until the GPU completes them
+	QSIMPLEQ_HEAD(, VirtIOQCReq) pending;
+	QSIMPLEQ_HEAD(, VirtIOQCReq) done;
+	QEMUBH *bh;
+
+	/* kernel arguments of the launch being submitted; a stream is only
+	 * ever served by one worker, so this is its streams' arena */
+	VirtIOQCLaunchArena arena;
 };
 
+/*
+ * Optional doorbell thread (doorbell-thread=on, or poll-us=N).  Under KVM
+ * it takes the ioeventfds of the virtqueues over from the transport and
+ * pops kicked requests itself, so a kick does not wait behind other main
+ * loop work.  With poll-us=N it also keeps watching the avail rings for N
+ * microseconds after the last request, with guest notifications turned
+ * off, so back to back commands are submitted without any exit.  Rings
+ * are popped with the iothread lock held.  While it polls, the thread
+ * only reads the avail indexes, through host pointers looked up inside an
+ * RCU read section that lasts for the window and is redone whenever the
+ * memory map changes.
+ *
+ * Completions are published once per batch: one used index update and
+ * one virtio_notify() per ring, which with VIRTIO_RING_F_EVENT_IDX only
+ * interrupts a guest that asked for it.
+ */
+typedef struct VirtIOQCDoorbell
+{
+	QemuThread thread;
+	QemuMutex lock;
+	QemuCond cond;
+	EventNotifier wake;
+	bool running;		// the thread exists
+	bool stopping;		// under lock
+	bool notifiers;		// the host notifiers are ours; under lock
+	bool in_poll;		// the thread waits on them; under lock
+	bool polling;		// guest notifications are off; iothread lock
+} VirtIOQCDoorbell;
+
 struct VirtIOQC
 {
     VirtIODevice parent_obj;
 	VirtIOQCConf conf;
-	VirtQueue *vq;
+	VirtIOQCQueue *queues;
+	VirtIOQCDoorbell doorbell;
+
+	/* per guest process state, keyed by VirtIOQCArgExt.session */
+	QemuMutex session_lock;
+	GHashTable *sessions;
+
+	/* host blocks page-locked for copies by any session, under pin_lock */
+	QemuMutex pin_lock;
+	GHashTable *pinned;
+
+	/* used instead of the queue workers when conf.chardev is set */
+	struct vhost_dev vhost;
+
+	/* shared memory BAR contents, conf.mem_size bytes */
+	MemoryRegion shm;
+	uint8_t *shm_ptr;
+	int shm_fd;
+
+	/* VirtIOQCCmdStats by command; only used from the main loop */
+	GHashTable *stats;
+	/* shared by the cudaMalloc caches of all sessions and devices */
+	QCAllocStats alloc_stats;
+	/* shared by the oversubscribed allocations of all sessions */
+	QCSwapStats swap_stats;
+	/* launches and copies wait here when the device is over its share */
+	QCQos qos;
+	/* device memory is being sent; both under session_lock */
+	bool migrating;
+	int blobs_held;	// weight blob references of all sessions
+	GArray *mig_closed;	// ids of sessions closed meanwhile
+	VMChangeStateEntry *vmstate;
+	Error *migration_blocker;	// external backend
+	QLIST_ENTRY(VirtIOQC) next;
 };
 
 #endif
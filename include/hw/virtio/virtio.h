@@ -41,15 +41,28 @@ typedef struct VirtQueue VirtQueue;
 
 #define VIRTQUEUE_MAX_SIZE 1024
 
+typedef struct VirtQueueElementPool VirtQueueElementPool;
+
+/*
+ * A request popped from a virtqueue.  Elements are allocated by
+ * virtqueue_pop() with room for exactly the device's request structure,
+ * which must start with the VirtQueueElement, followed by the four
+ * arrays.  Free them with virtqueue_element_free().
+ */
 typedef struct VirtQueueElement
 {
     unsigned int index;
     unsigned int out_num;
     unsigned int in_num;
-    hwaddr in_addr[VIRTQUEUE_MAX_SIZE];
-    hwaddr out_addr[VIRTQUEUE_MAX_SIZE];
-    struct iovec in_sg[VIRTQUEUE_MAX_SIZE];
-    struct iovec out_sg[VIRTQUEUE_MAX_SIZE];
+    hwaddr *in_addr;
+    hwaddr *out_addr;
+    struct iovec *in_sg;
+    struct iovec *out_sg;
+
+    /* private to virtio.c */
+    VirtQueueElementPool *pool;
+    unsigned int pool_class;
+    QSLIST_ENTRY(VirtQueueElement) pool_next;
 } VirtQueueElement;
 
 #define VIRTIO_QUEUE_MAX 1024
@@ -151,7 +164,16 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
 
 void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
     size_t num_sg, int is_write);
-int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem);
+void *virtqueue_pop(VirtQueue *vq, size_t sz);
+void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem);
+void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz);
+
+VirtQueueElementPool *virtqueue_element_pool_new(unsigned int max_cached);
+void virtqueue_element_pool_release(VirtQueueElementPool *pool);
+VirtQueueElement *virtqueue_element_pool_scratch(VirtQueueElementPool *pool);
+void *virtqueue_alloc_element(VirtQueueElementPool *pool, size_t sz,
+                              unsigned int out_num, unsigned int in_num);
+void virtqueue_element_free(VirtQueueElement *elem);
 int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
                           unsigned int out_bytes);
 void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
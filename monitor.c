@@ -2865,6 +2865,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show memory devices",
         .mhandler.cmd = hmp_info_memory_devices,
     },
+    {
+        .name       = "qcuda",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show virtio-qcuda command statistics",
+        .mhandler.cmd = hmp_info_qcuda,
+    },
     {
         .name       = "rocker",
         .args_type  = "name:s",
@@ -4169,6 +4169,81 @@ Example:
                  "write-threshold": 17179869184 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "query-qcuda-stats",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_qcuda_stats,
+    },
+
+SQMP
+query-qcuda-stats
+-----------------
+
+Show per command counters and latency histograms of every virtio-qcuda
+device.  Latencies are split into queue wait, translate, execute and
+complete phases; each histogram bucket covers a power of two of
+microseconds.  "allocator" shows the counters of the device memory cache
+behind cudaMalloc.
+
+Example:
+
+-> { "execute": "query-qcuda-stats" }
+<- { "return": [
+       { "device": "/machine/peripheral-anon/device[0]/virtio-backend",
+         "commands": [
+           { "cmd": 7, "name": "cudaLaunch", "count": 1000,
+             "queue-wait": { "count": 1000, "total-ns": 2100000,
+                             "max-ns": 41000, "buckets": [ 12, 850, ... ] },
+             "translate": { ... },
+             "execute": { ... },
+             "complete": { ... } } ],
+         "allocator": { "hits": 9990, "misses": 10, "frees": 9950,
+                        "trims": 0, "segments": 10,
+                        "reserved": 20971520, "allocated": 4194304,
+                        "requested": 4000000 },
+         "qos": { "group": "gpu0", "weight": 100,
+                  "launch-rate": 20000, "launch-burst": 2000,
+                  "copy-bw": 0, "copy-burst": 0,
+                  "launches-throttled": 120, "launch-wait-ns": 9600000,
+                  "copies-throttled": 0, "copy-wait-ns": 0 } } ] }
+
+EQMP
+
+    {
+        .name       = "qcuda-set-qos",
+        .args_type  = "device:s,weight:i?,launch-rate:l?,launch-burst:l?,"
+                      "copy-bw:l?,copy-burst:l?",
+        .mhandler.cmd_new = qmp_marshal_input_qcuda_set_qos,
+    },
+
+SQMP
+qcuda-set-qos
+-------------
+
+Change the GPU time share of a virtio-qcuda device.  Limits are shared by
+all devices of its QoS group, the weight sets the device's part of them
+while the group is busy.  Arguments that are left out keep their value.
+
+Arguments:
+
+- "device": the device's ID or QOM path (json-string)
+- "weight": share within the group, 1 to 10000 (json-int, optional)
+- "launch-rate": kernel launches per second, 0 for no limit
+                 (json-int, optional)
+- "launch-burst": launches allowed at once above the rate (json-int, optional)
+- "copy-bw": bytes per second copied to and from the GPUs, 0 for no limit
+             (json-int, optional)
+- "copy-burst": bytes allowed at once above the bandwidth (json-int, optional)
+
+Example:
+
+-> { "execute": "qcuda-set-qos",
+     "arguments": { "device": "batch0", "weight": 10,
+                    "launch-rate": 20000 } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -0,0 +1,245 @@
+/*
+ * Fake device memory for the virtio-qcuda unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qcuda-fake-dev.h"
+
+typedef struct FakeMap {
+    uint64_t size;
+    uint8_t data[];
+} FakeMap;
+
+void fake_init(FakeDev *d, uint64_t capacity, uint64_t gran)
+{
+    memset(d, 0, sizeof(*d));
+    d->next = FAKE_BASE;
+    d->capacity = capacity;
+    d->gran = gran;
+    d->mem = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+}
+
+void fake_fini(FakeDev *d)
+{
+    g_assert_cmpuint(g_hash_table_size(d->mem), ==, 0);
+    g_assert_cmpuint(d->mapped, ==, 0);
+    g_assert_cmpuint(d->reserved, ==, 0);
+    g_assert_cmpuint(d->fences_live, ==, 0);
+    g_hash_table_destroy(d->mem);
+}
+
+uint8_t *fake_mem(FakeDev *d, uint64_t addr)
+{
+    FakeMap *map = g_hash_table_lookup(d->mem, GSIZE_TO_POINTER(addr));
+
+    return map != NULL ? map->data : NULL;
+}
+
+/* Address space for size bytes, with a hole after it. */
+static uint64_t fake_place(FakeDev *d, uint64_t size)
+{
+    uint64_t addr = d->next;
+
+    d->next += size + MAX(d->gran, 1ULL << 20);
+    return addr;
+}
+
+static bool fake_map(void *opaque, uint64_t addr, uint64_t size)
+{
+    FakeDev *d = opaque;
+    FakeMap *map;
+
+    if (d->gran != 0) {
+        g_assert_cmpuint(addr % d->gran, ==, 0);
+        g_assert_cmpuint(size % d->gran, ==, 0);
+    }
+    if (d->fail_at >= addr && d->fail_at < addr + size) {
+        return false;
+    }
+    if (d->capacity != 0 && d->mapped + size > d->capacity) {
+        return false;
+    }
+    g_assert(fake_mem(d, addr) == NULL);
+    map = g_malloc0(sizeof(*map) + size);
+    map->size = size;
+    g_hash_table_insert(d->mem, GSIZE_TO_POINTER(addr), map);
+    d->mapped += size;
+    return true;
+}
+
+static void fake_unmap(void *opaque, uint64_t addr, uint64_t size)
+{
+    FakeDev *d = opaque;
+    FakeMap *map = g_hash_table_lookup(d->mem, GSIZE_TO_POINTER(addr));
+
+    g_assert(map != NULL);
+    g_assert_cmpuint(map->size, ==, size);
+    g_hash_table_remove(d->mem, GSIZE_TO_POINTER(addr));
+    d->mapped -= size;
+}
+
+/* QCAllocOps: segments are mappings, fences pass when the test says so. */
+
+static bool fake_alloc(void *opaque, uint64_t size, uint64_t *addr)
+{
+    FakeDev *d = opaque;
+
+    if (!fake_map(d, d->next, size)) {
+        return false;
+    }
+    *addr = fake_place(d, size);
+    return true;
+}
+
+static void fake_free(void *opaque, uint64_t addr)
+{
+    FakeDev *d = opaque;
+    FakeMap *map = g_hash_table_lookup(d->mem, GSIZE_TO_POINTER(addr));
+
+    g_assert(map != NULL);
+    fake_unmap(d, addr, map->size);
+}
+
+static void *fake_fence_new(void *opaque)
+{
+    FakeDev *d = opaque;
+
+    d->fences_live++;
+    return GUINT_TO_POINTER(++d->fences_made);
+}
+
+static bool fake_fence_done(void *opaque, void *fence)
+{
+    FakeDev *d = opaque;
+
+    return GPOINTER_TO_UINT(fence) <= d->fences_passed;
+}
+
+static void fake_fence_wait(void *opaque, void *fence)
+{
+    FakeDev *d = opaque;
+
+    d->fences_passed = MAX(d->fences_passed, GPOINTER_TO_UINT(fence));
+}
+
+static void fake_fence_release(void *opaque, void *fence)
+{
+    FakeDev *d = opaque;
+
+    d->fences_live--;
+}
+
+const QCAllocOps fake_alloc_ops = {
+    .alloc = fake_alloc,
+    .free = fake_free,
+    .fence_new = fake_fence_new,
+    .fence_done = fake_fence_done,
+    .fence_wait = fake_fence_wait,
+    .fence_release = fake_fence_release,
+};
+
+/* QCBlobOps: a blob is a mapping holding a copy of the file. */
+
+static bool fake_load(void *opaque, int device, const void *data,
+                      uint64_t size, uint64_t *addr)
+{
+    FakeDev *d = opaque;
+    uint64_t at;
+
+    if (d->entered != NULL) {
+        qemu_event_set(d->entered);
+        qemu_event_wait(d->proceed);
+    }
+    at = d->next + device;
+    if (d->fail || !fake_map(d, at, size)) {
+        return false;
+    }
+    fake_place(d, size);
+    memcpy(fake_mem(d, at), data, size);
+    d->loads++;
+    *addr = at;
+    return true;
+}
+
+static void fake_unload(void *opaque, int device, uint64_t addr,
+                        uint64_t size)
+{
+    FakeDev *d = opaque;
+
+    fake_unmap(d, addr, size);
+    d->unloads++;
+}
+
+const QCBlobOps fake_blob_ops = {
+    .load = fake_load,
+    .unload = fake_unload,
+};
+
+/* QCMigOps: the destination maps at the addresses it is given. */
+
+const QCMigOps fake_mig_ops = {
+    .map = fake_map,
+    .unmap = fake_unmap,
+};
+
+/* QCSwapOps: reserved address space is mapped while resident. */
+
+static bool fake_reserve(void *opaque, uint64_t size, uint64_t *addr)
+{
+    FakeDev *d = opaque;
+
+    if (d->gran != 0) {
+        g_assert_cmpuint(size % d->gran, ==, 0);
+    }
+    *addr = fake_place(d, size);
+    d->reserved += size;
+    return true;
+}
+
+static void fake_release(void *opaque, uint64_t addr, uint64_t size)
+{
+    FakeDev *d = opaque;
+
+    g_assert(fake_mem(d, addr) == NULL);
+    d->reserved -= size;
+}
+
+static void fake_sync(void *opaque)
+{
+    FakeDev *d = opaque;
+
+    d->syncs++;
+}
+
+static bool fake_read(void *opaque, uint64_t addr, void *buf, uint64_t size)
+{
+    uint8_t *mem = fake_mem(opaque, addr);
+
+    g_assert(mem != NULL);
+    memcpy(buf, mem, size);
+    return true;
+}
+
+static bool fake_write(void *opaque, uint64_t addr, const void *buf,
+                       uint64_t size)
+{
+    uint8_t *mem = fake_mem(opaque, addr);
+
+    g_assert(mem != NULL);
+    memcpy(mem, buf, size);
+    return true;
+}
+
+const QCSwapOps fake_swap_ops = {
+    .reserve = fake_reserve,
+    .release = fake_release,
+    .map = fake_map,
+    .unmap = fake_unmap,
+    .sync = fake_sync,
+    .read = fake_read,
+    .write = fake_write,
+};
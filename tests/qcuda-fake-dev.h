@@ -0,0 +1,51 @@
+/*
+ * Fake device memory for the virtio-qcuda unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef TESTS_QCUDA_FAKE_DEV_H
+#define TESTS_QCUDA_FAKE_DEV_H
+
+#include "qemu/thread.h"
+#include "hw/virtio/virtio-qcuda-alloc.h"
+#include "hw/virtio/virtio-qcuda-blob.h"
+#include "hw/virtio/virtio-qcuda-migrate.h"
+#include "hw/virtio/virtio-qcuda-swap.h"
+
+#define FAKE_BASE 0x700000000ULL
+
+/* Device memory is a host buffer per mapping, so contents can be
+ * checked; the backend of every bookkeeping module works on it. */
+typedef struct FakeDev {
+    GHashTable *mem;            /* addr -> FakeMap */
+    uint64_t next;              /* where the next allocation goes */
+    uint64_t capacity;          /* bytes that can be mapped, 0 for any */
+    uint64_t gran;              /* mappings are multiples of it, if set */
+    uint64_t mapped;
+    uint64_t reserved;          /* address space without memory */
+    uint64_t fail_at;           /* mapping this address fails */
+    bool fail;                  /* loads fail */
+    unsigned loads;
+    unsigned unloads;
+    unsigned syncs;
+    unsigned fences_made;
+    unsigned fences_passed;     /* fences numbered up to this have passed */
+    unsigned fences_live;
+    QemuEvent *entered;         /* set when a load starts, if not NULL */
+    QemuEvent *proceed;         /* and wait for this */
+} FakeDev;
+
+extern const QCAllocOps fake_alloc_ops;
+extern const QCBlobOps fake_blob_ops;
+extern const QCMigOps fake_mig_ops;
+extern const QCSwapOps fake_swap_ops;
+
+void fake_init(FakeDev *d, uint64_t capacity, uint64_t gran);
+/* Everything must have been given back. */
+void fake_fini(FakeDev *d);
+/* The memory mapped at addr, NULL if there is no mapping there. */
+uint8_t *fake_mem(FakeDev *d, uint64_t addr);
+
+#endif
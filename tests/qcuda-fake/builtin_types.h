@@ -0,0 +1,77 @@
+/*
+ * Link-time stand-in for the CUDA runtime types, see cuda.h
+ *
+ * Status codes use the numbering of the runtime before CUDA 10.1, which
+ * is what the virtio-qcuda protocol documents (VIRTIO_QC_BATCH_EINVAL).
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef QCUDA_FAKE_BUILTIN_TYPES_H
+#define QCUDA_FAKE_BUILTIN_TYPES_H
+
+#include <stddef.h>
+
+typedef enum cudaError {
+    cudaSuccess = 0,
+    cudaErrorMissingConfiguration = 1,
+    cudaErrorMemoryAllocation = 2,
+    cudaErrorInitializationError = 3,
+    cudaErrorLaunchFailure = 4,
+    cudaErrorInvalidDeviceFunction = 8,
+    cudaErrorInvalidDevice = 10,
+    cudaErrorInvalidValue = 11,
+    cudaErrorInvalidDevicePointer = 17,
+    cudaErrorUnknown = 30,
+    cudaErrorInvalidResourceHandle = 33,
+    cudaErrorNotReady = 34,
+    cudaErrorInvalidKernelImage = 47,
+    cudaErrorHostMemoryAlreadyRegistered = 61,
+    cudaErrorHostMemoryNotRegistered = 62,
+    cudaErrorNotSupported = 71,
+} cudaError_t;
+
+enum cudaMemcpyKind {
+    cudaMemcpyHostToHost = 0,
+    cudaMemcpyHostToDevice = 1,
+    cudaMemcpyDeviceToHost = 2,
+    cudaMemcpyDeviceToDevice = 3,
+    cudaMemcpyDefault = 4,
+};
+
+typedef struct CUstream_st *cudaStream_t;
+typedef struct CUevent_st *cudaEvent_t;
+
+#define cudaEventDefault            0x00
+#define cudaEventBlockingSync       0x01
+#define cudaEventDisableTiming      0x02
+
+#define cudaStreamDefault           0x00
+#define cudaStreamNonBlocking       0x01
+
+#define cudaHostRegisterDefault     0x00
+#define cudaHostRegisterPortable    0x01
+#define cudaHostRegisterMapped      0x02
+
+/* The leading fields of the CUDA 11 layout; the rest is not filled in. */
+struct cudaDeviceProp {
+    char name[256];
+    unsigned char uuid[16];
+    char luid[8];
+    unsigned int luidDeviceNodeMask;
+    size_t totalGlobalMem;
+    size_t sharedMemPerBlock;
+    int regsPerBlock;
+    int warpSize;
+    size_t memPitch;
+    int maxThreadsPerBlock;
+    int maxThreadsDim[3];
+    int maxGridSize[3];
+    int clockRate;
+    size_t totalConstMem;
+    int major;
+    int minor;
+    int reserved[256];
+};
+
+#endif
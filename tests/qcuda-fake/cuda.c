@@ -0,0 +1,1968 @@
+/*
+ * Link-time stand-in for the CUDA driver API, see cuda.h
+ *
+ * Everything is protected by one lock.  Work queued on a stream is a
+ * FakeOp; each stream has a thread that runs its ops in order and
+ * broadcasts "progress" whenever one completes, which is also what any
+ * thread waiting for work to finish sleeps on.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "cuda.h"
+
+#define FAKE_MAX_DEVICES    16
+#define FAKE_MAX_PARAMS     8
+#define FAKE_CTX_STACK      16
+#define FAKE_GRANULARITY    (2 * 1024 * 1024)
+#define FAKE_NO_WORK        UINT64_MAX
+
+enum {
+    OP_COPY,
+    OP_SET,
+    OP_KERNEL,
+    OP_RECORD,
+    OP_WAIT,
+    OP_CALLBACK,
+};
+
+typedef struct FakeOp {
+    int type;
+    uint64_t seq;           /* submission order within all streams */
+    void *dst;
+    const void *src;
+    size_t len;
+    unsigned char value;
+    CUfunction func;
+    uint64_t args[FAKE_MAX_PARAMS];
+    CUevent event;
+    uint64_t target;        /* OP_RECORD/OP_WAIT: record count of event */
+    CUstreamCallback cb;
+    void *data;
+    struct FakeOp *next;
+} FakeOp;
+
+struct CUstream_st {
+    CUcontext ctx;
+    unsigned flags;
+    bool legacy;            /* the NULL stream of ctx */
+    bool stopping;
+    pthread_t thread;
+    FakeOp *head, *tail;    /* head is running or next to run */
+    uint64_t submitted, completed;
+    struct CUstream_st *next;
+};
+
+struct CUctx_st {
+    CUdevice device;
+    struct CUstream_st *null_stream;
+    struct CUstream_st *streams;
+    struct CUctx_st *next;
+};
+
+struct CUevent_st {
+    unsigned flags;
+    int refs;               /* the handle and every queued op using it */
+    uint64_t recorded, done;
+    int64_t time_ns;
+};
+
+struct CUfunc_st {
+    const char *name;
+    int nparams;
+    size_t size[FAKE_MAX_PARAMS];
+    void (*run)(const uint64_t *args);
+};
+
+struct CUmod_st {
+    char *text;             /* PTX, NULL for binary images */
+};
+
+struct CUlinkState_st {
+    char *data;
+    size_t size;
+};
+
+struct CUgraphNode_st {
+    int type;               /* OP_KERNEL or OP_COPY */
+    CUfunction func;
+    uint64_t args[FAKE_MAX_PARAMS];
+    CUdeviceptr dst, src;
+    size_t len;
+};
+
+struct CUgraph_st {
+    struct CUgraphNode_st **nodes;
+    size_t n;
+};
+
+struct CUgraphExec_st {
+    CUgraphNode *orig;      /* nodes of the graph it was made from */
+    struct CUgraphNode_st *nodes;
+    size_t n;
+};
+
+typedef struct FakeHandle {
+    int fd;
+    size_t size;
+    int device;
+    int refs;               /* the handle and every mapping */
+} FakeHandle;
+
+enum {
+    RANGE_HOST_ALLOC = 1,   /* host ranges from cuMemAllocHost */
+};
+
+typedef struct FakeRange {
+    uintptr_t addr;
+    size_t size;
+    int device;
+    unsigned flags;         /* mappings: CUmemAccess_flags */
+    FakeHandle *handle;
+} FakeRange;
+
+typedef struct RangeSet {
+    FakeRange *r;
+    size_t n, cap;
+} RangeSet;
+
+static struct {
+    pthread_once_t once;
+    pthread_mutex_t lock;
+    pthread_cond_t progress;
+    int ndevices;
+    size_t mem_size;
+    int64_t launch_ns;
+    uint64_t copy_mbps;
+    size_t used[FAKE_MAX_DEVICES];
+    struct CUctx_st *primary[FAKE_MAX_DEVICES];
+    int primary_refs[FAKE_MAX_DEVICES];
+    struct CUctx_st *contexts;
+    RangeSet dev_mem;       /* cuMemAlloc */
+    RangeSet reserved;      /* cuMemAddressReserve */
+    RangeSet mapped;        /* cuMemMap */
+    RangeSet host;          /* registered or page-locked host memory */
+    uint64_t seq;
+} fake = {
+    .once = PTHREAD_ONCE_INIT,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .progress = PTHREAD_COND_INITIALIZER,
+};
+
+static __thread CUcontext ctx_stack[FAKE_CTX_STACK];
+static __thread int ctx_depth;
+
+static int64_t env_int(const char *name, int64_t def)
+{
+    const char *s = getenv(name);
+
+    return s != NULL && *s != '\0' ? strtoll(s, NULL, 0) : def;
+}
+
+static void fake_init_once(void)
+{
+    fake.ndevices = env_int("QCUDA_FAKE_DEVICES", 2);
+    if (fake.ndevices < 0) {
+        fake.ndevices = 0;
+    } else if (fake.ndevices > FAKE_MAX_DEVICES) {
+        fake.ndevices = FAKE_MAX_DEVICES;
+    }
+    fake.mem_size = (size_t)env_int("QCUDA_FAKE_MEM_MB", 1024) << 20;
+    fake.launch_ns = env_int("QCUDA_FAKE_LAUNCH_NS", 0);
+    fake.copy_mbps = env_int("QCUDA_FAKE_COPY_MBPS", 0);
+}
+
+static void fake_init(void)
+{
+    pthread_once(&fake.once, fake_init_once);
+}
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_until(int64_t deadline)
+{
+    struct timespec ts = {
+        .tv_sec = deadline / 1000000000LL,
+        .tv_nsec = deadline % 1000000000LL,
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+        continue;
+    }
+}
+
+/*
+ * Ranges
+ */
+
+static FakeRange *range_find(RangeSet *s, uintptr_t addr, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < s->n; i++) {
+        if (addr >= s->r[i].addr && len <= s->r[i].size &&
+            addr - s->r[i].addr <= s->r[i].size - len) {
+            return &s->r[i];
+        }
+    }
+    return NULL;
+}
+
+static FakeRange *range_overlap(RangeSet *s, uintptr_t addr, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < s->n; i++) {
+        if (addr < s->r[i].addr + s->r[i].size && s->r[i].addr < addr + len) {
+            return &s->r[i];
+        }
+    }
+    return NULL;
+}
+
+static FakeRange *range_add(RangeSet *s, uintptr_t addr, size_t size)
+{
+    FakeRange *r;
+
+    if (s->n == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 16;
+        s->r = realloc(s->r, s->cap * sizeof(*s->r));
+    }
+    r = &s->r[s->n++];
+    memset(r, 0, sizeof(*r));
+    r->addr = addr;
+    r->size = size;
+    return r;
+}
+
+static void range_del(RangeSet *s, FakeRange *r)
+{
+    *r = s->r[--s->n];
+}
+
+/* Whether the device may access [addr, addr + len); called locked. */
+static bool device_range_ok(uintptr_t addr, size_t len, bool write)
+{
+    FakeRange *r;
+
+    if (range_find(&fake.dev_mem, addr, len) != NULL ||
+        range_find(&fake.host, addr, len) != NULL) {
+        return true;
+    }
+    r = range_find(&fake.mapped, addr, len);
+    if (r == NULL) {
+        return false;
+    }
+    return write ? r->flags == CU_MEM_ACCESS_FLAGS_PROT_READWRITE
+                 : r->flags != CU_MEM_ACCESS_FLAGS_PROT_NONE;
+}
+
+/*
+ * Contexts
+ */
+
+static bool ctx_live(CUcontext ctx)
+{
+    CUcontext c;
+
+    for (c = fake.contexts; c != NULL; c = c->next) {
+        if (c == ctx) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* The current context of the calling thread; called locked. */
+static CUcontext ctx_current(void)
+{
+    CUcontext ctx;
+
+    if (ctx_depth == 0) {
+        return NULL;
+    }
+    ctx = ctx_stack[ctx_depth - 1];
+    return ctx_live(ctx) ? ctx : NULL;
+}
+
+static void *stream_thread(void *opaque);
+
+static CUstream stream_new(CUcontext ctx, unsigned flags, bool legacy)
+{
+    CUstream s = calloc(1, sizeof(*s));
+
+    s->ctx = ctx;
+    s->flags = flags;
+    s->legacy = legacy;
+    pthread_create(&s->thread, NULL, stream_thread, s);
+    return s;
+}
+
+/* Called locked; drops the lock while joining the thread. */
+static void stream_stop(CUstream s)
+{
+    CUstream *p;
+
+    s->stopping = true;
+    pthread_cond_broadcast(&fake.progress);
+    pthread_mutex_unlock(&fake.lock);
+    pthread_join(s->thread, NULL);
+    pthread_mutex_lock(&fake.lock);
+
+    for (p = &s->ctx->streams; *p != NULL; p = &(*p)->next) {
+        if (*p == s) {
+            *p = s->next;
+            break;
+        }
+    }
+    free(s);
+}
+
+static void stream_wait(CUstream s, uint64_t ticket)
+{
+    while (s->completed < ticket) {
+        pthread_cond_wait(&fake.progress, &fake.lock);
+    }
+}
+
+static void ctx_wait(CUcontext ctx)
+{
+    uint64_t null_ticket = ctx->null_stream->submitted;
+    CUstream s;
+
+    stream_wait(ctx->null_stream, null_ticket);
+    for (;;) {
+        for (s = ctx->streams; s != NULL; s = s->next) {
+            if (s->completed < s->submitted) {
+                break;
+            }
+        }
+        if (s == NULL) {
+            return;
+        }
+        pthread_cond_wait(&fake.progress, &fake.lock);
+    }
+}
+
+static CUcontext ctx_new(CUdevice dev)
+{
+    CUcontext ctx = calloc(1, sizeof(*ctx));
+
+    ctx->device = dev;
+    ctx->null_stream = stream_new(ctx, CU_STREAM_DEFAULT, true);
+    ctx->next = fake.contexts;
+    fake.contexts = ctx;
+    return ctx;
+}
+
+/* Called locked. */
+static void ctx_free(CUcontext ctx)
+{
+    CUcontext *p;
+    int i;
+
+    ctx_wait(ctx);
+    while (ctx->streams != NULL) {
+        stream_stop(ctx->streams);
+    }
+    ctx->null_stream->stopping = true;
+    pthread_cond_broadcast(&fake.progress);
+    pthread_mutex_unlock(&fake.lock);
+    pthread_join(ctx->null_stream->thread, NULL);
+    pthread_mutex_lock(&fake.lock);
+    free(ctx->null_stream);
+
+    for (p = &fake.contexts; *p != NULL; p = &(*p)->next) {
+        if (*p == ctx) {
+            *p = ctx->next;
+            break;
+        }
+    }
+    for (i = 0; i < ctx_depth; i++) {
+        if (ctx_stack[i] == ctx) {
+            memmove(&ctx_stack[i], &ctx_stack[i + 1],
+                    (ctx_depth - i - 1) * sizeof(ctx_stack[0]));
+            ctx_depth--;
+            i--;
+        }
+    }
+    free(ctx);
+}
+
+/* The stream work on hStream goes to; called locked. */
+static CUstream stream_resolve(CUstream hStream)
+{
+    CUcontext ctx;
+
+    if (hStream != NULL) {
+        return hStream;
+    }
+    ctx = ctx_current();
+    return ctx != NULL ? ctx->null_stream : NULL;
+}
+
+/*
+ * Work
+ */
+
+static uint64_t head_seq(CUstream s)
+{
+    return s->head != NULL ? s->head->seq : FAKE_NO_WORK;
+}
+
+/*
+ * The legacy NULL stream waits for all earlier work on the blocking
+ * streams of its context, and they wait for all earlier work on it.
+ */
+static bool op_ready(CUstream s, FakeOp *op)
+{
+    CUstream t;
+
+    if (s->legacy) {
+        for (t = s->ctx->streams; t != NULL; t = t->next) {
+            if (!(t->flags & CU_STREAM_NON_BLOCKING) && head_seq(t) < op->seq) {
+                return false;
+            }
+        }
+    } else if (!(s->flags & CU_STREAM_NON_BLOCKING) &&
+               head_seq(s->ctx->null_stream) < op->seq) {
+        return false;
+    }
+    if (op->type == OP_WAIT && op->event->done < op->target) {
+        return false;
+    }
+    return true;
+}
+
+static void event_unref(CUevent ev)
+{
+    if (--ev->refs == 0) {
+        free(ev);
+    }
+}
+
+static void op_run(CUstream s, FakeOp *op)
+{
+    int64_t start = now_ns();
+
+    switch (op->type) {
+    case OP_COPY:
+        memmove(op->dst, op->src, op->len);
+        if (fake.copy_mbps) {
+            sleep_until(start + op->len * 1000 / fake.copy_mbps);
+        }
+        break;
+    case OP_SET:
+        memset(op->dst, op->value, op->len);
+        if (fake.copy_mbps) {
+            sleep_until(start + op->len * 1000 / fake.copy_mbps);
+        }
+        break;
+    case OP_KERNEL:
+        op->func->run(op->args);
+        if (fake.launch_ns) {
+            sleep_until(start + fake.launch_ns);
+        }
+        break;
+    case OP_CALLBACK:
+        op->cb(s, CUDA_SUCCESS, op->data);
+        break;
+    }
+}
+
+static void *stream_thread(void *opaque)
+{
+    CUstream s = opaque;
+    FakeOp *op;
+
+    pthread_mutex_lock(&fake.lock);
+    for (;;) {
+        op = s->head;
+        if (op == NULL && s->stopping) {
+            break;
+        }
+        if (op == NULL || !op_ready(s, op)) {
+            pthread_cond_wait(&fake.progress, &fake.lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&fake.lock);
+        op_run(s, op);
+        pthread_mutex_lock(&fake.lock);
+
+        if (op->type == OP_RECORD) {
+            if (op->event->done < op->target) {
+                op->event->done = op->target;
+                op->event->time_ns = now_ns();
+            }
+        }
+        if (op->event != NULL) {
+            event_unref(op->event);
+        }
+        s->head = op->next;
+        if (s->head == NULL) {
+            s->tail = NULL;
+        }
+        s->completed++;
+        free(op);
+        pthread_cond_broadcast(&fake.progress);
+    }
+    pthread_mutex_unlock(&fake.lock);
+    return NULL;
+}
+
+static FakeOp *op_new(int type)
+{
+    FakeOp *op = calloc(1, sizeof(*op));
+
+    op->type = type;
+    return op;
+}
+
+/* Queue op on s and return its ticket for stream_wait(); called locked. */
+static uint64_t op_submit(CUstream s, FakeOp *op)
+{
+    op->seq = ++fake.seq;
+    if (s->tail != NULL) {
+        s->tail->next = op;
+    } else {
+        s->head = op;
+    }
+    s->tail = op;
+    pthread_cond_broadcast(&fake.progress);
+    return ++s->submitted;
+}
+
+/*
+ * Copies and memsets; dst_dev/src_dev say which side is device memory.
+ * With sync the call returns once the work is done, like the
+ * non-Async variants do for pageable host memory.
+ */
+static CUresult copy_submit(void *dst, bool dst_dev, const void *src,
+                            bool src_dev, size_t len, CUstream hStream,
+                            bool sync)
+{
+    CUresult err = CUDA_SUCCESS;
+    uint64_t ticket;
+    CUstream s;
+    FakeOp *op;
+
+    fake_init();
+    pthread_mutex_lock(&fake.lock);
+    s = stream_resolve(hStream);
+    if (s == NULL) {
+        err = CUDA_ERROR_INVALID_CONTEXT;
+    } else if ((dst_dev && !device_range_ok((uintptr_t)dst, len, true)) ||
+               (src_dev && !device_range_ok((uintptr_t)src, len, false))) {
+        err = CUDA_ERROR_INVALID_VALUE;
+    } else if (len > 0) {
+        op = op_new(OP_COPY);
+        op->dst = dst;
+        op->src = src;
+        op->len = len;
+        ticket = op_submit(s, op);
+        if (sync) {
+            stream_wait(s, ticket);
+        }
+    }
+    pthread_mutex_unlock(&fake.lock);
+    return err;
+}
+
+/*
+ * Built-in kernels
+ */
+
+static void kernel_fill(const uint64_t *args)
+{
+    uint32_t *p = (uint32_t *)(uintptr_t)args[0];
+    uint32_t i;
+
+    for (i = 0; i < (uint32_t)args[2]; i++) {
+        p[i] = (uint32_t)args[1];
+    }
+}
+
+static void kernel_inc(const uint64_t *args)
+{
+    uint32_t *p = (uint32_t *)(uintptr_t)args[0];
+    uint32_t i;
+
+    for (i = 0; i < (uint32_t)args[1]; i++) {
+        p[i]++;
+    }
+}
+
+static void kernel_noop(const uint64_t *args)
+{
+}
+
+static struct CUfunc_st fake_kernels[] = {
+    { QCUDA_FAKE_KERNEL_FILL, 3, { 8, 4, 4 }, kernel_fill },
+    { QCUDA_FAKE_KERNEL_INC, 2, { 8, 4 }, kernel_inc },
+};
+
+static struct CUfunc_st fake_noop = { "", 0, { 0 }, kernel_noop };
+
+/* Memory a built-in kernel writes, checked when it is launched. */
+static bool kernel_args_ok(CUfunction f, const uint64_t *args)
+{
+    if (f->run == kernel_fill) {
+        return device_range_ok(args[0], (size_t)(uint32_t)args[2] * 4, true);
+    }
+    if (f->run == kernel_inc) {
+        return device_range_ok(args[0], (size_t)(uint32_t)args[1] * 4, true);
+    }
+    return true;
+}
+
+static void kernel_args_copy(CUfunction f, uint64_t *args, void **params)
+{
+    int i;
+
+    memset(args, 0, FAKE_MAX_PARAMS * sizeof(*args));
+    for (i = 0; i < f->nparams; i++) {
+        memcpy(&args[i], params[i], f->size[i]);
+    }
+}
+
+/* Arguments packed in a CU_LAUNCH_PARAM_BUFFER_POINTER buffer. */
+static bool kernel_args_unpack(CUfunction f, uint64_t *args, void **extra)
+{
+    const char *buf = NULL;
+    size_t *size = NULL;
+    size_t off = 0;
+    int i;
+
+    for (i = 0; extra[i] != CU_LAUNCH_PARAM_END; i += 2) {
+        if (extra[i] == CU_LAUNCH_PARAM_BUFFER_POINTER) {
+            buf = extra[i + 1];
+        } else if (extra[i] == CU_LAUNCH_PARAM_BUFFER_SIZE) {
+            size = extra[i + 1];
+        } else {
+            return false;
+        }
+    }
+    if (buf == NULL || size == NULL) {
+        return false;
+    }
+    memset(args, 0, FAKE_MAX_PARAMS * sizeof(*args));
+    for (i = 0; i < f->nparams; i++) {
+        off = (off + f->size[i] - 1) & ~(f->size[i] - 1);
+        if (off + f->size[i] > *size) {
+            return false;
+        }
+        memcpy(&args[i], buf + off, f->size[i]);
+        off += f->size[i];
+    }
+    return true;
+}
+
+/* Called locked. */
+static CUresult kernel_submit(CUfunction f, const uint64_t *args, CUstream s)
+{
+    FakeOp *op;
+
+    if (!kernel_args_ok(f, args)) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    op = op_new(OP_KERNEL);
+    op->func = f;
+    memcpy(op->args, args, sizeof(op->args));
+    op_submit(s, op);
+    return CUDA_SUCCESS;
+}
+
+/*
+ * Initialization, devices, errors
+ */
+
+CUresult cuInit(unsigned int flags)
+{
+    fake_init();
+    return flags ? CUDA_ERROR_INVALID_VALUE : CUDA_SUCCESS;
+}
+
+CUresult cuDriverGetVersion(int *driverVersion)
+{
+    if (driverVersion == NULL) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    *driverVersion = CUDA_VERSION;
+    return CUDA_SUCCESS;
+}
+
+CUresult cuDeviceGet(CUdevice *device, int ordinal)
+{
+    fake_init();
+    if (ordinal < 0 || ordinal >= fake.ndevices) {
+        return CUDA_ERROR_INVALID_DEVICE;
+    }
+    *device = ordinal;
+    return CUDA_SUCCESS;
+}
+
+CUresult cuDeviceGetCount(int *count)
+{
+    fake_init();
+    *count = fake.ndevices;
+    return CUDA_SUCCESS;
+}
+
+CUresult cuDeviceGetName(char *name, int len, CUdevice dev)
+{
+    fake_init();
+    if (dev < 0 || dev >= fake.ndevices) {
+        return CUDA_ERROR_INVALID_DEVICE;
+    }
+    snprintf(name, len, "qCUDA fake device %d", dev);
+    return CUDA_SUCCESS;
+}
+
+CUresult cuDeviceTotalMem(size_t *bytes, CUdevice dev)
+{
+    fake_init();
+    if (dev < 0 || dev >= fake.ndevices) {
+        return CUDA_ERROR_INVALID_DEVICE;
+    }
+    *bytes = fake.mem_size;
+    return CUDA_SUCCESS;
+}
+
+CUresult cuDeviceGetAttribute(int *pi, CUdevice_attribute attrib,
+                              CUdevice dev)
+{
+    fake_init();
+    if (dev < 0 || dev >= fake.ndevices) {
+        return CUDA_ERROR_INVALID_DEVICE;
+    }
+    switch (attrib) {
+    case CU_DEVICE_ATTRIBUTE_ASYNC_ENGINE_COUNT:
+        *pi = 2;
+        break;
+    case CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MAJOR:
+        *pi = 8;
+        break;
+    case CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MINOR:
+        *pi = 6;
+        break;
+    default:
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    return CUDA_SUCCESS;
+}
+
+CUresult cuGetErrorName(CUresult error, const char **pStr)
+{
+    static const struct {
+        CUresult err;
+        const char *name;
+    } names[] = {
+#define NAME(e) { e, #e }
+        NAME(CUDA_SUCCESS),
+        NAME(CUDA_ERROR_INVALID_VALUE),
+        NAME(CUDA_ERROR_OUT_OF_MEMORY),
+        NAME(CUDA_ERROR_NOT_INITIALIZED),
+        NAME(CUDA_ERROR_INVALID_DEVICE),
+        NAME(CUDA_ERROR_INVALID_IMAGE),
+        NAME(CUDA_ERROR_INVALID_CONTEXT),
+        NAME(CUDA_ERROR_INVALID_HANDLE),
+        NAME(CUDA_ERROR_NOT_FOUND),
+        NAME(CUDA_ERROR_NOT_READY),
+        NAME(CUDA_ERROR_HOST_MEMORY_ALREADY_REGISTERED),
+        NAME(CUDA_ERROR_HOST_MEMORY_NOT_REGISTERED),
+        NAME(CUDA_ERROR_NOT_SUPPORTED),
+        NAME(CUDA_ERROR_UNKNOWN),
+#undef NAME
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (names[i].err == error) {
+            *pStr = names[i].name;
+            return CUDA_SUCCESS;
+        }
+    }
+    *pStr = NULL;
+    return CUDA_ERROR_INVALID_VALUE;
+}
+
+/*
+ * Contexts
+ */
+
+CUresult cuCtxCreate(CUcontext *pctx, unsigned int flags, CUdevice dev)
+{
+    CUresult err;
+
+    err = cuDeviceGet(&dev, dev);
+    if (err != CUDA_SUCCESS) {
+        return err;
+    }
+    if (ctx_depth == FAKE_CTX_STACK) {
+        return CUDA_ERROR_INVALID_CONTEXT;
+    }
+    pthread_mutex_lock(&fake.lock);
+    *pctx = ctx_new(dev);
+    ctx_stack[ctx_depth++] = *pctx;
+    pthread_mutex_unlock(&fake.lock);
+    return CUDA_SUCCESS;
+}
+
+CUresult cuCtxDestroy(CUcontext ctx)
+{
+    CUresult err = CUDA_SUCCESS;
+    int i;
+
+    fake_init();
+    pthread_mutex_lock(&fake.lock);
+    if (!ctx_live(ctx)) {
+        err = CUDA_ERROR_INVALID_CONTEXT;
+    } else {
+        for (i = 0; i < fake.ndevices; i++) {
+            if (fake.primary[i] == ctx) {
+                err = CUDA_ERROR_INVALID_CONTEXT;
+            }
+        }
+    }
+    if (err == CUDA_SUCCESS) {
+        ctx_free(ctx);
+    }
+    pthread_mutex_unlock(&fake.lock);
+    return err;
+}
+
+CUresult cuCtxGetCurrent(CUcontext *pctx)
+{
+    fake_init();
+    pthread_mutex_lock(&fake.lock);
+    *pctx = ctx_current();
+    pthread_mutex_unlock(&fake.lock);
+    return CUDA_SUCCESS;
+}
+
+CUresult cuCtxGetDevice(CUdevice *device)
+{
+    CUcontext ctx;
+
+    fake_init();
+    pthread_mutex_lock(&fake.lock);
+    ctx = ctx_current();
+    if (ctx != NULL) {
+        *device = ctx->device;
+    }
+    pthread_mutex_unlock(&fake.lock);
+    return ctx != NULL ? CUDA_SUCCESS : CUDA_ERROR_INVALID_CONTEXT;
+}
+
+CUresult cuCtxSetCurrent(CUcontext ctx)
+{
+    if (ctx == NULL) {
+        if (ctx_depth > 0) {
+            ctx_depth--;
+        }
+        return CUDA_SUCCESS;
+    }
+    if (ctx_depth == 0) {
+        return cuCtxPushCurrent(ctx);
+    }
+    ctx_stack[ctx_depth - 1] = ctx;
+    return CUDA_SUCCESS;
+}
+
+CUresult cuCtxPushCurrent(CUcontext ctx)
+{
+    if (ctx == NULL || ctx_depth == FAKE_CTX_STACK) {
+        return CUDA_ERROR_INVALID_CONTEXT;
+    }
+    ctx_stack[ctx_depth++] = ctx;
+    return CUDA_SUCCESS;
+}
+
+CUresult cuCtxPopCurrent(CUcontext *pctx)
+{
+    if (ctx_depth == 0) {
+        return CUDA_ERROR_INVALID_CONTEXT;
+    }
+    ctx_depth--;
+    if (pctx != NULL) {
+        *pctx = ctx_stack[ctx_depth];
+    }
+    return CUDA_SUCCESS;
+}
+
+CUresult cuCtxSynchronize(void)
+{
+    CUcontext ctx;
+
+    fake_init();
+    pthread_mutex_lock(&fake.lock);
+    ctx = ctx_current();
+    if (ctx != NULL) {
+        ctx_wait(ctx);
+    }
+    pthread_mutex_unlock(&fake.lock);
+    return ctx != NULL ? CUDA_SUCCESS : CUDA_ERROR_INVALID_CONTEXT;
+}
+
+CUresult cuDevicePrimaryCtxRetain(CUcontext *pctx, CUdevice dev)
+{
+    CUresult err;
+
+    err = cuDeviceGet(&dev, dev);
+    if (err != CUDA_SUCCESS) {
+        return err;
+    }
+    pthread_mutex_lock(&fake.lock);
+    if (fake.primary[dev] == NULL) {
+        fake.primary[dev] = ctx_new(dev);
+    }
+    fake.primary_refs[dev]++;
+    *pctx = fake.primary[dev];
+    pthread_mutex_unlock(&fake.lock);
+    return CUDA_SUCCESS;
+}
+
+CUresult cuDevicePrimaryCtxRelease(CUdevice dev)
+{
+    CUresult err = CUDA_SUCCESS;
+    CUcontext ctx;
+
+    fake_init();
+    if (dev < 0 || dev >= fake.ndevices) {
+        return CUDA_ERROR_INVALID_DEVICE;
+    }
+    pthread_mutex_lock(&fake.lock);
+    if (fake.primary_refs[dev] == 0) {
+        err = CUDA_ERROR_INVALID_CONTEXT;
+    } else if (--fake.primary_refs[dev] == 0) {
+        ctx = fake.primary[dev];
+        fake.primary[dev] = NULL;
+        ctx_free(ctx);
+    }
+    pthread_mutex_unlock(&fake.lock);
+    return err;
+}
+
+/*
+ * Modules
+ */
+
+static bool image_is_binary(const void *image)
+{
+    static const unsigned char elf[4] = { 0x7f, 'E', 'L', 'F' };
+    static const unsigned char fatbin[4] = { 0x50, 0xed, 0x55, 0xba };
+
+    return memcmp(image, elf, 4) == 0 || memcmp(image, fatbin, 4) == 0;
+}
+
+CUresult cuModuleLoadData(CUmodule *module, const void *image)
+{
+    CUmodule mod;
+
+    if (image == NULL) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    if (!image_is_binary(image) && *(const char *)image == '\0') {
+        return CUDA_ERROR_INVALID_IMAGE;
+    }
+    mod = calloc(1, sizeof(*mod));
+    if (!image_is_binary(image)) {
+        mod->text = strdup(image);
+    }
+    *module = mod;
+    return CUDA_SUCCESS;
+}
+
+CUresult cuModuleUnload(CUmodule hmod)
+{
+    if (hmod == NULL) {
+        return CUDA_ERROR_INVALID_HANDLE;
+    }
+    free(hmod->text);
+    free(hmod);
+    return CUDA_SUCCESS;
+}
+
+/*
+ * A PTX module has the functions it names; binary images are opaque, so
+ * they have every function.
+ */
+CUresult cuModuleGetFunction(CUfunction *hfunc, CUmodule hmod,
+                             const char *name)
+{
+    size_t i;
+
+    if (hmod == NULL || name == NULL) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    if (hmod->text != NULL && strstr(hmod->text, name) == NULL) {
+        return CUDA_ERROR_NOT_FOUND;
+    }
+    *hfunc = &fake_noop;
+    for (i = 0; i < sizeof(fake_kernels) / sizeof(fake_kernels[0]); i++) {
+        if (strcmp(fake_kernels[i].name, name) == 0) {
+            *hfunc = &fake_kernels[i];
+        }
+    }
+    return CUDA_SUCCESS;
+}
+
+CUresult cuLinkCreate(unsigned int numOptions, CUjit_option *options,
+                      void **optionValues, CUlinkState *stateOut)
+{
+    static const char banner[] = "// qcuda fake cubin\n";
+    CUlinkState state = calloc(1, sizeof(*state));
+
+    state->size = sizeof(banner) - 1;
+    state->data = malloc(state->size + 1);
+    memcpy(state->data, banner, state->size + 1);
+    *stateOut = state;
+    return CUDA_SUCCESS;
+}
+
+/* The linked "cubin" is the text of all inputs behind a banner. */
+CUresult cuLinkAddData(CUlinkState state, CUjitInputType type, void *data,
+                       size_t size, const char *name,
+                       unsigned int numOptions, CUjit_option *options,
+                       void **optionValues)
+{
+    if (state == NULL || data == NULL || size == 0) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    if (type != CU_JIT_INPUT_PTX) {
+        return CUDA_ERROR_INVALID_IMAGE;
+    }
+    size = strnlen(data, size);
+    state->data = realloc(state->data, state->size + size + 1);
+    memcpy(state->data + state->size, data, size);
+    state->size += size;
+    state->data[state->size] = '\0';
+    return CUDA_SUCCESS;
+}
+
+CUresult cuLinkComplete(CUlinkState state, void **cubinOut, size_t *sizeOut)
+{
+    if (state == NULL) {
+        return CUDA_ERROR_INVALID_HANDLE;
+    }
+    *cubinOut = state->data;
+    *sizeOut = state->size + 1;
+    return CUDA_SUCCESS;
+}
+
+CUresult cuLinkDestroy(CUlinkState state)
+{
+    if (state == NULL) {
+        return CUDA_ERROR_INVALID_HANDLE;
+    }
+    free(state->data);
+    free(state);
+    return CUDA_SUCCESS;
+}
+
+/*
+ * Memory
+ */
+
+CUresult cuMemAlloc(CUdeviceptr *dptr, size_t bytesize)
+{
+    CUresult err = CUDA_SUCCESS;
+    FakeRange *r;
+    CUcontext ctx;
+    void *p = NULL;
+
+    fake_init();
+    if (bytesize == 0) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    pthread_mutex_lock(&fake.lock);
+    ctx = ctx_current();
+    if (ctx == NULL) {
+        err = CUDA_ERROR_INVALID_CONTEXT;
+    } else if (bytesize > fake.mem_size - fake.used[ctx->device] ||
+               posix_memalign(&p, 256, bytesize) != 0) {
+        err = CUDA_ERROR_OUT_OF_MEMORY;
+    } else {
+        fake.used[ctx->device] += bytesize;
+        r = range_add(&fake.dev_mem, (uintptr_t)p, bytesize);
+        r->device = ctx->device;
+        *dptr = (uintptr_t)p;
+    }
+    pthread_mutex_unlock(&fake.lock);
+    return err;
+}
+
+CUresult cuMemFree(CUdeviceptr dptr)
+{
+    CUresult err = CUDA_SUCCESS;
+    FakeRange *r;
+    CUcontext ctx;
+
+    fake_init();
+    pthread_mutex_lock(&fake.lock);
+    ctx = ctx_current();
+    if (ctx != NULL) {
+        ctx_wait(ctx);
+    }
+    r = range_find(&fake.dev_mem, dptr, 1);
+    if (r == NULL || r->addr != dptr) {
+        err = CUDA_ERROR_INVALID_VALUE;
+    } else {
+        fake.used[r->device] -= r->size;
+        free((void *)r->addr);
+        range_del(&fake.dev_mem, r);
+    }
+    pthread_mutex_unlock(&fake.lock);
+    return err;
+}
+
+CUresult cuMemAllocHost(void **pp, size_t bytesize)
+{
+    FakeRange *r;
+    void *p;
+
+    fake_init();
+    if (bytesize == 0) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    if (posix_memalign(&p, getpagesize(), bytesize) != 0) {
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+    pthread_mutex_lock(&fake.lock);
+    r = range_add(&fake.host, (uintptr_t)p, bytesize);
+    r->flags = RANGE_HOST_ALLOC;
+    pthread_mutex_unlock(&fake.lock);
+    *pp = p;
+    return CUDA_SUCCESS;
+}
+
+CUresult cuMemFreeHost(void *p)
+{
+    CUresult err = CUDA_SUCCESS;
+    FakeRange *r;
+
+    fake_init();
+    pthread_mutex_lock(&fake.lock);
+    r = range_find(&fake.host, (uintptr_t)p, 1);
+    if (r == NULL || r->addr != (uintptr_t)p || !(r->flags & RANGE_HOST_ALLOC)) {
+        err = CUDA_ERROR_INVALID_VALUE;
+    } else {
+        range_del(&fake.host, r);
+        free(p);
+    }
+    pthread_mutex_unlock(&fake.lock);
+    return err;
+}
+
+CUresult cuMemHostRegister(void *p, size_t bytesize, unsigned int Flags)
+{
+    CUresult err = CUDA_SUCCESS;
+
+    fake_init();
+    if (p == NULL || bytesize == 0) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    pthread_mutex_lock(&fake.lock);
+    if (range_overlap(&fake.host, (uintptr_t)p, bytesize) != NULL) {
+        err = CUDA_ERROR_HOST_MEMORY_ALREADY_REGISTERED;
+    } else {
+        range_add(&fake.host, (uintptr_t)p, bytesize);
+    }
+    pthread_mutex_unlock(&fake.lock);
+    return err;
+}
+
+CUresult cuMemHostUnregister(void *p)
+{
+    CUresult err = CUDA_SUCCESS;
+    FakeRange *r;
+
+    fake_init();
+    pthread_mutex_lock(&fake.lock);
+    r = range_find(&fake.host, (uintptr_t)p, 1);
+    if (r == NULL || r->addr != (uintptr_t)p || (r->flags & RANGE_HOST_ALLOC)) {
+        err = CUDA_ERROR_HOST_MEMORY_NOT_REGISTERED;
+    } else {
+        range_del(&fake.host, r);
+    }
+    pthread_mutex_unlock(&fake.lock);
+    return err;
+}
+
+CUresult cuMemHostGetDevicePointer(CUdeviceptr *pdptr, void *p,
+                                   unsigned int Flags)
+{
+    CUresult err = CUDA_SUCCESS;
+
+    fake_init();
+    pthread_mutex_lock(&fake.lock);
+    if (Flags != 0 || range_find(&fake.host, (uintptr_t)p, 1) == NULL) {
+        err = CUDA_ERROR_INVALID_VALUE;
+    } else {
+        *pdptr = (uintptr_t)p;
+    }
+    pthread_mutex_unlock(&fake.lock);
+    return err;
+}
+
+CUresult cuMemcpyHtoD(CUdeviceptr dstDevice, const void *srcHost,
+                      size_t ByteCount)
+{
+    return copy_submit((void *)(uintptr_t)dstDevice, true, srcHost, false,
+                       ByteCount, NULL, true);
+}
+
+CUresult cuMemcpyDtoH(void *dstHost, CUdeviceptr srcDevice, size_t ByteCount)
+{
+    return copy_submit(dstHost, false, (void *)(uintptr_t)srcDevice, true,
+                       ByteCount, NULL, true);
+}
+
+CUresult cuMemcpyDtoD(CUdeviceptr dstDevice, CUdeviceptr srcDevice,
+                      size_t ByteCount)
+{
+    return copy_submit((void *)(uintptr_t)dstDevice, true,
+                       (void *)(uintptr_t)srcDevice, true, ByteCount, NULL,
+                       true);
+}
+
+CUresult cuMemcpyHtoDAsync(CUdeviceptr dstDevice, const void *srcHost,
+                           size_t ByteCount, CUstream hStream)
+{
+    return copy_submit((void *)(uintptr_t)dstDevice, true, srcHost, false,
+                       ByteCount, hStream, false);
+}
+
+CUresult cuMemcpyDtoHAsync(void *dstHost, CUdeviceptr srcDevice,
+                           size_t ByteCount, CUstream hStream)
+{
+    return copy_submit(dstHost, false, (void *)(uintptr_t)srcDevice, true,
+                       ByteCount, hStream, false);
+}
+
+CUresult cuMemcpyDtoDAsync(CUdeviceptr dstDevice, CUdeviceptr srcDevice,
+                           size_t ByteCount, CUstream hStream)
+{
+    return copy_submit((void *)(uintptr_t)dstDevice, true,
+                       (void *)(uintptr_t)srcDevice, true, ByteCount,
+                       hStream, false);
+}
+
+CUresult cuMemsetD8Async(CUdeviceptr dstDevice, unsigned char uc, size_t N,
+                         CUstream hStream)
+{
+    CUresult err = CUDA_SUCCESS;
+    CUstream s;
+    FakeOp *op;
+
+    fake_init();
+    pthread_mutex_lock(&fake.lock);
+    s = stream_resolve(hStream);
+    if (s == NULL) {
+        err = CUDA_ERROR_INVALID_CONTEXT;
+    } else if (!device_range_ok(dstDevice, N, true)) {
+        err = CUDA_ERROR_INVALID_VALUE;
+    } else if (N > 0) {
+        op = op_new(OP_SET);
+        op->dst = (void *)(uintptr_t)dstDevice;
+        op->value = uc;
+        op->len = N;
+        op_submit(s, op);
+    }
+    pthread_mutex_unlock(&fake.lock);
+    return err;
+}
+
+/*
+ * Virtual memory management.  Physical allocations are unlinked files
+ * mapped into reservations that are PROT_NONE host address ranges.
+ */
+
+static bool prop_ok(const CUmemAllocationProp *prop)
+{
+    return prop != NULL && prop->type == CU_MEM_ALLOCATION_TYPE_PINNED &&
+           prop->location.type == CU_MEM_LOCATION_TYPE_DEVICE &&
+           prop->location.id >= 0 && prop->location.id < fake.ndevices;
+}
+
+CUresult cuMemGetAllocationGranularity(size_t *granularity,
+                                       const CUmemAllocationProp *prop,
+                                       CUmemAllocationGranularity_flags option)
+{
+    fake_init();
+    if (!prop_ok(prop)) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    *granularity = FAKE_GRANULARITY;
+    return CUDA_SUCCESS;
+}
+
+CUresult cuMemAddressReserve(CUdeviceptr *ptr, size_t size,
+                             size_t alignment, CUdeviceptr addr,
+                             unsigned long long flags)
+{
+    uintptr_t base, aligned;
+    void *p;
+
+    fake_init();
+    if (size == 0 || size % FAKE_GRANULARITY || flags) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    if (alignment < FAKE_GRANULARITY) {
+        alignment = FAKE_GRANULARITY;
+    }
+
+    /* try the hint first, then anywhere with room to align */
+    p = MAP_FAILED;
+    if (addr != 0 && addr % alignment == 0) {
+        p = mmap((void *)(uintptr_t)addr, size, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p != MAP_FAILED && (uintptr_t)p != addr) {
+            munmap(p, size);
+            p = MAP_FAILED;
+        }
+    }
+    if (p == MAP_FAILED) {
+        p = mmap(NULL, size + alignment, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED) {
+            return CUDA_ERROR_OUT_OF_MEMORY;
+        }
+        base = (uintptr_t)p;
+        aligned = (base + alignment - 1) & ~(uintptr_t)(alignment - 1);
+        if (aligned > base) {
+            munmap(p, aligned - base);
+        }
+        munmap((void *)(aligned + size), base + alignment - aligned);
+        p = (void *)aligned;
+    }
+
+    pthread_mutex_lock(&fake.lock);
+    range_add(&fake.reserved, (uintptr_t)p, size);
+    pthread_mutex_unlock(&fake.lock);
+    *ptr = (uintptr_t)p;
+    return CUDA_SUCCESS;
+}
+
+static void handle_unref(FakeHandle *h)
+{
+    if (--h->refs == 0) {
+        close(h->fd);
+        fake.used[h->device] -= h->size;
+        free(h);
+    }
+}
+
+CUresult cuMemAddressFree(CUdeviceptr ptr, size_t size)
+{
+    CUresult err = CUDA_SUCCESS;
+    FakeRange *r;
+
+    fake_init();
+    pthread_mutex_lock(&fake.lock);
+    r = range_find(&fake.reserved, ptr, size);
+    if (r == NULL || r->addr != ptr || r->size != size) {
+        err = CUDA_ERROR_INVALID_VALUE;
+    } else {
+        range_del(&fake.reserved, r);
+        while ((r = range_overlap(&fake.mapped, ptr, size)) != NULL) {
+            handle_unref(r->handle);
+            range_del(&fake.mapped, r);
+        }
+        munmap((void *)(uintptr_t)ptr, size);
+    }
+    pthread_mutex_unlock(&fake.lock);
+    return err;
+}
+
+static int handle_fd(void)
+{
+    char path[] = "/tmp/qcuda-fake-XXXXXX";
+    int fd;
+
+#ifdef __NR_memfd_create
+    fd = syscall(__NR_memfd_create, "qcuda-fake", 0);
+    if (fd >= 0) {
+        return fd;
+    }
+#endif
+    fd = mkstemp(path);
+    if (fd >= 0) {
+        unlink(path);
+    }
+    return fd;
+}
+
+CUresult cuMemCreate(CUmemGenericAllocationHandle *handle, size_t size,
+                     const CUmemAllocationProp *prop,
+                     unsigned long long flags)
+{
+    CUresult err = CUDA_SUCCESS;
+    FakeHandle *h;
+    int fd;
+
+    fake_init();
+    if (!prop_ok(prop) || size == 0 || size % FAKE_GRANULARITY || flags) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    pthread_mutex_lock(&fake.lock);
+    if (size > fake.mem_size - fake.used[prop->location.id]) {
+        err = CUDA_ERROR_OUT_OF_MEMORY;
+    } else {
+        fake.used[prop->location.id] += size;
+    }
+    pthread_mutex_unlock(&fake.lock);
+    if (err != CUDA_SUCCESS) {
+        return err;
+    }
+
+    fd = handle_fd();
+    if (fd < 0 || ftruncate(fd, size) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        pthread_mutex_lock(&fake.lock);
+        fake.used[prop->location.id] -= size;
+        pthread_mutex_unlock(&fake.lock);
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+
+    h = calloc(1, sizeof(*h));
+    h->fd = fd;
+    h->size = size;
+    h->device = prop->location.id;
+    h->refs = 1;
+    *handle = (uintptr_t)h;
+    return CUDA_SUCCESS;
+}
+
+CUresult cuMemRelease(CUmemGenericAllocationHandle handle)
+{
+    if (handle == 0) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    pthread_mutex_lock(&fake.lock);
+    handle_unref((FakeHandle *)(uintptr_t)handle);
+    pthread_mutex_unlock(&fake.lock);
+    return CUDA_SUCCESS;
+}
+
+CUresult cuMemMap(CUdeviceptr ptr, size_t size, size_t offset,
+                  CUmemGenericAllocationHandle handle,
+                  unsigned long long flags)
+{
+    FakeHandle *h = (FakeHandle *)(uintptr_t)handle;
+    CUresult err = CUDA_SUCCESS;
+    FakeRange *r;
+
+    fake_init();
+    if (h == NULL || size == 0 || offset > h->size ||
+        size > h->size - offset || flags) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    pthread_mutex_lock(&fake.lock);
+    if (range_find(&fake.reserved, ptr, size) == NULL ||
+        range_overlap(&fake.mapped, ptr, size) != NULL) {
+        err = CUDA_ERROR_INVALID_VALUE;
+    } else if (mmap((void *)(uintptr_t)ptr, size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_FIXED, h->fd, offset) == MAP_FAILED) {
+        err = CUDA_ERROR_OUT_OF_MEMORY;
+    } else {
+        h->refs++;
+        r = range_add(&fake.mapped, ptr, size);
+        r->device = h->device;
+        r->flags = CU_MEM_ACCESS_FLAGS_PROT_NONE;
+        r->handle = h;
+    }
+    pthread_mutex_unlock(&fake.lock);
+    return err;
+}
+
+CUresult cuMemUnmap(CUdeviceptr ptr, size_t size)
+{
+    CUresult err = CUDA_SUCCESS;
+    FakeRange *r;
+
+    fake_init();
+    pthread_mutex_lock(&fake.lock);
+    r = range_find(&fake.mapped, ptr, size);
+    if (r == NULL || r->addr != ptr || r->size != size) {
+        err = CUDA_ERROR_INVALID_VALUE;
+    } else {
+        mmap((void *)(uintptr_t)ptr, size, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+        handle_unref(r->handle);
+        range_del(&fake.mapped, r);
+    }
+    pthread_mutex_unlock(&fake.lock);
+    return err;
+}
+
+/* Only recorded: device accesses are checked against it, see copy_submit. */
+CUresult cuMemSetAccess(CUdeviceptr ptr, size_t size,
+                        const CUmemAccessDesc *desc, size_t count)
+{
+    bool found = false;
+    size_t i;
+
+    fake_init();
+    if (desc == NULL || count == 0) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    pthread_mutex_lock(&fake.lock);
+    for (i = 0; i < fake.mapped.n; i++) {
+        FakeRange *r = &fake.mapped.r[i];
+
+        if (r->addr >= ptr && r->addr + r->size <= ptr + size) {
+            r->flags = desc[0].flags;
+            found = true;
+        }
+    }
+    pthread_mutex_unlock(&fake.lock);
+    return found ? CUDA_SUCCESS : CUDA_ERROR_INVALID_VALUE;
+}
+
+/*
+ * Execution
+ */
+
+CUresult cuLaunchKernel(CUfunction f, unsigned int gridDimX,
+                        unsigned int gridDimY, unsigned int gridDimZ,
+                        unsigned int blockDimX, unsigned int blockDimY,
+                        unsigned int blockDimZ, unsigned int sharedMemBytes,
+                        CUstream hStream, void **kernelParams, void **extra)
+{
+    uint64_t args[FAKE_MAX_PARAMS];
+    CUresult err;
+    CUstream s;
+
+    fake_init();
+    if (f == NULL) {
+        return CUDA_ERROR_INVALID_HANDLE;
+    }
+    if (gridDimX == 0 || gridDimY == 0 || gridDimZ == 0 ||
+        blockDimX == 0 || blockDimY == 0 || blockDimZ == 0 ||
+        (kernelParams != NULL && extra != NULL)) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    if (extra != NULL) {
+        if (!kernel_args_unpack(f, args, extra)) {
+            return CUDA_ERROR_INVALID_VALUE;
+        }
+    } else if (f->nparams > 0 && kernelParams == NULL) {
+        return CUDA_ERROR_INVALID_VALUE;
+    } else {
+        kernel_args_copy(f, args, kernelParams);
+    }
+
+    pthread_mutex_lock(&fake.lock);
+    s = stream_resolve(hStream);
+    err = s != NULL ? kernel_submit(f, args, s) : CUDA_ERROR_INVALID_CONTEXT;
+    pthread_mutex_unlock(&fake.lock);
+    return err;
+}
+
+/*
+ * Streams and events
+ */
+
+CUresult cuStreamCreate(CUstream *phStream, unsigned int Flags)
+{
+    CUresult err = CUDA_SUCCESS;
+    CUcontext ctx;
+    CUstream s;
+
+    fake_init();
+    if (Flags & ~CU_STREAM_NON_BLOCKING) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    pthread_mutex_lock(&fake.lock);
+    ctx = ctx_current();
+    if (ctx == NULL) {
+        err = CUDA_ERROR_INVALID_CONTEXT;
+    } else {
+        s = stream_new(ctx, Flags, false);
+        s->next = ctx->streams;
+        ctx->streams = s;
+        *phStream = s;
+    }
+    pthread_mutex_unlock(&fake.lock);
+    return err;
+}
+
+/* Work already queued still runs; the call waits for it. */
+CUresult cuStreamDestroy(CUstream hStream)
+{
+    if (hStream == NULL || hStream->legacy) {
+        return CUDA_ERROR_INVALID_HANDLE;
+    }
+    pthread_mutex_lock(&fake.lock);
+    stream_stop(hStream);
+    pthread_mutex_unlock(&fake.lock);
+    return CUDA_SUCCESS;
+}
+
+CUresult cuStreamSynchronize(CUstream hStream)
+{
+    CUresult err = CUDA_SUCCESS;
+    CUstream s;
+
+    fake_init();
+    pthread_mutex_lock(&fake.lock);
+    s = stream_resolve(hStream);
+    if (s == NULL) {
+        err = CUDA_ERROR_INVALID_CONTEXT;
+    } else {
+        stream_wait(s, s->submitted);
+    }
+    pthread_mutex_unlock(&fake.lock);
+    return err;
+}
+
+CUresult cuStreamWaitEvent(CUstream hStream, CUevent hEvent,
+                           unsigned int Flags)
+{
+    CUresult err = CUDA_SUCCESS;
+    CUstream s;
+    FakeOp *op;
+
+    fake_init();
+    if (hEvent == NULL || Flags != 0) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    pthread_mutex_lock(&fake.lock);
+    s = stream_resolve(hStream);
+    if (s == NULL) {
+        err = CUDA_ERROR_INVALID_CONTEXT;
+    } else if (hEvent->recorded > 0) {
+        op = op_new(OP_WAIT);
+        op->event = hEvent;
+        op->target = hEvent->recorded;
+        hEvent->refs++;
+        op_submit(s, op);
+    }
+    pthread_mutex_unlock(&fake.lock);
+    return err;
+}
+
+CUresult cuStreamAddCallback(CUstream hStream, CUstreamCallback callback,
+                             void *userData, unsigned int flags)
+{
+    CUresult err = CUDA_SUCCESS;
+    CUstream s;
+    FakeOp *op;
+
+    fake_init();
+    if (callback == NULL || flags != 0) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    pthread_mutex_lock(&fake.lock);
+    s = stream_resolve(hStream);
+    if (s == NULL) {
+        err = CUDA_ERROR_INVALID_CONTEXT;
+    } else {
+        op = op_new(OP_CALLBACK);
+        op->cb = callback;
+        op->data = userData;
+        op_submit(s, op);
+    }
+    pthread_mutex_unlock(&fake.lock);
+    return err;
+}
+
+CUresult cuEventCreate(CUevent *phEvent, unsigned int Flags)
+{
+    CUevent ev;
+
+    if (Flags & ~(CU_EVENT_BLOCKING_SYNC | CU_EVENT_DISABLE_TIMING)) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    ev = calloc(1, sizeof(*ev));
+    ev->flags = Flags;
+    ev->refs = 1;
+    *phEvent = ev;
+    return CUDA_SUCCESS;
+}
+
+/* Queued work that uses the event keeps it alive. */
+CUresult cuEventDestroy(CUevent hEvent)
+{
+    if (hEvent == NULL) {
+        return CUDA_ERROR_INVALID_HANDLE;
+    }
+    pthread_mutex_lock(&fake.lock);
+    event_unref(hEvent);
+    pthread_mutex_unlock(&fake.lock);
+    return CUDA_SUCCESS;
+}
+
+CUresult cuEventRecord(CUevent hEvent, CUstream hStream)
+{
+    CUresult err = CUDA_SUCCESS;
+    CUstream s;
+    FakeOp *op;
+
+    fake_init();
+    if (hEvent == NULL) {
+        return CUDA_ERROR_INVALID_HANDLE;
+    }
+    pthread_mutex_lock(&fake.lock);
+    s = stream_resolve(hStream);
+    if (s == NULL) {
+        err = CUDA_ERROR_INVALID_CONTEXT;
+    } else {
+        op = op_new(OP_RECORD);
+        op->event = hEvent;
+        op->target = ++hEvent->recorded;
+        hEvent->refs++;
+        op_submit(s, op);
+    }
+    pthread_mutex_unlock(&fake.lock);
+    return err;
+}
+
+CUresult cuEventQuery(CUevent hEvent)
+{
+    CUresult err;
+
+    if (hEvent == NULL) {
+        return CUDA_ERROR_INVALID_HANDLE;
+    }
+    pthread_mutex_lock(&fake.lock);
+    err = hEvent->done >= hEvent->recorded ? CUDA_SUCCESS : CUDA_ERROR_NOT_READY;
+    pthread_mutex_unlock(&fake.lock);
+    return err;
+}
+
+CUresult cuEventSynchronize(CUevent hEvent)
+{
+    uint64_t target;
+
+    if (hEvent == NULL) {
+        return CUDA_ERROR_INVALID_HANDLE;
+    }
+    pthread_mutex_lock(&fake.lock);
+    target = hEvent->recorded;
+    while (hEvent->done < target) {
+        pthread_cond_wait(&fake.progress, &fake.lock);
+    }
+    pthread_mutex_unlock(&fake.lock);
+    return CUDA_SUCCESS;
+}
+
+CUresult cuEventElapsedTime(float *pMilliseconds, CUevent hStart,
+                            CUevent hEnd)
+{
+    CUresult err = CUDA_SUCCESS;
+
+    if (hStart == NULL || hEnd == NULL) {
+        return CUDA_ERROR_INVALID_HANDLE;
+    }
+    pthread_mutex_lock(&fake.lock);
+    if ((hStart->flags | hEnd->flags) & CU_EVENT_DISABLE_TIMING ||
+        hStart->recorded == 0 || hEnd->recorded == 0) {
+        err = CUDA_ERROR_INVALID_HANDLE;
+    } else if (hStart->done < hStart->recorded ||
+               hEnd->done < hEnd->recorded) {
+        err = CUDA_ERROR_NOT_READY;
+    } else {
+        *pMilliseconds = (hEnd->time_ns - hStart->time_ns) / 1e6;
+    }
+    pthread_mutex_unlock(&fake.lock);
+    return err;
+}
+
+/*
+ * Graphs.  Nodes run in the order they were added, which satisfies any
+ * dependencies they were given.
+ */
+
+CUresult cuGraphCreate(CUgraph *phGraph, unsigned int flags)
+{
+    if (flags != 0) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    *phGraph = calloc(1, sizeof(**phGraph));
+    return CUDA_SUCCESS;
+}
+
+CUresult cuGraphDestroy(CUgraph hGraph)
+{
+    size_t i;
+
+    if (hGraph == NULL) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    for (i = 0; i < hGraph->n; i++) {
+        free(hGraph->nodes[i]);
+    }
+    free(hGraph->nodes);
+    free(hGraph);
+    return CUDA_SUCCESS;
+}
+
+static CUgraphNode graph_add(CUgraph g, int type)
+{
+    CUgraphNode node = calloc(1, sizeof(*node));
+
+    node->type = type;
+    g->nodes = realloc(g->nodes, (g->n + 1) * sizeof(*g->nodes));
+    g->nodes[g->n++] = node;
+    return node;
+}
+
+CUresult cuGraphAddKernelNode(CUgraphNode *phGraphNode, CUgraph hGraph,
+                              const CUgraphNode *dependencies,
+                              size_t numDependencies,
+                              const CUDA_KERNEL_NODE_PARAMS *nodeParams)
+{
+    CUgraphNode node;
+
+    if (hGraph == NULL || nodeParams == NULL || nodeParams->func == NULL ||
+        (nodeParams->func->nparams > 0 && nodeParams->kernelParams == NULL) ||
+        nodeParams->extra != NULL) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    node = graph_add(hGraph, OP_KERNEL);
+    node->func = nodeParams->func;
+    kernel_args_copy(node->func, node->args, nodeParams->kernelParams);
+    *phGraphNode = node;
+    return CUDA_SUCCESS;
+}
+
+/* Only one-dimensional device to device copies are supported. */
+CUresult cuGraphAddMemcpyNode(CUgraphNode *phGraphNode, CUgraph hGraph,
+                              const CUgraphNode *dependencies,
+                              size_t numDependencies,
+                              const CUDA_MEMCPY3D *copyParams,
+                              CUcontext ctx)
+{
+    CUgraphNode node;
+
+    if (hGraph == NULL || copyParams == NULL) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    if (copyParams->srcMemoryType != CU_MEMORYTYPE_DEVICE ||
+        copyParams->dstMemoryType != CU_MEMORYTYPE_DEVICE ||
+        copyParams->Height != 1 || copyParams->Depth != 1) {
+        return CUDA_ERROR_NOT_SUPPORTED;
+    }
+    node = graph_add(hGraph, OP_COPY);
+    node->dst = copyParams->dstDevice + copyParams->dstXInBytes;
+    node->src = copyParams->srcDevice + copyParams->srcXInBytes;
+    node->len = copyParams->WidthInBytes;
+    *phGraphNode = node;
+    return CUDA_SUCCESS;
+}
+
+CUresult cuGraphInstantiate(CUgraphExec *phGraphExec, CUgraph hGraph,
+                            CUgraphNode *phErrorNode, char *logBuffer,
+                            size_t bufferSize)
+{
+    CUgraphExec exec;
+    size_t i;
+
+    if (hGraph == NULL) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    exec = calloc(1, sizeof(*exec));
+    exec->n = hGraph->n;
+    exec->orig = calloc(exec->n + 1, sizeof(*exec->orig));
+    exec->nodes = calloc(exec->n + 1, sizeof(*exec->nodes));
+    for (i = 0; i < exec->n; i++) {
+        exec->orig[i] = hGraph->nodes[i];
+        exec->nodes[i] = *hGraph->nodes[i];
+    }
+    *phGraphExec = exec;
+    return CUDA_SUCCESS;
+}
+
+CUresult cuGraphExecKernelNodeSetParams(CUgraphExec hGraphExec,
+                                        CUgraphNode hNode,
+                                        const CUDA_KERNEL_NODE_PARAMS *nodeParams)
+{
+    size_t i;
+
+    if (hGraphExec == NULL || nodeParams == NULL) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    for (i = 0; i < hGraphExec->n; i++) {
+        if (hGraphExec->orig[i] == hNode) {
+            break;
+        }
+    }
+    if (i == hGraphExec->n || hGraphExec->nodes[i].type != OP_KERNEL ||
+        nodeParams->func != hGraphExec->nodes[i].func ||
+        (nodeParams->func->nparams > 0 && nodeParams->kernelParams == NULL)) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    kernel_args_copy(nodeParams->func, hGraphExec->nodes[i].args,
+                     nodeParams->kernelParams);
+    return CUDA_SUCCESS;
+}
+
+CUresult cuGraphLaunch(CUgraphExec hGraphExec, CUstream hStream)
+{
+    CUresult err = CUDA_SUCCESS;
+    CUgraphNode node;
+    CUstream s;
+    FakeOp *op;
+    size_t i;
+
+    fake_init();
+    if (hGraphExec == NULL) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    pthread_mutex_lock(&fake.lock);
+    s = stream_resolve(hStream);
+    if (s == NULL) {
+        err = CUDA_ERROR_INVALID_CONTEXT;
+    }
+    for (i = 0; err == CUDA_SUCCESS && i < hGraphExec->n; i++) {
+        node = &hGraphExec->nodes[i];
+        if (node->type == OP_KERNEL) {
+            err = kernel_submit(node->func, node->args, s);
+        } else if (!device_range_ok(node->dst, node->len, true) ||
+                   !device_range_ok(node->src, node->len, false)) {
+            err = CUDA_ERROR_INVALID_VALUE;
+        } else {
+            op = op_new(OP_COPY);
+            op->dst = (void *)(uintptr_t)node->dst;
+            op->src = (void *)(uintptr_t)node->src;
+            op->len = node->len;
+            op_submit(s, op);
+        }
+    }
+    pthread_mutex_unlock(&fake.lock);
+    return err;
+}
+
+CUresult cuGraphExecDestroy(CUgraphExec hGraphExec)
+{
+    if (hGraphExec == NULL) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    free(hGraphExec->orig);
+    free(hGraphExec->nodes);
+    free(hGraphExec);
+    return CUDA_SUCCESS;
+}
@@ -0,0 +1,361 @@
+/*
+ * Link-time stand-in for the CUDA runtime API, see cuda_runtime.h
+ *
+ * Every call is a thin wrapper around the fake driver.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "cuda_runtime.h"
+
+static __thread cudaError_t last_error;
+static __thread int current_device;
+
+static cudaError_t rt_error(CUresult err)
+{
+    cudaError_t e;
+
+    switch (err) {
+    case CUDA_SUCCESS:
+        return cudaSuccess;
+    case CUDA_ERROR_INVALID_VALUE:
+        e = cudaErrorInvalidValue;
+        break;
+    case CUDA_ERROR_OUT_OF_MEMORY:
+        e = cudaErrorMemoryAllocation;
+        break;
+    case CUDA_ERROR_NOT_INITIALIZED:
+        e = cudaErrorInitializationError;
+        break;
+    case CUDA_ERROR_INVALID_DEVICE:
+        e = cudaErrorInvalidDevice;
+        break;
+    case CUDA_ERROR_INVALID_IMAGE:
+        e = cudaErrorInvalidKernelImage;
+        break;
+    case CUDA_ERROR_INVALID_CONTEXT:
+    case CUDA_ERROR_INVALID_HANDLE:
+        e = cudaErrorInvalidResourceHandle;
+        break;
+    case CUDA_ERROR_NOT_FOUND:
+        e = cudaErrorInvalidDeviceFunction;
+        break;
+    case CUDA_ERROR_NOT_READY:
+        /* not an error, so it is not sticky either */
+        return cudaErrorNotReady;
+    case CUDA_ERROR_HOST_MEMORY_ALREADY_REGISTERED:
+        e = cudaErrorHostMemoryAlreadyRegistered;
+        break;
+    case CUDA_ERROR_HOST_MEMORY_NOT_REGISTERED:
+        e = cudaErrorHostMemoryNotRegistered;
+        break;
+    case CUDA_ERROR_NOT_SUPPORTED:
+        e = cudaErrorNotSupported;
+        break;
+    default:
+        e = cudaErrorUnknown;
+        break;
+    }
+    last_error = e;
+    return e;
+}
+
+/* Make sure a context is current, the primary one of the current device
+ * if the thread has none. */
+static CUresult rt_context(void)
+{
+    CUcontext ctx;
+    CUresult err;
+
+    err = cuCtxGetCurrent(&ctx);
+    if (err != CUDA_SUCCESS || ctx != NULL) {
+        return err;
+    }
+    err = cuDevicePrimaryCtxRetain(&ctx, current_device);
+    if (err == CUDA_SUCCESS) {
+        err = cuCtxSetCurrent(ctx);
+    }
+    return err;
+}
+
+const char *cudaGetErrorString(cudaError_t error)
+{
+    switch (error) {
+    case cudaSuccess:
+        return "no error";
+    case cudaErrorMemoryAllocation:
+        return "out of memory";
+    case cudaErrorInitializationError:
+        return "initialization error";
+    case cudaErrorInvalidDeviceFunction:
+        return "invalid device function";
+    case cudaErrorInvalidDevice:
+        return "invalid device ordinal";
+    case cudaErrorInvalidValue:
+        return "invalid argument";
+    case cudaErrorInvalidDevicePointer:
+        return "invalid device pointer";
+    case cudaErrorInvalidResourceHandle:
+        return "invalid resource handle";
+    case cudaErrorNotReady:
+        return "device not ready";
+    case cudaErrorInvalidKernelImage:
+        return "device kernel image is invalid";
+    case cudaErrorHostMemoryAlreadyRegistered:
+        return "part or all of the requested memory range is already mapped";
+    case cudaErrorHostMemoryNotRegistered:
+        return "pointer does not correspond to a registered memory region";
+    case cudaErrorNotSupported:
+        return "operation not supported";
+    default:
+        return "unknown error";
+    }
+}
+
+cudaError_t cudaGetLastError(void)
+{
+    cudaError_t e = last_error;
+
+    last_error = cudaSuccess;
+    return e;
+}
+
+cudaError_t cudaDriverGetVersion(int *driverVersion)
+{
+    return rt_error(cuDriverGetVersion(driverVersion));
+}
+
+cudaError_t cudaRuntimeGetVersion(int *runtimeVersion)
+{
+    if (runtimeVersion == NULL) {
+        return rt_error(CUDA_ERROR_INVALID_VALUE);
+    }
+    *runtimeVersion = CUDART_VERSION;
+    return cudaSuccess;
+}
+
+cudaError_t cudaGetDeviceCount(int *count)
+{
+    return rt_error(cuDeviceGetCount(count));
+}
+
+/* The device of the current context, which cuCtxSetCurrent may change. */
+cudaError_t cudaGetDevice(int *device)
+{
+    CUdevice dev;
+
+    if (cuCtxGetDevice(&dev) == CUDA_SUCCESS) {
+        current_device = dev;
+    }
+    *device = current_device;
+    return cudaSuccess;
+}
+
+cudaError_t cudaSetDevice(int device)
+{
+    CUcontext ctx;
+    CUresult err;
+
+    err = cuDevicePrimaryCtxRetain(&ctx, device);
+    if (err == CUDA_SUCCESS) {
+        err = cuCtxSetCurrent(ctx);
+    }
+    if (err == CUDA_SUCCESS) {
+        current_device = device;
+    }
+    return rt_error(err);
+}
+
+cudaError_t cudaSetDeviceFlags(unsigned int flags)
+{
+    return cudaSuccess;
+}
+
+cudaError_t cudaGetDeviceProperties(struct cudaDeviceProp *prop, int device)
+{
+    CUresult err;
+
+    memset(prop, 0, sizeof(*prop));
+    err = cuDeviceGetName(prop->name, sizeof(prop->name), device);
+    if (err == CUDA_SUCCESS) {
+        err = cuDeviceTotalMem(&prop->totalGlobalMem, device);
+    }
+    if (err == CUDA_SUCCESS) {
+        err = cuDeviceGetAttribute(&prop->major,
+                                   CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MAJOR,
+                                   device);
+    }
+    if (err == CUDA_SUCCESS) {
+        err = cuDeviceGetAttribute(&prop->minor,
+                                   CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MINOR,
+                                   device);
+    }
+    prop->warpSize = 32;
+    prop->maxThreadsPerBlock = 1024;
+    return rt_error(err);
+}
+
+cudaError_t cudaDeviceSynchronize(void)
+{
+    CUresult err = rt_context();
+
+    if (err == CUDA_SUCCESS) {
+        err = cuCtxSynchronize();
+    }
+    return rt_error(err);
+}
+
+/* Device memory is not torn down, the device is only drained. */
+cudaError_t cudaDeviceReset(void)
+{
+    return cudaDeviceSynchronize();
+}
+
+cudaError_t cudaMalloc(void **devPtr, size_t size)
+{
+    CUdeviceptr p = 0;
+    CUresult err = rt_context();
+
+    if (err == CUDA_SUCCESS) {
+        err = cuMemAlloc(&p, size);
+    }
+    *devPtr = (void *)(uintptr_t)p;
+    return rt_error(err);
+}
+
+cudaError_t cudaFree(void *devPtr)
+{
+    CUresult err = rt_context();
+
+    if (err == CUDA_SUCCESS && devPtr != NULL) {
+        err = cuMemFree((uintptr_t)devPtr);
+    }
+    return rt_error(err);
+}
+
+/* Queued on the default stream, like the real one for device memory. */
+cudaError_t cudaMemset(void *devPtr, int value, size_t count)
+{
+    CUresult err = rt_context();
+
+    if (err == CUDA_SUCCESS) {
+        err = cuMemsetD8Async((uintptr_t)devPtr, value, count, NULL);
+    }
+    return rt_error(err);
+}
+
+static CUresult rt_memcpy(void *dst, const void *src, size_t count,
+                          enum cudaMemcpyKind kind, cudaStream_t stream,
+                          bool async)
+{
+    CUresult err = rt_context();
+
+    if (err != CUDA_SUCCESS) {
+        return err;
+    }
+    switch (kind) {
+    case cudaMemcpyHostToDevice:
+        return async ? cuMemcpyHtoDAsync((uintptr_t)dst, src, count, stream)
+                     : cuMemcpyHtoD((uintptr_t)dst, src, count);
+    case cudaMemcpyDeviceToHost:
+        return async ? cuMemcpyDtoHAsync(dst, (uintptr_t)src, count, stream)
+                     : cuMemcpyDtoH(dst, (uintptr_t)src, count);
+    case cudaMemcpyDeviceToDevice:
+        return async ? cuMemcpyDtoDAsync((uintptr_t)dst, (uintptr_t)src,
+                                         count, stream)
+                     : cuMemcpyDtoD((uintptr_t)dst, (uintptr_t)src, count);
+    case cudaMemcpyHostToHost:
+        memmove(dst, src, count);
+        return CUDA_SUCCESS;
+    default:
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+}
+
+cudaError_t cudaMemcpy(void *dst, const void *src, size_t count,
+                       enum cudaMemcpyKind kind)
+{
+    return rt_error(rt_memcpy(dst, src, count, kind, NULL, false));
+}
+
+cudaError_t cudaMemcpyAsync(void *dst, const void *src, size_t count,
+                            enum cudaMemcpyKind kind, cudaStream_t stream)
+{
+    return rt_error(rt_memcpy(dst, src, count, kind, stream, true));
+}
+
+cudaError_t cudaHostRegister(void *ptr, size_t size, unsigned int flags)
+{
+    return rt_error(cuMemHostRegister(ptr, size, flags));
+}
+
+cudaError_t cudaHostUnregister(void *ptr)
+{
+    return rt_error(cuMemHostUnregister(ptr));
+}
+
+cudaError_t cudaHostGetDevicePointer(void **pDevice, void *pHost,
+                                     unsigned int flags)
+{
+    CUdeviceptr p = 0;
+    CUresult err;
+
+    err = cuMemHostGetDevicePointer(&p, pHost, flags);
+    *pDevice = (void *)(uintptr_t)p;
+    return rt_error(err);
+}
+
+cudaError_t cudaStreamCreate(cudaStream_t *pStream)
+{
+    CUresult err = rt_context();
+
+    if (err == CUDA_SUCCESS) {
+        err = cuStreamCreate(pStream, CU_STREAM_DEFAULT);
+    }
+    return rt_error(err);
+}
+
+cudaError_t cudaStreamDestroy(cudaStream_t stream)
+{
+    return rt_error(cuStreamDestroy(stream));
+}
+
+cudaError_t cudaEventCreate(cudaEvent_t *event)
+{
+    return rt_error(cuEventCreate(event, CU_EVENT_DEFAULT));
+}
+
+cudaError_t cudaEventCreateWithFlags(cudaEvent_t *event, unsigned int flags)
+{
+    return rt_error(cuEventCreate(event, flags));
+}
+
+cudaError_t cudaEventRecord(cudaEvent_t event, cudaStream_t stream)
+{
+    CUresult err = rt_context();
+
+    if (err == CUDA_SUCCESS) {
+        err = cuEventRecord(event, stream);
+    }
+    return rt_error(err);
+}
+
+cudaError_t cudaEventSynchronize(cudaEvent_t event)
+{
+    return rt_error(cuEventSynchronize(event));
+}
+
+cudaError_t cudaEventElapsedTime(float *ms, cudaEvent_t start,
+                                 cudaEvent_t end)
+{
+    return rt_error(cuEventElapsedTime(ms, start, end));
+}
+
+cudaError_t cudaEventDestroy(cudaEvent_t event)
+{
+    return rt_error(cuEventDestroy(event));
+}
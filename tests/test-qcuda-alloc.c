@@ -0,0 +1,210 @@
+/*
+ * virtio-qcuda caching device memory allocator
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qcuda-fake-dev.h"
+
+#define KiB (1ULL << 10)
+#define MiB (1ULL << 20)
+
+static void test_reuse(void)
+{
+    FakeDev d;
+    QCAllocStats st = { 0 };
+    QCAlloc *a;
+    uint64_t p, q;
+
+    fake_init(&d, 1024 * MiB, 0);
+    a = qcu_alloc_new(&fake_alloc_ops, &d, &st);
+    g_assert(qcu_alloc_get(a, 1000, 0, &p));
+    g_assert_cmpuint(st.misses, ==, 1);
+    g_assert_cmpuint(st.reserved, ==, QCU_ALLOC_SMALL_SEG);
+    g_assert_cmpuint(st.allocated, ==, 1024);
+    g_assert_cmpuint(st.requested, ==, 1000);
+
+    /* the rest of the segment serves the next one */
+    g_assert(qcu_alloc_get(a, 4 * KiB, 0, &q));
+    g_assert_cmpuint(q, ==, p + 1024);
+    g_assert_cmpuint(st.hits, ==, 1);
+
+    g_assert(qcu_alloc_put(a, p, false));
+    g_assert(!qcu_alloc_put(a, p, false));
+    g_assert(qcu_alloc_get(a, 512, 0, &q));
+    g_assert_cmpuint(q, ==, p);
+    g_assert_cmpuint(st.hits, ==, 2);
+    g_assert_cmpuint(st.segments, ==, 1);
+
+    qcu_alloc_destroy(a);
+    g_assert_cmpuint(st.reserved, ==, 0);
+    g_assert_cmpuint(st.allocated, ==, 0);
+    g_assert_cmpuint(st.requested, ==, 0);
+    fake_fini(&d);
+}
+
+static void test_merge(void)
+{
+    FakeDev d;
+    QCAllocStats st = { 0 };
+    QCAlloc *a;
+    uint64_t p[4], big;
+    int i;
+
+    fake_init(&d, 1024 * MiB, 0);
+    a = qcu_alloc_new(&fake_alloc_ops, &d, &st);
+    for (i = 0; i < 4; i++) {
+        g_assert(qcu_alloc_get(a, 256 * KiB, 0, &p[i]));
+    }
+    /* free out of order; neighbours merge back into the whole segment */
+    g_assert(qcu_alloc_put(a, p[1], false));
+    g_assert(qcu_alloc_put(a, p[3], false));
+    g_assert(qcu_alloc_put(a, p[0], false));
+    g_assert(qcu_alloc_put(a, p[2], false));
+
+    g_assert_cmpuint(qcu_alloc_trim(a), ==, QCU_ALLOC_SMALL_SEG);
+    g_assert_cmpuint(st.segments, ==, 0);
+    g_assert_cmpuint(st.trims, ==, 1);
+
+    /* large requests never come out of small segments */
+    g_assert(qcu_alloc_get(a, 3 * MiB, 0, &big));
+    g_assert_cmpuint(st.reserved, ==, QCU_ALLOC_MID_SEG);
+    g_assert(qcu_alloc_get(a, 12 * MiB, 0, &big));
+    g_assert_cmpuint(st.reserved, ==, QCU_ALLOC_MID_SEG);
+    g_assert(qcu_alloc_get(a, 18 * MiB, 0, &big));
+    g_assert_cmpuint(st.reserved, ==, QCU_ALLOC_MID_SEG + 18 * MiB);
+
+    qcu_alloc_destroy(a);
+    fake_fini(&d);
+}
+
+static void test_streams(void)
+{
+    FakeDev d;
+    QCAllocStats st = { 0 };
+    QCAlloc *a;
+    uint64_t p, q;
+
+    fake_init(&d, 1024 * MiB, 0);
+    a = qcu_alloc_new(&fake_alloc_ops, &d, &st);
+    g_assert(qcu_alloc_get(a, 64 * KiB, 1, &p));
+    g_assert(qcu_alloc_put(a, p, false));
+
+    /* another stream does not see the cached block */
+    g_assert(qcu_alloc_get(a, 64 * KiB, 2, &q));
+    g_assert_cmpuint(st.segments, ==, 2);
+    g_assert(qcu_alloc_put(a, q, false));
+
+    g_assert(qcu_alloc_get(a, 64 * KiB, 1, &q));
+    g_assert_cmpuint(q, ==, p);
+
+    qcu_alloc_destroy(a);
+    fake_fini(&d);
+}
+
+static void test_fence(void)
+{
+    FakeDev d;
+    QCAllocStats st = { 0 };
+    QCAlloc *a;
+    uint64_t p, q, r;
+
+    fake_init(&d, 1024 * MiB, 0);
+    a = qcu_alloc_new(&fake_alloc_ops, &d, &st);
+    g_assert(qcu_alloc_get(a, QCU_ALLOC_SMALL, 0, &p));
+    g_assert(qcu_alloc_get(a, QCU_ALLOC_SMALL, 0, &q));
+    g_assert(qcu_alloc_put(a, p, true));
+    g_assert(qcu_alloc_owns(a, q));
+    g_assert(!qcu_alloc_owns(a, p));
+
+    /* still in flight: a new segment is needed */
+    g_assert(qcu_alloc_get(a, QCU_ALLOC_SMALL, 0, &r));
+    g_assert(r != p);
+    g_assert_cmpuint(st.segments, ==, 2);
+    g_assert(qcu_alloc_put(a, r, false));
+
+    d.fences_passed = d.fences_made;
+    g_assert(qcu_alloc_get(a, QCU_ALLOC_SMALL, 0, &r));
+    g_assert_cmpuint(r, ==, p);
+    g_assert_cmpuint(d.fences_live, ==, 0);
+
+    /* destroying waits for fences and frees leaked blocks */
+    g_assert(qcu_alloc_put(a, r, true));
+    qcu_alloc_destroy(a);
+    fake_fini(&d);
+}
+
+static void test_pressure(void)
+{
+    FakeDev d;
+    QCAllocStats st = { 0 };
+    QCAlloc *a;
+    uint64_t p[3], q;
+    int i;
+
+    fake_init(&d, 3 * QCU_ALLOC_SMALL_SEG, 0);
+    a = qcu_alloc_new(&fake_alloc_ops, &d, &st);
+    for (i = 0; i < 3; i++) {
+        g_assert(qcu_alloc_get(a, QCU_ALLOC_SMALL, i, &p[i]));
+    }
+    g_assert(!qcu_alloc_get(a, 512, 3, &q));
+
+    /* cached memory of other streams is given back when needed */
+    g_assert(qcu_alloc_put(a, p[0], true));
+    g_assert(qcu_alloc_put(a, p[1], false));
+    g_assert(qcu_alloc_get(a, 3 * MiB, 3, &q) == false);
+    g_assert(qcu_alloc_get(a, 512, 3, &q));
+    g_assert_cmpuint(st.trims, ==, 2);
+    g_assert_cmpuint(st.segments, ==, 2);
+
+    qcu_alloc_destroy(a);
+    fake_fini(&d);
+}
+
+/* Allocation churn of a framework that allocates per batch. */
+static void perf_churn(void)
+{
+    FakeDev d;
+    QCAllocStats st = { 0 };
+    QCAlloc *a;
+    unsigned int i, j, n = 64, rounds = 20000;
+    uint64_t p[64];
+    double duration;
+
+    fake_init(&d, 64ULL * 1024 * MiB, 0);
+    a = qcu_alloc_new(&fake_alloc_ops, &d, &st);
+    g_test_timer_start();
+    for (i = 0; i < rounds; i++) {
+        for (j = 0; j < n; j++) {
+            g_assert(qcu_alloc_get(a, 512 << (j % 16), 0, &p[j]));
+        }
+        for (j = 0; j < n; j++) {
+            g_assert(qcu_alloc_put(a, p[j], false));
+        }
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("%u alloc/free pairs: %f s, %.0f/s, hit rate %.4f\n",
+                   n * rounds, duration, n * rounds / duration,
+                   (double)st.hits / (st.hits + st.misses));
+
+    qcu_alloc_destroy(a);
+    fake_fini(&d);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/qcuda-alloc/reuse", test_reuse);
+    g_test_add_func("/qcuda-alloc/merge", test_merge);
+    g_test_add_func("/qcuda-alloc/streams", test_streams);
+    g_test_add_func("/qcuda-alloc/fence", test_fence);
+    g_test_add_func("/qcuda-alloc/pressure", test_pressure);
+    if (g_test_perf()) {
+        g_test_add_func("/perf/qcuda-alloc/churn", perf_churn);
+    }
+    return g_test_run();
+}
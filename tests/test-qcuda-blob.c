@@ -0,0 +1,229 @@
+/*
+ * virtio-qcuda shared weight blobs
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "qemu-common.h"
+#include "qcuda-fake-dev.h"
+
+static char *dir;
+
+static void put_file(const char *name, const char *contents)
+{
+    char *path = g_build_filename(dir, name, NULL);
+
+    g_assert(g_file_set_contents(path, contents, strlen(contents), NULL));
+    g_free(path);
+}
+
+static const char *loaded(FakeDev *d, uint64_t addr)
+{
+    uint8_t *mem = fake_mem(d, addr);
+
+    g_assert(mem != NULL);
+    return (const char *)mem;
+}
+
+static void test_share(void)
+{
+    FakeDev d;
+    QCBlobStore *st;
+    uint64_t a, b, c, size;
+
+    fake_init(&d, 0, 0);
+    st = qcu_blob_store_new(&fake_blob_ops, &d);
+    put_file("weights", "0123456789");
+
+    g_assert_cmpint(qcu_blob_get(st, 0, dir, "weights", &a, &size), ==, 0);
+    g_assert_cmpuint(size, ==, 10);
+    g_assert(!memcmp(loaded(&d, a), "0123456789", 10));
+
+    /* a second session gets the same memory, loaded once */
+    g_assert_cmpint(qcu_blob_get(st, 0, dir, "weights", &b, &size), ==, 0);
+    g_assert_cmpuint(b, ==, a);
+    g_assert_cmpuint(d.loads, ==, 1);
+
+    /* another GPU has a copy of its own */
+    g_assert_cmpint(qcu_blob_get(st, 1, dir, "weights", &c, &size), ==, 0);
+    g_assert_cmpuint(c, !=, a);
+    g_assert_cmpuint(d.loads, ==, 2);
+
+    /* the memory goes with the last reference */
+    g_assert(!qcu_blob_put(st, 1, a));
+    g_assert(qcu_blob_put(st, 0, a));
+    g_assert_cmpuint(d.unloads, ==, 0);
+    g_assert(qcu_blob_put(st, 0, a));
+    g_assert_cmpuint(d.unloads, ==, 1);
+    g_assert(!qcu_blob_put(st, 0, a));
+    g_assert(qcu_blob_put(st, 1, c));
+
+    qcu_blob_store_free(st);
+    fake_fini(&d);
+}
+
+/* A file rewritten on disk is loaded again; the old copy stays in use. */
+static void test_changed(void)
+{
+    FakeDev d;
+    QCBlobStore *st;
+    uint64_t a, b, size;
+
+    fake_init(&d, 0, 0);
+    st = qcu_blob_store_new(&fake_blob_ops, &d);
+    put_file("model", "old");
+    g_assert_cmpint(qcu_blob_get(st, 0, dir, "model", &a, &size), ==, 0);
+
+    put_file("model", "newer");
+    g_assert_cmpint(qcu_blob_get(st, 0, dir, "model", &b, &size), ==, 0);
+    g_assert_cmpuint(b, !=, a);
+    g_assert_cmpuint(size, ==, 5);
+    g_assert(!memcmp(loaded(&d, a), "old", 3));
+    g_assert(!memcmp(loaded(&d, b), "newer", 5));
+
+    g_assert(qcu_blob_put(st, 0, a));
+    g_assert(qcu_blob_put(st, 0, b));
+    qcu_blob_store_free(st);
+    fake_fini(&d);
+}
+
+static void test_invalid(void)
+{
+    FakeDev d;
+    QCBlobStore *st;
+    uint64_t a, size;
+    char *sub;
+
+    fake_init(&d, 0, 0);
+    st = qcu_blob_store_new(&fake_blob_ops, &d);
+    put_file("empty", "");
+    sub = g_build_filename(dir, "sub", NULL);
+    g_assert_cmpint(g_mkdir(sub, 0700), ==, 0);
+
+    /* names may not leave the directory */
+    g_assert_cmpint(qcu_blob_get(st, 0, dir, "", &a, &size), ==, -EINVAL);
+    g_assert_cmpint(qcu_blob_get(st, 0, dir, ".", &a, &size), ==, -EINVAL);
+    g_assert_cmpint(qcu_blob_get(st, 0, dir, "..", &a, &size), ==, -EINVAL);
+    g_assert_cmpint(qcu_blob_get(st, 0, dir, "../etc", &a, &size), ==,
+                    -EINVAL);
+    g_assert_cmpint(qcu_blob_get(st, 0, dir, "sub/x", &a, &size), ==,
+                    -EINVAL);
+
+    g_assert_cmpint(qcu_blob_get(st, 0, dir, "missing", &a, &size), ==,
+                    -ENOENT);
+    g_assert_cmpint(qcu_blob_get(st, 0, dir, "sub", &a, &size), ==, -EINVAL);
+    g_assert_cmpint(qcu_blob_get(st, 0, dir, "empty", &a, &size), ==,
+                    -EINVAL);
+
+    /* a failed load leaves nothing behind */
+    put_file("big", "too big");
+    d.fail = true;
+    g_assert_cmpint(qcu_blob_get(st, 0, dir, "big", &a, &size), ==, -EIO);
+    d.fail = false;
+    g_assert_cmpint(qcu_blob_get(st, 0, dir, "big", &a, &size), ==, 0);
+    g_assert_cmpuint(d.loads, ==, 1);
+    g_assert(qcu_blob_put(st, 0, a));
+
+    g_rmdir(sub);
+    g_free(sub);
+    qcu_blob_store_free(st);
+    fake_fini(&d);
+}
+
+typedef struct Getter {
+    QCBlobStore *st;
+    QemuThread thread;
+    uint64_t addr;
+    int ret;
+} Getter;
+
+static void *getter(void *opaque)
+{
+    Getter *g = opaque;
+    uint64_t size;
+
+    g->ret = qcu_blob_get(g->st, 0, dir, "shared", &g->addr, &size);
+    return NULL;
+}
+
+/* Sessions asking while the first one uploads wait for its copy. */
+static void test_concurrent(void)
+{
+    FakeDev d;
+    QemuEvent entered, proceed;
+    Getter g[3];
+    int i;
+
+    fake_init(&d, 0, 0);
+    qemu_event_init(&entered, false);
+    qemu_event_init(&proceed, false);
+    d.entered = &entered;
+    d.proceed = &proceed;
+    put_file("shared", "weights");
+
+    for (i = 0; i < 3; i++) {
+        g[i].st = i == 0 ? qcu_blob_store_new(&fake_blob_ops, &d) : g[0].st;
+    }
+    qemu_thread_create(&g[0].thread, "getter", getter, &g[0],
+                       QEMU_THREAD_JOINABLE);
+    qemu_event_wait(&entered);
+    for (i = 1; i < 3; i++) {
+        qemu_thread_create(&g[i].thread, "getter", getter, &g[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    qemu_event_set(&proceed);
+
+    for (i = 0; i < 3; i++) {
+        qemu_thread_join(&g[i].thread);
+        g_assert_cmpint(g[i].ret, ==, 0);
+        g_assert_cmpuint(g[i].addr, ==, g[0].addr);
+    }
+    g_assert_cmpuint(d.loads, ==, 1);
+
+    for (i = 0; i < 3; i++) {
+        g_assert(qcu_blob_put(g[0].st, 0, g[0].addr));
+    }
+    g_assert_cmpuint(d.unloads, ==, 1);
+
+    qcu_blob_store_free(g[0].st);
+    qemu_event_destroy(&entered);
+    qemu_event_destroy(&proceed);
+    fake_fini(&d);
+}
+
+static void remove_all(void)
+{
+    const char *name;
+    char *path;
+    GDir *gd = g_dir_open(dir, 0, NULL);
+
+    while ((name = g_dir_read_name(gd)) != NULL) {
+        path = g_build_filename(dir, name, NULL);
+        g_unlink(path);
+        g_free(path);
+    }
+    g_dir_close(gd);
+    g_rmdir(dir);
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+    dir = g_strdup("/tmp/qcuda-blob-XXXXXX");
+    g_assert(mkdtemp(dir) != NULL);
+
+    g_test_add_func("/qcuda-blob/share", test_share);
+    g_test_add_func("/qcuda-blob/changed", test_changed);
+    g_test_add_func("/qcuda-blob/invalid", test_invalid);
+    g_test_add_func("/qcuda-blob/concurrent", test_concurrent);
+    ret = g_test_run();
+
+    remove_all();
+    g_free(dir);
+    return ret;
+}
@@ -0,0 +1,251 @@
+/*
+ * virtio-qcuda deferred completions
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/thread.h"
+#include "hw/virtio/virtio-qcuda-defer.h"
+
+/*
+ * A stub backend in place of the GPU: callbacks queued on it only run
+ * once the test lets it go, like stream callbacks behind a long kernel.
+ */
+typedef void StubCallback(void *opaque);
+
+typedef struct Stub {
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    GQueue callbacks;
+    bool running;
+    bool stopping;
+} Stub;
+
+static Stub stub;
+
+static void *stub_thread(void *opaque)
+{
+    StubCallback *cb;
+    void *cb_opaque;
+
+    qemu_mutex_lock(&stub.lock);
+    for (;;) {
+        while (!stub.stopping &&
+               (!stub.running || g_queue_is_empty(&stub.callbacks))) {
+            qemu_cond_wait(&stub.cond, &stub.lock);
+        }
+        if (stub.stopping) {
+            break;
+        }
+        cb = g_queue_pop_head(&stub.callbacks);
+        cb_opaque = g_queue_pop_head(&stub.callbacks);
+        qemu_mutex_unlock(&stub.lock);
+        cb(cb_opaque);
+        qemu_mutex_lock(&stub.lock);
+    }
+    qemu_mutex_unlock(&stub.lock);
+    return NULL;
+}
+
+static void stub_start(void)
+{
+    memset(&stub, 0, sizeof(stub));
+    qemu_mutex_init(&stub.lock);
+    qemu_cond_init(&stub.cond);
+    g_queue_init(&stub.callbacks);
+    qemu_thread_create(&stub.thread, "stub-gpu", stub_thread, NULL,
+                       QEMU_THREAD_JOINABLE);
+}
+
+static void stub_add_callback(StubCallback *cb, void *opaque)
+{
+    qemu_mutex_lock(&stub.lock);
+    g_queue_push_tail(&stub.callbacks, cb);
+    g_queue_push_tail(&stub.callbacks, opaque);
+    qemu_cond_signal(&stub.cond);
+    qemu_mutex_unlock(&stub.lock);
+}
+
+static void stub_run(void)
+{
+    qemu_mutex_lock(&stub.lock);
+    stub.running = true;
+    qemu_cond_signal(&stub.cond);
+    qemu_mutex_unlock(&stub.lock);
+}
+
+static void stub_stop(void)
+{
+    qemu_mutex_lock(&stub.lock);
+    stub.stopping = true;
+    qemu_cond_signal(&stub.cond);
+    qemu_mutex_unlock(&stub.lock);
+    qemu_thread_join(&stub.thread);
+    g_assert(g_queue_is_empty(&stub.callbacks));
+    qemu_cond_destroy(&stub.cond);
+    qemu_mutex_destroy(&stub.lock);
+}
+
+/* Requests and a worker that handles them the way the device does. */
+enum { CMD_NOP, CMD_SYNC };
+
+typedef struct Req {
+    int id;
+    int cmd;
+    QCDeferred defer;
+} Req;
+
+static QemuMutex done_lock;
+static QemuCond done_cond;
+static GArray *done;
+
+static void req_complete(Req *req)
+{
+    qemu_mutex_lock(&done_lock);
+    g_array_append_val(done, req->id);
+    qemu_cond_broadcast(&done_cond);
+    qemu_mutex_unlock(&done_lock);
+}
+
+static void wait_done(unsigned n)
+{
+    qemu_mutex_lock(&done_lock);
+    while (done->len < n) {
+        qemu_cond_wait(&done_cond, &done_lock);
+    }
+    qemu_mutex_unlock(&done_lock);
+}
+
+static void sync_done(void *opaque)
+{
+    Req *req = opaque;
+
+    if (qcu_deferred_put(&req->defer)) {
+        req_complete(req);
+    }
+}
+
+static void *worker(void *opaque)
+{
+    GArray *reqs = opaque;
+    Req *req;
+    guint i;
+
+    for (i = 0; i < reqs->len; i++) {
+        req = &g_array_index(reqs, Req, i);
+        if (req->cmd == CMD_SYNC) {
+            qcu_deferred_arm(&req->defer);
+            stub_add_callback(sync_done, req);
+        }
+
+        if (!qcu_deferred_armed(&req->defer) ||
+            qcu_deferred_put(&req->defer)) {
+            req_complete(req);
+        }
+    }
+    return NULL;
+}
+
+/* A sync waiting for the GPU must not hold up the commands behind it. */
+static void test_flow(void)
+{
+    QemuThread thread;
+    GArray *reqs;
+    Req req;
+    int i, n = 16;
+
+    stub_start();
+    qemu_mutex_init(&done_lock);
+    qemu_cond_init(&done_cond);
+    done = g_array_new(FALSE, FALSE, sizeof(int));
+
+    reqs = g_array_new(FALSE, TRUE, sizeof(Req));
+    for (i = 0; i < n; i++) {
+        memset(&req, 0, sizeof(req));
+        req.id = i;
+        req.cmd = i == 0 ? CMD_SYNC : CMD_NOP;
+        g_array_append_val(reqs, req);
+    }
+
+    qemu_thread_create(&thread, "worker", worker, reqs, QEMU_THREAD_JOINABLE);
+    wait_done(n - 1);
+    qemu_thread_join(&thread);
+
+    g_assert_cmpint(done->len, ==, n - 1);
+    for (i = 0; i < n - 1; i++) {
+        g_assert_cmpint(g_array_index(done, int, i), ==, i + 1);
+    }
+
+    stub_run();
+    wait_done(n);
+    g_assert_cmpint(g_array_index(done, int, n - 1), ==, 0);
+
+    stub_stop();
+    g_array_free(reqs, TRUE);
+    g_array_free(done, TRUE);
+    qemu_cond_destroy(&done_cond);
+    qemu_mutex_destroy(&done_lock);
+}
+
+/* Whatever the timing, exactly one side completes an armed request. */
+#define RACE_N 100000
+
+static QCDeferred race[RACE_N];
+
+static void *race_thread(void *opaque)
+{
+    unsigned *wins = opaque;
+    int i;
+
+    for (i = 0; i < RACE_N; i++) {
+        if (qcu_deferred_put(&race[i])) {
+            (*wins)++;
+        }
+    }
+    return NULL;
+}
+
+static void test_race(void)
+{
+    QemuThread thread;
+    unsigned wins_a = 0, wins_b = 0;
+    int i;
+
+    for (i = 0; i < RACE_N; i++) {
+        qcu_deferred_arm(&race[i]);
+    }
+
+    qemu_thread_create(&thread, "race", race_thread, &wins_b,
+                       QEMU_THREAD_JOINABLE);
+    race_thread(&wins_a);
+    qemu_thread_join(&thread);
+
+    g_assert_cmpuint(wins_a + wins_b, ==, RACE_N);
+    for (i = 0; i < RACE_N; i++) {
+        g_assert(!qcu_deferred_armed(&race[i]));
+    }
+}
+
+static void test_disarm(void)
+{
+    QCDeferred d = { 0 };
+
+    g_assert(!qcu_deferred_armed(&d));
+    qcu_deferred_arm(&d);
+    g_assert(qcu_deferred_armed(&d));
+    qcu_deferred_disarm(&d);
+    g_assert(!qcu_deferred_armed(&d));
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/qcuda-defer/flow", test_flow);
+    g_test_add_func("/qcuda-defer/race", test_race);
+    g_test_add_func("/qcuda-defer/disarm", test_disarm);
+    return g_test_run();
+}
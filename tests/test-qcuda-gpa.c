@@ -0,0 +1,130 @@
+/*
+ * virtio-qcuda guest physical address translation table
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "hw/virtio/virtio-qcuda-gpa.h"
+
+#define KiB (1ULL << 10)
+#define MiB (1ULL << 20)
+#define GiB (1ULL << 30)
+
+#define FAKE_HVA(x) ((uint8_t *)(uintptr_t)(x))
+
+/* Roughly what a 6G x86 guest looks like: low RAM, RAM below the PCI
+ * hole, RAM above 4G.  Given out of order on purpose. */
+static const QCGpaRange pc_ranges[] = {
+    { 4 * GiB,  3 * GiB,    FAKE_HVA(0x7f0000000000ULL + 3 * GiB), NULL },
+    { 0,        640 * KiB,  FAKE_HVA(0x7f0000000000ULL),           NULL },
+    { 1 * MiB,  3 * GiB - 1 * MiB,
+                            FAKE_HVA(0x7f0000000000ULL + 1 * MiB), NULL },
+};
+
+static QCGpaMap *pc_map(void)
+{
+    return qcu_gpa_map_new(pc_ranges, ARRAY_SIZE(pc_ranges));
+}
+
+static void test_find(void)
+{
+    QCGpaMap *map = pc_map();
+    const QCGpaRange *r;
+
+    r = qcu_gpa_map_find(map, 0);
+    g_assert(r != NULL);
+    g_assert_cmpuint(r->gpa, ==, 0);
+    g_assert(qcu_gpa_range_hva(r, 0x1234) == FAKE_HVA(0x7f0000001234ULL));
+
+    r = qcu_gpa_map_find(map, 640 * KiB - 1);
+    g_assert(r != NULL);
+    g_assert_cmpuint(qcu_gpa_range_avail(r, 640 * KiB - 1), ==, 1);
+
+    r = qcu_gpa_map_find(map, 3 * GiB - 1);
+    g_assert(r != NULL);
+    g_assert_cmpuint(r->gpa, ==, 1 * MiB);
+
+    r = qcu_gpa_map_find(map, 4 * GiB + 4096);
+    g_assert(r != NULL);
+    g_assert(qcu_gpa_range_hva(r, 4 * GiB + 4096) ==
+             FAKE_HVA(0x7f0000000000ULL + 3 * GiB + 4096));
+    g_assert_cmpuint(qcu_gpa_range_avail(r, 4 * GiB + 4096), ==,
+                     3 * GiB - 4096);
+
+    qcu_gpa_map_free(map);
+}
+
+static void test_holes(void)
+{
+    QCGpaMap *map = pc_map();
+
+    g_assert(qcu_gpa_map_find(map, 640 * KiB) == NULL);
+    g_assert(qcu_gpa_map_find(map, 1 * MiB - 1) == NULL);
+    g_assert(qcu_gpa_map_find(map, 3 * GiB) == NULL);
+    g_assert(qcu_gpa_map_find(map, 4 * GiB - 1) == NULL);
+    g_assert(qcu_gpa_map_find(map, 7 * GiB) == NULL);
+    g_assert(qcu_gpa_map_find(map, UINT64_MAX) == NULL);
+
+    qcu_gpa_map_free(map);
+}
+
+static void test_empty(void)
+{
+    QCGpaMap *map = qcu_gpa_map_new(NULL, 0);
+
+    g_assert(qcu_gpa_map_find(map, 0) == NULL);
+    g_assert(qcu_gpa_map_find(map, 4 * GiB) == NULL);
+
+    qcu_gpa_map_free(map);
+}
+
+/* Translate the page list of a 1 GiB buffer scattered over guest RAM, the
+ * way a large cudaMemcpy gather list arrives from the guest. */
+static void perf_gather_1g(void)
+{
+    QCGpaMap *map = pc_map();
+    const QCGpaRange *r;
+    unsigned int i, n, pass, passes;
+    uint64_t *gpa, sum = 0;
+    double duration;
+
+    n = 1 * GiB / (4 * KiB);
+    passes = 20;
+    gpa = g_new(uint64_t, n);
+    for (i = 0; i < n; i++) {
+        /* spread pages over both RAM ranges around the PCI hole */
+        gpa[i] = (i & 1 ? 4 * GiB : 1 * MiB) +
+                 ((uint64_t)g_test_rand_int_range(0, 0xbff00) << 12);
+    }
+
+    g_test_timer_start();
+    for (pass = 0; pass < passes; pass++) {
+        for (i = 0; i < n; i++) {
+            r = qcu_gpa_map_find(map, gpa[i]);
+            sum += (uintptr_t)qcu_gpa_range_hva(r, gpa[i]);
+        }
+    }
+    duration = g_test_timer_elapsed();
+
+    g_assert(sum != 0);
+    g_test_message("1 GiB gather list, %u translations: %f s, %.0f/s\n",
+                   n * passes, duration, n * passes / duration);
+
+    g_free(gpa);
+    qcu_gpa_map_free(map);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/qcuda-gpa/find", test_find);
+    g_test_add_func("/qcuda-gpa/holes", test_holes);
+    g_test_add_func("/qcuda-gpa/empty", test_empty);
+    if (g_test_perf()) {
+        g_test_add_func("/perf/qcuda-gpa/gather-1g", perf_gather_1g);
+    }
+    return g_test_run();
+}
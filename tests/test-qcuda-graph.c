@@ -0,0 +1,272 @@
+/*
+ * virtio-qcuda launch graphs
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "hw/virtio/virtio-qcuda-graph.h"
+
+static const uint64_t conf[] = { 64, 2, 1, 256, 1, 1, 1024, 0 };
+
+/* A parameter blob as the guest driver builds it for cudaLaunch. */
+static GByteArray *blob_new(void)
+{
+    GByteArray *b = g_byte_array_new();
+    uint32_t count = 0;
+
+    g_byte_array_append(b, (guint8 *)&count, sizeof(count));
+    return b;
+}
+
+static void blob_add(GByteArray *b, const void *data, uint32_t size)
+{
+    uint32_t count;
+
+    memcpy(&count, b->data, sizeof(count));
+    count++;
+    memcpy(b->data, &count, sizeof(count));
+    g_byte_array_append(b, (guint8 *)&size, sizeof(size));
+    g_byte_array_append(b, data, size);
+}
+
+static void patch_add(GByteArray *p, uint32_t node, uint32_t param,
+                      const void *data, uint32_t size)
+{
+    VirtIOQCGraphPatch e = { node, param, size, 0 };
+    static const uint8_t zero[8];
+
+    g_byte_array_append(p, (guint8 *)&e, sizeof(e));
+    g_byte_array_append(p, data, size);
+    g_byte_array_append(p, zero, ROUND_UP(size, 8) - size);
+}
+
+static QCGraph *graph_new(void)
+{
+    QCGraph *g = qcu_graph_new();
+    GByteArray *b = blob_new();
+    uint64_t ptr = 0x7000000000ULL;
+    uint32_t n = 4096;
+    float alpha = 2.0;
+
+    blob_add(b, &ptr, sizeof(ptr));
+    blob_add(b, &n, sizeof(n));
+    blob_add(b, &alpha, sizeof(alpha));
+    g_assert(qcu_graph_add_kernel(g, 7, conf, b->data, b->len));
+    g_assert(qcu_graph_add_copy(g, 0x8000, 0x9000, 4096));
+    g_assert(qcu_graph_add_kernel(g, 8, conf, b->data, b->len));
+    g_byte_array_free(b, TRUE);
+    return g;
+}
+
+static void test_record(void)
+{
+    QCGraph *g = graph_new();
+    QCGraphNode *n;
+
+    g_assert_cmpuint(g->nodes->len, ==, 3);
+
+    n = qcu_graph_node(g, 0);
+    g_assert_cmpint(n->type, ==, QCU_GRAPH_KERNEL);
+    g_assert_cmpuint(n->func, ==, 7);
+    g_assert_cmpuint(n->grid[0], ==, 64);
+    g_assert_cmpuint(n->grid[1], ==, 2);
+    g_assert_cmpuint(n->block[0], ==, 256);
+    g_assert_cmpuint(n->shared, ==, 1024);
+    g_assert_cmpuint(n->nparams, ==, 3);
+    g_assert_cmpuint(n->arg_size[0], ==, 8);
+    g_assert_cmpuint(n->arg_size[1], ==, 4);
+    g_assert_cmpuint(*(uint64_t *)n->args[0], ==, 0x7000000000ULL);
+    g_assert_cmpuint(*(uint32_t *)n->args[1], ==, 4096);
+    g_assert(*(float *)n->args[2] == 2.0);
+    g_assert(!n->dirty);
+
+    n = qcu_graph_node(g, 1);
+    g_assert_cmpint(n->type, ==, QCU_GRAPH_COPY);
+    g_assert_cmpuint(n->dst, ==, 0x8000);
+    g_assert_cmpuint(n->src, ==, 0x9000);
+    g_assert_cmpuint(n->bytes, ==, 4096);
+
+    qcu_graph_free(g);
+}
+
+static void test_params(void)
+{
+    GByteArray *b = blob_new();
+    uint8_t big[QCU_GRAPH_PARAM_SPACE];
+    uint32_t v = 1, count;
+    int i;
+
+    /* no parameters at all is fine */
+    g_assert_cmpuint(qcu_graph_params_size(b->data, b->len), ==, 4);
+    g_assert_cmpuint(qcu_graph_params_size(b->data, 3), ==, 0);
+
+    blob_add(b, &v, sizeof(v));
+    g_assert_cmpuint(qcu_graph_params_size(b->data, b->len), ==, 12);
+    g_assert_cmpuint(qcu_graph_params_size(b->data, b->len - 1), ==, 0);
+
+    /* more than the driver takes */
+    blob_add(b, big, sizeof(big));
+    g_assert_cmpuint(qcu_graph_params_size(b->data, b->len), ==, 0);
+    g_byte_array_free(b, TRUE);
+
+    b = blob_new();
+    for (i = 0; i <= QCU_GRAPH_MAX_PARAMS; i++) {
+        blob_add(b, &v, sizeof(v));
+    }
+    g_assert_cmpuint(qcu_graph_params_size(b->data, b->len), ==, 0);
+
+    /* a count that runs past the end */
+    count = 2;
+    g_byte_array_set_size(b, 12);
+    memcpy(b->data, &count, sizeof(count));
+    g_assert_cmpuint(qcu_graph_params_size(b->data, b->len), ==, 0);
+    g_byte_array_free(b, TRUE);
+}
+
+static void test_patch(void)
+{
+    QCGraph *g = graph_new();
+    GByteArray *p = g_byte_array_new();
+    uint64_t ptr = 0x7100000000ULL;
+    uint32_t n = 8192;
+    QCGraphNode *k0, *k2;
+
+    patch_add(p, 0, 1, &n, sizeof(n));
+    patch_add(p, 2, 0, &ptr, sizeof(ptr));
+    g_assert_cmpint(qcu_graph_patch(g, p->data, p->len), ==, 2);
+
+    k0 = qcu_graph_node(g, 0);
+    k2 = qcu_graph_node(g, 2);
+    g_assert(k0->dirty);
+    g_assert(!qcu_graph_node(g, 1)->dirty);
+    g_assert(k2->dirty);
+    g_assert_cmpuint(*(uint32_t *)k0->args[1], ==, 8192);
+    g_assert_cmpuint(*(uint64_t *)k0->args[0], ==, 0x7000000000ULL);
+    g_assert_cmpuint(*(uint64_t *)k2->args[0], ==, 0x7100000000ULL);
+    g_assert_cmpuint(*(uint32_t *)k2->args[1], ==, 4096);
+
+    /* an empty list changes nothing */
+    g_assert_cmpint(qcu_graph_patch(g, p->data, 0), ==, 0);
+
+    g_byte_array_free(p, TRUE);
+    qcu_graph_free(g);
+}
+
+static void test_patch_invalid(void)
+{
+    QCGraph *g = graph_new();
+    GByteArray *p;
+    uint64_t v = 5;
+    uint32_t n = 1;
+
+    struct {
+        uint32_t node, param, size;
+    } bad[] = {
+        { 3, 0, 8 },    /* no such node */
+        { 1, 0, 8 },    /* a copy */
+        { 0, 3, 8 },    /* no such parameter */
+        { 0, 1, 8 },    /* recorded with 4 bytes */
+    };
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(bad); i++) {
+        p = g_byte_array_new();
+        /* a good entry first: it must not be applied either */
+        patch_add(p, 2, 1, &n, sizeof(n));
+        patch_add(p, bad[i].node, bad[i].param, &v, bad[i].size);
+        g_assert_cmpint(qcu_graph_patch(g, p->data, p->len), ==, -1);
+        g_assert(!qcu_graph_node(g, 2)->dirty);
+        g_assert_cmpuint(*(uint32_t *)qcu_graph_node(g, 2)->args[1], ==, 4096);
+        g_byte_array_free(p, TRUE);
+    }
+
+    /* truncated header and truncated data */
+    p = g_byte_array_new();
+    patch_add(p, 0, 0, &v, sizeof(v));
+    g_assert_cmpint(qcu_graph_patch(g, p->data, 8), ==, -1);
+    g_assert_cmpint(qcu_graph_patch(g, p->data, p->len - 1), ==, -1);
+    g_byte_array_free(p, TRUE);
+
+    qcu_graph_free(g);
+}
+
+/*
+ * Host side cost of one iteration of a 64 launch loop that changes one
+ * parameter per iteration: decoding every launch as cudaLaunch does,
+ * against a single patched replay.
+ */
+#define PERF_LAUNCHES 64
+
+static void perf_replay(void)
+{
+    QCGraph *g = qcu_graph_new();
+    GByteArray *b = blob_new(), *p = g_byte_array_new();
+    unsigned int i, j, iters = 200000;
+    uint64_t ptr = 0x7000000000ULL, sum = 0;
+    uint32_t count, idx, k;
+    void **args;
+    double t_launch, t_replay;
+
+    for (k = 0; k < 6; k++) {
+        blob_add(b, &ptr, sizeof(ptr));
+    }
+    for (j = 0; j < PERF_LAUNCHES; j++) {
+        g_assert(qcu_graph_add_kernel(g, j, conf, b->data, b->len));
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < iters; i++) {
+        for (j = 0; j < PERF_LAUNCHES; j++) {
+            memcpy(&count, b->data, sizeof(count));
+            args = malloc(count * sizeof(void *));
+            idx = sizeof(uint32_t);
+            for (k = 0; k < count; k++) {
+                args[k] = &b->data[idx + sizeof(uint32_t)];
+                idx += *(uint32_t *)&b->data[idx] + sizeof(uint32_t);
+            }
+            sum += *(uint64_t *)args[count - 1];
+            free(args);
+        }
+    }
+    t_launch = g_test_timer_elapsed();
+
+    g_test_timer_start();
+    for (i = 0; i < iters; i++) {
+        g_byte_array_set_size(p, 0);
+        ptr = i;
+        patch_add(p, 0, 0, &ptr, sizeof(ptr));
+        g_assert_cmpint(qcu_graph_patch(g, p->data, p->len), ==, 1);
+        for (j = 0; j < PERF_LAUNCHES; j++) {
+            sum += *(uint64_t *)qcu_graph_node(g, j)->args[5];
+            qcu_graph_node(g, j)->dirty = false;
+        }
+    }
+    t_replay = g_test_timer_elapsed();
+
+    g_test_message("%u launches per iteration, %u iterations (%" PRIu64 ")\n",
+                   PERF_LAUNCHES, iters, sum & 1);
+    g_test_message("  per launch decode: %.0f ns/iteration\n",
+                   t_launch * 1e9 / iters);
+    g_test_message("  patched replay:    %.0f ns/iteration\n",
+                   t_replay * 1e9 / iters);
+
+    g_byte_array_free(p, TRUE);
+    g_byte_array_free(b, TRUE);
+    qcu_graph_free(g);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/qcuda-graph/record", test_record);
+    g_test_add_func("/qcuda-graph/params", test_params);
+    g_test_add_func("/qcuda-graph/patch", test_patch);
+    g_test_add_func("/qcuda-graph/patch-invalid", test_patch_invalid);
+    if (g_test_perf()) {
+        g_test_add_func("/perf/qcuda-graph/replay", perf_replay);
+    }
+    return g_test_run();
+}
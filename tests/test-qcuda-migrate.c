@@ -0,0 +1,291 @@
+/*
+ * virtio-qcuda device memory migration bookkeeping
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qcuda-fake-dev.h"
+
+#define KiB (1ULL << 10)
+#define MiB (1ULL << 20)
+#define BASE 0x700000000ULL
+#define GRAN (2 * MiB)
+
+static GArray *records(void)
+{
+    return g_array_new(FALSE, FALSE, sizeof(QCMigRecord));
+}
+
+static QCMigRecord *rec(GArray *out, guint i)
+{
+    return &g_array_index(out, QCMigRecord, i);
+}
+
+/* Collect everything and check that each byte of [addr, addr + size) is
+ * sent exactly once, in DATA records. */
+static void expect_data(QCMig *m, uint64_t addr, uint64_t size)
+{
+    GArray *out = records();
+    uint64_t bytes, next = addr;
+    guint i;
+
+    bytes = qcu_mig_collect(m, out, UINT64_MAX);
+    g_assert_cmpuint(bytes, ==, size);
+    for (i = 0; i < out->len; i++) {
+        g_assert_cmpint(rec(out, i)->type, ==, QCU_MIG_REC_DATA);
+        g_assert_cmpuint(rec(out, i)->addr, ==, next);
+        g_assert_cmpuint(rec(out, i)->len, <=, QCU_MIG_RUN_MAX);
+        next += rec(out, i)->len;
+    }
+    g_assert_cmpuint(next, ==, addr + size);
+    g_assert_cmpuint(qcu_mig_pending(m), ==, 0);
+    g_array_free(out, TRUE);
+}
+
+static void test_track(void)
+{
+    QCMig *m = qcu_mig_new(NULL, NULL, 0);
+
+    qcu_mig_add(m, BASE, 1000);
+    qcu_mig_add(m, BASE + MiB, 10 * MiB);
+    g_assert(qcu_mig_owns(m, BASE + 999));
+    g_assert(!qcu_mig_owns(m, BASE + 1000));
+    g_assert(qcu_mig_owns(m, BASE + 11 * MiB - 1));
+
+    /* nothing is logged outside a migration */
+    qcu_mig_dirty(m, BASE, 100);
+    g_assert_cmpuint(qcu_mig_pending(m), ==, 0);
+    g_assert(!qcu_mig_logging(m));
+
+    /* only the start of an allocation frees it */
+    g_assert(!qcu_mig_remove(m, BASE + 1));
+    g_assert(qcu_mig_owns(m, BASE));
+    g_assert(!qcu_mig_remove(m, BASE));
+    g_assert(!qcu_mig_owns(m, BASE));
+
+    /* no backend, nothing to restore */
+    g_assert(!qcu_mig_restore(m, BASE, 1000));
+
+    qcu_mig_destroy(m);
+}
+
+static void test_precopy(void)
+{
+    QCMig *m = qcu_mig_new(NULL, NULL, 0);
+    uint64_t a = BASE, b = BASE + 64 * MiB;
+    uint64_t asize = 9 * MiB + 100, bsize = 64 * KiB;
+    GArray *out = records();
+
+    qcu_mig_add(m, a, asize);
+    qcu_mig_add(m, b, bsize);
+    qcu_mig_start(m);
+    g_assert(qcu_mig_logging(m));
+    g_assert_cmpuint(qcu_mig_pending(m), ==, asize + bsize);
+
+    /* the first round announces both allocations */
+    g_assert_cmpuint(qcu_mig_collect(m, out, 0), ==, 0);
+    g_assert_cmpuint(out->len, ==, 2);
+    g_assert_cmpint(rec(out, 0)->type, ==, QCU_MIG_REC_ALLOC);
+    g_assert_cmpuint(rec(out, 0)->addr, ==, a);
+    g_assert_cmpuint(rec(out, 0)->len, ==, asize);
+    g_assert_cmpint(rec(out, 1)->type, ==, QCU_MIG_REC_ALLOC);
+    g_assert_cmpuint(rec(out, 1)->addr, ==, b);
+    g_array_free(out, TRUE);
+
+    /* then all of the data, in runs */
+    out = records();
+    g_assert_cmpuint(qcu_mig_collect(m, out, UINT64_MAX), ==, asize + bsize);
+    g_assert_cmpuint(out->len, ==, 4);
+    g_assert_cmpuint(rec(out, 0)->addr, ==, a);
+    g_assert_cmpuint(rec(out, 0)->len, ==, QCU_MIG_RUN_MAX);
+    g_assert_cmpuint(rec(out, 1)->addr, ==, a + QCU_MIG_RUN_MAX);
+    g_assert_cmpuint(rec(out, 2)->addr, ==, a + 2 * QCU_MIG_RUN_MAX);
+    g_assert_cmpuint(rec(out, 2)->len, ==, asize - 2 * QCU_MIG_RUN_MAX);
+    g_assert_cmpuint(rec(out, 3)->addr, ==, b);
+    g_assert_cmpuint(rec(out, 3)->len, ==, bsize);
+    g_array_free(out, TRUE);
+    g_assert_cmpuint(qcu_mig_pending(m), ==, 0);
+
+    /* a copy rewrites the chunk it hits, clipped to the allocation */
+    qcu_mig_dirty(m, a + 300 * KiB, 10);
+    g_assert_cmpuint(qcu_mig_pending(m), ==, QCU_MIG_CHUNK);
+    expect_data(m, a + QCU_MIG_CHUNK, QCU_MIG_CHUNK);
+
+    qcu_mig_dirty(m, a + asize - 50, MiB);
+    g_assert_cmpuint(qcu_mig_pending(m), ==, asize % QCU_MIG_CHUNK);
+    expect_data(m, a + asize - asize % QCU_MIG_CHUNK, asize % QCU_MIG_CHUNK);
+
+    /* a kernel rewrites all of what its pointers point into */
+    qcu_mig_dirty_ptr(m, b + 17);
+    qcu_mig_dirty_ptr(m, b + bsize);
+    qcu_mig_dirty_ptr(m, 42);
+    expect_data(m, b, bsize);
+
+    qcu_mig_dirty(m, a, asize);
+    qcu_mig_stop(m);
+    g_assert_cmpuint(qcu_mig_pending(m), ==, 0);
+    qcu_mig_dirty(m, a, asize);
+    g_assert_cmpuint(qcu_mig_pending(m), ==, 0);
+
+    qcu_mig_destroy(m);
+}
+
+/* A budget spreads the data over several rounds, continuing where the
+ * last one stopped even if earlier allocations got dirty again. */
+static void test_budget(void)
+{
+    QCMig *m = qcu_mig_new(NULL, NULL, 0);
+    GArray *out;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        qcu_mig_add(m, BASE + i * MiB, QCU_MIG_CHUNK);
+    }
+    qcu_mig_start(m);
+
+    out = records();
+    g_assert_cmpuint(qcu_mig_collect(m, out, 1), ==, QCU_MIG_CHUNK);
+    g_assert_cmpuint(out->len, ==, 4);
+    g_assert_cmpuint(rec(out, 3)->addr, ==, BASE);
+    g_array_free(out, TRUE);
+
+    qcu_mig_dirty(m, BASE, 1);
+
+    out = records();
+    g_assert_cmpuint(qcu_mig_collect(m, out, 1), ==, QCU_MIG_CHUNK);
+    g_assert_cmpuint(out->len, ==, 1);
+    g_assert_cmpuint(rec(out, 0)->addr, ==, BASE + MiB);
+    g_array_free(out, TRUE);
+
+    out = records();
+    g_assert_cmpuint(qcu_mig_collect(m, out, 1), ==, QCU_MIG_CHUNK);
+    g_assert_cmpuint(rec(out, 0)->addr, ==, BASE + 2 * MiB);
+    g_array_free(out, TRUE);
+
+    out = records();
+    g_assert_cmpuint(qcu_mig_collect(m, out, 1), ==, QCU_MIG_CHUNK);
+    g_assert_cmpuint(rec(out, 0)->addr, ==, BASE);
+    g_array_free(out, TRUE);
+    g_assert_cmpuint(qcu_mig_pending(m), ==, 0);
+
+    qcu_mig_destroy(m);
+}
+
+static void test_free(void)
+{
+    QCMig *m = qcu_mig_new(NULL, NULL, 0);
+    GArray *out;
+
+    qcu_mig_add(m, BASE, MiB);
+    qcu_mig_add(m, BASE + MiB, MiB);
+    qcu_mig_start(m);
+    out = records();
+    qcu_mig_collect(m, out, 0);
+    g_assert_cmpuint(out->len, ==, 2);
+    g_array_free(out, TRUE);
+
+    /* the destination learns about frees before anything new */
+    g_assert(!qcu_mig_remove(m, BASE));
+    g_assert_cmpuint(qcu_mig_pending(m), ==, MiB);
+
+    qcu_mig_add(m, BASE, 4 * KiB);
+    /* one that was never freed here is replaced */
+    qcu_mig_add(m, BASE + MiB + 4 * KiB, 4 * KiB);
+
+    out = records();
+    g_assert_cmpuint(qcu_mig_collect(m, out, UINT64_MAX), ==, 8 * KiB);
+    g_assert_cmpuint(out->len, ==, 6);
+    g_assert_cmpint(rec(out, 0)->type, ==, QCU_MIG_REC_FREE);
+    g_assert_cmpuint(rec(out, 0)->addr, ==, BASE);
+    g_assert_cmpint(rec(out, 1)->type, ==, QCU_MIG_REC_FREE);
+    g_assert_cmpuint(rec(out, 1)->addr, ==, BASE + MiB);
+    g_assert_cmpint(rec(out, 2)->type, ==, QCU_MIG_REC_ALLOC);
+    g_assert_cmpuint(rec(out, 2)->addr, ==, BASE);
+    g_assert_cmpuint(rec(out, 2)->len, ==, 4 * KiB);
+    g_assert_cmpint(rec(out, 3)->type, ==, QCU_MIG_REC_ALLOC);
+    g_assert_cmpint(rec(out, 4)->type, ==, QCU_MIG_REC_DATA);
+    g_assert_cmpint(rec(out, 5)->type, ==, QCU_MIG_REC_DATA);
+    g_array_free(out, TRUE);
+
+    /* an allocation made and freed between two rounds is never seen */
+    qcu_mig_add(m, BASE + 8 * MiB, MiB);
+    g_assert(!qcu_mig_remove(m, BASE + 8 * MiB));
+    qcu_mig_clear(m);
+    out = records();
+    g_assert_cmpuint(qcu_mig_collect(m, out, UINT64_MAX), ==, 0);
+    g_assert_cmpuint(out->len, ==, 2);
+    g_assert_cmpint(rec(out, 0)->type, ==, QCU_MIG_REC_FREE);
+    g_assert_cmpint(rec(out, 1)->type, ==, QCU_MIG_REC_FREE);
+    g_array_free(out, TRUE);
+
+    /* a new migration starts from scratch */
+    qcu_mig_stop(m);
+    qcu_mig_add(m, BASE, MiB);
+    g_assert(!qcu_mig_remove(m, BASE));
+    qcu_mig_start(m);
+    out = records();
+    g_assert_cmpuint(qcu_mig_collect(m, out, UINT64_MAX), ==, 0);
+    g_assert_cmpuint(out->len, ==, 0);
+    g_array_free(out, TRUE);
+
+    qcu_mig_destroy(m);
+}
+
+static void test_restore(void)
+{
+    FakeDev d;
+    QCMig *m;
+    uint64_t a = BASE + GRAN + 512, b = BASE + GRAN + 4096;
+    uint64_t c = BASE + GRAN + 8192;
+
+    fake_init(&d, 0, GRAN);
+    m = qcu_mig_new(&fake_mig_ops, &d, GRAN);
+
+    /* two small allocations share a mapping */
+    g_assert(qcu_mig_restore(m, a, 1000));
+    g_assert_cmpuint(d.mapped, ==, GRAN);
+    g_assert(qcu_mig_restore(m, b, 1000));
+    g_assert_cmpuint(d.mapped, ==, GRAN);
+    g_assert(!qcu_mig_restore(m, a + 10, 10));
+
+    /* a large one only maps what is not mapped yet */
+    g_assert(qcu_mig_restore(m, c, 3 * GRAN));
+    g_assert_cmpuint(d.mapped, ==, 4 * GRAN);
+    g_assert(fake_mem(&d, BASE + 2 * GRAN) != NULL);
+    g_assert(qcu_mig_owns(m, c + 3 * GRAN - 1));
+
+    /* restored memory is freed here, not by the caller */
+    g_assert(qcu_mig_remove(m, a));
+    g_assert(qcu_mig_remove(m, b));
+    g_assert_cmpuint(d.mapped, ==, 4 * GRAN);
+    g_assert(qcu_mig_remove(m, c));
+    g_assert_cmpuint(d.mapped, ==, 0);
+
+    /* a mapping that fails leaves nothing behind */
+    g_assert(qcu_mig_restore(m, BASE + 4 * GRAN, 100));
+    d.fail_at = BASE + 6 * GRAN;
+    g_assert(!qcu_mig_restore(m, BASE + 3 * GRAN, 4 * GRAN));
+    g_assert_cmpuint(d.mapped, ==, GRAN);
+    g_assert(!qcu_mig_owns(m, BASE + 3 * GRAN));
+
+    /* allocations made after the migration are not the backend's */
+    qcu_mig_add(m, BASE + 100 * GRAN, MiB);
+    g_assert(!qcu_mig_remove(m, BASE + 100 * GRAN));
+
+    qcu_mig_destroy(m);
+    fake_fini(&d);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/qcuda-migrate/track", test_track);
+    g_test_add_func("/qcuda-migrate/precopy", test_precopy);
+    g_test_add_func("/qcuda-migrate/budget", test_budget);
+    g_test_add_func("/qcuda-migrate/free", test_free);
+    g_test_add_func("/qcuda-migrate/restore", test_restore);
+    return g_test_run();
+}
@@ -0,0 +1,297 @@
+/*
+ * virtio-qcuda GPU time arbitration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/main-loop.h"
+#include "qemu/thread.h"
+#include "block/aio.h"
+#include "hw/virtio/virtio-qcuda-qos.h"
+
+static AioContext *ctx;
+
+/* The time the group's buckets were last configured: tests count from it. */
+static int64_t base(QCQos *m)
+{
+    return m->group->ts.previous_leak;
+}
+
+static void test_rate(void)
+{
+    QCQosLimits l = { .launch_rate = 1000 };
+    QCQos m;
+    int64_t t, wait;
+    int i;
+
+    qcu_qos_register(&m, NULL, QCU_QOS_WEIGHT_DEFAULT, &l, ctx);
+    t = base(&m);
+
+    /* the default burst is a tenth of a second */
+    for (i = 0; i <= 100; i++) {
+        g_assert_cmpint(qcu_qos_admit(&m, QCU_QOS_LAUNCH, 1, t), ==, 0);
+    }
+    wait = qcu_qos_admit(&m, QCU_QOS_LAUNCH, 1, t);
+    g_assert_cmpint(wait, >, 0);
+    g_assert_cmpint(wait, <=, 1000000);
+    g_assert(m.waiting[QCU_QOS_LAUNCH]);
+
+    /* copies are not limited */
+    g_assert_cmpint(qcu_qos_admit(&m, QCU_QOS_COPY, 1 << 30, t), ==, 0);
+
+    g_assert_cmpint(qcu_qos_admit(&m, QCU_QOS_LAUNCH, 1, t + wait), ==, 0);
+    g_assert(!m.waiting[QCU_QOS_LAUNCH]);
+
+    /* one second later, another second's worth and the burst */
+    t += NANOSECONDS_PER_SECOND + wait;
+    for (i = 0; i < 100; i++) {
+        g_assert_cmpint(qcu_qos_admit(&m, QCU_QOS_LAUNCH, 1, t), ==, 0);
+    }
+
+    qcu_qos_get_limits(&m, &l);
+    g_assert_cmpuint(l.launch_rate, ==, 1000);
+    g_assert_cmpuint(l.launch_burst, ==, 100);
+    g_assert_cmpuint(l.copy_bw, ==, 0);
+    qcu_qos_unregister(&m);
+}
+
+static void test_copy(void)
+{
+    QCQosLimits l = { .copy_bw = 1 << 20, .copy_burst = 1 << 20 };
+    QCQos m;
+    int64_t t, wait;
+
+    qcu_qos_register(&m, NULL, QCU_QOS_WEIGHT_DEFAULT, &l, ctx);
+    t = base(&m);
+
+    /* a copy larger than the burst goes once the bucket is empty... */
+    g_assert_cmpint(qcu_qos_admit(&m, QCU_QOS_COPY, 4 << 20, t), ==, 0);
+    /* ...and the next one waits until it has drained */
+    wait = qcu_qos_admit(&m, QCU_QOS_COPY, 4096, t);
+    g_assert_cmpint(wait, ==, 3 * NANOSECONDS_PER_SECOND);
+    g_assert_cmpint(qcu_qos_admit(&m, QCU_QOS_LAUNCH, 1, t), ==, 0);
+    g_assert_cmpint(qcu_qos_admit(&m, QCU_QOS_COPY, 4096, t + wait), ==, 0);
+
+    qcu_qos_unregister(&m);
+}
+
+/*
+ * Two busy members of a group in every time step, the first always asking
+ * first; return how many launches each got.
+ */
+static void run_busy(QCQos *a, QCQos *b, int64_t *t, int steps,
+                     unsigned *na, unsigned *nb)
+{
+    int i;
+
+    *na = *nb = 0;
+    for (i = 0; i < steps; i++) {
+        *t += 100000;
+        while (qcu_qos_admit(a, QCU_QOS_LAUNCH, 1, *t) == 0) {
+            (*na)++;
+        }
+        while (qcu_qos_admit(b, QCU_QOS_LAUNCH, 1, *t) == 0) {
+            (*nb)++;
+        }
+    }
+}
+
+static void test_weights(void)
+{
+    QCQosLimits l = { .launch_rate = 10000, .launch_burst = 1 };
+    QCQos a, b;
+    unsigned na, nb;
+    int64_t t;
+
+    qcu_qos_register(&a, "gpu0", 300, &l, ctx);
+    qcu_qos_register(&b, "gpu0", 100, NULL, ctx);
+    g_assert(a.group == b.group);
+    t = base(&a);
+
+    run_busy(&a, &b, &t, 10000, &na, &nb);
+    g_assert_cmpuint(na + nb, >=, 9900);
+    g_assert_cmpuint(na + nb, <=, 10100);
+    g_assert_cmpuint(na, >=, 2.8 * nb);
+    g_assert_cmpuint(na, <=, 3.2 * nb);
+
+    /* asking first does not help */
+    run_busy(&b, &a, &t, 10000, &nb, &na);
+    g_assert_cmpuint(na, >=, 2.8 * nb);
+    g_assert_cmpuint(na, <=, 3.2 * nb);
+
+    /* retuned live */
+    qcu_qos_set_weight(&b, 300);
+    run_busy(&a, &b, &t, 10000, &na, &nb);
+    g_assert_cmpuint(na, >=, 0.9 * nb);
+    g_assert_cmpuint(na, <=, 1.1 * nb);
+
+    qcu_qos_unregister(&b);
+    qcu_qos_unregister(&a);
+}
+
+/* A member that was idle does not get to catch up on its share. */
+static void test_idle(void)
+{
+    QCQosLimits l = { .launch_rate = 10000, .launch_burst = 1 };
+    QCQos a, b;
+    unsigned na = 0, nb, i;
+    int64_t t;
+
+    qcu_qos_register(&a, "gpu0", 100, &l, ctx);
+    qcu_qos_register(&b, "gpu0", 100, NULL, ctx);
+    t = base(&a);
+
+    for (i = 0; i < 10000; i++) {
+        t += 100000;
+        while (qcu_qos_admit(&a, QCU_QOS_LAUNCH, 1, t) == 0) {
+            na++;
+        }
+    }
+    g_assert_cmpuint(na, >=, 9900);
+
+    run_busy(&b, &a, &t, 1000, &nb, &na);
+    g_assert_cmpuint(na, >=, 0.9 * nb);
+    g_assert_cmpuint(na, <=, 1.1 * nb);
+
+    qcu_qos_unregister(&b);
+    qcu_qos_unregister(&a);
+}
+
+static void test_group(void)
+{
+    QCQosLimits l = { .launch_rate = 500 }, got;
+    QCQos a, b, c;
+
+    qcu_qos_register(&a, "gpu0", 100, &l, ctx);
+    /* no limits of its own: keeps the group's */
+    qcu_qos_register(&b, "gpu0", 100, NULL, ctx);
+    qcu_qos_get_limits(&b, &got);
+    g_assert_cmpuint(got.launch_rate, ==, 500);
+
+    /* limits are per group */
+    l.launch_rate = 800;
+    qcu_qos_set_limits(&b, &l);
+    qcu_qos_get_limits(&a, &got);
+    g_assert_cmpuint(got.launch_rate, ==, 800);
+    g_assert_cmpuint(got.launch_burst, ==, 80);
+
+    /* other groups are not affected */
+    qcu_qos_register(&c, "gpu1", 100, NULL, ctx);
+    g_assert(c.group != a.group);
+    qcu_qos_get_limits(&c, &got);
+    g_assert_cmpuint(got.launch_rate, ==, 0);
+    g_assert_cmpint(qcu_qos_admit(&c, QCU_QOS_LAUNCH, 1 << 20, 0), ==, 0);
+
+    qcu_qos_unregister(&c);
+    qcu_qos_unregister(&b);
+    qcu_qos_unregister(&a);
+
+    /* the last member took the group with it */
+    qcu_qos_register(&a, "gpu0", 100, NULL, ctx);
+    qcu_qos_get_limits(&a, &got);
+    g_assert_cmpuint(got.launch_rate, ==, 0);
+    qcu_qos_unregister(&a);
+}
+
+static void test_stop(void)
+{
+    QCQosLimits l = { .launch_rate = 10 };
+    QCQos a, b;
+    int64_t t;
+
+    qcu_qos_register(&a, "gpu0", 100, &l, ctx);
+    qcu_qos_register(&b, "gpu0", 100, NULL, ctx);
+    t = base(&a);
+
+    g_assert_cmpint(qcu_qos_admit(&a, QCU_QOS_LAUNCH, 1, t), ==, 0);
+    g_assert_cmpint(qcu_qos_admit(&a, QCU_QOS_LAUNCH, 1, t), ==, 0);
+    g_assert_cmpint(qcu_qos_admit(&a, QCU_QOS_LAUNCH, 1, t), >, 0);
+
+    qcu_qos_stop(&a);
+    g_assert(!a.waiting[QCU_QOS_LAUNCH]);
+    g_assert_cmpint(qcu_qos_admit(&a, QCU_QOS_LAUNCH, 1, t), ==, 0);
+    g_assert_cmpint(qcu_qos_admit(&b, QCU_QOS_LAUNCH, 1, t), >, 0);
+
+    qcu_qos_resume(&a);
+    g_assert_cmpint(qcu_qos_admit(&a, QCU_QOS_LAUNCH, 1, t), !=, 0);
+
+    qcu_qos_unregister(&b);
+    qcu_qos_unregister(&a);
+}
+
+/* qcu_qos_wait from worker threads, woken by the group timer. */
+#define WAIT_RATE       2000
+#define WAIT_LAUNCHES   60
+
+static QCQos waiters[2];
+static int waiting_threads;
+
+static void *wait_thread(void *opaque)
+{
+    QCQos *m = opaque;
+    int i;
+
+    for (i = 0; i < WAIT_LAUNCHES; i++) {
+        qcu_qos_wait(m, QCU_QOS_LAUNCH, 1);
+    }
+    atomic_dec(&waiting_threads);
+    aio_notify(ctx);
+    return NULL;
+}
+
+static void test_wait(void)
+{
+    QCQosLimits l = { .launch_rate = WAIT_RATE, .launch_burst = 10 };
+    QemuThread threads[2];
+    int64_t start, elapsed;
+    int i;
+
+    qcu_qos_register(&waiters[0], "gpu0", 100, &l, ctx);
+    qcu_qos_register(&waiters[1], "gpu0", 100, NULL, ctx);
+
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    waiting_threads = 2;
+    for (i = 0; i < 2; i++) {
+        qemu_thread_create(&threads[i], "qos", wait_thread, &waiters[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    while (atomic_read(&waiting_threads) > 0) {
+        aio_poll(ctx, true);
+    }
+    for (i = 0; i < 2; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    elapsed = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+
+    /* everything above the burst at the configured rate */
+    g_assert_cmpint(elapsed, >=,
+                    (2 * WAIT_LAUNCHES - 20) * NANOSECONDS_PER_SECOND /
+                    WAIT_RATE);
+    g_assert_cmpuint(waiters[0].throttled[QCU_QOS_LAUNCH] +
+                     waiters[1].throttled[QCU_QOS_LAUNCH], >, 0);
+
+    qcu_qos_unregister(&waiters[1]);
+    qcu_qos_unregister(&waiters[0]);
+}
+
+int main(int argc, char **argv)
+{
+    Error *local_error = NULL;
+
+    qemu_init_main_loop(&local_error);
+    ctx = qemu_get_aio_context();
+    g_assert(ctx != NULL);
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/qcuda-qos/rate", test_rate);
+    g_test_add_func("/qcuda-qos/copy", test_copy);
+    g_test_add_func("/qcuda-qos/weights", test_weights);
+    g_test_add_func("/qcuda-qos/idle", test_idle);
+    g_test_add_func("/qcuda-qos/group", test_group);
+    g_test_add_func("/qcuda-qos/stop", test_stop);
+    g_test_add_func("/qcuda-qos/wait", test_wait);
+    return g_test_run();
+}
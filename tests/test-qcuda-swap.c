@@ -0,0 +1,224 @@
+/*
+ * virtio-qcuda device memory oversubscription
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qcuda-fake-dev.h"
+
+#define MiB (1ULL << 20)
+#define GRAN (2 * MiB)
+
+static bool resident(FakeDev *d, uint64_t addr)
+{
+    return fake_mem(d, addr) != NULL;
+}
+
+/* What a kernel would do: write the first byte of a resident allocation. */
+static void poke(FakeDev *d, uint64_t addr, uint8_t val)
+{
+    uint8_t *mem = fake_mem(d, addr);
+
+    g_assert(mem != NULL);
+    mem[0] = val;
+}
+
+static uint8_t peek(FakeDev *d, uint64_t addr)
+{
+    uint8_t *mem = fake_mem(d, addr);
+
+    g_assert(mem != NULL);
+    return mem[0];
+}
+
+static bool pin1(QCSwap *sw, uint64_t ptr)
+{
+    return qcu_swap_pin(sw, &ptr, 1);
+}
+
+static void unpin1(QCSwap *sw, uint64_t ptr)
+{
+    qcu_swap_unpin(sw, &ptr, 1);
+}
+
+static void test_evict(void)
+{
+    QCSwapStats st = { 0 };
+    FakeDev d;
+    QCSwap *sw;
+    uint64_t a[4];
+    uint8_t byte;
+    int i;
+
+    fake_init(&d, 3 * GRAN, GRAN);
+    sw = qcu_swap_new(&fake_swap_ops, &d, GRAN, 0, &st);
+
+    for (i = 0; i < 3; i++) {
+        g_assert(qcu_swap_alloc(sw, MiB, &a[i]));
+        poke(&d, a[i], i + 1);
+    }
+    g_assert_cmpuint(st.resident, ==, 3 * GRAN);
+    g_assert_cmpuint(d.syncs, ==, 0);
+
+    /* the device is full: the oldest one goes to host memory */
+    g_assert(qcu_swap_alloc(sw, MiB, &a[3]));
+    g_assert(!resident(&d, a[0]));
+    g_assert_cmpuint(d.syncs, ==, 1);
+    g_assert_cmpuint(st.evictions, ==, 1);
+    g_assert_cmpuint(st.swapped, ==, GRAN);
+    g_assert_cmpuint(st.resident, ==, 3 * GRAN);
+
+    /* migration reads it where it is */
+    g_assert(qcu_swap_copy_out(sw, a[0], &byte, 1));
+    g_assert_cmpuint(byte, ==, 1);
+    g_assert(qcu_swap_copy_out(sw, a[2], &byte, 1));
+    g_assert_cmpuint(byte, ==, 3);
+    g_assert(!qcu_swap_copy_out(sw, a[0] + 1, &byte, GRAN));
+    g_assert(!resident(&d, a[0]));
+
+    /* using it brings it back with its contents, evicting the next one */
+    g_assert(pin1(sw, a[0] + 100));
+    g_assert_cmpuint(peek(&d, a[0]), ==, 1);
+    g_assert(!resident(&d, a[1]));
+    unpin1(sw, a[0] + 100);
+    g_assert_cmpuint(st.faults, ==, 1);
+    g_assert_cmpuint(st.bytes_out, ==, 2 * GRAN);
+    g_assert_cmpuint(st.bytes_in, ==, GRAN);
+
+    /* pointers outside the allocations are left alone */
+    g_assert(pin1(sw, 0x1000));
+    g_assert(pin1(sw, a[3] + GRAN));
+    g_assert_cmpuint(st.faults, ==, 1);
+
+    g_assert(pin1(sw, a[1]));
+    g_assert_cmpuint(peek(&d, a[1]), ==, 2);
+    unpin1(sw, a[1]);
+
+    qcu_swap_destroy(sw);
+    g_assert_cmpuint(st.resident, ==, 0);
+    g_assert_cmpuint(st.swapped, ==, 0);
+    fake_fini(&d);
+}
+
+/* Recently used allocations stay, pinned ones are never evicted. */
+static void test_lru(void)
+{
+    QCSwapStats st = { 0 };
+    FakeDev d;
+    QCSwap *sw;
+    uint64_t a[4], both[2];
+    int i;
+
+    fake_init(&d, 3 * GRAN, GRAN);
+    sw = qcu_swap_new(&fake_swap_ops, &d, GRAN, 0, &st);
+    for (i = 0; i < 3; i++) {
+        g_assert(qcu_swap_alloc(sw, GRAN, &a[i]));
+    }
+
+    /* a[0] was used last, a[1] is the coldest now */
+    g_assert(pin1(sw, a[0]));
+    unpin1(sw, a[0]);
+    g_assert(qcu_swap_alloc(sw, GRAN, &a[3]));
+    g_assert(resident(&d, a[0]));
+    g_assert(!resident(&d, a[1]));
+
+    /* a launch using both a[1] and a[2]: a[1] may not push out a[2] */
+    both[0] = a[1];
+    both[1] = a[2];
+    g_assert(qcu_swap_pin(sw, both, 2));
+    g_assert(resident(&d, a[1]));
+    g_assert(resident(&d, a[2]));
+    g_assert(!resident(&d, a[0]));
+
+    /* with a[1], a[2] and a[3] pinned there is nothing to evict */
+    g_assert(pin1(sw, a[3]));
+    g_assert(!pin1(sw, a[0]));
+    g_assert(!resident(&d, a[0]));
+    g_assert(!qcu_swap_alloc(sw, GRAN, &a[0]));
+    unpin1(sw, a[3]);
+
+    /* a failed pin leaves nothing pinned: a[1] can go afterwards */
+    qcu_swap_unpin(sw, both, 2);
+    g_assert(pin1(sw, a[2]));
+    g_assert(pin1(sw, a[3]));
+    both[0] = a[0];
+    both[1] = a[1];
+    g_assert(!qcu_swap_pin(sw, both, 2));
+    g_assert(pin1(sw, a[0]));
+    g_assert(!resident(&d, a[1]));
+    unpin1(sw, a[0]);
+    unpin1(sw, a[2]);
+    unpin1(sw, a[3]);
+
+    qcu_swap_destroy(sw);
+    fake_fini(&d);
+}
+
+static void test_limit(void)
+{
+    QCSwapStats st = { 0 };
+    FakeDev d;
+    QCSwap *sw;
+    uint64_t a, b;
+
+    fake_init(&d, 100 * GRAN, GRAN);
+    sw = qcu_swap_new(&fake_swap_ops, &d, GRAN, 2 * GRAN, &st);
+
+    /* sizes are rounded to the granularity */
+    g_assert(qcu_swap_alloc(sw, GRAN + 1, &a));
+    g_assert_cmpuint(d.mapped, ==, 2 * GRAN);
+    g_assert(qcu_swap_alloc(sw, 1, &b));
+    g_assert(!resident(&d, a));
+    g_assert_cmpuint(d.mapped, ==, GRAN);
+
+    /* larger than the limit can never be resident */
+    g_assert(!qcu_swap_alloc(sw, 3 * GRAN, &b));
+
+    qcu_swap_destroy(sw);
+    fake_fini(&d);
+}
+
+static void test_free(void)
+{
+    QCSwapStats st = { 0 };
+    FakeDev d;
+    QCSwap *sw;
+    uint64_t a, b;
+
+    fake_init(&d, GRAN, GRAN);
+    sw = qcu_swap_new(&fake_swap_ops, &d, GRAN, 0, &st);
+    g_assert(qcu_swap_alloc(sw, GRAN, &a));
+    g_assert(qcu_swap_alloc(sw, GRAN, &b));
+
+    g_assert(qcu_swap_owns(sw, a + 1));
+    g_assert(!qcu_swap_free(sw, a + 1));
+    g_assert(!qcu_swap_free(sw, 0x1000));
+
+    /* an evicted allocation only has host memory to give back */
+    g_assert(!resident(&d, a));
+    g_assert(qcu_swap_free(sw, a));
+    g_assert(!qcu_swap_owns(sw, a));
+    g_assert_cmpuint(st.swapped, ==, 0);
+
+    /* a resident one waits for the device first */
+    d.syncs = 0;
+    g_assert(qcu_swap_free(sw, b));
+    g_assert_cmpuint(d.syncs, ==, 1);
+    g_assert_cmpuint(st.resident, ==, 0);
+
+    qcu_swap_destroy(sw);
+    fake_fini(&d);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/qcuda-swap/evict", test_evict);
+    g_test_add_func("/qcuda-swap/lru", test_lru);
+    g_test_add_func("/qcuda-swap/limit", test_limit);
+    g_test_add_func("/qcuda-swap/free", test_free);
+    return g_test_run();
+}
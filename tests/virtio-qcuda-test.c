@@ -0,0 +1,1902 @@
+/*
+ * QTest testcase for virtio-qcuda
+ *
+ * The device is built against tests/qcuda-fake (configure
+ * --enable-cuda-fake), so every command of the protocol can be driven
+ * through libqos without a GPU.  With -m perf the test also measures
+ * launch rate, copy bandwidth, synchronization latency, batching, the
+ * doorbell thread and the rate of small requests; the fake is slowed
+ * down through its environment where a measurement needs the device to
+ * take time.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <errno.h>
+#include <string.h>
+
+#include "libqtest.h"
+#include "libqos/virtio.h"
+#include "libqos/virtio-pci.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc.h"
+#include "libqos/malloc-pc.h"
+#include "qemu/osdep.h"
+
+#define QVIRTIO_QC_DEVICE_ID    69
+#define QVIRTIO_QC_TIMEOUT_US   (10 * 1000 * 1000)
+
+/*********** FROM qcu-driver/qcuda_common.h **********************************/
+
+enum {
+    VIRTQC_CMD_WRITE = 0,
+    VIRTQC_CMD_READ,
+    VIRTQC_CMD_OPEN,
+    VIRTQC_CMD_CLOSE,
+    VIRTQC_CMD_MMAP,
+    VIRTQC_CMD_MUNMAP,
+    VIRTQC_CMD_MMAPCTL,
+    VIRTQC_CMD_MMAPRELEASE,
+
+    VIRTQC_cudaRegisterFatBinary = 100,
+    VIRTQC_cudaUnregisterFatBinary,
+    VIRTQC_cudaRegisterFunction,
+    VIRTQC_cudaLaunch,
+    VIRTQC_cudaMalloc,
+    VIRTQC_cudaMemset,
+    VIRTQC_cudaMemcpy,
+    VIRTQC_cudaMemcpyAsync,
+    VIRTQC_cudaFree,
+    VIRTQC_cudaGetDevice,
+    VIRTQC_cudaGetDeviceCount,
+    VIRTQC_cudaSetDevice,
+    VIRTQC_cudaGetDeviceProperties,
+    VIRTQC_cudaDeviceSynchronize,
+    VIRTQC_cudaDeviceReset,
+    VIRTQC_cudaDriverGetVersion,
+    VIRTQC_cudaRuntimeGetVersion,
+    VIRTQC_cudaStreamCreate,
+    VIRTQC_cudaStreamDestroy,
+    VIRTQC_cudaEventCreate,
+    VIRTQC_cudaEventCreateWithFlags,
+    VIRTQC_cudaEventRecord,
+    VIRTQC_cudaEventSynchronize,
+    VIRTQC_cudaEventElapsedTime,
+    VIRTQC_cudaEventDestroy,
+    VIRTQC_cudaGetLastError,
+    VIRTQC_cudaHostRegister,
+    VIRTQC_cudaHostGetDevicePointer,
+    VIRTQC_cudaHostUnregister,
+    VIRTQC_cudaSetDeviceFlags,
+};
+
+typedef struct QVirtioQCArg {
+    int32_t cmd;
+    uint64_t rnd;
+    uint64_t para;
+    uint64_t pA;
+    uint32_t pASize;
+    uint64_t pB;
+    uint32_t pBSize;
+    uint32_t flag;
+} QVirtioQCArg;
+/*****************************************************************************/
+
+/*********** FROM include/hw/virtio/virtio-qcuda*.h **************************/
+
+typedef struct QVirtioQCArgExt {
+    uint32_t session;
+    uint32_t flags;
+} QVirtioQCArgExt;
+
+typedef struct QVirtioQCGraphPatch {
+    uint32_t node;
+    uint32_t param;
+    uint32_t size;
+    uint32_t reserved;
+} QVirtioQCGraphPatch;
+
+typedef struct QVirtioQCLaunchParam {
+    uint32_t offset;
+    uint32_t size;
+} QVirtioQCLaunchParam;
+
+#define VIRTQC_CMD_EXT_BASE         0x1000
+#define VIRTQC_CMD_BATCH            (VIRTQC_CMD_EXT_BASE + 0)
+#define VIRTQC_CMD_SHM_MEMCPY       (VIRTQC_CMD_EXT_BASE + 1)
+#define VIRTQC_CMD_GRAPH_BEGIN      (VIRTQC_CMD_EXT_BASE + 2)
+#define VIRTQC_CMD_GRAPH_END        (VIRTQC_CMD_EXT_BASE + 3)
+#define VIRTQC_CMD_GRAPH_LAUNCH     (VIRTQC_CMD_EXT_BASE + 4)
+#define VIRTQC_CMD_GRAPH_DESTROY    (VIRTQC_CMD_EXT_BASE + 5)
+#define VIRTQC_CMD_BLOB_LOAD        (VIRTQC_CMD_EXT_BASE + 6)
+#define VIRTQC_CMD_LAUNCH_LAYOUT    (VIRTQC_CMD_EXT_BASE + 7)
+#define VIRTQC_CMD_LAUNCH           (VIRTQC_CMD_EXT_BASE + 8)
+
+#define VIRTIO_QC_SHM_BAR           2
+#define VIRTIO_QC_BATCH_EINVAL      11
+/*****************************************************************************/
+
+/*********** FROM tests/qcuda-fake/builtin_types.h ***************************/
+
+#define cudaSuccess                     0
+#define cudaErrorInvalidDeviceFunction  8
+#define cudaErrorInvalidDevice          10
+#define cudaErrorInvalidValue           11
+#define cudaErrorInvalidResourceHandle  33
+#define cudaErrorNotSupported           71
+
+#define cudaMemcpyHostToDevice          1
+#define cudaMemcpyDeviceToHost          2
+#define cudaMemcpyDeviceToDevice        3
+
+#define cudaEventDisableTiming          0x02
+#define cudaHostRegisterMapped          0x02
+/*****************************************************************************/
+
+#define QC_STREAM_DEFAULT   ((uint64_t)-1)
+#define QC_BLOCK_SIZE       4096
+#define QC_VERSION          11080
+
+/* The image every test registers: the fake finds its built-in kernels
+ * in any PTX text that names them. */
+#define QC_PTX              ".version 7.8\n.target sm_86\n" \
+                            ".entry qcuda_fill\n.entry qcuda_inc\n"
+#define QC_FUNC_FILL        1
+#define QC_FUNC_INC         2
+#define QC_FUNC_MISSING     99
+
+typedef struct QCuda {
+    QPCIBus *bus;
+    QVirtioPCIDevice *dev;
+    QGuestAllocator *alloc;
+    QVirtQueue *vq;
+    uint16_t expected;      /* used index once everything has completed */
+    uint64_t req;           /* argument and reply of synchronous calls */
+    uint64_t conf;          /* launch configuration */
+    uint64_t params;        /* launch parameters */
+} QCuda;
+
+#define QC_PARAMS_SIZE      256
+
+/*
+ * Device lifetime
+ */
+
+static QCuda *qcuda_start(const char *opts)
+{
+    QVirtioPCIDevice *dev;
+    uint32_t features;
+    QCuda *qc;
+    char *cmd;
+
+    cmd = g_strdup_printf("-device virtio-qcuda-pci%s%s",
+                          opts ? "," : "", opts ? opts : "");
+    qtest_start(cmd);
+    g_free(cmd);
+
+    qc = g_new0(QCuda, 1);
+    qc->bus = qpci_init_pc();
+    dev = qvirtio_pci_device_find(qc->bus, QVIRTIO_QC_DEVICE_ID);
+    g_assert(dev != NULL);
+    g_assert_cmphex(dev->vdev.device_type, ==, QVIRTIO_QC_DEVICE_ID);
+    qc->dev = dev;
+
+    qvirtio_pci_device_enable(dev);
+    qvirtio_reset(&qvirtio_pci, &dev->vdev);
+    qvirtio_set_acknowledge(&qvirtio_pci, &dev->vdev);
+    qvirtio_set_driver(&qvirtio_pci, &dev->vdev);
+
+    qc->alloc = pc_alloc_init();
+    qc->vq = qvirtqueue_setup(&qvirtio_pci, &dev->vdev, qc->alloc, 0);
+
+    features = qvirtio_get_features(&qvirtio_pci, &dev->vdev);
+    features &= ~(QVIRTIO_F_BAD_FEATURE | QVIRTIO_F_RING_INDIRECT_DESC |
+                  QVIRTIO_F_RING_EVENT_IDX);
+    qvirtio_set_features(&qvirtio_pci, &dev->vdev, features);
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+
+    qc->req = guest_alloc(qc->alloc, 2 * sizeof(QVirtioQCArg));
+    qc->conf = guest_alloc(qc->alloc, 8 * sizeof(uint64_t));
+    qc->params = guest_alloc(qc->alloc, QC_PARAMS_SIZE);
+
+    return qc;
+}
+
+static void qcuda_stop(QCuda *qc)
+{
+    guest_free(qc->alloc, qc->params);
+    guest_free(qc->alloc, qc->conf);
+    guest_free(qc->alloc, qc->req);
+    guest_free(qc->alloc, qc->vq->desc);
+    pc_alloc_uninit(qc->alloc);
+    qvirtio_pci_device_disable(qc->dev);
+    g_free(qc->dev);
+    qpci_free_pc(qc->bus);
+    g_free(qc);
+    qtest_end();
+}
+
+/*
+ * Requests
+ */
+
+static uint16_t used_idx(QVirtQueue *vq)
+{
+    return readw(vq->used + offsetof(QVRingUsed, idx));
+}
+
+/* Every read is a round trip to QEMU already, so there is no need to
+ * sleep between them; that also keeps latencies measurable. */
+static void qcuda_wait(QCuda *qc, uint16_t idx)
+{
+    gint64 start = g_get_monotonic_time();
+
+    while (used_idx(qc->vq) != idx) {
+        g_assert_cmpint(g_get_monotonic_time() - start, <=,
+                        QVIRTIO_QC_TIMEOUT_US);
+    }
+}
+
+static void qcuda_wait_all(QCuda *qc)
+{
+    qcuda_wait(qc, qc->expected);
+}
+
+/* Queue one request, an out buffer with the argument and an in buffer
+ * for the reply.  libqos never recycles descriptors, so the table is
+ * reused from the start whenever the ring is idle. */
+static void qcuda_submit(QCuda *qc, uint64_t out, uint32_t out_len,
+                         uint64_t in, uint32_t in_len)
+{
+    uint32_t head;
+
+    if (qc->vq->num_free < 2) {
+        qcuda_wait_all(qc);
+        qc->vq->free_head = 0;
+        qc->vq->num_free = qc->vq->size;
+    }
+
+    head = qvirtqueue_add(qc->vq, out, out_len, false, true);
+    qvirtqueue_add(qc->vq, in, in_len, true, false);
+    qvirtqueue_kick(&qvirtio_pci, &qc->dev->vdev, qc->vq, head);
+    qc->expected++;
+}
+
+/* A request whose argument is already in guest memory at slot. */
+static void qcuda_submit_slot(QCuda *qc, uint64_t slot)
+{
+    qcuda_submit(qc, slot, sizeof(QVirtioQCArg),
+                 slot + sizeof(QVirtioQCArg), sizeof(QVirtioQCArg));
+}
+
+/* Run one command and wait for it; returns the status of the reply. */
+static int32_t qcuda_call(QCuda *qc, QVirtioQCArg *arg)
+{
+    memwrite(qc->req, arg, sizeof(*arg));
+    qcuda_submit_slot(qc, qc->req);
+    qcuda_wait_all(qc);
+    memread(qc->req + sizeof(*arg), arg, sizeof(*arg));
+    return arg->cmd;
+}
+
+static void arg_init(QVirtioQCArg *arg, int32_t cmd)
+{
+    memset(arg, 0, sizeof(*arg));
+    arg->cmd = cmd;
+}
+
+static int32_t qcuda_simple(QCuda *qc, int32_t cmd)
+{
+    QVirtioQCArg arg;
+
+    arg_init(&arg, cmd);
+    return qcuda_call(qc, &arg);
+}
+
+/*
+ * Guest driver operations
+ */
+
+/* What the guest driver does when a program starts: pick the block size
+ * of its gather lists and register the kernels of its image. */
+static void qcuda_open(QCuda *qc)
+{
+    QVirtioQCArg arg;
+    uint64_t image, name;
+
+    arg_init(&arg, VIRTQC_CMD_OPEN);
+    arg.pASize = QC_BLOCK_SIZE;
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, VIRTQC_CMD_OPEN);
+
+    g_assert_cmpint(qcuda_simple(qc, VIRTQC_cudaRegisterFatBinary), ==,
+                    cudaSuccess);
+
+    image = guest_alloc(qc->alloc, sizeof(QC_PTX));
+    name = guest_alloc(qc->alloc, 64);
+    memwrite(image, QC_PTX, sizeof(QC_PTX));
+
+    arg_init(&arg, VIRTQC_cudaRegisterFunction);
+    arg.pA = image;
+    arg.pB = name;
+    arg.flag = QC_FUNC_FILL;
+    memwrite(name, "qcuda_fill", sizeof("qcuda_fill"));
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+
+    arg_init(&arg, VIRTQC_cudaRegisterFunction);
+    arg.pA = image;
+    arg.pB = name;
+    arg.flag = QC_FUNC_INC;
+    memwrite(name, "qcuda_inc", sizeof("qcuda_inc"));
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+
+    guest_free(qc->alloc, name);
+    guest_free(qc->alloc, image);
+}
+
+static void qcuda_close(QCuda *qc)
+{
+    g_assert_cmpint(qcuda_simple(qc, VIRTQC_cudaUnregisterFatBinary), ==,
+                    cudaSuccess);
+    g_assert_cmpint(qcuda_simple(qc, VIRTQC_CMD_CLOSE), ==, VIRTQC_CMD_CLOSE);
+}
+
+static uint64_t qcuda_malloc(QCuda *qc, uint32_t size)
+{
+    QVirtioQCArg arg;
+
+    arg_init(&arg, VIRTQC_cudaMalloc);
+    arg.flag = size;
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+    g_assert_cmphex(arg.pA, !=, 0);
+    return arg.pA;
+}
+
+static void qcuda_free(QCuda *qc, uint64_t ptr)
+{
+    QVirtioQCArg arg;
+
+    arg_init(&arg, VIRTQC_cudaFree);
+    arg.pA = ptr;
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+}
+
+static void qcuda_memset(QCuda *qc, uint64_t ptr, uint8_t value, uint32_t size)
+{
+    QVirtioQCArg arg;
+
+    arg_init(&arg, VIRTQC_cudaMemset);
+    arg.pA = ptr;
+    arg.para = value;
+    arg.pASize = size;
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+}
+
+static void qcuda_dtoh(QCuda *qc, uint64_t gpa, uint64_t ptr, uint32_t size)
+{
+    QVirtioQCArg arg;
+
+    arg_init(&arg, VIRTQC_cudaMemcpy);
+    arg.flag = cudaMemcpyDeviceToHost;
+    arg.pA = gpa;
+    arg.pB = ptr;
+    arg.pASize = size;
+    arg.para = 1;
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+}
+
+static void qcuda_sync(QCuda *qc)
+{
+    g_assert_cmpint(qcuda_simple(qc, VIRTQC_cudaDeviceSynchronize), ==,
+                    cudaSuccess);
+}
+
+static uint64_t qcuda_stream_create(QCuda *qc)
+{
+    QVirtioQCArg arg;
+
+    arg_init(&arg, VIRTQC_cudaStreamCreate);
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+    g_assert_cmpuint(arg.pA, !=, 0);
+    return arg.pA;
+}
+
+static void qcuda_stream_destroy(QCuda *qc, uint64_t stream)
+{
+    QVirtioQCArg arg;
+
+    arg_init(&arg, VIRTQC_cudaStreamDestroy);
+    arg.pA = stream;
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+}
+
+/* Parameters in the layout of cudaLaunch: a count, then the size and
+ * the bytes of each. */
+static GByteArray *params_new(void)
+{
+    GByteArray *b = g_byte_array_new();
+    uint32_t count = 0;
+
+    g_byte_array_append(b, (guint8 *)&count, sizeof(count));
+    return b;
+}
+
+static void params_add(GByteArray *b, const void *data, uint32_t size)
+{
+    uint32_t count;
+
+    memcpy(&count, b->data, sizeof(count));
+    count++;
+    memcpy(b->data, &count, sizeof(count));
+    g_byte_array_append(b, (guint8 *)&size, sizeof(size));
+    g_byte_array_append(b, data, size);
+}
+
+/* Write the configuration and parameters of qcuda_fill (or qcuda_inc,
+ * which takes no value) to conf and params, and the launch to arg. */
+static void launch_prepare(QVirtioQCArg *arg, uint64_t conf, uint64_t params,
+                           uint32_t func, uint64_t stream, uint64_t ptr,
+                           uint32_t value, uint32_t count)
+{
+    uint64_t c[8] = { 1, 1, 1, 256, 1, 1, 0, stream };
+    GByteArray *b = params_new();
+
+    params_add(b, &ptr, sizeof(ptr));
+    if (func != QC_FUNC_INC) {
+        params_add(b, &value, sizeof(value));
+    }
+    params_add(b, &count, sizeof(count));
+    g_assert_cmpuint(b->len, <=, QC_PARAMS_SIZE);
+
+    memwrite(conf, c, sizeof(c));
+    memwrite(params, b->data, b->len);
+    g_byte_array_free(b, TRUE);
+
+    arg_init(arg, VIRTQC_cudaLaunch);
+    arg->pA = conf;
+    arg->pB = params;
+    arg->flag = func;
+}
+
+static int32_t qcuda_launch(QCuda *qc, uint32_t func, uint64_t stream,
+                            uint64_t ptr, uint32_t value, uint32_t count)
+{
+    QVirtioQCArg arg;
+
+    launch_prepare(&arg, qc->conf, qc->params, func, stream, ptr, value,
+                   count);
+    return qcuda_call(qc, &arg);
+}
+
+/* The argument buffer of qcuda_fill or qcuda_inc, parameters at their
+ * natural alignment. */
+static const QVirtioQCLaunchParam fill_layout[] = { { 0, 8 }, { 8, 4 },
+                                                    { 12, 4 } };
+static const QVirtioQCLaunchParam inc_layout[] = { { 0, 8 }, { 8, 4 } };
+
+static int32_t qcuda_launch_layout(QCuda *qc, uint32_t func,
+                                   const QVirtioQCLaunchParam *params,
+                                   uint32_t count, uint32_t size)
+{
+    QVirtioQCArg arg;
+
+    memwrite(qc->params, params, count * sizeof(*params));
+    arg_init(&arg, VIRTQC_CMD_LAUNCH_LAYOUT);
+    arg.flag = func;
+    arg.pA = qc->params;
+    arg.pASize = count;
+    arg.pBSize = size;
+    return qcuda_call(qc, &arg);
+}
+
+/* Like launch_prepare(), with a flat argument buffer. */
+static void flat_launch_prepare(QVirtioQCArg *arg, uint64_t conf,
+                                uint64_t params, uint32_t func,
+                                uint64_t stream, uint64_t ptr,
+                                uint32_t value, uint32_t count)
+{
+    uint64_t c[8] = { 1, 1, 1, 256, 1, 1, 0, stream };
+    uint8_t b[16];
+    uint32_t size;
+
+    memcpy(b, &ptr, sizeof(ptr));
+    if (func != QC_FUNC_INC) {
+        memcpy(b + 8, &value, sizeof(value));
+        memcpy(b + 12, &count, sizeof(count));
+        size = 16;
+    } else {
+        memcpy(b + 8, &count, sizeof(count));
+        size = 12;
+    }
+
+    memwrite(conf, c, sizeof(c));
+    memwrite(params, b, size);
+
+    arg_init(arg, VIRTQC_CMD_LAUNCH);
+    arg->pA = conf;
+    arg->pB = params;
+    arg->pBSize = size;
+    arg->flag = func;
+}
+
+static int32_t qcuda_flat_launch(QCuda *qc, uint32_t func, uint64_t stream,
+                                 uint64_t ptr, uint32_t value, uint32_t count)
+{
+    QVirtioQCArg arg;
+
+    flat_launch_prepare(&arg, qc->conf, qc->params, func, stream, ptr, value,
+                        count);
+    return qcuda_call(qc, &arg);
+}
+
+static uint64_t qcuda_event_create(QCuda *qc, uint32_t flags)
+{
+    QVirtioQCArg arg;
+
+    arg_init(&arg, flags ? VIRTQC_cudaEventCreateWithFlags :
+                           VIRTQC_cudaEventCreate);
+    arg.flag = flags;
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+    return arg.pA;
+}
+
+static void qcuda_event_call(QCuda *qc, int32_t cmd, uint64_t event,
+                             uint64_t stream)
+{
+    QVirtioQCArg arg;
+
+    arg_init(&arg, cmd);
+    arg.pA = event;
+    arg.pB = stream;
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+}
+
+/* Check that the count words at gpa all hold value. */
+static void check_words(uint64_t gpa, uint32_t value, uint32_t count)
+{
+    uint32_t *buf = g_new(uint32_t, count);
+    uint32_t i;
+
+    memread(gpa, buf, count * sizeof(uint32_t));
+    for (i = 0; i < count; i++) {
+        g_assert_cmphex(buf[i], ==, value);
+    }
+    g_free(buf);
+}
+
+static void fill_pattern(uint8_t *buf, size_t size, unsigned seed)
+{
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        buf[i] = (i % 251) ^ seed;
+    }
+}
+
+/*
+ * Gather lists: the guest passes the address of every block of its
+ * buffer, the first one 'offset' bytes into its block.
+ */
+enum {
+    SG_CONTIG,      /* one contiguous buffer, no list */
+    SG_PAGES,       /* list of blocks that are adjacent in guest RAM */
+    SG_REVERSED,    /* list of blocks in reverse order */
+    SG_OFFSET,      /* adjacent blocks, starting in the middle of one */
+    SG_SHAPES
+};
+
+static const char *sg_names[SG_SHAPES] = {
+    "contiguous", "pages", "reversed", "offset",
+};
+
+typedef struct QCBuffer {
+    uint64_t base;          /* guest allocation */
+    uint64_t list;          /* gpa array, 0 for SG_CONTIG */
+    uint32_t offset;
+    uint32_t size;
+    uint32_t blocks;
+    int shape;
+} QCBuffer;
+
+static void buffer_init(QCuda *qc, QCBuffer *b, int shape, uint32_t size)
+{
+    uint64_t *gpas;
+    uint32_t i;
+
+    b->shape = shape;
+    b->size = size;
+    b->offset = shape == SG_OFFSET ? QC_BLOCK_SIZE / 2 + 8 : 0;
+    b->blocks = DIV_ROUND_UP(b->offset + size, QC_BLOCK_SIZE);
+    b->base = guest_alloc(qc->alloc, b->blocks * QC_BLOCK_SIZE);
+    b->list = 0;
+    if (shape == SG_CONTIG) {
+        return;
+    }
+
+    gpas = g_new(uint64_t, b->blocks);
+    for (i = 0; i < b->blocks; i++) {
+        gpas[i] = b->base + (uint64_t)(shape == SG_REVERSED ?
+                                       b->blocks - 1 - i : i) * QC_BLOCK_SIZE;
+    }
+    gpas[0] += b->offset;
+    b->list = guest_alloc(qc->alloc, b->blocks * sizeof(uint64_t));
+    memwrite(b->list, gpas, b->blocks * sizeof(uint64_t));
+    g_free(gpas);
+}
+
+static void buffer_free(QCuda *qc, QCBuffer *b)
+{
+    if (b->list) {
+        guest_free(qc->alloc, b->list);
+    }
+    guest_free(qc->alloc, b->base);
+}
+
+/* Move the contents of the buffer between the guest and buf, following
+ * the block order of its list. */
+static void buffer_io(QCBuffer *b, uint8_t *buf, bool write)
+{
+    uint32_t done = 0, chunk, i;
+    uint64_t gpa;
+
+    if (b->shape == SG_CONTIG) {
+        if (write) {
+            memwrite(b->base, buf, b->size);
+        } else {
+            memread(b->base, buf, b->size);
+        }
+        return;
+    }
+
+    for (i = 0; done < b->size; i++) {
+        gpa = b->base + (uint64_t)(b->shape == SG_REVERSED ?
+                                   b->blocks - 1 - i : i) * QC_BLOCK_SIZE;
+        chunk = QC_BLOCK_SIZE;
+        if (i == 0) {
+            gpa += b->offset;
+            chunk -= b->offset;
+        }
+        chunk = MIN(chunk, b->size - done);
+        if (write) {
+            memwrite(gpa, buf + done, chunk);
+        } else {
+            memread(gpa, buf + done, chunk);
+        }
+        done += chunk;
+    }
+}
+
+static void buffer_arg(QVirtioQCArg *arg, QCBuffer *b, uint64_t ptr, int dir)
+{
+    arg_init(arg, VIRTQC_cudaMemcpy);
+    arg->flag = dir;
+    arg->para = b->shape == SG_CONTIG;
+    if (dir == cudaMemcpyHostToDevice) {
+        arg->pA = ptr;
+        arg->pB = b->list ? b->list : b->base;
+        arg->pBSize = b->size;
+        arg->pASize = b->offset;
+    } else {
+        arg->pB = ptr;
+        arg->pA = b->list ? b->list : b->base;
+        arg->pASize = b->size;
+        arg->pBSize = b->offset;
+    }
+}
+
+/*
+ * Functional tests
+ */
+
+/* The plain device buffer of the original driver. */
+static void test_device_space(void)
+{
+    QCuda *qc = qcuda_start(NULL);
+    uint8_t in[512], out[512];
+    QVirtioQCArg arg;
+    uint64_t buf;
+
+    buf = guest_alloc(qc->alloc, sizeof(in));
+    fill_pattern(in, sizeof(in), 0x5a);
+    memwrite(buf, in, sizeof(in));
+
+    arg_init(&arg, VIRTQC_CMD_OPEN);
+    arg.pASize = QC_BLOCK_SIZE;
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, VIRTQC_CMD_OPEN);
+
+    arg_init(&arg, VIRTQC_CMD_WRITE);
+    arg.pA = buf;
+    arg.pASize = sizeof(in);
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, VIRTQC_CMD_WRITE);
+
+    qmemset(buf, 0, sizeof(out));
+    arg_init(&arg, VIRTQC_CMD_READ);
+    arg.pA = buf;
+    arg.pASize = sizeof(out);
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, VIRTQC_CMD_READ);
+    memread(buf, out, sizeof(out));
+    g_assert(memcmp(in, out, sizeof(in)) == 0);
+
+    g_assert_cmpint(qcuda_simple(qc, VIRTQC_CMD_CLOSE), ==, VIRTQC_CMD_CLOSE);
+
+    guest_free(qc->alloc, buf);
+    qcuda_stop(qc);
+}
+
+static void test_device(void)
+{
+    QCuda *qc = qcuda_start(NULL);
+    QVirtioQCArg arg;
+    uint64_t prop;
+    char name[32];
+
+    qcuda_open(qc);
+
+    arg_init(&arg, VIRTQC_cudaGetDeviceCount);
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+    g_assert_cmpuint(arg.pA, ==, 2);
+
+    arg_init(&arg, VIRTQC_cudaGetDevice);
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+    g_assert_cmpuint(arg.pA, ==, 0);
+
+    arg_init(&arg, VIRTQC_cudaSetDevice);
+    arg.pA = 1;
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+    arg_init(&arg, VIRTQC_cudaGetDevice);
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+    g_assert_cmpuint(arg.pA, ==, 1);
+
+    arg_init(&arg, VIRTQC_cudaSetDevice);
+    arg.pA = 2;
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaErrorInvalidDevice);
+
+    /* the fake's cudaDeviceProp starts with the name */
+    prop = guest_alloc(qc->alloc, 4096);
+    arg_init(&arg, VIRTQC_cudaGetDeviceProperties);
+    arg.pA = prop;
+    arg.pB = 1;
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+    memread(prop, name, sizeof(name));
+    name[sizeof(name) - 1] = 0;
+    g_assert_cmpstr(name, ==, "qCUDA fake device 1");
+    guest_free(qc->alloc, prop);
+
+    arg_init(&arg, VIRTQC_cudaSetDeviceFlags);
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+
+    arg_init(&arg, VIRTQC_cudaDriverGetVersion);
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+    g_assert_cmpuint(arg.pA, ==, QC_VERSION);
+    arg_init(&arg, VIRTQC_cudaRuntimeGetVersion);
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+    g_assert_cmpuint(arg.pA, ==, QC_VERSION);
+
+    /* freeing what was never allocated is remembered until asked */
+    arg_init(&arg, VIRTQC_cudaFree);
+    arg.pA = 0x1000;
+    g_assert_cmpint(qcuda_call(qc, &arg), !=, cudaSuccess);
+    g_assert_cmpint(qcuda_simple(qc, VIRTQC_cudaGetLastError), ==,
+                    cudaErrorInvalidValue);
+    g_assert_cmpint(qcuda_simple(qc, VIRTQC_cudaGetLastError), ==,
+                    cudaSuccess);
+
+    qcuda_sync(qc);
+    g_assert_cmpint(qcuda_simple(qc, VIRTQC_cudaDeviceReset), ==,
+                    cudaSuccess);
+
+    qcuda_close(qc);
+    qcuda_stop(qc);
+}
+
+#define MEMCPY_SIZE     (5 * QC_BLOCK_SIZE + 123)
+
+/* Copies in every gather list shape, both ways and device to device. */
+static void test_memcpy(gconstpointer data)
+{
+    QCuda *qc = qcuda_start(data);
+    uint8_t *in = g_malloc(MEMCPY_SIZE), *out = g_malloc(MEMCPY_SIZE);
+    QVirtioQCArg arg;
+    QCBuffer b;
+    uint64_t ptr, ptr2;
+    int shape;
+
+    qcuda_open(qc);
+    ptr = qcuda_malloc(qc, MEMCPY_SIZE);
+    ptr2 = qcuda_malloc(qc, MEMCPY_SIZE);
+
+    for (shape = 0; shape < SG_SHAPES; shape++) {
+        buffer_init(qc, &b, shape, MEMCPY_SIZE);
+
+        fill_pattern(in, MEMCPY_SIZE, shape);
+        buffer_io(&b, in, true);
+        buffer_arg(&arg, &b, ptr, cudaMemcpyHostToDevice);
+        g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+
+        arg_init(&arg, VIRTQC_cudaMemcpy);
+        arg.flag = cudaMemcpyDeviceToDevice;
+        arg.pA = ptr2;
+        arg.pB = ptr;
+        arg.pBSize = MEMCPY_SIZE;
+        g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+
+        memset(out, 0, MEMCPY_SIZE);
+        buffer_io(&b, out, true);
+        buffer_arg(&arg, &b, ptr2, cudaMemcpyDeviceToHost);
+        g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+        buffer_io(&b, out, false);
+        g_assert(memcmp(in, out, MEMCPY_SIZE) == 0);
+
+        buffer_free(qc, &b);
+    }
+
+    /* memset is ordered before the copy that follows it */
+    buffer_init(qc, &b, SG_CONTIG, MEMCPY_SIZE);
+    qcuda_memset(qc, ptr, 0xa5, MEMCPY_SIZE);
+    qcuda_dtoh(qc, b.base, ptr, MEMCPY_SIZE);
+    memread(b.base, out, MEMCPY_SIZE);
+    memset(in, 0xa5, MEMCPY_SIZE);
+    g_assert(memcmp(in, out, MEMCPY_SIZE) == 0);
+    buffer_free(qc, &b);
+
+    qcuda_free(qc, ptr2);
+    qcuda_free(qc, ptr);
+    qcuda_close(qc);
+    qcuda_stop(qc);
+    g_free(out);
+    g_free(in);
+}
+
+#define LAUNCH_WORDS    1024
+
+static void test_launch(void)
+{
+    QCuda *qc = qcuda_start(NULL);
+    uint32_t size = LAUNCH_WORDS * sizeof(uint32_t);
+    uint64_t ptr, buf, stream, start, end;
+    QVirtioQCArg arg;
+    float ms;
+
+    qcuda_open(qc);
+    ptr = qcuda_malloc(qc, size);
+    buf = guest_alloc(qc->alloc, size);
+
+    g_assert_cmpint(qcuda_launch(qc, QC_FUNC_FILL, QC_STREAM_DEFAULT, ptr,
+                                 0x1234, LAUNCH_WORDS), ==, cudaSuccess);
+    g_assert_cmpint(qcuda_launch(qc, QC_FUNC_INC, QC_STREAM_DEFAULT, ptr,
+                                 0, LAUNCH_WORDS), ==, cudaSuccess);
+    qcuda_dtoh(qc, buf, ptr, size);
+    check_words(buf, 0x1235, LAUNCH_WORDS);
+
+    g_assert_cmpint(qcuda_launch(qc, QC_FUNC_MISSING, QC_STREAM_DEFAULT, ptr,
+                                 0, LAUNCH_WORDS), ==,
+                    cudaErrorInvalidDeviceFunction);
+
+    /* on a stream, timed with events */
+    stream = qcuda_stream_create(qc);
+    start = qcuda_event_create(qc, 0);
+    end = qcuda_event_create(qc, 0);
+    qcuda_event_call(qc, VIRTQC_cudaEventRecord, start, stream);
+    g_assert_cmpint(qcuda_launch(qc, QC_FUNC_FILL, stream, ptr, 7,
+                                 LAUNCH_WORDS), ==, cudaSuccess);
+    g_assert_cmpint(qcuda_launch(qc, QC_FUNC_INC, stream, ptr, 0,
+                                 LAUNCH_WORDS), ==, cudaSuccess);
+    qcuda_event_call(qc, VIRTQC_cudaEventRecord, end, stream);
+    qcuda_event_call(qc, VIRTQC_cudaEventSynchronize, end, 0);
+
+    arg_init(&arg, VIRTQC_cudaEventElapsedTime);
+    arg.pA = start;
+    arg.pB = end;
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+    memcpy(&ms, &arg.flag, sizeof(ms));
+    g_assert(ms >= 0);
+
+    qcuda_dtoh(qc, buf, ptr, size);
+    check_words(buf, 8, LAUNCH_WORDS);
+
+    qcuda_event_call(qc, VIRTQC_cudaEventDestroy, end, 0);
+    qcuda_event_call(qc, VIRTQC_cudaEventDestroy, start, 0);
+    end = qcuda_event_create(qc, cudaEventDisableTiming);
+    qcuda_event_call(qc, VIRTQC_cudaEventDestroy, end, 0);
+    qcuda_stream_destroy(qc, stream);
+
+    guest_free(qc->alloc, buf);
+    qcuda_free(qc, ptr);
+    qcuda_close(qc);
+    qcuda_stop(qc);
+}
+
+#define SLOW_KERNEL_NS  "200000000"
+
+/* A synchronization waits for the kernel without holding up the queue:
+ * a call sent after it completes first. */
+static void test_deferred_sync(void)
+{
+    uint32_t size = LAUNCH_WORDS * sizeof(uint32_t);
+    QVirtioQCArg arg, reply;
+    uint64_t ptr, slots;
+    QCuda *qc;
+
+    g_setenv("QCUDA_FAKE_LAUNCH_NS", SLOW_KERNEL_NS, true);
+    qc = qcuda_start(NULL);
+    g_unsetenv("QCUDA_FAKE_LAUNCH_NS");
+
+    qcuda_open(qc);
+    ptr = qcuda_malloc(qc, size);
+    slots = guest_alloc(qc->alloc, 4 * sizeof(arg));
+
+    g_assert_cmpint(qcuda_launch(qc, QC_FUNC_FILL, QC_STREAM_DEFAULT, ptr,
+                                 1, LAUNCH_WORDS), ==, cudaSuccess);
+
+    arg_init(&arg, VIRTQC_cudaDeviceSynchronize);
+    memwrite(slots, &arg, sizeof(arg));
+    qmemset(slots + sizeof(arg), 0xff, sizeof(arg));
+    qcuda_submit_slot(qc, slots);
+
+    arg_init(&arg, VIRTQC_cudaGetDeviceCount);
+    memwrite(slots + 2 * sizeof(arg), &arg, sizeof(arg));
+    qcuda_submit_slot(qc, slots + 2 * sizeof(arg));
+
+    qcuda_wait(qc, qc->expected - 1);
+    memread(slots + sizeof(arg), &reply, sizeof(reply));
+    g_assert_cmpint(reply.cmd, ==, -1);
+    memread(slots + 3 * sizeof(arg), &reply, sizeof(reply));
+    g_assert_cmpint(reply.cmd, ==, cudaSuccess);
+    g_assert_cmpuint(reply.pA, ==, 2);
+
+    qcuda_wait_all(qc);
+    memread(slots + sizeof(arg), &reply, sizeof(reply));
+    g_assert_cmpint(reply.cmd, ==, cudaSuccess);
+
+    guest_free(qc->alloc, slots);
+    qcuda_free(qc, ptr);
+    qcuda_close(qc);
+    qcuda_stop(qc);
+}
+
+#define MMAP_BLOCKS     4
+
+/* The zero-copy path: guest pages backed by a host file that both the
+ * asynchronous copies and page-locked host memory work on. */
+static void test_mmap(void)
+{
+    QCuda *qc = qcuda_start(NULL);
+    uint32_t size = MMAP_BLOCKS * QC_BLOCK_SIZE;
+    uint32_t words = size / sizeof(uint32_t);
+    uint64_t gpas[MMAP_BLOCKS];
+    uint64_t base, list, ptr, host, dptr;
+    QVirtioQCArg arg;
+    int32_t fd;
+    int i;
+
+    qcuda_open(qc);
+    ptr = qcuda_malloc(qc, size);
+
+    base = guest_alloc(qc->alloc, size);
+    list = guest_alloc(qc->alloc, sizeof(gpas));
+    for (i = 0; i < MMAP_BLOCKS; i++) {
+        gpas[i] = base + i * QC_BLOCK_SIZE;
+    }
+    memwrite(list, gpas, sizeof(gpas));
+
+    arg_init(&arg, VIRTQC_CMD_MMAPCTL);
+    arg.pBSize = size;
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, VIRTQC_CMD_MMAPCTL);
+    fd = (int32_t)arg.pA;
+    g_assert_cmpint(fd, >=, 0);
+
+    arg_init(&arg, VIRTQC_CMD_MMAP);
+    arg.pA = fd;
+    arg.pASize = MMAP_BLOCKS;
+    arg.pB = list;
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, VIRTQC_CMD_MMAP);
+
+    /* guest pages -> file -> device, increment, and back */
+    qmemset(base, 0x11, size);
+    arg_init(&arg, VIRTQC_cudaMemcpyAsync);
+    arg.flag = cudaMemcpyHostToDevice;
+    arg.rnd = QC_STREAM_DEFAULT;
+    arg.pA = ptr;
+    arg.pASize = fd;
+    arg.pB = 0;
+    arg.pBSize = size;
+    arg.para = size;
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+
+    g_assert_cmpint(qcuda_launch(qc, QC_FUNC_INC, QC_STREAM_DEFAULT, ptr, 0,
+                                 words), ==, cudaSuccess);
+
+    arg_init(&arg, VIRTQC_cudaMemcpyAsync);
+    arg.flag = cudaMemcpyDeviceToHost;
+    arg.rnd = QC_STREAM_DEFAULT;
+    arg.pB = ptr;
+    arg.pBSize = fd;
+    arg.pA = 0;
+    arg.pASize = size;
+    arg.para = size;
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+    qcuda_sync(qc);
+    check_words(base, 0x11111112, words);
+
+    /* kernels writing straight into the guest pages */
+    arg_init(&arg, VIRTQC_cudaHostRegister);
+    arg.pBSize = fd;
+    arg.pA = 0;
+    arg.pASize = size;
+    arg.pB = size;
+    arg.flag = cudaHostRegisterMapped;
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+    host = arg.pA;
+
+    arg_init(&arg, VIRTQC_cudaHostGetDevicePointer);
+    arg.pB = host;
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+    dptr = arg.pA;
+    g_assert_cmphex(dptr, !=, 0);
+
+    g_assert_cmpint(qcuda_launch(qc, QC_FUNC_FILL, QC_STREAM_DEFAULT, dptr,
+                                 0xcafe, words), ==, cudaSuccess);
+    qcuda_sync(qc);
+    check_words(base, 0xcafe, words);
+
+    arg_init(&arg, VIRTQC_cudaHostUnregister);
+    arg.pB = host;
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+
+    arg_init(&arg, VIRTQC_CMD_MUNMAP);
+    arg.pB = list;
+    arg.pBSize = MMAP_BLOCKS;
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, VIRTQC_CMD_MUNMAP);
+    check_words(base, 0, words);
+
+    arg_init(&arg, VIRTQC_CMD_MMAPRELEASE);
+    arg.pBSize = fd;
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, VIRTQC_CMD_MMAPRELEASE);
+
+    guest_free(qc->alloc, list);
+    guest_free(qc->alloc, base);
+    qcuda_free(qc, ptr);
+    qcuda_close(qc);
+    qcuda_stop(qc);
+}
+
+#define SHM_SIZE        (1 << 20)
+
+static void shm_arg(QVirtioQCArg *arg, int dir, uint64_t ptr, uint64_t offset,
+                    uint32_t size, uint64_t stream)
+{
+    arg_init(arg, VIRTQC_CMD_SHM_MEMCPY);
+    arg->flag = dir;
+    arg->pA = ptr;
+    arg->pB = offset;
+    arg->pBSize = size;
+    arg->rnd = stream;
+}
+
+static void test_shm(void)
+{
+    QCuda *qc = qcuda_start("size=1M");
+    uint8_t in[8192], out[8192];
+    QVirtioQCArg arg;
+    uint64_t bar, bar_size, ptr, stream;
+
+    bar = (uintptr_t)qpci_iomap(qc->dev->pdev, VIRTIO_QC_SHM_BAR, &bar_size);
+    g_assert_cmpuint(bar_size, ==, SHM_SIZE);
+
+    qcuda_open(qc);
+    ptr = qcuda_malloc(qc, sizeof(in));
+
+    fill_pattern(in, sizeof(in), 0x3c);
+    memwrite(bar + 4096, in, sizeof(in));
+    shm_arg(&arg, cudaMemcpyHostToDevice, ptr, 4096, sizeof(in),
+            QC_STREAM_DEFAULT);
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+    shm_arg(&arg, cudaMemcpyDeviceToHost, ptr, 65536, sizeof(in),
+            QC_STREAM_DEFAULT);
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+    memread(bar + 65536, out, sizeof(out));
+    g_assert(memcmp(in, out, sizeof(in)) == 0);
+
+    /* queued on a stream, done by the next synchronization */
+    stream = qcuda_stream_create(qc);
+    qcuda_memset(qc, ptr, 0x77, sizeof(in));
+    shm_arg(&arg, cudaMemcpyDeviceToHost, ptr, 0, sizeof(in), stream);
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+    qcuda_sync(qc);
+    memread(bar, out, sizeof(out));
+    memset(in, 0x77, sizeof(in));
+    g_assert(memcmp(in, out, sizeof(in)) == 0);
+    qcuda_stream_destroy(qc, stream);
+
+    shm_arg(&arg, cudaMemcpyHostToDevice, ptr, SHM_SIZE - 4096, sizeof(in),
+            QC_STREAM_DEFAULT);
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaErrorInvalidValue);
+
+    qcuda_free(qc, ptr);
+    qcuda_close(qc);
+    qcuda_stop(qc);
+}
+
+static void patch_add(GByteArray *p, uint32_t node, uint32_t param,
+                      const void *data, uint32_t size)
+{
+    QVirtioQCGraphPatch e = { node, param, size, 0 };
+    static const uint8_t zero[8];
+
+    g_byte_array_append(p, (guint8 *)&e, sizeof(e));
+    g_byte_array_append(p, data, size);
+    g_byte_array_append(p, zero, ROUND_UP(size, 8) - size);
+}
+
+static int32_t qcuda_graph_launch(QCuda *qc, uint64_t graph, uint64_t stream,
+                                  GByteArray *patch)
+{
+    QVirtioQCArg arg;
+    uint64_t list = 0;
+    int32_t ret;
+
+    arg_init(&arg, VIRTQC_CMD_GRAPH_LAUNCH);
+    arg.pA = graph;
+    arg.rnd = stream;
+    if (patch) {
+        list = guest_alloc(qc->alloc, patch->len);
+        memwrite(list, patch->data, patch->len);
+        arg.pB = list;
+        arg.pBSize = patch->len;
+    }
+    ret = qcuda_call(qc, &arg);
+    if (list) {
+        guest_free(qc->alloc, list);
+    }
+    return ret;
+}
+
+static void test_graph(void)
+{
+    QCuda *qc = qcuda_start(NULL);
+    uint32_t size = LAUNCH_WORDS * sizeof(uint32_t);
+    uint64_t ptr, copy, buf, stream, graph;
+    QVirtioQCArg arg;
+    GByteArray *p;
+    uint32_t value;
+    uint16_t shortv = 1;
+
+    qcuda_open(qc);
+    ptr = qcuda_malloc(qc, size);
+    copy = qcuda_malloc(qc, size);
+    buf = guest_alloc(qc->alloc, size);
+    stream = qcuda_stream_create(qc);
+
+    arg_init(&arg, VIRTQC_CMD_GRAPH_BEGIN);
+    arg.rnd = stream;
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+
+    /* recorded, not run */
+    g_assert_cmpint(qcuda_launch(qc, QC_FUNC_FILL, stream, ptr, 40,
+                                 LAUNCH_WORDS), ==, cudaSuccess);
+    g_assert_cmpint(qcuda_launch(qc, QC_FUNC_INC, stream, ptr, 0,
+                                 LAUNCH_WORDS), ==, cudaSuccess);
+    arg_init(&arg, VIRTQC_cudaMemcpyAsync);
+    arg.flag = cudaMemcpyDeviceToDevice;
+    arg.rnd = stream;
+    arg.pA = ptr;
+    arg.pB = copy;
+    arg.pBSize = size;
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+
+    arg_init(&arg, VIRTQC_CMD_GRAPH_END);
+    arg.rnd = stream;
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+    graph = arg.pA;
+    g_assert_cmpuint(arg.pB, ==, 3);
+
+    qcuda_memset(qc, copy, 0, size);
+    qcuda_dtoh(qc, buf, copy, size);
+    check_words(buf, 0, LAUNCH_WORDS);
+
+    g_assert_cmpint(qcuda_graph_launch(qc, graph, stream, NULL), ==,
+                    cudaSuccess);
+    qcuda_sync(qc);
+    qcuda_dtoh(qc, buf, copy, size);
+    check_words(buf, 41, LAUNCH_WORDS);
+
+    /* a new fill value, kept for later replays */
+    p = g_byte_array_new();
+    value = 100;
+    patch_add(p, 0, 1, &value, sizeof(value));
+    g_assert_cmpint(qcuda_graph_launch(qc, graph, stream, p), ==,
+                    cudaSuccess);
+    g_assert_cmpint(qcuda_graph_launch(qc, graph, QC_STREAM_DEFAULT, NULL), ==,
+                    cudaSuccess);
+    qcuda_sync(qc);
+    qcuda_dtoh(qc, buf, copy, size);
+    check_words(buf, 101, LAUNCH_WORDS);
+    g_byte_array_free(p, TRUE);
+
+    /* a patch of the wrong size is refused as a whole */
+    p = g_byte_array_new();
+    value = 5;
+    patch_add(p, 0, 1, &value, sizeof(value));
+    patch_add(p, 0, 1, &shortv, sizeof(shortv));
+    g_assert_cmpint(qcuda_graph_launch(qc, graph, stream, p), ==,
+                    cudaErrorInvalidValue);
+    g_byte_array_free(p, TRUE);
+
+    arg_init(&arg, VIRTQC_CMD_GRAPH_DESTROY);
+    arg.pA = graph;
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+    arg_init(&arg, VIRTQC_CMD_GRAPH_DESTROY);
+    arg.pA = graph;
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaErrorInvalidResourceHandle);
+    g_assert_cmpint(qcuda_graph_launch(qc, graph, stream, NULL), ==,
+                    cudaErrorInvalidResourceHandle);
+
+    qcuda_stream_destroy(qc, stream);
+    guest_free(qc->alloc, buf);
+    qcuda_free(qc, copy);
+    qcuda_free(qc, ptr);
+    qcuda_close(qc);
+    qcuda_stop(qc);
+}
+
+#define BLOB_SIZE       10000
+
+static int32_t qcuda_blob_load(QCuda *qc, const char *name, QVirtioQCArg *arg)
+{
+    uint64_t gpa = guest_alloc(qc->alloc, strlen(name));
+    int32_t ret;
+
+    memwrite(gpa, name, strlen(name));
+    arg_init(arg, VIRTQC_CMD_BLOB_LOAD);
+    arg->pA = gpa;
+    arg->pASize = strlen(name);
+    ret = qcuda_call(qc, arg);
+    guest_free(qc->alloc, gpa);
+    return ret;
+}
+
+static void test_blob(void)
+{
+    char dir_tmpl[] = "/tmp/qcuda-blob-XXXXXX";
+    uint8_t *in = g_malloc(BLOB_SIZE), *out = g_malloc(BLOB_SIZE);
+    char *dir, *path, *opts;
+    QVirtioQCArg arg;
+    uint64_t buf, ptr;
+    QCuda *qc;
+
+    dir = mkdtemp(dir_tmpl);
+    g_assert(dir != NULL);
+    path = g_build_filename(dir, "weights", NULL);
+    fill_pattern(in, BLOB_SIZE, 0x42);
+    g_assert(g_file_set_contents(path, (char *)in, BLOB_SIZE, NULL));
+
+    opts = g_strdup_printf("blob-dir=%s", dir);
+    qc = qcuda_start(opts);
+    g_free(opts);
+
+    /* nothing to load into before the program registers its image */
+    g_assert_cmpint(qcuda_blob_load(qc, "weights", &arg), ==,
+                    cudaErrorNotSupported);
+
+    qcuda_open(qc);
+    g_assert_cmpint(qcuda_blob_load(qc, "weights", &arg), ==, cudaSuccess);
+    ptr = arg.pA;
+    g_assert_cmpuint(arg.para, ==, BLOB_SIZE);
+
+    buf = guest_alloc(qc->alloc, BLOB_SIZE);
+    qcuda_dtoh(qc, buf, ptr, BLOB_SIZE);
+    memread(buf, out, BLOB_SIZE);
+    g_assert(memcmp(in, out, BLOB_SIZE) == 0);
+    guest_free(qc->alloc, buf);
+
+    /* kernels may only read it */
+    g_assert_cmpint(qcuda_launch(qc, QC_FUNC_FILL, QC_STREAM_DEFAULT, ptr, 0,
+                                 BLOB_SIZE / sizeof(uint32_t)), !=,
+                    cudaSuccess);
+
+    /* loaded once, shared */
+    g_assert_cmpint(qcuda_blob_load(qc, "weights", &arg), ==, cudaSuccess);
+    g_assert_cmphex(arg.pA, ==, ptr);
+    qcuda_free(qc, ptr);
+    qcuda_free(qc, ptr);
+
+    g_assert_cmpint(qcuda_blob_load(qc, "missing", &arg), ==,
+                    cudaErrorInvalidValue);
+    g_assert_cmpuint(arg.pB, ==, ENOENT);
+    g_assert_cmpint(qcuda_blob_load(qc, "../weights", &arg), ==,
+                    cudaErrorInvalidValue);
+
+    qcuda_close(qc);
+    qcuda_stop(qc);
+
+    unlink(path);
+    rmdir(dir);
+    g_free(path);
+    g_free(out);
+    g_free(in);
+}
+
+/*
+ * Batches: out is the header, the extension and the entries; in is the
+ * reply header and one status per entry.
+ */
+typedef struct QCBatch {
+    uint64_t out;
+    uint64_t in;
+    uint32_t max;
+} QCBatch;
+
+static void batch_init(QCuda *qc, QCBatch *b, uint32_t max)
+{
+    b->max = max;
+    b->out = guest_alloc(qc->alloc, (max + 1) * sizeof(QVirtioQCArg) +
+                                    sizeof(QVirtioQCArgExt));
+    b->in = guest_alloc(qc->alloc, sizeof(QVirtioQCArg) +
+                                   max * sizeof(int32_t));
+}
+
+static void batch_free(QCuda *qc, QCBatch *b)
+{
+    guest_free(qc->alloc, b->in);
+    guest_free(qc->alloc, b->out);
+}
+
+static void batch_write(QCBatch *b, const QVirtioQCArg *entries,
+                        uint32_t count)
+{
+    QVirtioQCArgExt ext = { 0, 0 };
+    QVirtioQCArg arg;
+
+    g_assert_cmpuint(count, <=, b->max);
+    arg_init(&arg, VIRTQC_CMD_BATCH);
+    arg.pASize = count;
+    memwrite(b->out, &arg, sizeof(arg));
+    memwrite(b->out + sizeof(arg), &ext, sizeof(ext));
+    memwrite(b->out + sizeof(arg) + sizeof(ext), entries,
+             count * sizeof(*entries));
+}
+
+static void batch_submit(QCuda *qc, QCBatch *b, uint32_t count)
+{
+    qcuda_submit(qc, b->out, (count + 1) * sizeof(QVirtioQCArg) +
+                             sizeof(QVirtioQCArgExt),
+                 b->in, sizeof(QVirtioQCArg) + count * sizeof(int32_t));
+}
+
+static void test_batch(void)
+{
+    QCuda *qc = qcuda_start(NULL);
+    uint32_t size = LAUNCH_WORDS * sizeof(uint32_t);
+    uint64_t ptr, buf, event;
+    QVirtioQCArg entries[5], reply;
+    int32_t status[5];
+    QCBatch b;
+
+    qcuda_open(qc);
+    ptr = qcuda_malloc(qc, size);
+    buf = guest_alloc(qc->alloc, size);
+    event = qcuda_event_create(qc, 0);
+    batch_init(qc, &b, ARRAY_SIZE(entries));
+
+    arg_init(&entries[0], VIRTQC_cudaMemset);
+    entries[0].pA = ptr;
+    entries[0].pASize = size;
+    launch_prepare(&entries[1], qc->conf, qc->params, QC_FUNC_INC,
+                   QC_STREAM_DEFAULT, ptr, 0, LAUNCH_WORDS);
+    arg_init(&entries[2], VIRTQC_cudaGetDeviceCount);
+    entries[3] = entries[1];
+    arg_init(&entries[4], VIRTQC_cudaEventRecord);
+    entries[4].pA = event;
+    entries[4].pB = QC_STREAM_DEFAULT;
+
+    batch_write(&b, entries, ARRAY_SIZE(entries));
+    batch_submit(qc, &b, ARRAY_SIZE(entries));
+    qcuda_wait_all(qc);
+
+    memread(b.in, &reply, sizeof(reply));
+    memread(b.in + sizeof(reply), status, sizeof(status));
+    g_assert_cmpint(reply.cmd, ==, VIRTIO_QC_BATCH_EINVAL);
+    g_assert_cmpint(status[0], ==, cudaSuccess);
+    g_assert_cmpint(status[1], ==, cudaSuccess);
+    g_assert_cmpint(status[2], ==, VIRTIO_QC_BATCH_EINVAL);
+    g_assert_cmpint(status[3], ==, cudaSuccess);
+    g_assert_cmpint(status[4], ==, cudaSuccess);
+
+    /* the entry that was refused did not stop the ones after it */
+    qcuda_event_call(qc, VIRTQC_cudaEventSynchronize, event, 0);
+    qcuda_dtoh(qc, buf, ptr, size);
+    check_words(buf, 2, LAUNCH_WORDS);
+
+    /* an empty batch is malformed */
+    batch_write(&b, entries, 0);
+    batch_submit(qc, &b, 0);
+    qcuda_wait_all(qc);
+    memread(b.in, &reply, sizeof(reply));
+    g_assert_cmpint(reply.cmd, ==, VIRTIO_QC_BATCH_EINVAL);
+
+    batch_free(qc, &b);
+    qcuda_event_call(qc, VIRTQC_cudaEventDestroy, event, 0);
+    guest_free(qc->alloc, buf);
+    qcuda_free(qc, ptr);
+    qcuda_close(qc);
+    qcuda_stop(qc);
+}
+
+static void test_launch_layout(void)
+{
+    QCuda *qc = qcuda_start(NULL);
+    uint32_t size = LAUNCH_WORDS * sizeof(uint32_t);
+    static const QVirtioQCLaunchParam overlap[] = { { 0, 8 }, { 4, 4 } };
+    static const QVirtioQCLaunchParam beyond[] = { { 0, 8 }, { 12, 8 } };
+    uint64_t ptr, buf, stream, graph;
+    QVirtioQCArg arg, entries[2], reply;
+    int32_t status[2];
+    QCBatch b;
+
+    qcuda_open(qc);
+    ptr = qcuda_malloc(qc, size);
+    buf = guest_alloc(qc->alloc, size);
+
+    /* no layout yet */
+    g_assert_cmpint(qcuda_flat_launch(qc, QC_FUNC_FILL, QC_STREAM_DEFAULT, ptr,
+                                      1, LAUNCH_WORDS), ==,
+                    cudaErrorInvalidValue);
+
+    g_assert_cmpint(qcuda_launch_layout(qc, QC_FUNC_FILL, overlap,
+                                        ARRAY_SIZE(overlap), 16), ==,
+                    cudaErrorInvalidValue);
+    g_assert_cmpint(qcuda_launch_layout(qc, QC_FUNC_FILL, beyond,
+                                        ARRAY_SIZE(beyond), 16), ==,
+                    cudaErrorInvalidValue);
+    g_assert_cmpint(qcuda_launch_layout(qc, QC_FUNC_FILL, fill_layout,
+                                        ARRAY_SIZE(fill_layout), 16), ==,
+                    cudaSuccess);
+    g_assert_cmpint(qcuda_launch_layout(qc, QC_FUNC_INC, inc_layout,
+                                        ARRAY_SIZE(inc_layout), 12), ==,
+                    cudaSuccess);
+
+    /* registering the same layout again is fine, a different one is not */
+    g_assert_cmpint(qcuda_launch_layout(qc, QC_FUNC_INC, inc_layout,
+                                        ARRAY_SIZE(inc_layout), 12), ==,
+                    cudaSuccess);
+    g_assert_cmpint(qcuda_launch_layout(qc, QC_FUNC_INC, inc_layout,
+                                        ARRAY_SIZE(inc_layout), 16), ==,
+                    cudaErrorInvalidValue);
+
+    g_assert_cmpint(qcuda_flat_launch(qc, QC_FUNC_FILL, QC_STREAM_DEFAULT, ptr,
+                                      0x4321, LAUNCH_WORDS), ==, cudaSuccess);
+    g_assert_cmpint(qcuda_flat_launch(qc, QC_FUNC_INC, QC_STREAM_DEFAULT, ptr,
+                                      0, LAUNCH_WORDS), ==, cudaSuccess);
+    qcuda_dtoh(qc, buf, ptr, size);
+    check_words(buf, 0x4322, LAUNCH_WORDS);
+
+    /* the buffer must have the registered size */
+    flat_launch_prepare(&arg, qc->conf, qc->params, QC_FUNC_FILL,
+                        QC_STREAM_DEFAULT, ptr, 0, LAUNCH_WORDS);
+    arg.pBSize = 12;
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaErrorInvalidValue);
+    g_assert_cmpint(qcuda_launch_layout(qc, QC_FUNC_MISSING, inc_layout,
+                                        ARRAY_SIZE(inc_layout), 12), ==,
+                    cudaSuccess);
+    g_assert_cmpint(qcuda_flat_launch(qc, QC_FUNC_MISSING, QC_STREAM_DEFAULT,
+                                      ptr, 0, LAUNCH_WORDS), ==,
+                    cudaErrorInvalidDeviceFunction);
+
+    /* batched */
+    batch_init(qc, &b, ARRAY_SIZE(entries));
+    flat_launch_prepare(&entries[0], qc->conf, qc->params, QC_FUNC_INC,
+                        QC_STREAM_DEFAULT, ptr, 0, LAUNCH_WORDS);
+    entries[1] = entries[0];
+    batch_write(&b, entries, ARRAY_SIZE(entries));
+    batch_submit(qc, &b, ARRAY_SIZE(entries));
+    qcuda_wait_all(qc);
+    memread(b.in, &reply, sizeof(reply));
+    memread(b.in + sizeof(reply), status, sizeof(status));
+    g_assert_cmpint(reply.cmd, ==, cudaSuccess);
+    g_assert_cmpint(status[0], ==, cudaSuccess);
+    g_assert_cmpint(status[1], ==, cudaSuccess);
+    qcuda_dtoh(qc, buf, ptr, size);
+    check_words(buf, 0x4324, LAUNCH_WORDS);
+    batch_free(qc, &b);
+
+    /* recorded like cudaLaunch */
+    stream = qcuda_stream_create(qc);
+    arg_init(&arg, VIRTQC_CMD_GRAPH_BEGIN);
+    arg.rnd = stream;
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+    g_assert_cmpint(qcuda_flat_launch(qc, QC_FUNC_FILL, stream, ptr, 60,
+                                      LAUNCH_WORDS), ==, cudaSuccess);
+    g_assert_cmpint(qcuda_flat_launch(qc, QC_FUNC_INC, stream, ptr, 0,
+                                      LAUNCH_WORDS), ==, cudaSuccess);
+    arg_init(&arg, VIRTQC_CMD_GRAPH_END);
+    arg.rnd = stream;
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+    graph = arg.pA;
+    g_assert_cmpuint(arg.pB, ==, 2);
+
+    g_assert_cmpint(qcuda_graph_launch(qc, graph, stream, NULL), ==,
+                    cudaSuccess);
+    qcuda_sync(qc);
+    qcuda_dtoh(qc, buf, ptr, size);
+    check_words(buf, 61, LAUNCH_WORDS);
+
+    arg_init(&arg, VIRTQC_CMD_GRAPH_DESTROY);
+    arg.pA = graph;
+    g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+    qcuda_stream_destroy(qc, stream);
+
+    guest_free(qc->alloc, buf);
+    qcuda_free(qc, ptr);
+    qcuda_close(qc);
+    qcuda_stop(qc);
+}
+
+/*
+ * Benchmarks
+ */
+
+#define PERF_WINDOW     64      /* requests in flight */
+#define PERF_LAUNCHES   8192
+
+/* Requests per second with PERF_WINDOW requests in flight, all sharing
+ * one argument. */
+static double perf_request_rate(QCuda *qc, QVirtioQCArg *arg, uint32_t n)
+{
+    uint64_t slots;
+    uint32_t i;
+    double t;
+
+    slots = guest_alloc(qc->alloc, PERF_WINDOW * 2 * sizeof(*arg));
+    for (i = 0; i < PERF_WINDOW; i++) {
+        memwrite(slots + i * 2 * sizeof(*arg), arg, sizeof(*arg));
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < n; i++) {
+        qcuda_submit_slot(qc, slots + (i % PERF_WINDOW) * 2 * sizeof(*arg));
+        if (i % PERF_WINDOW == PERF_WINDOW - 1) {
+            qcuda_wait_all(qc);
+        }
+    }
+    qcuda_wait_all(qc);
+    qcuda_sync(qc);
+    t = g_test_timer_elapsed();
+
+    guest_free(qc->alloc, slots);
+    return n / t;
+}
+
+/* Launch throughput; flat launches use a registered layout. */
+static double perf_launch_rate(QCuda *qc, uint64_t ptr, uint32_t launches,
+                               bool flat)
+{
+    QVirtioQCArg arg;
+
+    if (flat) {
+        flat_launch_prepare(&arg, qc->conf, qc->params, QC_FUNC_INC,
+                            QC_STREAM_DEFAULT, ptr, 0, 1);
+    } else {
+        launch_prepare(&arg, qc->conf, qc->params, QC_FUNC_INC,
+                       QC_STREAM_DEFAULT, ptr, 0, 1);
+    }
+    return perf_request_rate(qc, &arg, launches);
+}
+
+static void perf_launch(void)
+{
+    QCuda *qc = qcuda_start(NULL);
+    uint64_t ptr;
+
+    qcuda_open(qc);
+    ptr = qcuda_malloc(qc, 4096);
+
+    g_test_message("launch rate, %u launches, %u in flight: %.0f/s\n",
+                   PERF_LAUNCHES, PERF_WINDOW,
+                   perf_launch_rate(qc, ptr, PERF_LAUNCHES, false));
+    g_assert_cmpint(qcuda_launch_layout(qc, QC_FUNC_INC, inc_layout,
+                                        ARRAY_SIZE(inc_layout), 12), ==,
+                    cudaSuccess);
+    g_test_message("flat launch rate, %u launches, %u in flight: %.0f/s\n",
+                   PERF_LAUNCHES, PERF_WINDOW,
+                   perf_launch_rate(qc, ptr, PERF_LAUNCHES, true));
+
+    qcuda_free(qc, ptr);
+    qcuda_close(qc);
+    qcuda_stop(qc);
+}
+
+#define PERF_SMALL_REQUESTS 65536
+
+/* Two-descriptor requests that do next to nothing on the host, so the
+ * rate is bound by popping and completing them: the virtqueue element
+ * handling is most of what is measured.  Run it on trees before and
+ * after a change to the virtio core to compare. */
+static void perf_small_requests(void)
+{
+    QCuda *qc = qcuda_start(NULL);
+    QVirtioQCArg arg;
+    int i;
+
+    qcuda_open(qc);
+    arg_init(&arg, VIRTQC_cudaGetDevice);
+
+    /* the first round warms up the host side */
+    perf_request_rate(qc, &arg, PERF_SMALL_REQUESTS / 4);
+    g_test_message("small requests, %u requests, %u in flight:\n",
+                   PERF_SMALL_REQUESTS, PERF_WINDOW);
+    for (i = 0; i < 3; i++) {
+        g_test_message("  round %d: %8.0f requests/s\n", i + 1,
+                       perf_request_rate(qc, &arg, PERF_SMALL_REQUESTS));
+    }
+
+    qcuda_close(qc);
+    qcuda_stop(qc);
+}
+
+#define PERF_COPY_SIZE  (4 << 20)
+#define PERF_COPIES     16
+
+/* MB/s of synchronous copies of buffer b in direction dir. */
+static double perf_copy_rate(QCuda *qc, QCBuffer *b, uint64_t ptr, int dir)
+{
+    QVirtioQCArg arg;
+    double t;
+    int i;
+
+    buffer_arg(&arg, b, ptr, dir);
+    g_test_timer_start();
+    for (i = 0; i < PERF_COPIES; i++) {
+        g_assert_cmpint(qcuda_call(qc, &arg), ==, cudaSuccess);
+        buffer_arg(&arg, b, ptr, dir);
+    }
+    t = g_test_timer_elapsed();
+    return (double)PERF_COPIES * b->size / t / (1 << 20);
+}
+
+static void perf_copy_shapes(QCuda *qc, const char *what)
+{
+    QCBuffer b;
+    uint64_t ptr;
+    int shape;
+
+    ptr = qcuda_malloc(qc, PERF_COPY_SIZE);
+    g_test_message("%s, %u copies of %u KiB:\n", what, PERF_COPIES,
+                   PERF_COPY_SIZE >> 10);
+    for (shape = 0; shape < SG_SHAPES; shape++) {
+        buffer_init(qc, &b, shape, PERF_COPY_SIZE);
+        g_test_message("  %-10s  HtoD %8.0f MB/s  DtoH %8.0f MB/s\n",
+                       sg_names[shape],
+                       perf_copy_rate(qc, &b, ptr, cudaMemcpyHostToDevice),
+                       perf_copy_rate(qc, &b, ptr, cudaMemcpyDeviceToHost));
+        buffer_free(qc, &b);
+    }
+    qcuda_free(qc, ptr);
+}
+
+static void perf_bandwidth(void)
+{
+    QCuda *qc = qcuda_start(NULL);
+
+    qcuda_open(qc);
+    perf_copy_shapes(qc, "copy bandwidth");
+    qcuda_close(qc);
+    qcuda_stop(qc);
+}
+
+#define PERF_COPY_MBPS  "4000"
+
+/* With copies that take time, staging through bounce buffers should
+ * stay close to the speed of copies straight out of page-locked guest
+ * RAM, as long as filling a buffer overlaps with the copy of the last. */
+static void perf_staging(void)
+{
+    static const char *modes[] = { "pin-guest-ram=on", "pin-guest-ram=off" };
+    char *what;
+    QCuda *qc;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(modes); i++) {
+        g_setenv("QCUDA_FAKE_COPY_MBPS", PERF_COPY_MBPS, true);
+        qc = qcuda_start(modes[i]);
+        g_unsetenv("QCUDA_FAKE_COPY_MBPS");
+
+        qcuda_open(qc);
+        what = g_strdup_printf("%s, copies at %s MB/s", modes[i],
+                               PERF_COPY_MBPS);
+        perf_copy_shapes(qc, what);
+        g_free(what);
+        qcuda_close(qc);
+        qcuda_stop(qc);
+    }
+}
+
+#define PERF_SYNCS      1000
+#define PERF_KERNEL_NS  "100000"
+
+/* Round trip of a call, in microseconds. */
+static double perf_call_latency(QCuda *qc, int32_t cmd, unsigned n)
+{
+    QVirtioQCArg arg;
+    unsigned i;
+
+    g_test_timer_start();
+    for (i = 0; i < n; i++) {
+        arg_init(&arg, cmd);
+        qcuda_call(qc, &arg);
+    }
+    return g_test_timer_elapsed() * 1e6 / n;
+}
+
+static void perf_sync(void)
+{
+    uint64_t ptr, event;
+    QVirtioQCArg launch;
+    QCuda *qc;
+    unsigned i;
+    double t;
+
+    g_setenv("QCUDA_FAKE_LAUNCH_NS", PERF_KERNEL_NS, true);
+    qc = qcuda_start(NULL);
+    g_unsetenv("QCUDA_FAKE_LAUNCH_NS");
+
+    qcuda_open(qc);
+    ptr = qcuda_malloc(qc, 4096);
+    event = qcuda_event_create(qc, cudaEventDisableTiming);
+
+    g_test_message("synchronization, %u rounds:\n", PERF_SYNCS);
+    g_test_message("  cudaGetDevice          %8.1f us\n",
+                   perf_call_latency(qc, VIRTQC_cudaGetDevice, PERF_SYNCS));
+    g_test_message("  idle cudaDeviceSynchronize %4.1f us\n",
+                   perf_call_latency(qc, VIRTQC_cudaDeviceSynchronize,
+                                     PERF_SYNCS));
+
+    /* launch, record, wait: what is left once the kernel time is
+     * taken out is the cost of parking and completing the request */
+    launch_prepare(&launch, qc->conf, qc->params, QC_FUNC_INC,
+                   QC_STREAM_DEFAULT, ptr, 0, 1);
+    g_test_timer_start();
+    for (i = 0; i < PERF_SYNCS / 10; i++) {
+        qcuda_call(qc, &launch);
+        qcuda_event_call(qc, VIRTQC_cudaEventRecord, event,
+                         QC_STREAM_DEFAULT);
+        qcuda_event_call(qc, VIRTQC_cudaEventSynchronize, event, 0);
+    }
+    t = g_test_timer_elapsed() * 1e6 / (PERF_SYNCS / 10);
+    g_test_message("  launch+record+wait     %8.1f us (kernel %s ns)\n", t,
+                   PERF_KERNEL_NS);
+
+    g_test_timer_start();
+    for (i = 0; i < PERF_SYNCS / 10; i++) {
+        qcuda_call(qc, &launch);
+        qcuda_sync(qc);
+    }
+    t = g_test_timer_elapsed() * 1e6 / (PERF_SYNCS / 10);
+    g_test_message("  launch+device sync     %8.1f us (kernel %s ns)\n", t,
+                   PERF_KERNEL_NS);
+
+    qcuda_event_call(qc, VIRTQC_cudaEventDestroy, event, 0);
+    qcuda_free(qc, ptr);
+    qcuda_close(qc);
+    qcuda_stop(qc);
+}
+
+#define PERF_BATCH_MAX  256
+
+/* The same number of launches, sent in batches of 1 to 256. */
+static void perf_batch(void)
+{
+    QCuda *qc = qcuda_start(NULL);
+    QVirtioQCArg *entries;
+    QCBatch b[PERF_WINDOW / 8];
+    uint32_t n, i, sent;
+    uint64_t ptr;
+    double t;
+
+    qcuda_open(qc);
+    ptr = qcuda_malloc(qc, 4096);
+    entries = g_new(QVirtioQCArg, PERF_BATCH_MAX);
+    launch_prepare(&entries[0], qc->conf, qc->params, QC_FUNC_INC,
+                   QC_STREAM_DEFAULT, ptr, 0, 1);
+    for (i = 1; i < PERF_BATCH_MAX; i++) {
+        entries[i] = entries[0];
+    }
+    for (i = 0; i < ARRAY_SIZE(b); i++) {
+        batch_init(qc, &b[i], PERF_BATCH_MAX);
+    }
+
+    g_test_message("%u launches in batches, up to %zu in flight:\n",
+                   PERF_LAUNCHES, ARRAY_SIZE(b));
+    for (n = 1; n <= PERF_BATCH_MAX; n *= 2) {
+        for (i = 0; i < ARRAY_SIZE(b); i++) {
+            batch_write(&b[i], entries, n);
+        }
+
+        g_test_timer_start();
+        for (sent = 0, i = 0; sent < PERF_LAUNCHES; sent += n, i++) {
+            batch_submit(qc, &b[i % ARRAY_SIZE(b)], n);
+            if (i % ARRAY_SIZE(b) == ARRAY_SIZE(b) - 1) {
+                qcuda_wait_all(qc);
+            }
+        }
+        qcuda_wait_all(qc);
+        qcuda_sync(qc);
+        t = g_test_timer_elapsed();
+
+        g_test_message("  batch %3u: %8.0f launches/s\n", n, sent / t);
+    }
+
+    for (i = 0; i < ARRAY_SIZE(b); i++) {
+        batch_free(qc, &b[i]);
+    }
+    g_free(entries);
+    qcuda_free(qc, ptr);
+    qcuda_close(qc);
+    qcuda_stop(qc);
+}
+
+/* Doorbell thread without and with polling against the plain kick
+ * path: latency of single calls and throughput of launches. */
+static void perf_doorbell(void)
+{
+    static const char *modes[] = {
+        "doorbell-thread=off",
+        "doorbell-thread=on,poll-us=0",
+        "doorbell-thread=on,poll-us=50",
+    };
+    QCuda *qc;
+    uint64_t ptr;
+    int i;
+
+    g_test_message("doorbell, %u calls:\n", PERF_SYNCS);
+    for (i = 0; i < ARRAY_SIZE(modes); i++) {
+        qc = qcuda_start(modes[i]);
+        qcuda_open(qc);
+        ptr = qcuda_malloc(qc, 4096);
+
+        g_test_message("  %-30s %6.1f us/call %8.0f launches/s\n", modes[i],
+                       perf_call_latency(qc, VIRTQC_cudaGetDevice,
+                                         PERF_SYNCS),
+                       perf_launch_rate(qc, ptr, PERF_LAUNCHES, false));
+
+        qcuda_free(qc, ptr);
+        qcuda_close(qc);
+        qcuda_stop(qc);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/virtio-qcuda/device-space", test_device_space);
+    qtest_add_func("/virtio-qcuda/device", test_device);
+    qtest_add_data_func("/virtio-qcuda/memcpy/pinned", "pin-guest-ram=on",
+                        test_memcpy);
+    qtest_add_data_func("/virtio-qcuda/memcpy/staged", "pin-guest-ram=off",
+                        test_memcpy);
+    qtest_add_data_func("/virtio-qcuda/memcpy/uncached", "alloc-cache=off",
+                        test_memcpy);
+    qtest_add_func("/virtio-qcuda/launch", test_launch);
+    qtest_add_func("/virtio-qcuda/deferred-sync", test_deferred_sync);
+    qtest_add_func("/virtio-qcuda/mmap", test_mmap);
+    qtest_add_func("/virtio-qcuda/shm", test_shm);
+    qtest_add_func("/virtio-qcuda/graph", test_graph);
+    qtest_add_func("/virtio-qcuda/blob", test_blob);
+    qtest_add_func("/virtio-qcuda/batch", test_batch);
+    qtest_add_func("/virtio-qcuda/launch-layout", test_launch_layout);
+
+    if (g_test_perf()) {
+        qtest_add_func("/perf/virtio-qcuda/launch", perf_launch);
+        qtest_add_func("/perf/virtio-qcuda/bandwidth", perf_bandwidth);
+        qtest_add_func("/perf/virtio-qcuda/staging", perf_staging);
+        qtest_add_func("/perf/virtio-qcuda/sync", perf_sync);
+        qtest_add_func("/perf/virtio-qcuda/batch", perf_batch);
+        qtest_add_func("/perf/virtio-qcuda/doorbell", perf_doorbell);
+        qtest_add_func("/perf/virtio-qcuda/small-requests",
+                       perf_small_requests);
+    }
+
+    return g_test_run();
+}
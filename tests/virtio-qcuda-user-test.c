@@ -0,0 +1,485 @@
+/*
+ * QTest testcase for virtio-qcuda with an external (vhost-user) backend
+ *
+ * The test plays both the guest driver, through libqos, and the backend
+ * daemon: a stub that serves the request ring out of the shared guest
+ * memory without any GPU behind it.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#define QEMU_GLIB_COMPAT_H
+#include <glib.h>
+
+#include "libqtest.h"
+#include "libqos/virtio.h"
+#include "libqos/virtio-pci.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc.h"
+#include "libqos/malloc-pc.h"
+#include "qemu/atomic.h"
+#include "qemu/option.h"
+#include "qemu/thread.h"
+#include "sysemu/char.h"
+#include "sysemu/sysemu.h"
+
+#include <linux/vhost.h>
+#include <sys/mman.h>
+
+#define QEMU_CMD_ACCEL  " -machine accel=tcg"
+#define QEMU_CMD_MEM    " -m 512 -object memory-backend-file,id=mem,size=512M,"\
+                        "mem-path=%s,share=on -numa node,memdev=mem"
+#define QEMU_CMD_CHR    " -chardev socket,id=chr0,path=%s"
+#define QEMU_CMD_DEV    " -device virtio-qcuda-pci,chardev=chr0"
+
+#define QEMU_CMD        QEMU_CMD_ACCEL QEMU_CMD_MEM QEMU_CMD_CHR QEMU_CMD_DEV
+
+#define QVIRTIO_QC_DEVICE_ID    69
+#define QVIRTIO_QC_TIMEOUT_US   (5 * 1000 * 1000)
+
+/*********** FROM hw/virtio/vhost-user.c *************************************/
+
+#define VHOST_MEMORY_MAX_NREGIONS    8
+
+typedef enum VhostUserRequest {
+    VHOST_USER_NONE = 0,
+    VHOST_USER_GET_FEATURES = 1,
+    VHOST_USER_SET_FEATURES = 2,
+    VHOST_USER_SET_OWNER = 3,
+    VHOST_USER_RESET_OWNER = 4,
+    VHOST_USER_SET_MEM_TABLE = 5,
+    VHOST_USER_SET_LOG_BASE = 6,
+    VHOST_USER_SET_LOG_FD = 7,
+    VHOST_USER_SET_VRING_NUM = 8,
+    VHOST_USER_SET_VRING_ADDR = 9,
+    VHOST_USER_SET_VRING_BASE = 10,
+    VHOST_USER_GET_VRING_BASE = 11,
+    VHOST_USER_SET_VRING_KICK = 12,
+    VHOST_USER_SET_VRING_CALL = 13,
+    VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_MAX
+} VhostUserRequest;
+
+typedef struct VhostUserMemoryRegion {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr;
+    uint64_t mmap_offset;
+} VhostUserMemoryRegion;
+
+typedef struct VhostUserMemory {
+    uint32_t nregions;
+    uint32_t padding;
+    VhostUserMemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
+} VhostUserMemory;
+
+typedef struct VhostUserMsg {
+    VhostUserRequest request;
+
+#define VHOST_USER_VERSION_MASK     (0x3)
+#define VHOST_USER_REPLY_MASK       (0x1<<2)
+    uint32_t flags;
+    uint32_t size; /* the following payload size */
+    union {
+        uint64_t u64;
+        struct vhost_vring_state state;
+        struct vhost_vring_addr addr;
+        VhostUserMemory memory;
+    };
+} QEMU_PACKED VhostUserMsg;
+
+static VhostUserMsg m __attribute__ ((unused));
+#define VHOST_USER_HDR_SIZE (sizeof(m.request) \
+                            + sizeof(m.flags) \
+                            + sizeof(m.size))
+
+#define VHOST_USER_VRING_IDX_MASK   (0xff)
+#define VHOST_USER_VRING_NOFD_MASK  (0x1<<8)
+/*****************************************************************************/
+
+/*********** FROM qcu-driver/qcuda_common.h **********************************/
+
+typedef struct QVirtioQCArg {
+    int32_t cmd;
+    uint64_t rnd;
+    uint64_t para;
+    uint64_t pA;
+    uint32_t pASize;
+    uint64_t pB;
+    uint32_t pBSize;
+    uint32_t flag;
+} QVirtioQCArg;
+/*****************************************************************************/
+
+/* The stub backend.  Everything below runs in the main loop thread. */
+typedef struct StubRing {
+    bool started;
+    uint32_t num;
+    uint16_t last_avail;
+    QVRingDesc *desc;
+    QVRingAvail *avail;
+    QVRingUsed *used;
+    struct vhost_vring_addr addr;
+} StubRing;
+
+static VhostUserMemory memory;
+static uint8_t *memory_base[VHOST_MEMORY_MAX_NREGIONS];
+static StubRing ring;
+static unsigned served;
+
+static void *stub_qva(uint64_t addr)
+{
+    VhostUserMemoryRegion *r;
+    int i;
+
+    for (i = 0; i < memory.nregions; i++) {
+        r = &memory.regions[i];
+        if (addr >= r->userspace_addr &&
+            addr - r->userspace_addr < r->memory_size) {
+            return memory_base[i] + addr - r->userspace_addr;
+        }
+    }
+    return NULL;
+}
+
+static void *stub_gpa(uint64_t addr, uint32_t len)
+{
+    VhostUserMemoryRegion *r;
+    int i;
+
+    for (i = 0; i < memory.nregions; i++) {
+        r = &memory.regions[i];
+        if (addr >= r->guest_phys_addr &&
+            addr - r->guest_phys_addr + len <= r->memory_size) {
+            return memory_base[i] + addr - r->guest_phys_addr;
+        }
+    }
+    return NULL;
+}
+
+static void stub_set_mem_table(CharDriverState *chr, VhostUserMsg *msg)
+{
+    int fds[VHOST_MEMORY_MAX_NREGIONS];
+    VhostUserMemoryRegion *r;
+    size_t size;
+    int i, n;
+
+    memcpy(&memory, &msg->memory, sizeof(msg->memory));
+    n = qemu_chr_fe_get_msgfds(chr, fds, ARRAY_SIZE(fds));
+    g_assert_cmpint(n, ==, memory.nregions);
+
+    for (i = 0; i < n; i++) {
+        r = &memory.regions[i];
+        size = r->memory_size + r->mmap_offset;
+        memory_base[i] = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                              fds[i], 0);
+        g_assert(memory_base[i] != MAP_FAILED);
+        memory_base[i] += r->mmap_offset;
+        close(fds[i]);
+    }
+}
+
+/* Answer one request: success, with the nonce it carried plus one. */
+static void stub_serve(uint16_t head)
+{
+    QVirtioQCArg arg, *reply = NULL;
+    QVRingDesc *d;
+    bool have_arg = false;
+    uint32_t len = 0;
+    uint16_t idx;
+
+    for (idx = head; ; idx = d->next) {
+        d = &ring.desc[idx];
+        if (d->flags & QVRING_DESC_F_WRITE) {
+            if (reply == NULL && d->len >= sizeof(*reply)) {
+                reply = stub_gpa(d->addr, sizeof(*reply));
+            }
+        } else if (!have_arg && d->len >= sizeof(arg)) {
+            memcpy(&arg, stub_gpa(d->addr, sizeof(arg)), sizeof(arg));
+            have_arg = true;
+        }
+        if (!(d->flags & QVRING_DESC_F_NEXT)) {
+            break;
+        }
+    }
+
+    if (have_arg && reply != NULL) {
+        arg.cmd = 0;
+        arg.pA = arg.rnd + 1;
+        memcpy(reply, &arg, sizeof(arg));
+        len = sizeof(arg);
+    }
+
+    idx = ring.used->idx % ring.num;
+    ring.used->ring[idx].id = head;
+    ring.used->ring[idx].len = len;
+    smp_wmb();
+    ring.used->idx++;
+    served++;
+}
+
+/* No kick or call eventfds under TCG: poll the avail ring instead. */
+static gboolean stub_poll(gpointer opaque)
+{
+    uint16_t avail_idx;
+
+    if (!ring.started) {
+        return TRUE;
+    }
+
+    avail_idx = atomic_read(&ring.avail->idx);
+    smp_rmb();
+    while (ring.last_avail != avail_idx) {
+        stub_serve(ring.avail->ring[ring.last_avail % ring.num]);
+        ring.last_avail++;
+    }
+    return TRUE;
+}
+
+static void *thread_function(void *data)
+{
+    GMainLoop *loop;
+
+    g_timeout_add(1, stub_poll, NULL);
+    loop = g_main_loop_new(NULL, FALSE);
+    g_main_loop_run(loop);
+    return NULL;
+}
+
+static int chr_can_read(void *opaque)
+{
+    return VHOST_USER_HDR_SIZE;
+}
+
+static void chr_read(void *opaque, const uint8_t *buf, int size)
+{
+    CharDriverState *chr = opaque;
+    VhostUserMsg msg;
+    uint8_t *p = (uint8_t *) &msg;
+    int fd;
+
+    if (size != VHOST_USER_HDR_SIZE) {
+        g_test_message("Wrong message size received %d\n", size);
+        return;
+    }
+
+    memcpy(p, buf, VHOST_USER_HDR_SIZE);
+    if (msg.size) {
+        p += VHOST_USER_HDR_SIZE;
+        qemu_chr_fe_read_all(chr, p, msg.size);
+    }
+
+    switch (msg.request) {
+    case VHOST_USER_GET_FEATURES:
+        msg.flags |= VHOST_USER_REPLY_MASK;
+        msg.size = sizeof(m.u64);
+        msg.u64 = 0;
+        qemu_chr_fe_write_all(chr, (uint8_t *) &msg,
+                              VHOST_USER_HDR_SIZE + msg.size);
+        break;
+
+    case VHOST_USER_SET_MEM_TABLE:
+        stub_set_mem_table(chr, &msg);
+        break;
+
+    case VHOST_USER_SET_VRING_NUM:
+        g_assert_cmpint(msg.state.index, ==, 0);
+        ring.num = msg.state.num;
+        break;
+
+    case VHOST_USER_SET_VRING_BASE:
+        ring.last_avail = msg.state.num;
+        break;
+
+    case VHOST_USER_SET_VRING_ADDR:
+        ring.addr = msg.addr;
+        break;
+
+    case VHOST_USER_SET_VRING_KICK:
+        /* the ring is live from here on */
+        ring.desc = stub_qva(ring.addr.desc_user_addr);
+        ring.avail = stub_qva(ring.addr.avail_user_addr);
+        ring.used = stub_qva(ring.addr.used_user_addr);
+        g_assert(ring.desc && ring.avail && ring.used);
+        ring.started = true;
+        /* fall through */
+    case VHOST_USER_SET_VRING_CALL:
+        if (!(msg.u64 & VHOST_USER_VRING_NOFD_MASK)) {
+            qemu_chr_fe_get_msgfds(chr, &fd, 1);
+            close(fd);
+        }
+        break;
+
+    case VHOST_USER_GET_VRING_BASE:
+        ring.started = false;
+        msg.flags |= VHOST_USER_REPLY_MASK;
+        msg.size = sizeof(m.state);
+        msg.state.num = ring.last_avail;
+        qemu_chr_fe_write_all(chr, (uint8_t *) &msg,
+                              VHOST_USER_HDR_SIZE + msg.size);
+        break;
+
+    default:
+        break;
+    }
+}
+
+/* The guest side. */
+static QVirtioPCIDevice *qcuda_pci_init(QPCIBus *bus)
+{
+    QVirtioPCIDevice *dev;
+
+    dev = qvirtio_pci_device_find(bus, QVIRTIO_QC_DEVICE_ID);
+    g_assert(dev != NULL);
+    g_assert_cmphex(dev->vdev.device_type, ==, QVIRTIO_QC_DEVICE_ID);
+
+    qvirtio_pci_device_enable(dev);
+    qvirtio_reset(&qvirtio_pci, &dev->vdev);
+    qvirtio_set_acknowledge(&qvirtio_pci, &dev->vdev);
+    qvirtio_set_driver(&qvirtio_pci, &dev->vdev);
+
+    return dev;
+}
+
+static uint16_t used_idx(QVirtQueue *vq)
+{
+    return readw(vq->used + offsetof(QVRingUsed, idx));
+}
+
+static void wait_used(QVirtQueue *vq, uint16_t idx)
+{
+    gint64 start = g_get_monotonic_time();
+
+    while (used_idx(vq) != idx) {
+        g_assert_cmpint(g_get_monotonic_time() - start, <=,
+                        QVIRTIO_QC_TIMEOUT_US);
+        g_usleep(1000);
+    }
+}
+
+#define BATCH   8
+#define ROUNDS  16
+
+static void test_requests(void)
+{
+    QVirtioPCIDevice *dev;
+    QGuestAllocator *alloc;
+    QVirtQueue *vq;
+    QPCIBus *bus;
+    QVirtioQCArg arg;
+    uint64_t req[BATCH];
+    uint32_t features, head;
+    uint16_t expected = 0;
+    int i, j;
+
+    bus = qpci_init_pc();
+    dev = qcuda_pci_init(bus);
+    alloc = pc_alloc_init();
+    vq = qvirtqueue_setup(&qvirtio_pci, &dev->vdev, alloc, 0);
+
+    features = qvirtio_get_features(&qvirtio_pci, &dev->vdev);
+    features &= ~(QVIRTIO_F_BAD_FEATURE | QVIRTIO_F_RING_INDIRECT_DESC |
+                  QVIRTIO_F_RING_EVENT_IDX);
+    qvirtio_set_features(&qvirtio_pci, &dev->vdev, features);
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+
+    for (i = 0; i < BATCH; i++) {
+        req[i] = guest_alloc(alloc, 2 * sizeof(arg));
+    }
+
+    for (j = 0; j < ROUNDS; j++) {
+        for (i = 0; i < BATCH; i++) {
+            memset(&arg, 0, sizeof(arg));
+            arg.cmd = -1;
+            arg.rnd = j * BATCH + i;
+            memwrite(req[i], &arg, sizeof(arg));
+            memset(&arg, 0xff, sizeof(arg));
+            memwrite(req[i] + sizeof(arg), &arg, sizeof(arg));
+
+            head = qvirtqueue_add(vq, req[i], sizeof(arg), false, true);
+            qvirtqueue_add(vq, req[i] + sizeof(arg), sizeof(arg), true, false);
+            qvirtqueue_kick(&qvirtio_pci, &dev->vdev, vq, head);
+        }
+
+        expected += BATCH;
+        wait_used(vq, expected);
+
+        for (i = 0; i < BATCH; i++) {
+            memread(req[i] + sizeof(arg), &arg, sizeof(arg));
+            g_assert_cmpint(arg.cmd, ==, 0);
+            g_assert_cmpuint(arg.pA, ==, j * BATCH + i + 1);
+        }
+    }
+
+    /* the backend gives the ring back when the driver resets the device */
+    qvirtio_reset(&qvirtio_pci, &dev->vdev);
+    g_assert_cmpuint(atomic_read(&served), ==, BATCH * ROUNDS);
+
+    for (i = 0; i < BATCH; i++) {
+        guest_free(alloc, req[i]);
+    }
+    guest_free(alloc, vq->desc);
+    pc_alloc_uninit(alloc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qpci_free_pc(bus);
+}
+
+int main(int argc, char **argv)
+{
+    QTestState *s = NULL;
+    CharDriverState *chr = NULL;
+    QemuThread thread;
+    char *socket_path = 0;
+    char *qemu_cmd = 0;
+    char *chr_path = 0;
+    char mem_path[] = "/tmp/qcuda-user-XXXXXX";
+    const char *mem_dir;
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    module_call_init(MODULE_INIT_QOM);
+
+    /* any directory will do for the guest RAM file, hugetlbfs or not */
+    mem_dir = getenv("QTEST_HUGETLBFS_PATH");
+    if (!mem_dir) {
+        mem_dir = mkdtemp(mem_path);
+        g_assert(mem_dir != NULL);
+    }
+
+    socket_path = g_strdup_printf("/tmp/vhost-qcuda-%d.sock", getpid());
+
+    /* create char dev and add read handlers */
+    qemu_add_opts(&qemu_chardev_opts);
+    chr_path = g_strdup_printf("unix:%s,server,nowait", socket_path);
+    chr = qemu_chr_new("chr0", chr_path, NULL);
+    g_free(chr_path);
+    qemu_chr_add_handlers(chr, chr_can_read, chr_read, NULL, chr);
+
+    /* the stub backend lives in the main loop thread */
+    qemu_thread_create(&thread, "stub-backend", thread_function, NULL,
+                       QEMU_THREAD_DETACHED);
+
+    qemu_cmd = g_strdup_printf(QEMU_CMD, mem_dir, socket_path);
+    s = qtest_start(qemu_cmd);
+    g_free(qemu_cmd);
+
+    qtest_add_func("/virtio-qcuda-user/requests", test_requests);
+
+    ret = g_test_run();
+
+    if (s) {
+        qtest_quit(s);
+    }
+
+    /* cleanup */
+    unlink(socket_path);
+    g_free(socket_path);
+    if (mem_dir == mem_path) {
+        rmdir(mem_path);
+    }
+
+    return ret;
+}